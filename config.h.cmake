@@ -15,6 +15,8 @@
 #cmakedefine HAVE_STRNCASECMP
 #cmakedefine HAVE_PRCTL
 #cmakedefine HAVE_GETRANDOM_FUNC
+#cmakedefine HAVE_RECVMMSG
+#cmakedefine HAVE_SENDMMSG
 #cmakedefine HAVE_PTSNAME_R
 #cmakedefine HAVE_CFMAKERAW
 #cmakedefine01 USE_FILE_STDIO
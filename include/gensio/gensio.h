@@ -188,6 +188,10 @@ int gensio_control(struct gensio *io, int depth, bool get,
 #define GENSIO_CONTROL_RADDR			21
 #define GENSIO_CONTROL_RADDR_BIN		22
 #define GENSIO_CONTROL_REMOTE_ID		23
+#define GENSIO_CONTROL_SOCKOPT			24
+#define GENSIO_CONTROL_DROPS			25
+#define GENSIO_CONTROL_PRIORITY			26
+#define GENSIO_CONTROL_STATS			27
 
 GENSIO_DLL_PUBLIC
 const char *gensio_get_type(struct gensio *io, unsigned int depth);
@@ -227,6 +231,36 @@ int gensio_write_s_intr(struct gensio *io, gensiods *count,
 			const void *data, gensiods datalen,
 			gensio_time *timeout);
 
+/*
+ * A pool of open client gensios all created from the same string.
+ * gensio_pool_get() hands out an idle one if there is one, otherwise
+ * it creates and opens a new one.  Give it back with
+ * gensio_pool_put() when done, set reuse to false if it is not in a
+ * state to be used again.  Idle gensios that get data or an error
+ * or that are not used for idle_timeout are closed.  max_size, if
+ * not zero, limits the number of gensios in the pool, in use or not.
+ */
+struct gensio_pool;
+
+#define GENSIO_POOL_DEFAULT_IDLE_TIMEOUT	60 /* seconds */
+
+typedef void (*gensio_pool_done)(struct gensio_pool *pool, struct gensio *io,
+				 int err, void *done_data);
+
+GENSIO_DLL_PUBLIC
+int gensio_pool_alloc(struct gensio_os_funcs *o, const char *str,
+		      unsigned int max_size, const gensio_time *idle_timeout,
+		      struct gensio_pool **pool);
+GENSIO_DLL_PUBLIC
+int gensio_pool_get(struct gensio_pool *pool, gensio_pool_done done,
+		    void *done_data);
+GENSIO_DLL_PUBLIC
+int gensio_pool_get_s(struct gensio_pool *pool, struct gensio **io);
+GENSIO_DLL_PUBLIC
+int gensio_pool_put(struct gensio_pool *pool, struct gensio *io, bool reuse);
+GENSIO_DLL_PUBLIC
+void gensio_pool_free(struct gensio_pool *pool);
+
 
 struct gensio_accepter;
 
@@ -329,6 +363,25 @@ int gensio_acc_control(struct gensio_accepter *accepter, int depth, bool get,
  */
 #define GENSIO_ACC_CONTROL_TCPDNAME	3
 
+/*
+ * Get/set accept limits (maxconns, acceptrate, acceptburst) and
+ * fetch the limit statistics (conns, shed, throttled).  Get takes the
+ * name, set takes "<name>=<value>".
+ */
+#define GENSIO_ACC_CONTROL_LIMIT	4
+
+/*
+ * Get/set a socket option (sndbuf, rcvbuf, etc.) on the accepter's
+ * sockets, like GENSIO_CONTROL_SOCKOPT.
+ */
+#define GENSIO_ACC_CONTROL_SOCKOPT	5
+
+/*
+ * Get the number of datagrams the kernel dropped on the accepter's
+ * sockets because the receive buffer was full.
+ */
+#define GENSIO_ACC_CONTROL_DROPS	6
+
 GENSIO_DLL_PUBLIC
 int gensio_acc_set_sync(struct gensio_accepter *acc);
 
@@ -38,6 +38,13 @@ typedef int (*gensio_ll_filter_data_handler)(void *cb_data,
  */
 #define GENSIO_FILTER_CB_START_TIMER	2
 
+/*
+ * Like GENSIO_FILTER_CB_START_TIMER, but if the timer is already
+ * running it is stopped and started again with the new timeout.
+ * timeout => data
+ */
+#define GENSIO_FILTER_CB_RESTART_TIMER	3
+
 typedef int (*gensio_filter_cb)(void *cb_data, int func, void *data);
 
 
@@ -528,4 +535,39 @@ int base_gensio_accepter_alloc(struct gensio_accepter *child,
 			       gensio_accepter_event cb, void *user_data,
 			       struct gensio_accepter **accepter);
 
+/*
+ * Limits on accepting new connections.  maxconns is the maximum
+ * number of accepted connections that may exist at once.  acceptrate
+ * is the number of new connections per second allowed on average,
+ * with up to acceptburst accepted back to back.  Zero means no limit;
+ * if acceptburst is zero it is the same as acceptrate.
+ *
+ * When a limit is hit the base accepter disables the accept callback
+ * on the lower accepter (so the listen socket is not polled and
+ * connections wait in the kernel) until it is below the limit again.
+ */
+struct gensio_acc_limits {
+    unsigned int maxconns;
+    unsigned int acceptrate;
+    unsigned int acceptburst;
+};
+
+/*
+ * Check str for maxconns=, acceptrate=, or acceptburst= and fill in
+ * limits.  Returns 1 if found, 0 if not a limit option, and -1 if the
+ * value is invalid.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_check_acc_limit(const char *str, struct gensio_acc_limits *limits);
+
+/* Fetch the default limits for the given class. */
+GENSIO_DLL_PUBLIC
+int gensio_get_default_acc_limits(struct gensio_os_funcs *o,
+				  const char *class,
+				  struct gensio_acc_limits *limits);
+
+GENSIO_DLL_PUBLIC
+void base_gensio_accepter_set_limits(struct gensio_accepter *accepter,
+				     const struct gensio_acc_limits *limits);
+
 #endif /* GENSIO_BASE_H */
@@ -120,6 +120,17 @@ struct gensio *gensio_data_alloc(struct gensio_os_funcs *o,
 				 const char *typename, void *gensio_data);
 GENSIO_DLL_PUBLIC
 void gensio_data_free(struct gensio *io);
+
+/*
+ * Call free_notify when the gensio's data is freed.  The gensio must
+ * not be used in the callback, the pointer is only for identification.
+ * Only one notifier may be set; this is used by accepters to track
+ * the connections they have handed out.
+ */
+GENSIO_DLL_PUBLIC
+void gensio_set_free_notify(struct gensio *io,
+			    void (*free_notify)(struct gensio *io, void *data),
+			    void *data);
 GENSIO_DLL_PUBLIC
 void *gensio_get_gensio_data(struct gensio *io);
 
@@ -28,6 +28,9 @@ struct gensio_fd_ll_ops {
      * return value is ignored.  Return 0.  When
      * GENSIO_LL_CLOSE_STATE_DONE, return EINPROGRESS to get called again
      * after next_timeout microseconds, zero to continue the close.
+     * If next_timeout->secs is set negative with EINPROGRESS, no
+     * timer is started and check_close() is called again when the
+     * handler calls gensio_fd_ll_close_continue().
      */
     int (*check_close)(void *handler_data, enum gensio_ll_close_state state,
 		       gensio_time *next_timeout);
@@ -62,6 +65,16 @@ gensiods gensio_fd_ll_callback(struct gensio_ll *ll, int op, int val,
 GENSIO_DLL_PUBLIC
 void gensio_fd_ll_close_now(struct gensio_ll *ll);
 
+/*
+ * After check_close() returned EINPROGRESS with a negative
+ * next_timeout->secs, call this when the handler is ready for
+ * check_close() to be called again.  Must not be called with any
+ * locks held that check_close() claims.  Does nothing if the close is
+ * not waiting on it.
+ */
+GENSIO_DLL_PUBLIC
+void gensio_fd_ll_close_continue(struct gensio_ll *ll);
+
 GENSIO_DLL_PUBLIC
 void gensio_fd_ll_handle_incoming(struct gensio_ll *ll,
 				  int (*doread)(int fd, void *buf,
@@ -75,6 +88,19 @@ void gensio_fd_ll_handle_incoming(struct gensio_ll *ll,
 GENSIO_DLL_PUBLIC
 void *gensio_fd_ll_get_handler_data(struct gensio_ll *ll);
 
+/*
+ * If an open is in progress, abandon the current fd and call
+ * retry_open() to get a new one.  This is for when the user has
+ * something better to use than the fd being opened, like when a
+ * parallel connection attempt completed first.  This is also how to
+ * continue an open where sub_open() returned GE_INPROGRESS without
+ * an fd (leaving it -1), retry_open() will be called to get one.
+ * Does nothing if the open is not in progress.  Do not call this
+ * with any locks held that retry_open() will claim.
+ */
+GENSIO_DLL_PUBLIC
+void gensio_fd_ll_retry_open(struct gensio_ll *ll);
+
 GENSIO_DLL_PUBLIC
 struct gensio_ll *fd_gensio_ll_alloc(struct gensio_os_funcs *o,
 				     int fd,
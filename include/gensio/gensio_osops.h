@@ -26,6 +26,28 @@ struct opensocks
 /* Flags for opensock_flags. */
 #define GENSIO_OPENSOCK_REUSEADDR	(1 << 0)
 
+/*
+ * Socket tuning parameters.  A zero value (or an empty congestion
+ * string) means the option is not set and the OS default is used.
+ * In particular, leaving sndbuf and rcvbuf at zero lets the kernel
+ * autosize the buffers for each connection.  Only sndbuf, rcvbuf,
+ * and busy_poll apply to non-TCP sockets.
+ */
+#define GENSIO_SOCKOPT_CONGESTION_LEN 16
+struct gensio_sockopts
+{
+    int sndbuf;		/* SO_SNDBUF, in bytes. */
+    int rcvbuf;		/* SO_RCVBUF, in bytes. */
+    int notsent_lowat;	/* TCP_NOTSENT_LOWAT, in bytes. */
+    int quickack;	/* TCP_QUICKACK, boolean. */
+    int user_timeout;	/* TCP_USER_TIMEOUT, in milliseconds. */
+    int keepidle;	/* TCP_KEEPIDLE, in seconds. */
+    int keepintvl;	/* TCP_KEEPINTVL, in seconds. */
+    int keepcnt;	/* TCP_KEEPCNT. */
+    int busy_poll;	/* SO_BUSY_POLL, in microseconds. */
+    char congestion[GENSIO_SOCKOPT_CONGESTION_LEN]; /* TCP_CONGESTION */
+};
+
 GENSIO_DLL_PUBLIC
 int gensio_os_write(struct gensio_os_funcs *o,
 		    int fd, const struct gensio_sg *sg, gensiods sglen,
@@ -48,6 +70,7 @@ int gensio_os_send(struct gensio_os_funcs *o,
 		   int fd, const struct gensio_sg *sg, gensiods sglen,
 		   gensiods *rcount, int flags);
 
+/* addr may be NULL on a connected socket. */
 GENSIO_DLL_PUBLIC
 int gensio_os_sendto(struct gensio_os_funcs *o,
 		     int fd, const struct gensio_sg *sg, gensiods sglen,
@@ -60,11 +83,115 @@ int gensio_os_sendto(struct gensio_os_funcs *o,
 GENSIO_DLL_PUBLIC
 struct gensio_addr *gensio_addr_alloc_recvfrom(struct gensio_os_funcs *o);
 
+/*
+ * gensio_addr_dup() may share the address data with the original,
+ * so an address that gensio_os_recvfrom() will write into again
+ * must be copied with this if it needs to be kept.
+ */
+GENSIO_DLL_PUBLIC
+struct gensio_addr *gensio_addr_copy(const struct gensio_addr *addr);
+
+/*
+ * Return a hash of the current address in addr.  Addresses that
+ * gensio_addr_equal() (with compare_all false) says are equal hash
+ * the same, hash_port should match its compare_ports.
+ */
+GENSIO_DLL_PUBLIC
+uint32_t gensio_addr_hash(const struct gensio_addr *addr, bool hash_port);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_recvfrom(struct gensio_os_funcs *o,
 		       int fd, void *buf, gensiods buflen, gensiods *rcount,
 		       int flags, struct gensio_addr *addr);
 
+/*
+ * Batch versions of gensio_os_recvfrom() and gensio_os_sendto(),
+ * using recvmmsg() and sendmmsg() where the OS has them.  At most
+ * GENSIO_OS_MAX_MMSG messages are handled per call.
+ *
+ * For receive, each message's buf and buflen must be set, and addr
+ * must come from gensio_addr_alloc_recvfrom(), or be NULL on a
+ * connected socket to not fetch the source address.  The number of
+ * messages received is returned in nr_recvd (zero if nothing was
+ * waiting) and each message's len is set.  If UDP GRO is on (see
+ * gensio_os_set_udp_gro()) and the kernel put several datagrams in
+ * buf, segsize is set to the size of each, the last one may be
+ * shorter.  Otherwise segsize is 0.  If receive timestamps are on
+ * (see gensio_os_set_rx_timestamp()) has_stamp is set and stamp
+ * holds the time the kernel received the datagram.  If drop
+ * reporting is on (see gensio_os_set_rx_drops()) and the socket has
+ * dropped anything, has_drops is set and drops holds the number of
+ * datagrams the socket has dropped so far.
+ *
+ * For send, nr_sent returns how many messages went out.  An error is
+ * only returned if the first message could not be sent.  A message's
+ * addr may be NULL on a connected socket.
+ */
+#define GENSIO_OS_MAX_MMSG 64
+
+struct gensio_os_recvmsg {
+    void *buf;
+    gensiods buflen;
+    gensiods len;
+    gensiods segsize;
+    struct gensio_addr *addr;
+    bool has_stamp;
+    gensio_time stamp;
+    bool has_drops;
+    uint32_t drops;
+};
+
+GENSIO_DLL_PUBLIC
+int gensio_os_recvmmsg(struct gensio_os_funcs *o, int fd,
+		       struct gensio_os_recvmsg *msgs, unsigned int nr_msgs,
+		       unsigned int *nr_recvd, int flags);
+
+struct gensio_os_sendmsg {
+    const struct gensio_sg *sg;
+    gensiods sglen;
+    const struct gensio_addr *addr;
+};
+
+GENSIO_DLL_PUBLIC
+int gensio_os_sendmmsg(struct gensio_os_funcs *o, int fd,
+		       const struct gensio_os_sendmsg *msgs,
+		       unsigned int nr_msgs, unsigned int *nr_sent, int flags);
+
+/*
+ * Like gensio_os_sendto(), but if segsize is not zero the data is
+ * sent as a series of segsize datagrams (the last may be shorter).
+ * UDP_SEGMENT (GSO) is used to hand them to the kernel in large
+ * chunks where it is available, otherwise they are sent one at a
+ * time.  rcount is the number of bytes in datagrams that went out.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_sendto_gso(struct gensio_os_funcs *o,
+			 int fd, const struct gensio_sg *sg, gensiods sglen,
+			 gensiods *rcount, int flags,
+			 const struct gensio_addr *raddr, gensiods segsize);
+
+/*
+ * Turn UDP_GRO on or off for the socket, returns GE_NOTSUP if the OS
+ * doesn't have it.  Coalesced receives are reported through the
+ * segsize field of gensio_os_recvmmsg().
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_set_udp_gro(struct gensio_os_funcs *o, int fd, bool val);
+
+/*
+ * Turn kernel receive timestamps (SO_TIMESTAMPNS) on or off for the
+ * socket, returns GE_NOTSUP if the OS doesn't have them.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_set_rx_timestamp(struct gensio_os_funcs *o, int fd, bool val);
+
+/*
+ * Turn reporting of the socket's receive drop count (SO_RXQ_OVFL) on
+ * or off, returns GE_NOTSUP if the OS doesn't have it.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_set_rx_drops(struct gensio_os_funcs *o, int fd, bool val);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_accept(struct gensio_os_funcs *o, int fd,
 		     struct gensio_addr **addr, int *newsock);
@@ -121,9 +248,49 @@ GENSIO_DLL_PUBLIC
 int gensio_os_scan_netaddr(struct gensio_os_funcs *o, const char *str,
 			   bool listen, int protocol, struct gensio_addr **rai);
 
+/*
+ * Like gensio_os_scan_netaddr(), but never blocks the caller on a
+ * name lookup.  If the result is available right away (it is in the
+ * resolve cache or needs no lookup), it is returned in raddr and 0 is
+ * returned.  Otherwise GE_INPROGRESS is returned, the lookup is done
+ * in a resolver thread, and done is called from a runner with the
+ * result.  On success, done owns addr and must free it.
+ *
+ * Without pthreads there is no resolver thread, the lookup is done in
+ * the runner, so whatever thread runs the runner blocks on it.
+ *
+ * gensio_cleanup_mem() drops lookups on o that haven't started and
+ * waits for ones in progress, call it before freeing o if any are
+ * outstanding.
+ */
+typedef void (*gensio_os_resolve_done)(struct gensio_os_funcs *o, int err,
+				       struct gensio_addr *addr,
+				       void *cb_data);
+GENSIO_DLL_PUBLIC
+int gensio_os_scan_netaddr_async(struct gensio_os_funcs *o, const char *str,
+				 bool listen, int protocol,
+				 gensio_os_resolve_done done, void *cb_data,
+				 struct gensio_addr **raddr);
+
+/*
+ * Replace the function that does the lookups for
+ * gensio_os_scan_netaddr_async(), mostly for testing.  It is called
+ * from a resolver thread.  Passing NULL restores the default,
+ * gensio_os_scan_netaddr().  This empties the resolve cache.
+ */
+typedef int (*gensio_os_resolver)(struct gensio_os_funcs *o, const char *str,
+				  bool listen, int protocol,
+				  struct gensio_addr **raddr);
+GENSIO_DLL_PUBLIC
+void gensio_os_set_resolver(gensio_os_resolver resolver);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_close(struct gensio_os_funcs *o, int *fd);
 
+/* Create a new fd referring to the same socket/file as fd. */
+GENSIO_DLL_PUBLIC
+int gensio_os_dup(struct gensio_os_funcs *o, int fd, int *newfd);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_check_socket_open(struct gensio_os_funcs *o, int fd);
 
@@ -141,6 +308,14 @@ int gensio_os_socket_setup(struct gensio_os_funcs *o, int fd,
 			   unsigned int opensock_flags,
 			   struct gensio_addr *bindaddr);
 
+/* Like gensio_os_socket_setup(), but also applies sockopts if not NULL. */
+GENSIO_DLL_PUBLIC
+int gensio_os_socket_setup_opts(struct gensio_os_funcs *o, int fd,
+				int protocol, bool keepalive, bool nodelay,
+				const struct gensio_sockopts *sockopts,
+				unsigned int opensock_flags,
+				struct gensio_addr *bindaddr);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_mcast_add(struct gensio_os_funcs *o, int fd,
 			struct gensio_addr *mcast_addrs, int interface,
@@ -166,6 +341,50 @@ GENSIO_DLL_PUBLIC
 int gensio_os_set_nodelay(struct gensio_os_funcs *o, int fd, int protocol,
 			  int val);
 
+/*
+ * TCP_QUICKACK is not permanent on some systems, the kernel clears it
+ * when it goes back to delayed acks.  This is used to re-arm it.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_set_quickack(struct gensio_os_funcs *o, int fd, int val);
+
+/*
+ * Apply all the set values in sockopts to the given socket.  The
+ * buffer sizes are set with SO_SNDBUFFORCE and SO_RCVBUFFORCE if
+ * the process is allowed to, so they can go past the system limits.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_set_sockopts(struct gensio_os_funcs *o, int fd, int protocol,
+			   const struct gensio_sockopts *sockopts);
+
+/*
+ * Check str for a "<name>=<value>" socket option and store it in
+ * sockopts.  Returns 1 if found, 0 if not a socket option, and -1 if
+ * the value is invalid, like the gensio_check_keyxxx() functions.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_check_sockopt(const char *str, struct gensio_sockopts *sockopts);
+
+/*
+ * Fetch the defaults for all the socket options for the given class.
+ * TCP-only options are left alone unless the class is "tcp".
+ */
+GENSIO_DLL_PUBLIC
+int gensio_get_default_sockopts(struct gensio_os_funcs *o, const char *class,
+				struct gensio_sockopts *sockopts);
+
+/*
+ * Handle GENSIO_CONTROL_SOCKOPT.  On a get, data holds the option
+ * name and the current value is returned.  If fd is not -1, the
+ * value is fetched from the socket, so the effective value is
+ * returned.  On a set, data is "<name>=<value>"; the value is stored
+ * in sockopts and applied to the socket if fd is not -1.
+ */
+GENSIO_DLL_PUBLIC
+int gensio_os_sockopt_control(struct gensio_os_funcs *o, int fd, int protocol,
+			      struct gensio_sockopts *sockopts, bool get,
+			      char *data, gensiods *datalen);
+
 GENSIO_DLL_PUBLIC
 int gensio_os_getsockname(struct gensio_os_funcs *o, int fd,
 			  struct gensio_addr **addr);
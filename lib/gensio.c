@@ -95,6 +95,9 @@ struct gensio {
     struct gensio_link link;
 
     struct gensio_link glink;
+
+    void (*free_notify)(struct gensio *io, void *data);
+    void *free_notify_data;
 };
 
 static struct gensio_os_funcs *o_base;
@@ -171,6 +174,9 @@ gensio_data_free(struct gensio *io)
 {
     assert(gensio_list_empty(&io->waiters));
 
+    if (io->free_notify)
+	io->free_notify(io, io->free_notify_data);
+
     while (io->classes) {
 	struct gensio_classobj *c = io->classes;
 
@@ -185,6 +191,15 @@ gensio_data_free(struct gensio *io)
     o_base->unlock(gensio_base_lock);
 }
 
+void
+gensio_set_free_notify(struct gensio *io,
+		       void (*free_notify)(struct gensio *io, void *data),
+		       void *data)
+{
+    io->free_notify = free_notify;
+    io->free_notify_data = data;
+}
+
 void *
 gensio_get_gensio_data(struct gensio *io)
 {
@@ -1900,10 +1915,43 @@ struct gensio_enum_val shared_serial_alert_enums[] = {
 };
 #endif
 
+static struct gensio_enum_val udp_rxdrop_enums[] = {
+    { "tail",		0 },
+    { "head",		1 },
+    { NULL }
+};
+
 struct gensio_def_entry builtin_defaults[] = {
     /* Defaults for TCP, UDP, and SCTP. */
     { "nodelay",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
     { "laddr",		GENSIO_DEFAULT_STR,	.def.strval = NULL },
+    /* TCP socket tuning, zero means use the OS default. */
+    { "sndbuf",		GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "rcvbuf",		GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "notsent_lowat",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "quickack",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    { "user_timeout",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "keepidle",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "keepintvl",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "keepcnt",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "busy_poll",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "congestion",	GENSIO_DEFAULT_STR,	.def.strval = NULL },
+    { "asyncresolve",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    /* Accepter limits, zero means no limit. */
+    { "maxconns",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "acceptrate",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "acceptburst",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
     /* sctp */
     { "instreams",	GENSIO_DEFAULT_INT,	.min = 1, .max = INT_MAX,
 						.def.intval = 1 },
@@ -1913,6 +1961,18 @@ struct gensio_def_entry builtin_defaults[] = {
 						.def.intval = 1 },
     { "sack_delay",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
 						.def.intval = 10 },
+    /* udp */
+    { "rxbatch",	GENSIO_DEFAULT_INT,	.min = 1, .max = 64,
+						.def.intval = 16 },
+    { "rxqueue",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 32 },
+    { "rxdrop",		GENSIO_DEFAULT_ENUM,	.enums = udp_rxdrop_enums,
+						.def.intval = 0 },
+    { "gro",		GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    { "timestamp",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    { "idle_timeout",	GENSIO_DEFAULT_INT,	.min = 0, .max = INT_MAX,
+						.def.intval = 0 },
+    { "connected",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
     /* TCP and SCTP, UDP get added in init as false. */
     { "reuseaddr",	GENSIO_DEFAULT_BOOL,	.def.intval = 1 },
     /* serialdev */
@@ -2023,6 +2083,9 @@ gensio_cleanup_mem(struct gensio_os_funcs *o)
     }
     reg_gensios = NULL;
 
+    udp_gensio_cleanup_mem(o);
+    gensio_os_resolve_cleanup_mem(o);
+
     memset(&gensio_default_initialized, 0, sizeof(gensio_default_initialized));
     memset(&gensio_base_initialized, 0, sizeof(gensio_base_initialized));
 }
@@ -6,6 +6,7 @@
  */
 
 #include "config.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
@@ -48,8 +49,32 @@ struct basena_data {
     bool call_shutdown_done;
     gensio_acc_done shutdown_done;
     void *shutdown_data;
+
+    /*
+     * Accept limits.  nr_conns counts the connections accepted while
+     * a limit was set that have not been freed yet.  credit is the
+     * token bucket for acceptrate, in millionths of a connection.
+     * When over a limit, throttled is set and the lower accepter's
+     * accept callback is disabled; cb_enabled is what the user asked
+     * for.
+     */
+    struct gensio_acc_limits limits;
+    unsigned int nr_conns;
+    int64_t credit;
+    gensio_time last_refill;
+    bool counting_child;
+    bool cb_enabled;
+    bool throttled;
+    struct gensio_timer *limit_timer;
+    bool limit_timer_running;
+
+    /* Statistics for the limits. */
+    gensiods shed;
+    gensiods throttle_count;
 };
 
+#define BASENA_CONN_CREDIT 1000000
+
 static void
 basena_set_state(struct basena_data *nadata, enum basena_state state)
 {
@@ -128,6 +153,8 @@ basena_finish_free(struct basena_data *nadata)
 {
     struct gensio_os_funcs *o = nadata->o;
 
+    if (nadata->limit_timer)
+	o->free_timer(nadata->limit_timer);
     if (nadata->lock)
 	o->free_lock(nadata->lock);
     if (nadata->ops)
@@ -157,6 +184,144 @@ basena_deref_and_unlock(struct basena_data *nadata)
 	basena_finish_free(nadata);
 }
 
+static bool
+basena_limited(struct basena_data *nadata)
+{
+    return nadata->limits.maxconns || nadata->limits.acceptrate;
+}
+
+static int64_t
+basena_max_credit(struct basena_data *nadata)
+{
+    unsigned int burst = nadata->limits.acceptburst;
+
+    if (!burst)
+	burst = nadata->limits.acceptrate;
+    return (int64_t) burst * BASENA_CONN_CREDIT;
+}
+
+static void
+basena_refill(struct basena_data *nadata)
+{
+    gensio_time now;
+    int64_t elapsed, max = basena_max_credit(nadata);
+
+    nadata->o->get_monotonic_time(nadata->o, &now);
+    elapsed = ((now.secs - nadata->last_refill.secs) * 1000000 +
+	       (now.nsecs - nadata->last_refill.nsecs) / 1000);
+    nadata->last_refill = now;
+    if (!nadata->limits.acceptrate || elapsed <= 0)
+	return;
+
+    /* elapsed usecs * conns/sec is in millionths of a connection. */
+    if (elapsed > (max - nadata->credit) / nadata->limits.acceptrate)
+	nadata->credit = max;
+    else
+	nadata->credit += elapsed * nadata->limits.acceptrate;
+}
+
+static void
+basena_reset_limits(struct basena_data *nadata)
+{
+    nadata->credit = basena_max_credit(nadata);
+    nadata->o->get_monotonic_time(nadata->o, &nadata->last_refill);
+}
+
+static bool
+basena_over_limit(struct basena_data *nadata)
+{
+    if (nadata->limits.maxconns && nadata->nr_conns >= nadata->limits.maxconns)
+	return true;
+    if (nadata->limits.acceptrate && nadata->credit < BASENA_CONN_CREDIT)
+	return true;
+    return false;
+}
+
+static void
+basena_start_limit_timer(struct basena_data *nadata)
+{
+    int64_t wait;
+    gensio_time timeout;
+
+    if (nadata->limit_timer_running)
+	return;
+
+    /* Wait until one more connection's worth of credit is there. */
+    wait = ((BASENA_CONN_CREDIT - nadata->credit +
+	     nadata->limits.acceptrate - 1) / nadata->limits.acceptrate);
+    timeout.secs = wait / 1000000;
+    timeout.nsecs = (wait % 1000000) * 1000;
+    if (!nadata->o->start_timer(nadata->limit_timer, &timeout)) {
+	nadata->limit_timer_running = true;
+	basena_ref(nadata);
+    }
+}
+
+static void
+basena_stop_limit_timer(struct basena_data *nadata)
+{
+    if (nadata->limit_timer_running &&
+		!nadata->o->stop_timer(nadata->limit_timer)) {
+	nadata->limit_timer_running = false;
+	/* The caller holds a ref, so this can't go to zero. */
+	assert(nadata->refcount > 1);
+	nadata->refcount--;
+    }
+}
+
+/*
+ * Compare where we are to the limits, and turn the lower accepter
+ * on or off as necessary.  Must be called with the lock held.
+ */
+static void
+basena_check_limits(struct basena_data *nadata)
+{
+    bool over;
+
+    if (nadata->state != BASENA_OPEN)
+	return;
+
+    basena_refill(nadata);
+    over = basena_over_limit(nadata);
+    if (over && !nadata->throttled) {
+	nadata->throttled = true;
+	nadata->throttle_count++;
+	if (nadata->cb_enabled)
+	    base_gensio_acc_set_cb_enable(nadata, false, NULL);
+    } else if (!over && nadata->throttled) {
+	nadata->throttled = false;
+	if (nadata->cb_enabled)
+	    base_gensio_acc_set_cb_enable(nadata, true, NULL);
+    }
+
+    if (nadata->throttled && nadata->limits.acceptrate &&
+		nadata->credit < BASENA_CONN_CREDIT)
+	basena_start_limit_timer(nadata);
+}
+
+static void
+basena_limit_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct basena_data *nadata = cb_data;
+
+    basena_lock(nadata);
+    nadata->limit_timer_running = false;
+    basena_check_limits(nadata);
+    basena_deref_and_unlock(nadata);
+}
+
+static void
+basena_conn_freed(struct gensio *io, void *cb_data)
+{
+    struct basena_data *nadata = cb_data;
+
+    basena_lock(nadata);
+    assert(nadata->nr_conns > 0);
+    nadata->nr_conns--;
+    basena_check_limits(nadata);
+    basena_deref_and_unlock(nadata);
+}
+
 static void
 basena_finish_shutdown_unlock(struct basena_data *nadata)
 {
@@ -207,8 +372,13 @@ basena_startup(struct gensio_accepter *accepter)
     } else {
 	nadata->shutdown_done = NULL;
 	err = base_gensio_acc_startup(nadata);
-	if (!err)
+	if (!err) {
 	    basena_set_state(nadata, BASENA_OPEN);
+	    nadata->cb_enabled = true;
+	    nadata->throttled = false;
+	    basena_reset_limits(nadata);
+	    basena_check_limits(nadata);
+	}
     }
     basena_unlock(nadata);
 
@@ -248,6 +418,7 @@ basena_shutdown(struct gensio_accepter *accepter,
 	if (!rv) {
 	    basena_ref(nadata);
 	    basena_set_state(nadata, BASENA_IN_SHUTDOWN);
+	    basena_stop_limit_timer(nadata);
 	}
     }
     basena_unlock(nadata);
@@ -291,10 +462,17 @@ basena_set_accept_callback_enable(struct gensio_accepter *accepter,
 	nadata->set_cb_enable_done_data = done_data;
 	ldone = basena_cb_en_done;
     }
-    if (!rv)
-	rv = base_gensio_acc_set_cb_enable(nadata, enabled, ldone);
-    if (!rv && done)
-	basena_in_cb(nadata);
+    if (!rv) {
+	/* While throttled the lower accepter stays off. */
+	rv = base_gensio_acc_set_cb_enable(nadata,
+					   enabled && !nadata->throttled,
+					   ldone);
+    }
+    if (!rv) {
+	nadata->cb_enabled = enabled;
+	if (done)
+	    basena_in_cb(nadata);
+    }
     basena_unlock(nadata);
     return rv;
 }
@@ -308,6 +486,7 @@ basena_free(struct gensio_accepter *accepter)
     basena_lock(nadata);
     assert(!nadata->freed);
     nadata->freed = true;
+    basena_stop_limit_timer(nadata);
     switch (nadata->state) {
     case BASENA_CLOSED:
 	break;
@@ -342,12 +521,67 @@ basena_str_to_gensio(struct gensio_accepter *accepter, const char *addr,
     return base_gensio_acc_str_to_gensio(nadata, addr, cb, user_data, new_io);
 }
 
+static int
+basena_limit_control(struct basena_data *nadata, bool get,
+		     char *data, gensiods *datalen)
+{
+    struct gensio_acc_limits limits;
+    gensiods val;
+    int rv;
+
+    basena_lock(nadata);
+    if (get) {
+	if (strcmp(data, "maxconns") == 0) {
+	    val = nadata->limits.maxconns;
+	} else if (strcmp(data, "acceptrate") == 0) {
+	    val = nadata->limits.acceptrate;
+	} else if (strcmp(data, "acceptburst") == 0) {
+	    val = nadata->limits.acceptburst;
+	} else if (strcmp(data, "conns") == 0) {
+	    val = nadata->nr_conns;
+	} else if (strcmp(data, "shed") == 0) {
+	    val = nadata->shed;
+	} else if (strcmp(data, "throttled") == 0) {
+	    val = nadata->throttle_count;
+	} else {
+	    basena_unlock(nadata);
+	    return GE_NOTFOUND;
+	}
+	basena_unlock(nadata);
+	*datalen = snprintf(data, *datalen, "%lu", (unsigned long) val);
+	return 0;
+    }
+
+    limits = nadata->limits;
+    rv = gensio_check_acc_limit(data, &limits);
+    if (rv > 0) {
+	if (limits.acceptrate != nadata->limits.acceptrate ||
+		limits.acceptburst != nadata->limits.acceptburst) {
+	    nadata->limits = limits;
+	    basena_reset_limits(nadata);
+	} else {
+	    nadata->limits = limits;
+	}
+	basena_check_limits(nadata);
+	rv = 0;
+    } else if (rv < 0) {
+	rv = GE_INVAL;
+    } else {
+	rv = GE_NOTFOUND;
+    }
+    basena_unlock(nadata);
+    return rv;
+}
+
 static int
 basena_control(struct gensio_accepter *accepter, bool get, unsigned int option,
 	       char *data, gensiods *datalen)
 {
     struct basena_data *nadata = gensio_acc_get_gensio_data(accepter);
 
+    if (option == GENSIO_ACC_CONTROL_LIMIT)
+	return basena_limit_control(nadata, get, data, datalen);
+
     return base_gensio_acc_control(nadata, get, option, data, datalen);
 }
 
@@ -356,7 +590,10 @@ basena_disable(struct gensio_accepter *accepter)
 {
     struct basena_data *nadata = gensio_acc_get_gensio_data(accepter);
 
+    basena_lock(nadata);
     basena_set_state(nadata, BASENA_CLOSED);
+    basena_stop_limit_timer(nadata);
+    basena_unlock(nadata);
     return base_gensio_acc_disable(nadata);
 }
 
@@ -403,6 +640,25 @@ base_gensio_accepter_new_child_start(struct gensio_accepter *accepter)
 	basena_unlock(nadata);
 	return GE_NOTREADY;
     }
+
+    if (basena_limited(nadata)) {
+	basena_refill(nadata);
+	if (basena_over_limit(nadata)) {
+	    /*
+	     * Accepted before the lower accepter was turned off, there's
+	     * nothing to do but drop it.
+	     */
+	    nadata->shed++;
+	    basena_check_limits(nadata);
+	    basena_unlock(nadata);
+	    return GE_INUSE;
+	}
+	if (nadata->limits.acceptrate)
+	    nadata->credit -= BASENA_CONN_CREDIT;
+	nadata->nr_conns++;
+	nadata->counting_child = true;
+	basena_check_limits(nadata);
+    }
     return 0;
 }
 
@@ -412,6 +668,17 @@ base_gensio_accepter_new_child_end(struct gensio_accepter *accepter,
 {
     struct basena_data *nadata = gensio_acc_get_gensio_data(accepter);
 
+    if (nadata->counting_child) {
+	nadata->counting_child = false;
+	if (err) {
+	    nadata->nr_conns--;
+	    basena_check_limits(nadata);
+	} else {
+	    /* The connection holds a ref until it is freed. */
+	    basena_ref(nadata);
+	    gensio_set_free_notify(io, basena_conn_freed, nadata);
+	}
+    }
     if (!err) {
 	basena_in_cb(nadata);
 	gensio_acc_add_pending_gensio(nadata->acc, io);
@@ -424,11 +691,12 @@ base_gensio_server_open_done(struct gensio_accepter *accepter,
 			     struct gensio *net, int err)
 {
     struct basena_data *nadata = gensio_acc_get_gensio_data(accepter);
+    struct gensio *free_io = NULL;
 
     basena_lock(nadata);
     gensio_acc_remove_pending_gensio(nadata->acc, net);
     if (err) {
-	gensio_free(net);
+	free_io = net;
 	gensio_acc_log(nadata->acc, GENSIO_LOG_ERR,
 		       "Error accepting a gensio: %s",
 		       gensio_err_to_str(err));
@@ -439,10 +707,18 @@ base_gensio_server_open_done(struct gensio_accepter *accepter,
 	basena_lock(nadata);
 	nadata->in_cb_count--;
     } else {
-	gensio_free(net);
+	free_io = net;
     }
 
     basena_leave_cb_unlock(nadata);
+
+    /*
+     * Free after unlocking, the free may call basena_conn_freed().
+     * If the connection is counted it holds a ref, so nadata is
+     * still there in that case.
+     */
+    if (free_io)
+	gensio_free(free_io);
 }
 
 int
@@ -466,6 +742,10 @@ base_gensio_accepter_alloc(struct gensio_accepter *child,
     if (!nadata->lock)
 	goto out_nomem;
 
+    nadata->limit_timer = o->alloc_timer(o, basena_limit_timeout, nadata);
+    if (!nadata->limit_timer)
+	goto out_nomem;
+
     nadata->acc = gensio_acc_data_alloc(o, cb, user_data, gensio_acc_base_func,
 					child, typename, nadata);
     if (!nadata->acc)
@@ -483,3 +763,53 @@ out_nomem:
     basena_finish_free(nadata);
     return GE_NOMEM;
 }
+
+void
+base_gensio_accepter_set_limits(struct gensio_accepter *accepter,
+				const struct gensio_acc_limits *limits)
+{
+    struct basena_data *nadata = gensio_acc_get_gensio_data(accepter);
+
+    basena_lock(nadata);
+    nadata->limits = *limits;
+    basena_reset_limits(nadata);
+    basena_check_limits(nadata);
+    basena_unlock(nadata);
+}
+
+int
+gensio_check_acc_limit(const char *str, struct gensio_acc_limits *limits)
+{
+    int rv;
+
+    rv = gensio_check_keyuint(str, "maxconns", &limits->maxconns);
+    if (!rv)
+	rv = gensio_check_keyuint(str, "acceptrate", &limits->acceptrate);
+    if (!rv)
+	rv = gensio_check_keyuint(str, "acceptburst", &limits->acceptburst);
+    return rv;
+}
+
+int
+gensio_get_default_acc_limits(struct gensio_os_funcs *o, const char *class,
+			      struct gensio_acc_limits *limits)
+{
+    int err, ival;
+
+    err = gensio_get_default(o, class, "maxconns", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    limits->maxconns = ival;
+    err = gensio_get_default(o, class, "acceptrate", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    limits->acceptrate = ival;
+    err = gensio_get_default(o, class, "acceptburst", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    limits->acceptburst = ival;
+    return 0;
+}
@@ -70,9 +70,10 @@ gensna_set_accept_callback_enable(struct gensio_accepter *accepter,
 {
     gensio_acc_done ldone = NULL;
 
-    nadata->cb_en_done = done;
-    if (done)
+    if (done) {
+	nadata->cb_en_done = done;
 	ldone = gensna_cb_en_done;
+    }
     return gensio_acc_set_accept_callback_enable_cb(nadata->child, enabled,
 						    ldone, nadata);
 }
@@ -1644,6 +1644,35 @@ basen_start_timer_op(void *cb_data, gensio_time *timeout)
     }
 }
 
+static int
+basen_restart_timer_op(void *cb_data, gensio_time *timeout)
+{
+    struct basen_data *ndata = cb_data;
+    int err = 0;
+
+    if (ndata->state == BASEN_OPEN || ndata->state == BASEN_CLOSE_WAIT_DRAIN) {
+	/*
+	 * If the timer was stopped before it went off, its ref carries
+	 * over to the new start.  Otherwise it was not running or is in
+	 * the handler (which will drop its own ref), so start it fresh.
+	 */
+	if (ndata->o->stop_timer(ndata->timer) == 0) {
+	    err = ndata->o->start_timer(ndata->timer, timeout);
+	    if (err)
+		/* The stopped timer's ref has nothing to carry over to. */
+		basen_deref(ndata);
+	} else {
+	    err = ndata->o->start_timer(ndata->timer, timeout);
+	    if (!err)
+		basen_ref(ndata);
+	}
+    } else {
+	ndata->timer_start_pending = true;
+	ndata->pending_timer = *timeout;
+    }
+    return err;
+}
+
 static int
 gensio_base_filter_cb(void *cb_data, int op, void *data)
 {
@@ -1656,6 +1685,9 @@ gensio_base_filter_cb(void *cb_data, int op, void *data)
 	basen_start_timer_op(cb_data, data);
 	return 0;
 
+    case GENSIO_FILTER_CB_RESTART_TIMER:
+	return basen_restart_timer_op(cb_data, data);
+
     default:
 	return GE_NOTSUP;
     }
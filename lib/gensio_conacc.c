@@ -430,6 +430,7 @@ conaccn_open_done(struct gensio *io, int err, void *open_data)
  out_err:
     conaccn_finish_free(ndata);
     conaccna_lock(nadata);
+    nadata->ndata = NULL;
     nadata->con_err = err;
     nadata->in_open = false;
     conaccna_deferred_op(nadata);
@@ -442,7 +443,11 @@ conacc_start(struct conaccna_data *nadata)
     struct conaccn_data *ndata;
     int err = GE_NOMEM;
 
-    if (!nadata || !nadata->enabled)
+    /*
+     * Only one connection at a time.  The accepter limits can turn
+     * accepting off and back on while one is up.
+     */
+    if (!nadata || !nadata->enabled || nadata->ndata)
 	return;
 
     ndata = nadata->o->zalloc(nadata->o, sizeof(*ndata));
@@ -618,8 +623,20 @@ conacc_gensio_accepter_alloc(const char *gensio_str,
 			     struct gensio_accepter **accepter)
 {
     struct conaccna_data *nadata;
+    struct gensio_acc_limits limits;
+    unsigned int i;
     int err;
 
+    err = gensio_get_default_acc_limits(o, "conacc", &limits);
+    if (err)
+	return err;
+
+    for (i = 0; args && args[i]; i++) {
+	if (gensio_check_acc_limit(args[i], &limits) > 0)
+	    continue;
+	return GE_INVAL;
+    }
+
     nadata = o->zalloc(o, sizeof(*nadata));
     if (!nadata)
 	return GE_NOMEM;
@@ -643,6 +660,7 @@ conacc_gensio_accepter_alloc(const char *gensio_str,
     if (err)
 	goto out_err;
     nadata->acc = *accepter;
+    base_gensio_accepter_set_limits(nadata->acc, &limits);
 
     /* FIXME - how to set gensio_acc attributes (reliable, etc.) */
     return 0;
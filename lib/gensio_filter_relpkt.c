@@ -6,6 +6,7 @@
  */
 
 #include "config.h"
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -22,6 +23,73 @@ unsigned int curr_drop;
 #endif
 #include "utils.h"
 
+/*
+ * Times, in microseconds.  The retransmit timeout is worked out from
+ * the measured round trip time and is backed off exponentially while
+ * nothing gets through.  The keepalive makes sure something goes
+ * each way every so often so a dead remote end can be detected.
+ */
+#define RELPKT_KEEPALIVE	1000000
+#define RELPKT_INIT_RTO		1000000
+#define RELPKT_MIN_RTO		10000
+#define RELPKT_MAX_RTO		2000000
+#define RELPKT_ACK_DELAY	2000
+
+/*
+ * Protocol versions.  Version 0 has 8-bit sequence numbers and a
+ * window of at most RELPKT_V0_MAX_PACKETS.  Version 1 has 16-bit
+ * sequence numbers, so the window can be up to RELPKT_MAX_PACKETS.
+ * Version 2 adds selective acks.  The version is the lower of what
+ * the two ends ask for in the init messages.  Sequence numbers are
+ * kept as 32 bits internally and only the low bits go on the wire.
+ */
+#define RELPKT_VERSION		2
+#define RELPKT_V0_MAX_PACKETS	128
+#define RELPKT_MAX_PACKETS	32768
+#define RELPKT_MAX_HDR		5
+
+/*
+ * If max_pktsize is not given, packets are as big as the layer below
+ * can take, up to what fits in an ethernet frame as IPv6 UDP.
+ * RELPKT_DEFAULT_PKTSIZE is used if the layer below can't tell us.
+ */
+#define RELPKT_MTU_SIZE		1452
+#define RELPKT_DEFAULT_PKTSIZE	123
+
+/*
+ * Congestion control, in packets.  The congestion window starts
+ * small, doubles every round trip until the first loss (slow start),
+ * then grows by one packet per round trip.  On a loss it is cut to
+ * RELPKT_CWND_BETA percent of what was sent and unacked, like CUBIC,
+ * and it drops to one packet if the resend timer goes off.  Only the
+ * first loss in a window counts, losses found while recovering from
+ * it, including lost resends, don't cut it again.
+ */
+#define RELPKT_INIT_CWND	4
+#define RELPKT_MIN_SSTHRESH	2
+#define RELPKT_CWND_BETA	70
+
+/*
+ * Tail loss probes sent before the resend timer is allowed to go
+ * off.  A small window often loses its last packets or their acks,
+ * a probe finds that out in a couple of round trips instead of a
+ * whole resend timeout.
+ */
+#define RELPKT_MAX_PROBES	3
+
+/*
+ * A sent packet is taken as lost, and sent again right away, once
+ * this many packets sent after it have got to the other end.  Less
+ * reordering than that is not mistaken for a loss.  A window too
+ * small for that is left to the tail loss probes.  Without selective
+ * acks, this many duplicate acks do the same for the first unacked
+ * packet.
+ */
+#define RELPKT_DUPTHRESH	3
+
+/* The most selective ack blocks in an ack. */
+#define RELPKT_MAX_SACK		8
+
 enum relpkt_msgs {
     /*
      * Request a connection be established.
@@ -33,6 +101,14 @@ enum relpkt_msgs {
      * | pktlen msb     |    pktlen lsb  |
      * +----------------+----------------+
      * A - response bit, 1 if a response, 0 if not.
+     *
+     * Version 1 and later add a wider receive window, the one byte
+     * window above is for a version 0 remote end.  A version 0 end
+     * ignores the extra bytes and responds with version 0.
+     *
+     * +----------------+----------------+
+     * | recv win msb   |  recv win lsb  |
+     * +----------------+----------------+
      */
     RELPKT_MSG_INIT = 1,
 
@@ -44,6 +120,23 @@ enum relpkt_msgs {
      * |   2   |reserv|A| next expected  |  msg seq       |
      * +----------------+----------------+----------------+
      * A - eom bit, if 1 end of message, if 0 not.
+     *
+     * In version 1 the sequence numbers are two bytes, msb first.
+     *
+     * +----------------+----------------+----------------+
+     * |   2   |rsv|S|A| next exp msb   | next exp lsb   |
+     * +----------------+----------------+----------------+
+     * +----------------+----------------+
+     * |  msg seq msb   |  msg seq lsb   |
+     * +----------------+----------------+
+     * S - sack bit, version 2 only.  If 1 this is only an ack and the
+     *     rest of the packet is selective ack blocks, the first and
+     *     last sequence numbers of each run of packets received past
+     *     a missing one.
+     *
+     * +----------------+----------------+----------------+----------------+
+     * | first seq msb  | first seq lsb  | last seq msb   | last seq lsb   |
+     * +----------------+----------------+----------------+----------------+
      */
     RELPKT_MSG_DATA = 2,
 
@@ -51,6 +144,7 @@ enum relpkt_msgs {
      * Request resending data from starting at the first sequence
      * number up to and including the last sequence number.
      * Data after the header is more resend requests in pairs.
+     * In version 1 each sequence number is two bytes, msb first.
      * 
      * +----------------+----------------+----------------+
      * |   3   |reserved|first seq resend|last seq resend |
@@ -243,6 +337,11 @@ struct pkt {
     uint16_t start; /* For partial acceptance by user */
 
     bool sent; /* If true, packet does not need to be sent. */
+    bool resent; /* Sent more than once, not good for timing. */
+    bool urgent; /* Resend even if the cwnd is full. */
+    bool sacked; /* The remote end has it, but hasn't acked it yet. */
+    int64_t send_time; /* When the packet was last sent. */
+    uint32_t xmit_order; /* The value of next_xmit_order when last sent. */
 
     bool ready; /* If true, packet is ready to deliver to the user. */
     bool eom; /* If true, report end of message. */
@@ -266,12 +365,18 @@ struct relpkt_filter {
 
     bool server; /* True if server mode. */
 
-    gensiods max_pktsize;
-    unsigned int max_pkt; /* Our set value. */
+    unsigned int max_version; /* The highest version we will use. */
+    unsigned int version; /* Version in use with the remote end. */
+    unsigned int hdrlen; /* Data header size for the version. */
+    uint32_t seq_mask; /* Sequence number bits on the wire. */
 
-    uint8_t next_expected_seq; /* Next seq we expect from the remote. */
-    uint8_t next_deliver_seq; /* Next seq we will deliver to the user. */
-    uint8_t deliver_recvpkt; /* Pos in recvpkts of next_deliver_seq. */
+    gensiods max_pktsize; /* Zero until set from the layer below. */
+    unsigned int max_pkt; /* Our set value, the size of the arrays. */
+    unsigned int max_recvpkt; /* The window we told the remote end. */
+
+    uint32_t next_expected_seq; /* Next seq we expect from the remote. */
+    uint32_t next_deliver_seq; /* Next seq we will deliver to the user. */
+    unsigned int deliver_recvpkt; /* Pos in recvpkts of next_deliver_seq. */
     struct pkt *recvpkts;
 
     /*
@@ -281,16 +386,79 @@ struct relpkt_filter {
      */
     unsigned int timeouts_since_ack;
     bool send_since_timeout;
+    int64_t keepalive_deadline;
+
+    /*
+     * Round trip time estimation (Jacobson/Karels).  srtt is zero
+     * until the first measurement comes in.
+     */
+    int64_t srtt;
+    int64_t rttvar;
+    int64_t rto;
+    int64_t init_send_time;
+
+    /*
+     * Set while sent data is unacked, resend it all at the deadline.
+     * If probe_pending is set, the deadline is for a tail loss probe
+     * instead, which resends just the last packet.  nr_probes is how
+     * many have gone since data was last acked.
+     */
+    bool rto_running;
+    bool probe_pending;
+    unsigned int nr_probes;
+    int64_t rto_deadline;
+
+    /*
+     * Acks for delivered data are held back a little to be sent with
+     * data or cover more than one packet, if delay_acks is set.
+     */
+    bool delay_acks;
+    bool ack_pending;
+    int64_t ack_deadline;
+    unsigned int nr_unacked;
+
+    /* The earliest of the deadlines above the timer is set for. */
+    bool timer_running;
+    int64_t timer_deadline;
 
     unsigned int max_xmit_pktsize;
     unsigned int max_xmitpkt; /* Set from remote end by init packet. */
-    uint8_t next_acked_seq; /* Seq for next packet that is unacked. */
-    uint8_t next_send_seq; /* Seq for next packet we will send. */
-    uint8_t first_xmitpkt; /* Pos in xmitpkts of where next_ack_seq is. */
+    uint32_t next_acked_seq; /* Seq for next packet that is unacked. */
+    uint32_t next_send_seq; /* Seq for next packet the user writes. */
+    uint32_t next_xmit_seq; /* Seq for next packet never sent yet. */
+    uint32_t resend_seq; /* Nothing before this needs to be resent. */
+    unsigned int nr_urgent; /* Packets with urgent set. */
+    unsigned int first_xmitpkt; /* Pos in xmitpkts of where next_ack_seq is. */
     struct pkt *xmitpkts;
-    unsigned int nr_waiting_xmitpkt; /* nr in xmitpkt unsent */
 
-    char init_pkt[5];
+    /*
+     * Congestion control.  Only packets within cwnd of next_acked_seq
+     * may be sent.  After a loss the window is not cut again until
+     * everything sent before the loss has been acked (recover_seq).
+     */
+    unsigned int cwnd;
+    unsigned int cwnd_count; /* Acks toward the next cwnd increase. */
+    unsigned int ssthresh;
+    bool in_recovery;
+    uint32_t recover_seq;
+    unsigned int dup_acks; /* Acks in a row that acked nothing new. */
+
+    /*
+     * Selective acks, version 2 and later.  Acks list what the remote
+     * end got past a missing packet, so the sender knows exactly what
+     * to resend.  With sacks, only packets in flight (sent and not
+     * acked or sacked) count against the congestion window.
+     * delivered_order is one past the highest xmit_order of any
+     * packet acked or sacked.
+     */
+    bool sack;
+    unsigned int nr_sacked;
+    unsigned int nr_in_flight;
+    uint32_t next_xmit_order;
+    uint32_t delivered_order;
+
+    char init_pkt[7];
+    gensiods init_pkt_len;
     bool send_init_pkt;
     unsigned int init_retry_count;
 
@@ -298,15 +466,12 @@ struct relpkt_filter {
     bool send_close_pkt;
     unsigned int close_retry_count;
 
-    char ack_pkt[3];
+    unsigned char ack_pkt[RELPKT_MAX_HDR + 4 * RELPKT_MAX_SACK];
     bool send_ack_pkt;
 
-    char resend_pkt[51];
+    unsigned char resend_pkt[51];
     bool send_resend_pkt;
     uint16_t resend_pkt_len;
-
-    uint8_t last_timeout_ack; /* next_acked_seq on the last timeout. */
-    unsigned int timeout_ack_count; /* nr timeouts last_timeout_ack same. */
 };
 
 #define filter_to_relpkt(v) ((struct relpkt_filter *) \
@@ -327,72 +492,496 @@ relpkt_unlock(struct relpkt_filter *rfilter)
     rfilter->o->unlock(rfilter->lock);
 }
 
+static uint32_t
+get_seq(struct relpkt_filter *rfilter, const unsigned char *buf)
+{
+    if (rfilter->version == 0)
+	return buf[0];
+    return buf[0] << 8 | buf[1];
+}
+
+/* Returns the number of bytes used. */
+static unsigned int
+put_seq(struct relpkt_filter *rfilter, unsigned char *buf, uint32_t seq)
+{
+    if (rfilter->version == 0) {
+	buf[0] = seq;
+	return 1;
+    }
+    buf[0] = seq >> 8;
+    buf[1] = seq;
+    return 2;
+}
+
 /*
- * Returns true if seq >= first and seq < next, taking into account
- * wrapping.  If first == next, this will always return false.
+ * Only the low bits of a sequence number are on the wire.  Turn that
+ * into the full sequence number at or after base.
  */
-static bool
-seq_inside(uint8_t seq, uint8_t first, uint8_t next)
+static uint32_t
+seq_unwrap(struct relpkt_filter *rfilter, uint32_t wseq, uint32_t base)
 {
-    if (first <= next)
-	/* not wrapped */
-	return seq >= first && seq < next;
-    else
-	/* wrapped */
-	return seq >= first || seq < next;
+    return base + ((wseq - base) & rfilter->seq_mask);
+}
+
+static void
+relpkt_set_version(struct relpkt_filter *rfilter, unsigned int version)
+{
+    rfilter->version = version;
+    rfilter->sack = version >= 2;
+    if (version == 0) {
+	rfilter->hdrlen = 3;
+	rfilter->seq_mask = 0xff;
+    } else {
+	rfilter->hdrlen = 5;
+	rfilter->seq_mask = 0xffff;
+    }
 }
 
-static uint8_t
-recvpkt_pos(struct relpkt_filter *rfilter, uint8_t pos)
+static unsigned int
+recvpkt_pos(struct relpkt_filter *rfilter, unsigned int pos)
 {
     return (rfilter->deliver_recvpkt + pos) % rfilter->max_pkt;
 }
 
-static uint8_t
-xmitpkt_pos(struct relpkt_filter *rfilter, uint8_t pos)
+static unsigned int
+xmitpkt_pos(struct relpkt_filter *rfilter, unsigned int pos)
+{
+    return (rfilter->first_xmitpkt + pos) % rfilter->max_pkt;
+}
+
+static struct pkt *
+xmitpkt_seq(struct relpkt_filter *rfilter, uint32_t seq)
+{
+    return &rfilter->xmitpkts[xmitpkt_pos(rfilter,
+					  seq - rfilter->next_acked_seq)];
+}
+
+static int64_t
+relpkt_now(struct relpkt_filter *rfilter)
 {
-    return (rfilter->first_xmitpkt + pos) % rfilter->max_xmitpkt;
+    gensio_time now;
+
+    rfilter->o->get_monotonic_time(rfilter->o, &now);
+    return now.secs * 1000000LL + now.nsecs / 1000;
+}
+
+static int64_t
+relpkt_next_deadline(struct relpkt_filter *rfilter)
+{
+    int64_t next = rfilter->keepalive_deadline;
+
+    if (rfilter->rto_running && rfilter->rto_deadline < next)
+	next = rfilter->rto_deadline;
+    if (rfilter->ack_pending && rfilter->ack_deadline < next)
+	next = rfilter->ack_deadline;
+    return next;
 }
 
 static void
-resend_packets(struct relpkt_filter *rfilter, uint8_t first, uint8_t last)
+relpkt_deadline_to_timeout(int64_t deadline, int64_t now,
+			   gensio_time *timeout)
 {
-    uint8_t seq;
-    unsigned int i, pos;
-
-    for (seq = first, i = first - rfilter->next_acked_seq; seq != last; i++) {
-	pos = xmitpkt_pos(rfilter, i);
-	if (rfilter->xmitpkts[pos].sent) {
-	    rfilter->xmitpkts[pos].sent = false;
-	    rfilter->nr_waiting_xmitpkt++;
+    int64_t usecs = deadline - now;
+
+    if (usecs < 0)
+	usecs = 0;
+    timeout->secs = usecs / 1000000;
+    timeout->nsecs = (usecs % 1000000) * 1000;
+}
+
+/*
+ * Make sure the timer will go off by the earliest deadline.  The
+ * timer is only moved if that is earlier than what it is set for, if
+ * it goes off early the timeout just sets it again.
+ */
+static void
+relpkt_update_timer(struct relpkt_filter *rfilter, int64_t now)
+{
+    int64_t next = relpkt_next_deadline(rfilter);
+    gensio_time timeout;
+
+    if (rfilter->timer_running && rfilter->timer_deadline <= next)
+	return;
+    rfilter->timer_running = true;
+    rfilter->timer_deadline = next;
+    relpkt_deadline_to_timeout(next, now, &timeout);
+    if (rfilter->filter_cb(rfilter->filter_cb_data,
+			   GENSIO_FILTER_CB_RESTART_TIMER, &timeout))
+	/* Not running, try again on the next update. */
+	rfilter->timer_running = false;
+}
+
+static void
+relpkt_rtt_sample(struct relpkt_filter *rfilter, int64_t rtt)
+{
+    int64_t err;
+
+    if (rtt <= 0)
+	rtt = 1;
+    if (!rfilter->srtt) {
+	rfilter->srtt = rtt;
+	rfilter->rttvar = rtt / 2;
+    } else {
+	err = rtt - rfilter->srtt;
+	if (err < 0)
+	    err = -err;
+	rfilter->rttvar += (err - rfilter->rttvar) / 4;
+	rfilter->srtt += (rtt - rfilter->srtt) / 8;
+    }
+    rfilter->rto = rfilter->srtt + 4 * rfilter->rttvar;
+    if (rfilter->rto < RELPKT_MIN_RTO)
+	rfilter->rto = RELPKT_MIN_RTO;
+    else if (rfilter->rto > RELPKT_MAX_RTO)
+	rfilter->rto = RELPKT_MAX_RTO;
+}
+
+/*
+ * Probes go at a little over two round trips to allow for the other
+ * end delaying its ack.
+ */
+static int64_t
+relpkt_probe_timeout(struct relpkt_filter *rfilter)
+{
+    int64_t timeout = 2 * rfilter->srtt;
+
+    if (rfilter->next_xmit_seq - rfilter->next_acked_seq <= 1)
+	timeout += RELPKT_ACK_DELAY;
+    if (timeout > rfilter->rto)
+	timeout = rfilter->rto;
+    return timeout;
+}
+
+/*
+ * Data is out and unacked, start timing from now.  If we have a round
+ * trip time, probes go first.
+ */
+static void
+relpkt_start_rto(struct relpkt_filter *rfilter, int64_t now)
+{
+    int64_t timeout = rfilter->rto;
+
+    rfilter->probe_pending = rfilter->srtt != 0;
+    rfilter->nr_probes = 0;
+    if (rfilter->probe_pending)
+	timeout = relpkt_probe_timeout(rfilter);
+    rfilter->rto_running = true;
+    rfilter->rto_deadline = now + timeout;
+    relpkt_update_timer(rfilter, now);
+}
+
+static void
+relpkt_start_timers(struct relpkt_filter *rfilter)
+{
+    int64_t now = relpkt_now(rfilter);
+
+    rfilter->keepalive_deadline = now + RELPKT_KEEPALIVE;
+    relpkt_update_timer(rfilter, now);
+}
+
+/*
+ * Resend the sent packets from first up to, but not including, last.
+ * If urgent is set they go even if the congestion window is full.
+ * Packets the remote end has sacked are left alone.
+ */
+static void
+resend_packets(struct relpkt_filter *rfilter, uint32_t first, uint32_t last,
+	       bool urgent)
+{
+    uint32_t nr_sent = rfilter->next_xmit_seq - rfilter->next_acked_seq;
+    uint32_t seq;
+    struct pkt *p;
+
+    if (first - rfilter->next_acked_seq >= nr_sent)
+	return;
+    if (last - rfilter->next_acked_seq > nr_sent)
+	last = rfilter->next_xmit_seq;
+    for (seq = first; seq != last; seq++) {
+	p = xmitpkt_seq(rfilter, seq);
+	if (p->sacked)
+	    continue;
+	if (p->sent) {
+	    p->sent = false;
+	    p->resent = true;
+	    rfilter->nr_in_flight--;
+	}
+	if (urgent && !p->urgent) {
+	    p->urgent = true;
+	    rfilter->nr_urgent++;
 	}
-	seq++;
     }
+    if (first - rfilter->next_acked_seq <
+		rfilter->resend_seq - rfilter->next_acked_seq)
+	rfilter->resend_seq = first;
+}
+
+static bool
+xmitpkt_done(struct relpkt_filter *rfilter, uint32_t seq)
+{
+    struct pkt *p = xmitpkt_seq(rfilter, seq);
+
+    return p->sent || p->sacked;
 }
 
+/*
+ * Find the next packet to send, resends first, then new packets.
+ * Returns NULL if there is nothing or the congestion window is full.
+ * Urgent packets go even if the window is full, an ack may have been
+ * lost so we don't know how much is really out.
+ */
 static struct pkt *
-first_xmitpkt_to_send(struct relpkt_filter *rfilter)
+next_xmitpkt_to_send(struct relpkt_filter *rfilter, uint32_t *rseq)
+{
+    uint32_t seq = rfilter->resend_seq;
+    unsigned int used;
+    struct pkt *p;
+
+    while (seq != rfilter->next_xmit_seq && xmitpkt_done(rfilter, seq))
+	seq++;
+    rfilter->resend_seq = seq;
+    if (seq == rfilter->next_send_seq)
+	return NULL;
+    if (rfilter->sack)
+	used = rfilter->nr_in_flight;
+    else
+	used = seq - rfilter->next_acked_seq;
+    if (used < rfilter->cwnd) {
+	*rseq = seq;
+	return xmitpkt_seq(rfilter, seq);
+    }
+    for (; rfilter->nr_urgent && seq != rfilter->next_xmit_seq; seq++) {
+	p = xmitpkt_seq(rfilter, seq);
+	if (p->urgent && !p->sent) {
+	    *rseq = seq;
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+static void
+relpkt_cwnd_acked(struct relpkt_filter *rfilter, unsigned int count)
+{
+    if (rfilter->in_recovery) {
+	if (rfilter->next_acked_seq - rfilter->recover_seq < 0x80000000) {
+	    /* Everything sent before the loss is acked, back to normal. */
+	    rfilter->in_recovery = false;
+	    if (rfilter->cwnd > rfilter->ssthresh)
+		rfilter->cwnd = rfilter->ssthresh;
+	    rfilter->cwnd_count = 0;
+	} else if (rfilter->cwnd > rfilter->ssthresh) {
+	    /* Take back what duplicate acks added for these packets. */
+	    if (rfilter->cwnd - rfilter->ssthresh > count)
+		rfilter->cwnd -= count;
+	    else
+		rfilter->cwnd = rfilter->ssthresh;
+	}
+	return;
+    }
+
+    if (rfilter->cwnd < rfilter->ssthresh) {
+	rfilter->cwnd += count;
+    } else {
+	rfilter->cwnd_count += count;
+	while (rfilter->cwnd_count >= rfilter->cwnd) {
+	    rfilter->cwnd_count -= rfilter->cwnd;
+	    rfilter->cwnd++;
+	}
+    }
+    if (rfilter->cwnd > rfilter->max_xmitpkt)
+	rfilter->cwnd = rfilter->max_xmitpkt;
+}
+
+static void relpkt_cwnd_loss(struct relpkt_filter *rfilter, bool timeout);
+
+/*
+ * Without sacks, an ack that doesn't ack anything new means a later
+ * packet got to the other end.  While recovering from a loss, let
+ * another one go for each to keep acks coming back while the loss is
+ * resent.  Otherwise the resend request for a loss may itself have
+ * been lost, so after RELPKT_DUPTHRESH of them resend the first
+ * unacked packet.
+ */
+static void
+relpkt_dup_ack(struct relpkt_filter *rfilter)
+{
+    if (rfilter->sack || rfilter->next_xmit_seq == rfilter->next_acked_seq)
+	return;
+    if (rfilter->in_recovery) {
+	if (rfilter->cwnd < rfilter->max_xmitpkt)
+	    rfilter->cwnd++;
+    } else if (++rfilter->dup_acks == RELPKT_DUPTHRESH) {
+	resend_packets(rfilter, rfilter->next_acked_seq,
+		       rfilter->next_acked_seq + 1, true);
+	relpkt_cwnd_loss(rfilter, false);
+    }
+}
+
+/* The remote end got a packet we sent, it's no longer in flight. */
+static void
+relpkt_pkt_delivered(struct relpkt_filter *rfilter, struct pkt *p)
+{
+    if (p->sent && !p->sacked)
+	rfilter->nr_in_flight--;
+    if (p->xmit_order + 1 - rfilter->delivered_order < 0x80000000)
+	rfilter->delivered_order = p->xmit_order + 1;
+}
+
+/*
+ * Handle the selective ack blocks in an ack.  Blocks may be for
+ * things that have been acked since it was sent, just ignore those.
+ */
+static void
+handle_sack(struct relpkt_filter *rfilter, const unsigned char *buf,
+	    gensiods buflen)
+{
+    uint32_t nr_sent = rfilter->next_xmit_seq - rfilter->next_acked_seq;
+    uint32_t first, last;
+    struct pkt *p, *timed = NULL;
+    gensiods i;
+
+    for (i = 0; i + 4 <= buflen; i += 4) {
+	first = seq_unwrap(rfilter, get_seq(rfilter, buf + i),
+			   rfilter->next_acked_seq);
+	last = seq_unwrap(rfilter, get_seq(rfilter, buf + i + 2), first) + 1;
+	if (first - rfilter->next_acked_seq >= nr_sent)
+	    continue;
+	if (last - rfilter->next_acked_seq > nr_sent)
+	    last = rfilter->next_xmit_seq;
+	for (; first != last; first++) {
+	    p = xmitpkt_seq(rfilter, first);
+	    if (p->sacked)
+		continue;
+	    relpkt_pkt_delivered(rfilter, p);
+	    /* Sacks come right away, so these can be timed. */
+	    if (p->sent && !p->resent)
+		timed = p;
+	    p->sacked = true;
+	    rfilter->nr_sacked++;
+	    if (p->urgent) {
+		p->urgent = false;
+		rfilter->nr_urgent--;
+	    }
+	}
+    }
+    if (timed)
+	relpkt_rtt_sample(rfilter, relpkt_now(rfilter) - timed->send_time);
+}
+
+/*
+ * With sacks, a packet still in flight is lost if RELPKT_DUPTHRESH
+ * packets sent after it have got to the other end.  This catches
+ * lost resends, too, since they are ordered by when they were sent.
+ * Lost packets are sent again right away, the timer isn't needed.
+ */
+static void
+relpkt_detect_loss(struct relpkt_filter *rfilter)
 {
-    uint8_t seq = rfilter->next_acked_seq;
-    unsigned int i, pos;
+    uint32_t seq = rfilter->next_acked_seq, after;
+    unsigned int nr_sacked = 0;
+    bool lost = false;
+    struct pkt *p;
 
-    for (i = 0; seq != rfilter->next_send_seq; i++, seq++) {
-	pos = xmitpkt_pos(rfilter, i);
-	if (!rfilter->xmitpkts[pos].sent)
-	    return &(rfilter->xmitpkts[pos]);
+    for (; nr_sacked < rfilter->nr_sacked && seq != rfilter->next_xmit_seq;
+	 seq++) {
+	p = xmitpkt_seq(rfilter, seq);
+	if (p->sacked) {
+	    nr_sacked++;
+	    continue;
+	}
+	/* How many packets sent after this one got there, plus one. */
+	after = rfilter->delivered_order - p->xmit_order;
+	if (p->sent && after > RELPKT_DUPTHRESH && after < 0x80000000) {
+	    resend_packets(rfilter, seq, seq + 1, false);
+	    lost = true;
+	}
     }
-    assert(0);
+    if (lost)
+	relpkt_cwnd_loss(rfilter, false);
+}
+
+/*
+ * Something sent was lost, back off.  A resend timeout means nothing
+ * is getting through, so start over from one packet.  If we already
+ * backed off for an earlier loss, this is part of the same one (a
+ * timeout there is for a lost resend), and the window is already
+ * reduced.
+ */
+static void
+relpkt_cwnd_loss(struct relpkt_filter *rfilter, bool timeout)
+{
+    unsigned int unacked;
+
+    if (rfilter->in_recovery)
+	return;
+    /*
+     * Not nr_in_flight, even with sacks.  That has already dropped by
+     * what was sacked and by the packets just found lost, and would
+     * cut the window much further than the same loss without sacks.
+     */
+    unacked = rfilter->next_xmit_seq - rfilter->next_acked_seq;
+    rfilter->ssthresh = unacked * RELPKT_CWND_BETA / 100;
+    if (rfilter->ssthresh < RELPKT_MIN_SSTHRESH)
+	rfilter->ssthresh = RELPKT_MIN_SSTHRESH;
+    rfilter->cwnd = timeout ? 1 : rfilter->ssthresh;
+    rfilter->cwnd_count = 0;
+    rfilter->in_recovery = true;
+    rfilter->recover_seq = rfilter->next_xmit_seq;
 }
 
 static void
 send_init(struct relpkt_filter *rfilter, bool response)
 {
+    unsigned int window = rfilter->max_pkt;
+
+    if (window > RELPKT_V0_MAX_PACKETS)
+	window = RELPKT_V0_MAX_PACKETS;
     rfilter->init_pkt[0] = (RELPKT_MSG_INIT << 4) | (uint8_t) response;
-    rfilter->init_pkt[1] = 0; /* version */
-    rfilter->init_pkt[2] = rfilter->max_pkt;
+    rfilter->init_pkt[1] = rfilter->version;
+    rfilter->init_pkt[2] = window;
     rfilter->init_pkt[3] = rfilter->max_pktsize >> 8;
     rfilter->init_pkt[4] = rfilter->max_pktsize & 0xff;
+    rfilter->init_pkt_len = 5;
+    if (rfilter->version > 0) {
+	window = rfilter->max_pkt;
+	rfilter->init_pkt[5] = window >> 8;
+	rfilter->init_pkt[6] = window & 0xff;
+	rfilter->init_pkt_len = 7;
+    }
+    rfilter->max_recvpkt = window;
     rfilter->send_init_pkt = true;
+    if (!response)
+	rfilter->init_send_time = relpkt_now(rfilter);
+}
+
+/*
+ * Handle the version and window from the remote end's init.  The
+ * client's version is what it asked for until the response comes.
+ */
+static void
+handle_init(struct relpkt_filter *rfilter, unsigned char *buf,
+	    gensiods buflen)
+{
+    unsigned int version = buf[1];
+
+    if (version > rfilter->max_version)
+	version = rfilter->max_version;
+    if (version > 0 && buflen < 7)
+	version = 0;
+    relpkt_set_version(rfilter, version);
+
+    if (version == 0)
+	rfilter->max_xmitpkt = buf[2];
+    else
+	rfilter->max_xmitpkt = buf[5] << 8 | buf[6];
+    if (rfilter->max_xmitpkt > rfilter->max_pkt)
+	rfilter->max_xmitpkt = rfilter->max_pkt;
+    if (version == 0 && rfilter->max_xmitpkt > RELPKT_V0_MAX_PACKETS)
+	rfilter->max_xmitpkt = RELPKT_V0_MAX_PACKETS;
+    rfilter->max_xmit_pktsize = buf[3] << 8 | buf[4];
+    if (rfilter->max_xmit_pktsize > rfilter->max_pktsize)
+	rfilter->max_xmit_pktsize = rfilter->max_pktsize;
+    if (rfilter->cwnd > rfilter->max_xmitpkt)
+	rfilter->cwnd = rfilter->max_xmitpkt;
 }
 
 static void
@@ -407,69 +996,187 @@ send_close(struct relpkt_filter *rfilter)
 static void
 send_ack(struct relpkt_filter *rfilter)
 {
+    /* The ack is filled in at send time, the msg seq is unused. */
+    memset(rfilter->ack_pkt, 0, sizeof(rfilter->ack_pkt));
     rfilter->ack_pkt[0] = RELPKT_MSG_DATA << 4;
-    /* seq will be filled in at send time. */
-    rfilter->ack_pkt[2] = 0;
     rfilter->send_ack_pkt = true;
+    rfilter->ack_pending = false;
+    rfilter->nr_unacked = 0;
 }
 
+/* A packet was delivered to the user, ack it now or a little later. */
 static void
-request_resend(struct relpkt_filter *rfilter, uint8_t first, uint8_t last)
+delay_ack(struct relpkt_filter *rfilter)
 {
+    int64_t now;
+
+    /* Like TCP, every other packet gets acked right away. */
+    if (!rfilter->delay_acks || ++rfilter->nr_unacked >= 2) {
+	send_ack(rfilter);
+	return;
+    }
+    if (!rfilter->ack_pending) {
+	now = relpkt_now(rfilter);
+	rfilter->ack_pending = true;
+	rfilter->ack_deadline = now + RELPKT_ACK_DELAY;
+	relpkt_update_timer(rfilter, now);
+    }
+}
+
+static void
+request_resend(struct relpkt_filter *rfilter, uint32_t first, uint32_t last)
+{
+    unsigned char *buf;
+
     if (!rfilter->send_resend_pkt) {
 	rfilter->resend_pkt_len = 1;
 	rfilter->resend_pkt[0] = RELPKT_MSG_RESEND << 4;
 	rfilter->send_resend_pkt = true;
     }
-    if (rfilter->resend_pkt_len + 1 >= sizeof(rfilter->resend_pkt))
+    if (rfilter->resend_pkt_len + (rfilter->hdrlen - 1) >
+		sizeof(rfilter->resend_pkt))
 	return; /* No space left, let transmit timeout get it. */
-    rfilter->resend_pkt[rfilter->resend_pkt_len++] = first;
-    rfilter->resend_pkt[rfilter->resend_pkt_len++] = last;
-    rfilter->timeout_ack_count = 0;
+    buf = rfilter->resend_pkt + rfilter->resend_pkt_len;
+    buf += put_seq(rfilter, buf, first);
+    buf += put_seq(rfilter, buf, last);
+    rfilter->resend_pkt_len = buf - rfilter->resend_pkt;
+}
+
+/* Fill in the ack and sequence number of a data header. */
+static void
+set_data_hdr(struct relpkt_filter *rfilter, unsigned char *buf, uint32_t seq)
+{
+    buf++;
+    buf += put_seq(rfilter, buf, rfilter->next_deliver_seq);
+    put_seq(rfilter, buf, seq);
 }
 
-/* Returns true on a protocol error. */
+/*
+ * Fill in the ack packet and return its length.  With sacks, if
+ * something is missing the runs of packets we have past it are added.
+ */
+static unsigned int
+set_ack_pkt(struct relpkt_filter *rfilter)
+{
+    unsigned char *buf = rfilter->ack_pkt + rfilter->hdrlen;
+    unsigned int i, nr = rfilter->next_expected_seq - rfilter->next_deliver_seq;
+    unsigned int nr_blocks = 0, max_blocks = rfilter->max_xmit_pktsize / 4;
+    uint32_t first = 0;
+    bool in_run = false, ready;
+
+    rfilter->ack_pkt[0] = RELPKT_MSG_DATA << 4;
+    set_data_hdr(rfilter, rfilter->ack_pkt, 0);
+    if (!rfilter->sack || rfilter->recvpkts[rfilter->deliver_recvpkt].ready)
+	return rfilter->hdrlen;
+
+    /* The remote end can't take a bigger packet than it sends. */
+    if (max_blocks > RELPKT_MAX_SACK)
+	max_blocks = RELPKT_MAX_SACK;
+    for (i = 1; i <= nr && nr_blocks < max_blocks; i++) {
+	ready = i < nr && rfilter->recvpkts[recvpkt_pos(rfilter, i)].ready;
+	if (ready && !in_run) {
+	    first = rfilter->next_deliver_seq + i;
+	    in_run = true;
+	} else if (!ready && in_run) {
+	    buf += put_seq(rfilter, buf, first);
+	    buf += put_seq(rfilter, buf, rfilter->next_deliver_seq + i - 1);
+	    nr_blocks++;
+	    in_run = false;
+	}
+    }
+    if (nr_blocks)
+	rfilter->ack_pkt[0] |= 2;
+    return buf - rfilter->ack_pkt;
+}
+
+/* Ask again for the missing packets before the first one we have. */
+static void
+rerequest_resend(struct relpkt_filter *rfilter)
+{
+    unsigned int i, nr = rfilter->next_expected_seq - rfilter->next_deliver_seq;
+
+    for (i = 1; i < nr; i++) {
+	if (rfilter->recvpkts[recvpkt_pos(rfilter, i)].ready)
+	    break;
+    }
+    request_resend(rfilter, rfilter->next_deliver_seq,
+		   rfilter->next_deliver_seq + i - 1);
+}
+
+/*
+ * Returns true on a protocol error.  ack_only is set if there was no
+ * data with the ack.
+ */
 static bool
-handle_ack(struct relpkt_filter *rfilter, uint8_t seq)
+handle_ack(struct relpkt_filter *rfilter, uint32_t wseq, bool ack_only)
 {
-    unsigned int pos;
+    uint32_t seq = seq_unwrap(rfilter, wseq, rfilter->next_acked_seq);
+    unsigned int count;
+    struct pkt *p, *timed = NULL;
+    bool waited = false;
+    int64_t now;
 
     /*
      * The last received message on the other end is in seq, but we
      * keep the next thing that should be acked, thus the +1.
      */
-    if (!seq_inside(seq, rfilter->next_acked_seq,
-		    rfilter->next_send_seq + 1))
+    count = seq - rfilter->next_acked_seq;
+    if (count > rfilter->next_send_seq - rfilter->next_acked_seq)
 	return true;
+    rfilter->timeouts_since_ack = 0;
+    if (count == 0) {
+	if (ack_only)
+	    relpkt_dup_ack(rfilter);
+	return false;
+    }
+    rfilter->dup_acks = 0;
+
     while (rfilter->next_acked_seq != seq) {
-	pos = rfilter->first_xmitpkt;
-	if (!rfilter->xmitpkts[pos].sent) {
+	p = &(rfilter->xmitpkts[rfilter->first_xmitpkt]);
+	/*
+	 * If the packet wasn't sent yet, but we got an ack.  Could
+	 * happen on a retransmit or some other error.  Just act like
+	 * it was transmitted.
+	 */
+	if (p->resent)
 	    /*
-	     * Packets wasn't sent yet, but we got an ack.  Could
-	     * happen on a retransmit or some other error.  Just act
-	     * like it was transmitted.
+	     * Karn's algorithm, only time packets sent once.  And if
+	     * the ack had to wait for a resend, it's late for
+	     * everything after it, too.
 	     */
-	    rfilter->xmitpkts[pos].sent = true;
-	    assert(rfilter->nr_waiting_xmitpkt > 0);
-	    rfilter->nr_waiting_xmitpkt--;
+	    waited = true;
+	else if (p->sent && !p->sacked)
+	    timed = p;
+	if (p->urgent) {
+	    p->urgent = false;
+	    rfilter->nr_urgent--;
+	}
+	relpkt_pkt_delivered(rfilter, p);
+	if (p->sacked) {
+	    p->sacked = false;
+	    rfilter->nr_sacked--;
 	}
 	rfilter->first_xmitpkt = xmitpkt_pos(rfilter, 1);
 	rfilter->next_acked_seq++;
     }
-    rfilter->timeouts_since_ack = 0;
+    if (count > rfilter->next_xmit_seq - (seq - count))
+	rfilter->next_xmit_seq = seq;
+    if (rfilter->resend_seq - (seq - count) < count)
+	rfilter->resend_seq = seq;
+
+    now = relpkt_now(rfilter);
+    if (timed && !waited)
+	relpkt_rtt_sample(rfilter, now - timed->send_time);
+    relpkt_cwnd_acked(rfilter, count);
+    /* Something got through, restart the resend timer from here. */
+    if (rfilter->next_acked_seq != rfilter->next_xmit_seq)
+	relpkt_start_rto(rfilter, now);
+    else
+	rfilter->rto_running = false;
 
     return false;
 }
 
-static void
-relpkt_filter_start_timer(struct relpkt_filter *rfilter)
-{
-    gensio_time timeout = { 1, 0 };
-
-    rfilter->filter_cb(rfilter->filter_cb_data,
-		       GENSIO_FILTER_CB_START_TIMER, &timeout);
-}
-
 static void
 relpkt_set_callbacks(struct relpkt_filter *rfilter,
 		     gensio_filter_cb cb, void *cb_data)
@@ -489,9 +1196,15 @@ relpkt_ul_read_pending(struct relpkt_filter *rfilter)
 static bool
 relpkt_ll_write_pending(struct relpkt_filter *rfilter)
 {
-    return rfilter->nr_waiting_xmitpkt || rfilter->send_init_pkt ||
+    uint32_t seq;
+    bool rv;
+
+    relpkt_lock(rfilter);
+    rv = next_xmitpkt_to_send(rfilter, &seq) || rfilter->send_init_pkt ||
 	rfilter->send_close_pkt || rfilter->send_resend_pkt ||
 	rfilter->send_ack_pkt;
+    relpkt_unlock(rfilter);
+    return rv;
 }
 
 static bool
@@ -519,9 +1232,28 @@ relpkt_ll_read_needed(struct relpkt_filter *rfilter)
     return true;
 }
 
+/*
+ * If what is below holds back small writes waiting for acks from the
+ * other end (Nagle on TCP), a delayed ack can hold up a sender that
+ * is out of window until the ack timer goes off, so don't delay then.
+ * Packet interfaces don't have the control and don't do that.
+ */
+static bool
+relpkt_lower_sends_now(struct gensio *io)
+{
+    char val[10];
+    gensiods len = sizeof(val);
+    int err;
+
+    err = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			 GENSIO_CONTROL_NODELAY, val, &len);
+    return err || strtoul(val, NULL, 0);
+}
+
 static int
 relpkt_check_open_done(struct relpkt_filter *rfilter, struct gensio *io)
 {
+    rfilter->delay_acks = relpkt_lower_sends_now(io);
     gensio_set_is_packet(io, true);
     gensio_set_is_message(io, true);
     gensio_set_is_reliable(io, true);
@@ -620,12 +1352,14 @@ relpkt_try_disconnect(struct relpkt_filter *rfilter, gensio_time *timeout,
 	    /* Nothing left to send, start the close process. */
 	    rfilter->state = RELPKT_WAITING_CLOSE_RSP;
 	    send_close(rfilter);
+	    timeout->secs = 1;
+	    timeout->nsecs = 0;
 	} else {
 	    /* Wait for output to clear. */
 	    rfilter->state = RELPKT_WAITING_CLOSE_CLEAR;
+	    relpkt_deadline_to_timeout(relpkt_next_deadline(rfilter),
+				       relpkt_now(rfilter), timeout);
 	}
-	timeout->secs = 1;
-	timeout->nsecs = 0;
 	rv = GE_RETRY;
 	break;
 
@@ -643,8 +1377,9 @@ relpkt_try_disconnect(struct relpkt_filter *rfilter, gensio_time *timeout,
 	    }
 	    if (was_timeout) {
 		i_relpkt_filter_timeout(rfilter);
-		timeout->secs = 1;
-		timeout->nsecs = 0;
+		/* Keep resending on time while the data drains. */
+		relpkt_deadline_to_timeout(relpkt_next_deadline(rfilter),
+					   relpkt_now(rfilter), timeout);
 		rv = GE_RETRY;
 	    } else {
 		rv = GE_INPROGRESS;
@@ -683,12 +1418,14 @@ relpkt_ul_write(struct relpkt_filter *rfilter,
 		const struct gensio_sg *sg, gensiods sglen,
 		const char *const *auxdata)
 {
-    struct gensio_sg rsg = { NULL, 0 };
+    struct gensio_os_funcs *o = rfilter->o;
+    struct gensio_sg rsg;
     struct pkt *p = NULL;
     unsigned int nrqueued;
+    uint32_t seq = 0;
     int err = 0;
-    bool *endbool = NULL;
-    bool finish_close = false;
+    bool *endbool;
+    bool finish_close;
 
     relpkt_lock(rfilter);
     nrqueued = rfilter->next_send_seq - rfilter->next_acked_seq;
@@ -698,8 +1435,18 @@ relpkt_ul_write(struct relpkt_filter *rfilter,
     } else {
 	gensiods i, writelen = 0;
 	bool trunc = false;
-	unsigned int pos = xmitpkt_pos(rfilter, nrqueued);
-	struct pkt *p = &(rfilter->xmitpkts[pos]);
+	unsigned char *data;
+
+	p = xmitpkt_seq(rfilter, rfilter->next_send_seq);
+	if (!p->data) {
+	    /* Buffers are allocated as the window gets used. */
+	    p->data = o->zalloc(o, rfilter->max_pktsize + RELPKT_MAX_HDR);
+	    if (!p->data) {
+		err = GE_NOMEM;
+		goto out_unlock;
+	    }
+	}
+	data = p->data + rfilter->hdrlen;
 
 	/* FIXME - if previous packet is not full and not eom, can append */
 	p->len = 0;
@@ -711,7 +1458,7 @@ relpkt_ul_write(struct relpkt_filter *rfilter,
 		inlen = rfilter->max_xmit_pktsize - p->len;
 		trunc = true;
 	    }
-	    memcpy(p->data + p->len + 3, buf, inlen);
+	    memcpy(data + p->len, buf, inlen);
 	    writelen += inlen;
 	    p->len += inlen;
 	    if (p->len == rfilter->max_xmit_pktsize)
@@ -721,88 +1468,117 @@ relpkt_ul_write(struct relpkt_filter *rfilter,
 	    *rcount = writelen;
 
 	if (writelen > 0) {
-	    if (!trunc && gensio_str_in_auxdata(auxdata, "eom"))
-		p->eom = true;
+	    p->eom = !trunc && gensio_str_in_auxdata(auxdata, "eom");
 	    p->data[0] = (RELPKT_MSG_DATA << 4) | (uint8_t) p->eom;
-	    /* Ack (byte 1) will be filled in on transmit. */
-	    p->data[2] = rfilter->next_send_seq;
+	    /* Ack and seq will be filled in on transmit. */
 	    rfilter->next_send_seq++;
 	    p->sent = false;
-	    p->len += 3; /* For the header. */
-	    rfilter->nr_waiting_xmitpkt++;
+	    p->resent = false;
+	    p->urgent = false;
+	    p->sacked = false;
+	    p->len += rfilter->hdrlen;
 	}
     }
 
-    p = NULL;
-    if (rfilter->send_init_pkt) {
-	rsg.buf = rfilter->init_pkt;
-	rsg.buflen = 5;
-	endbool = &rfilter->send_init_pkt;
-    } else if (rfilter->nr_waiting_xmitpkt) {
-	p = first_xmitpkt_to_send(rfilter);
-	rsg.buf = p->data;
-	rsg.buflen = p->len;
-	p->data[1] = rfilter->next_deliver_seq; /* Add the ack */
-	rfilter->send_ack_pkt = false;
-    } else if (rfilter->send_resend_pkt) {
-	rsg.buf = rfilter->resend_pkt;
-	rsg.buflen = rfilter->resend_pkt_len;
-	endbool = &rfilter->send_resend_pkt;
-    } else if (rfilter->send_ack_pkt) {
-	rfilter->ack_pkt[1] = rfilter->next_deliver_seq;
-	rsg.buf = rfilter->ack_pkt;
-	rsg.buflen = 3;
-	endbool = &rfilter->send_ack_pkt;
-    } else if (rfilter->send_close_pkt) {
-	rsg.buf = rfilter->close_pkt;
-	rsg.buflen = 3;
-	endbool = &rfilter->send_close_pkt;
-	if (rfilter->state == RELPKT_REMCLOSED)
-	    finish_close = true;
-    }
+    /*
+     * Send everything we can, a packet at a time, until there's
+     * nothing left or the lower layer won't take any more.
+     */
+    for (;;) {
+	rsg.buflen = 0;
+	endbool = NULL;
+	finish_close = false;
+	p = NULL;
+	if (rfilter->send_init_pkt) {
+	    rsg.buf = rfilter->init_pkt;
+	    rsg.buflen = rfilter->init_pkt_len;
+	    endbool = &rfilter->send_init_pkt;
+	} else if ((p = next_xmitpkt_to_send(rfilter, &seq))) {
+	    set_data_hdr(rfilter, p->data, seq); /* Add the ack */
+	    rsg.buf = p->data;
+	    rsg.buflen = p->len;
+	    /* Sacks only go in an ack, so it's still needed for those. */
+	    if (!rfilter->sack ||
+			rfilter->recvpkts[rfilter->deliver_recvpkt].ready)
+		rfilter->send_ack_pkt = false;
+	    rfilter->ack_pending = false;
+	    rfilter->nr_unacked = 0;
+	} else if (rfilter->send_resend_pkt) {
+	    rsg.buf = rfilter->resend_pkt;
+	    rsg.buflen = rfilter->resend_pkt_len;
+	    endbool = &rfilter->send_resend_pkt;
+	} else if (rfilter->send_ack_pkt) {
+	    rfilter->ack_pending = false;
+	    rfilter->nr_unacked = 0;
+	    rsg.buf = rfilter->ack_pkt;
+	    rsg.buflen = set_ack_pkt(rfilter);
+	    endbool = &rfilter->send_ack_pkt;
+	} else if (rfilter->send_close_pkt) {
+	    rsg.buf = rfilter->close_pkt;
+	    rsg.buflen = 3;
+	    endbool = &rfilter->send_close_pkt;
+	    if (rfilter->state == RELPKT_REMCLOSED)
+		finish_close = true;
+	}
 
-    if (rsg.buflen) {
-	gensiods count;
+	if (rsg.buflen) {
+	    gensiods count;
 
 #ifdef DEBUG_MSG
-	printf("Writing(%p):", rfilter);
-	prbuf(rsg.buf, rsg.buflen);
+	    printf("Writing(%p):", rfilter);
+	    prbuf(rsg.buf, rsg.buflen);
 #endif
 #ifdef DROP_NR
-	if (p && curr_drop % DROP_NR == 0) {
-	    err = 0;
-	    count = rsg.buflen;
-	} else
+	    if (p && curr_drop % DROP_NR == 0) {
+		err = 0;
+		count = rsg.buflen;
+	    } else
 #endif
-	    err = handler(cb_data, &count, &rsg, 1, NULL);
+		err = handler(cb_data, &count, &rsg, 1, NULL);
 
 #ifdef DROP_NR
-	if (p)
-	    curr_drop++;
+	    if (p)
+		curr_drop++;
 #endif
-	if (!err) {
-	    if (count != 0 && count != rsg.buflen) {
+	    if (err)
+		break;
+	    if (count == 0)
+		break;
+	    if (count != rsg.buflen) {
 		/*
 		 * Is this right?  Lower layer should take whole packets
 		 * or nothing.
 		 */
 		err = GE_TOOBIG;
-	    } else if (count != 0) {
-		if (p) {
-		    p->sent = true;
-		    assert(rfilter->nr_waiting_xmitpkt);
-		    rfilter->nr_waiting_xmitpkt--;
-		    rfilter->send_since_timeout = true;
-		} else {
-		    *endbool = false;
-		    if (finish_close) {
-			rfilter->err = GE_REMCLOSE;
-			err = GE_REMCLOSE;
-		    }
+		break;
+	    }
+	    if (p) {
+		p->sent = true;
+		p->xmit_order = rfilter->next_xmit_order++;
+		rfilter->nr_in_flight++;
+		if (p->urgent) {
+		    p->urgent = false;
+		    rfilter->nr_urgent--;
+		}
+		if (seq == rfilter->next_xmit_seq)
+		    rfilter->next_xmit_seq++;
+		rfilter->send_since_timeout = true;
+		p->send_time = relpkt_now(rfilter);
+		if (!rfilter->rto_running)
+		    relpkt_start_rto(rfilter, p->send_time);
+	    } else {
+		*endbool = false;
+		if (finish_close) {
+		    rfilter->err = GE_REMCLOSE;
+		    err = GE_REMCLOSE;
+		    break;
 		}
 	    }
+	} else {
+	    break;
 	}
     }
+ out_unlock:
     relpkt_unlock(rfilter);
 
     return err;
@@ -815,13 +1591,15 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 		unsigned char *buf, gensiods buflen,
 		const char *const *auxdata)
 {
+    struct gensio_os_funcs *o = rfilter->o;
     int err = 0;
     static const char *eomaux[2] = { "eom", NULL };
     bool response;
-    uint8_t seq, endseq, pos, ppos;
-    unsigned int i;
+    uint32_t seq, endseq, pos;
+    unsigned int i, seqlen;
     struct pkt *p;
     const char *proto_err_str = NULL;
+    bool sack;
 
 #ifdef DEBUG_MSG
     if (buflen) {
@@ -864,32 +1642,35 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 
 	case RELPKT_WAITING_INIT:
 	    if (!response) {
-		rfilter->max_xmitpkt = buf[2];
+		handle_init(rfilter, buf, buflen);
 		if (rfilter->max_xmitpkt == 0) {
 		    proto_err_str = "rfilter->max_xmitpkt == 0";
 		    goto protocol_err;
 		}
-		if (rfilter->max_xmitpkt > rfilter->max_pkt)
-		    rfilter->max_xmitpkt = rfilter->max_pkt;
-		rfilter->max_xmit_pktsize = buf[3] << 8 | buf[4];
-		if (rfilter->max_xmit_pktsize > rfilter->max_pktsize)
-		    rfilter->max_xmit_pktsize = rfilter->max_pktsize;
 		send_init(rfilter, true);
 		rfilter->state = RELPKT_OPEN;
-		relpkt_filter_start_timer(rfilter);
+		relpkt_start_timers(rfilter);
 	    }
 	    break;
 
 	case RELPKT_WAITING_INIT_RSP:
 	    if (response) {
-		rfilter->max_xmitpkt = buf[2];
-		if (rfilter->max_xmitpkt > rfilter->max_pkt)
-		    rfilter->max_xmitpkt = rfilter->max_pkt;
-		rfilter->max_xmit_pktsize = buf[3] << 8 | buf[4];
-		if (rfilter->max_xmit_pktsize > rfilter->max_pktsize)
-		    rfilter->max_xmit_pktsize = rfilter->max_pktsize;
+		handle_init(rfilter, buf, buflen);
+		if (rfilter->max_xmitpkt == 0) {
+		    proto_err_str = "rfilter->max_xmitpkt == 0";
+		    goto protocol_err;
+		}
+		/* What we can take depends on the version. */
+		rfilter->max_recvpkt = rfilter->max_pkt;
+		if (rfilter->version == 0 &&
+			rfilter->max_recvpkt > RELPKT_V0_MAX_PACKETS)
+		    rfilter->max_recvpkt = RELPKT_V0_MAX_PACKETS;
+		/* Only time the first init, we can't tell which got here. */
+		if (rfilter->init_retry_count == 0)
+		    relpkt_rtt_sample(rfilter, (relpkt_now(rfilter) -
+						rfilter->init_send_time));
 		rfilter->state = RELPKT_OPEN;
-		relpkt_filter_start_timer(rfilter);
+		relpkt_start_timers(rfilter);
 	    }
 	    break;
 
@@ -897,8 +1678,23 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 	case RELPKT_WAITING_CLOSE_CLEAR:
 	    if (!response) {
 		send_init(rfilter, true);
+		/*
+		 * The remote end restarted, it lost what it sacked.
+		 * Those are already out of flight, so just mark them
+		 * unsent.
+		 */
+		for (seq = rfilter->next_acked_seq;
+		     seq != rfilter->next_xmit_seq; seq++) {
+		    p = xmitpkt_seq(rfilter, seq);
+		    if (p->sacked) {
+			p->sacked = false;
+			p->sent = false;
+			p->resent = true;
+		    }
+		}
+		rfilter->nr_sacked = 0;
 		resend_packets(rfilter, rfilter->next_acked_seq,
-			       rfilter->next_send_seq);
+			       rfilter->next_xmit_seq, false);
 	    }
 	    break;
 
@@ -918,12 +1714,31 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 
 	case RELPKT_OPEN:
 	case RELPKT_WAITING_CLOSE_CLEAR:
-	    if (buflen > rfilter->max_pktsize + 3) {
-		proto_err_str = "buflen > rfilter->max_pktsize + 3";
+	    if (buflen < rfilter->hdrlen) {
+		proto_err_str = "buflen < hdrlen";
+		goto protocol_err;
+	    }
+	    /* With the sack bit set there is no data, just an ack. */
+	    sack = rfilter->sack && buf[0] & 2;
+	    if (sack && (buflen - rfilter->hdrlen) % 4 != 0) {
+		proto_err_str = "sack len % 4 != 0";
 		goto protocol_err;
 	    }
-	    if (handle_ack(rfilter, buf[1]))
+	    if (buflen > rfilter->max_pktsize + rfilter->hdrlen) {
+		proto_err_str = "buflen > rfilter->max_pktsize + hdrlen";
+		goto protocol_err;
+	    }
+	    seqlen = (rfilter->hdrlen - 1) / 2;
+	    if (handle_ack(rfilter, get_seq(rfilter, buf + 1),
+			   sack || buflen == rfilter->hdrlen))
 		goto out_unlock;
+	    if (sack) {
+		handle_sack(rfilter, buf + rfilter->hdrlen,
+			    buflen - rfilter->hdrlen);
+		buflen = rfilter->hdrlen;
+	    }
+	    if (rfilter->nr_sacked)
+		relpkt_detect_loss(rfilter);
 	    if (rfilter->state != RELPKT_OPEN) {
 		/* Only deliver data in open state */
 
@@ -934,28 +1749,55 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 		}
 		break;
 	    }
-	    if (buflen == 3) /* Just an ack */
+	    if (buflen == rfilter->hdrlen) /* Just an ack */
 		break;
-	    seq = buf[2];
+	    seq = seq_unwrap(rfilter, get_seq(rfilter, buf + 1 + seqlen),
+			     rfilter->next_deliver_seq);
 	    pos = seq - rfilter->next_deliver_seq;
-	    if (seq - rfilter->next_deliver_seq > rfilter->max_pkt)
-		break; /* Ignore it */
-	    ppos = recvpkt_pos(rfilter, pos);
+	    if (pos >= rfilter->max_recvpkt) {
+		/* Probably a resend because our ack got lost, ack again. */
+		send_ack(rfilter);
+		break;
+	    }
 	    if (seq == rfilter->next_expected_seq) {
 		rfilter->next_expected_seq++;
-	    } else if (!seq_inside(seq, rfilter->next_deliver_seq,
-				  rfilter->next_expected_seq)) {
-		request_resend(rfilter, rfilter->next_expected_seq, seq - 1);
+	    } else if (pos >= (rfilter->next_expected_seq -
+			       rfilter->next_deliver_seq)) {
+		/* With sacks, the ack below tells the sender what's missing. */
+		if (!rfilter->sack)
+		    request_resend(rfilter, rfilter->next_expected_seq,
+				   seq - 1);
 		rfilter->next_expected_seq = seq + 1;
 	    }
-	    p = &(rfilter->recvpkts[ppos]);
-	    if (!p->ready) {
-		memcpy(p->data, buf + 3, buflen - 3);
-		p->len = buflen - 3;
+	    p = &(rfilter->recvpkts[recvpkt_pos(rfilter, pos)]);
+	    if (p->ready) {
+		/*
+		 * We already have this, the sender is probing because
+		 * it hasn't heard from us.  If the resend of something
+		 * before it got lost, ask again.
+		 */
+		if (!rfilter->sack &&
+			!rfilter->recvpkts[rfilter->deliver_recvpkt].ready)
+		    rerequest_resend(rfilter);
+	    } else {
+		if (!p->data) {
+		    p->data = o->zalloc(o, rfilter->max_pktsize);
+		    if (!p->data)
+			/* Drop it, it will be sent again. */
+			break;
+		}
+		memcpy(p->data, buf + rfilter->hdrlen, buflen - rfilter->hdrlen);
+		p->len = buflen - rfilter->hdrlen;
 		p->start = 0;
 		p->ready = true;
 		p->eom = buf[0] & 1;
 	    }
+	    /*
+	     * If something before this is missing, ack right away so
+	     * the sender knows data is still getting through.
+	     */
+	    if (!rfilter->recvpkts[rfilter->deliver_recvpkt].ready)
+		send_ack(rfilter);
 	    break;
 
 	default:
@@ -976,25 +1818,24 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 	case RELPKT_WAITING_CLOSE_RSP:
 	    buf++;
 	    buflen--;
-	    if (buflen % 2 != 0) { /* Should be pairs of sequence numbers. */
+	    seqlen = (rfilter->hdrlen - 1) / 2;
+	    /* Should be pairs of sequence numbers. */
+	    if (buflen % (2 * seqlen) != 0) {
 		proto_err_str = "buflen % 2 != 0";
 		goto protocol_err;
 	    }
-	    for (i = 0; i < buflen; i += 2) {
-		seq = buf[i];
-		endseq = buf[i + 1];
-		if (!seq_inside(seq, rfilter->next_acked_seq,
-				rfilter->next_send_seq)) {
-		    proto_err_str = "seq_inside A";
-		    goto protocol_err;
-		}
-		if (!seq_inside(endseq, rfilter->next_acked_seq,
-				rfilter->next_send_seq)) {
-		    proto_err_str = "seq_inside B";
-		    goto protocol_err;
-		}
-		resend_packets(rfilter, seq, endseq + 1);
+	    for (i = 0; i < buflen; i += 2 * seqlen) {
+		seq = seq_unwrap(rfilter, get_seq(rfilter, buf + i),
+				 rfilter->next_acked_seq);
+		endseq = seq_unwrap(rfilter, get_seq(rfilter, buf + i + seqlen),
+				    seq);
+		/*
+		 * The request may have crossed with an ack for some of
+		 * it, resend_packets() ignores what is already acked.
+		 */
+		resend_packets(rfilter, seq, endseq + 1, true);
 	    }
+	    relpkt_cwnd_loss(rfilter, false);
 	    break;
 
 	default:
@@ -1047,7 +1888,7 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
 		p->ready = false;
 		rfilter->deliver_recvpkt = recvpkt_pos(rfilter, 1);
 		rfilter->next_deliver_seq++;
-		send_ack(rfilter);
+		delay_ack(rfilter);
 	    } else {
 		p->start += count;
 	    }
@@ -1058,16 +1899,40 @@ relpkt_ll_write(struct relpkt_filter *rfilter,
     return err;
 
  protocol_err:
+    /*
+     * The remote end sent something bad.  Returning the error makes
+     * the layer above shut down the connection, anything else that
+     * comes in gets the same error.
+     */
     gensio_log(rfilter->o, GENSIO_LOG_ERR,
 	       "relpkt: protocol error: %s", proto_err_str);
-    assert(0);
+    rfilter->err = GE_PROTOERR;
     relpkt_unlock(rfilter);
     return GE_PROTOERR;
 }
 
 static int
-relpkt_setup(struct relpkt_filter *rfilter)
+relpkt_setup(struct relpkt_filter *rfilter, struct gensio *io)
 {
+    char buf[20] = "";
+    gensiods len = sizeof(buf);
+    unsigned long size;
+    int err;
+
+    if (rfilter->max_pktsize)
+	return 0;
+
+    /* Not set by the user, use what the layer below can take. */
+    rfilter->max_pktsize = RELPKT_DEFAULT_PKTSIZE;
+    err = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			 GENSIO_CONTROL_MAX_WRITE_PACKET, buf, &len);
+    if (!err) {
+	size = strtoul(buf, NULL, 0);
+	if (size > RELPKT_MTU_SIZE)
+	    size = RELPKT_MTU_SIZE;
+	if (size > RELPKT_MAX_HDR)
+	    rfilter->max_pktsize = size - RELPKT_MAX_HDR;
+    }
     return 0;
 }
 
@@ -1084,14 +1949,33 @@ relpkt_filter_cleanup(struct relpkt_filter *rfilter)
     rfilter->timeouts_since_ack = 0;
     rfilter->next_acked_seq = 0;
     rfilter->next_send_seq = 0;
+    rfilter->next_xmit_seq = 0;
+    rfilter->resend_seq = 0;
+    rfilter->nr_urgent = 0;
     rfilter->first_xmitpkt = 0;
-    rfilter->nr_waiting_xmitpkt = 0;
+    relpkt_set_version(rfilter, rfilter->max_version);
+    rfilter->cwnd = RELPKT_INIT_CWND;
+    rfilter->cwnd_count = 0;
+    rfilter->ssthresh = RELPKT_MAX_PACKETS;
+    rfilter->in_recovery = false;
+    rfilter->dup_acks = 0;
+    rfilter->nr_sacked = 0;
+    rfilter->nr_in_flight = 0;
+    rfilter->next_xmit_order = 0;
+    rfilter->delivered_order = 0;
     rfilter->send_init_pkt = false;
     rfilter->init_retry_count = 0;
     rfilter->send_close_pkt = false;
     rfilter->close_retry_count = 0;
     rfilter->send_resend_pkt = false;
     rfilter->send_ack_pkt = false;
+    rfilter->srtt = 0;
+    rfilter->rttvar = 0;
+    rfilter->rto = RELPKT_INIT_RTO;
+    rfilter->rto_running = false;
+    rfilter->ack_pending = false;
+    rfilter->nr_unacked = 0;
+    rfilter->timer_running = false;
     for (i = 0; i < rfilter->max_pkt; i++) {
 	struct pkt *p = &rfilter->recvpkts[i];
 
@@ -1115,7 +1999,6 @@ relpkt_free(struct relpkt_filter *rfilter)
 	o->free(o, rfilter->recvpkts);
     }
     if (rfilter->xmitpkts) {
-	/* Yes, the below is max_pkt for xmit.  That's the array size. */
 	for (i = 0; i < rfilter->max_pkt; i++) {
 	    if (rfilter->xmitpkts[i].data)
 		o->free(o, rfilter->xmitpkts[i].data);
@@ -1130,36 +2013,63 @@ relpkt_free(struct relpkt_filter *rfilter)
 static int
 i_relpkt_filter_timeout(struct relpkt_filter *rfilter)
 {
-    rfilter->timeouts_since_ack++;
-    if (rfilter->timeouts_since_ack > 5) {
-	rfilter->err = GE_TIMEDOUT;
-	return GE_TIMEDOUT;
+    int64_t now = relpkt_now(rfilter);
+    uint32_t seq;
+
+    /* The timer has gone off, whatever it was set for is done. */
+    rfilter->timer_running = false;
+
+    if (now >= rfilter->keepalive_deadline) {
+	rfilter->keepalive_deadline = now + RELPKT_KEEPALIVE;
+	rfilter->timeouts_since_ack++;
+	if (rfilter->timeouts_since_ack > 5) {
+	    rfilter->err = GE_TIMEDOUT;
+	    return GE_TIMEDOUT;
+	}
+
+	if (rfilter->send_since_timeout)
+	    rfilter->send_since_timeout = false;
+	else
+	    send_ack(rfilter);
     }
 
-    if (rfilter->send_since_timeout)
-	rfilter->send_since_timeout = false;
-    else
+    if (rfilter->ack_pending && now >= rfilter->ack_deadline)
 	send_ack(rfilter);
 
-    if (rfilter->next_acked_seq != rfilter->next_send_seq) {
-	if (rfilter->next_acked_seq == rfilter->last_timeout_ack) {
-	    rfilter->timeout_ack_count++;
-	    if (rfilter->timeout_ack_count > 1) {
-		/* 
-		 * We haven't received an ack for something we sent.
-		 * The packet must have been dropped.  Resend.
-		 */
-		resend_packets(rfilter, rfilter->next_acked_seq,
-			       rfilter->next_send_seq);
-		rfilter->timeout_ack_count = 0;
-	    }
+    if (rfilter->rto_running && rfilter->probe_pending &&
+		now >= rfilter->rto_deadline) {
+	/*
+	 * Maybe just the ack for the end of what we sent got lost.
+	 * Send the last packet again to get another one.  Nothing is
+	 * known to be lost yet, so don't back off.  If the remote end
+	 * already sacked the last packet, send the first missing one.
+	 */
+	seq = rfilter->next_xmit_seq - 1;
+	if (xmitpkt_seq(rfilter, seq)->sacked)
+	    seq = rfilter->next_acked_seq;
+	resend_packets(rfilter, seq, seq + 1, true);
+	if (++rfilter->nr_probes < RELPKT_MAX_PROBES) {
+	    rfilter->rto_deadline = now + relpkt_probe_timeout(rfilter);
 	} else {
-	    rfilter->timeout_ack_count = 0;
-	    rfilter->last_timeout_ack = rfilter->next_acked_seq;
+	    rfilter->probe_pending = false;
+	    rfilter->rto_deadline = now + rfilter->rto;
 	}
-	
+    } else if (rfilter->rto_running && now >= rfilter->rto_deadline) {
+	/*
+	 * We haven't received an ack for something we sent.  The
+	 * packet must have been dropped.  Resend, and wait longer
+	 * next time in case the network is just slow.
+	 */
+	relpkt_cwnd_loss(rfilter, true);
+	resend_packets(rfilter, rfilter->next_acked_seq,
+		       rfilter->next_xmit_seq, false);
+	rfilter->rto *= 2;
+	if (rfilter->rto > RELPKT_MAX_RTO)
+	    rfilter->rto = RELPKT_MAX_RTO;
+	rfilter->rto_deadline = now + rfilter->rto;
     }
-    relpkt_filter_start_timer(rfilter);
+
+    relpkt_update_timer(rfilter, now);
     return 0;
 }
 
@@ -1221,7 +2131,7 @@ static int gensio_relpkt_filter_func(struct gensio_filter *filter, int op,
 			       auxdata);
 
     case GENSIO_FILTER_FUNC_SETUP:
-	return relpkt_setup(rfilter);
+	return relpkt_setup(rfilter, data);
 
     case GENSIO_FILTER_FUNC_CLEANUP:
 	relpkt_filter_cleanup(rfilter);
@@ -1242,10 +2152,9 @@ static int gensio_relpkt_filter_func(struct gensio_filter *filter, int op,
 static struct gensio_filter *
 gensio_relpkt_filter_raw_alloc(struct gensio_os_funcs *o,
 			       gensiods max_pktsize, gensiods max_packets,
-			       bool server)
+			       unsigned int max_version, bool server)
 {
     struct relpkt_filter *rfilter;
-    gensiods i;
 
     rfilter = o->zalloc(o, sizeof(*rfilter));
     if (!rfilter)
@@ -1260,24 +2169,23 @@ gensio_relpkt_filter_raw_alloc(struct gensio_os_funcs *o,
 
     rfilter->max_pkt = max_packets;
     rfilter->max_pktsize = max_pktsize;
+    rfilter->max_version = max_version;
+    relpkt_set_version(rfilter, max_version);
+    rfilter->rto = RELPKT_INIT_RTO;
+    rfilter->cwnd = RELPKT_INIT_CWND;
+    rfilter->ssthresh = RELPKT_MAX_PACKETS;
 
+    /*
+     * The packet data is allocated when a slot is first used, so a
+     * big window only costs memory if it is actually filled.
+     */
     rfilter->recvpkts = o->zalloc(o, sizeof(struct pkt) * max_packets);
     if (!rfilter->recvpkts)
 	goto out_nomem;
-    for (i = 0; i < max_packets; i++) {
-	rfilter->recvpkts[i].data = o->zalloc(o, max_pktsize);
-	if (!rfilter->recvpkts[i].data)
-	    goto out_nomem;
-    }
 
     rfilter->xmitpkts = o->zalloc(o, sizeof(struct pkt) * max_packets);
     if (!rfilter->xmitpkts)
 	goto out_nomem;
-    for (i = 0; i < max_packets; i++) {
-	rfilter->xmitpkts[i].data = o->zalloc(o, max_pktsize + 3);
-	if (!rfilter->xmitpkts[i].data)
-	    goto out_nomem;
-    }
 
     rfilter->filter = gensio_filter_alloc_data(o, gensio_relpkt_filter_func,
 					       rfilter);
@@ -1298,8 +2206,9 @@ gensio_relpkt_filter_alloc(struct gensio_os_funcs *o,
 {
     struct gensio_filter *filter;
     unsigned int i;
-    gensiods max_pktsize = 123; /* FIXME - magic number. */
-    gensiods max_packets = 16;
+    gensiods max_pktsize = 0; /* Set from the layer below. */
+    gensiods max_packets = 1024;
+    unsigned int max_version = RELPKT_VERSION;
     char *str = NULL;
     int rv;
 
@@ -1327,14 +2236,20 @@ gensio_relpkt_filter_alloc(struct gensio_os_funcs *o,
 	    continue;
 	if (gensio_check_keyds(args[i], "max_packets", &max_packets) > 0)
 	    continue;
+	if (gensio_check_keyuint(args[i], "protocol", &max_version) > 0)
+	    continue;
 	if (gensio_check_keyboolv(args[i], "mode", "server", "client",
 				  &server) > 0)
 	    continue;
 	return GE_INVAL;
     }
 
+    if (max_packets == 0 || max_packets > RELPKT_MAX_PACKETS ||
+		max_pktsize > 0xffff - RELPKT_MAX_HDR || max_version > RELPKT_VERSION)
+	return GE_INVAL;
+
     filter = gensio_relpkt_filter_raw_alloc(o, max_pktsize, max_packets,
-					    server);
+					    max_version, server);
     if (!filter)
 	return GE_NOMEM;
 
@@ -125,6 +125,7 @@ struct fd_ll {
     gensio_ll_close_done close_done;
     void *close_data;
     bool close_requested;
+    bool close_wait; /* Waiting for gensio_fd_ll_close_continue(). */
     bool freed;
 
     unsigned char *read_data;
@@ -696,7 +697,10 @@ fd_check_close(struct fd_ll *fdll)
 
     if (err == GE_INPROGRESS) {
 	fd_ref(fdll);
-	fdll->o->start_timer(fdll->close_timer, &timeout);
+	if (timeout.secs < 0)
+	    fdll->close_wait = true;
+	else
+	    fdll->o->start_timer(fdll->close_timer, &timeout);
     } else {
 	fd_finish_cleared(fdll);
     }
@@ -712,25 +716,56 @@ fd_close_timeout(struct gensio_timer *t, void *cb_data)
     fd_deref_and_unlock(fdll); /* Lose the timer ref. */
 }
 
+void
+gensio_fd_ll_close_continue(struct gensio_ll *ll)
+{
+    struct fd_ll *fdll = ll_to_fd(ll);
+
+    fd_lock(fdll);
+    if (!fdll->close_wait) {
+	fd_unlock(fdll);
+	return;
+    }
+    fdll->close_wait = false;
+    fd_check_close(fdll);
+    fd_deref_and_unlock(fdll); /* Lose the wait ref. */
+}
+
+/* Call with the lock held and no fd. */
+static void
+fd_do_retry_open(struct fd_ll *fdll)
+{
+    int err;
+
+    err = fdll->ops->retry_open(fdll->handler_data, &fdll->fd);
+    if (err == GE_INPROGRESS && fdll->fd == -1)
+	/* Still waiting for something, gensio_fd_ll_retry_open() will come. */
+	return;
+    /*
+     * If it is already connected, write ready will come in
+     * immediately and check_open() will finish the open.
+     */
+    if (err == GE_INPROGRESS || err == 0)
+	err = fd_setup_handlers(fdll);
+    if (err) {
+	fd_deref(fdll);
+	fd_finish_open(fdll, err);
+    } else {
+	fd_set_state(fdll, FD_IN_OPEN);
+	fdll->o->set_write_handler(fdll->o, fdll->fd, true);
+	fdll->o->set_except_handler(fdll->o, fdll->fd, true);
+    }
+}
+
 static void
 fd_cleared(int fd, void *cb_data)
 {
     struct fd_ll *fdll = cb_data;
-    int err;
 
     fd_lock_and_ref(fdll);
     if (fdll->state == FD_IN_OPEN_RETRY) {
 	gensio_os_close(fdll->o, &fdll->fd);
-	err = fdll->ops->retry_open(fdll->handler_data, &fdll->fd);
-	if (err == GE_INPROGRESS)
-	    err = fd_setup_handlers(fdll);
-	if (err) {
-	    fd_deref(fdll);
-	    fd_finish_open(fdll, err);
-	} else {
-	    fdll->o->set_write_handler(fdll->o, fdll->fd, true);
-	    fdll->o->set_except_handler(fdll->o, fdll->fd, true);
-	}
+	fd_do_retry_open(fdll);
     } else {
 	fd_check_close(fdll);
     }
@@ -758,7 +793,17 @@ fd_open(struct gensio_ll *ll, gensio_ll_open_done done, void *open_data)
     fdll->read_data_pos = 0;
 
     err = fdll->ops->sub_open(fdll->handler_data, &fdll->fd);
-    if (err == GE_INPROGRESS || err == 0) {
+    if (err == GE_INPROGRESS && fdll->fd == -1) {
+	/*
+	 * The user doesn't have an fd yet (waiting for a name lookup,
+	 * for instance), it will call gensio_fd_ll_retry_open() when
+	 * it is ready to supply one through retry_open().
+	 */
+	fdll->open_done = done;
+	fdll->open_data = open_data;
+	fd_set_state(fdll, FD_IN_OPEN_RETRY);
+	fd_ref(fdll);
+    } else if (err == GE_INPROGRESS || err == 0) {
 	int err2 = fd_setup_handlers(fdll);
 	if (err2) {
 	    err = err2;
@@ -920,8 +965,10 @@ static void fd_disable(struct gensio_ll *ll)
 
     fd_set_state(fdll, FD_CLOSED);
     fd_deref(fdll);
-    fdll->o->clear_fd_handlers_norpt(fdll->o, fdll->fd);
-    gensio_os_close(fdll->o, &fdll->fd);
+    if (fdll->fd != -1) {
+	fdll->o->clear_fd_handlers_norpt(fdll->o, fdll->fd);
+	gensio_os_close(fdll->o, &fdll->fd);
+    }
 }
 
 static int
@@ -975,6 +1022,23 @@ gensio_fd_ll_get_handler_data(struct gensio_ll *ll)
     return fdll->handler_data;
 }
 
+void
+gensio_fd_ll_retry_open(struct gensio_ll *ll)
+{
+    struct fd_ll *fdll = ll_to_fd(ll);
+
+    fd_lock_and_ref(fdll);
+    if (!fdll->ops->retry_open) {
+	/* Nothing to do. */
+    } else if (fdll->state == FD_IN_OPEN) {
+	fd_set_state(fdll, FD_IN_OPEN_RETRY);
+	fdll->o->clear_fd_handlers(fdll->o, fdll->fd);
+    } else if (fdll->state == FD_IN_OPEN_RETRY && fdll->fd == -1) {
+	fd_do_retry_open(fdll);
+    }
+    fd_deref_and_unlock(fdll);
+}
+
 struct gensio_ll *
 fd_gensio_ll_alloc(struct gensio_os_funcs *o,
 		   int fd,
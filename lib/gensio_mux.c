@@ -7,6 +7,7 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -45,6 +46,13 @@
  * accepted.  Note that the flags (1 byte) and data size (2 bytes) is
  * considered part of the outstanding bytes for each message, so it
  * can be stored in the buffer with the data.
+ *
+ * Acks are cumulative.  With version 3, if the remote end says it
+ * can take them, an end holds an ack back until a quarter of the
+ * window needs acking, data going the other way can carry it, or
+ * MUX_ACK_DELAY_MSECS goes by.  If the data has the window limited
+ * flag set the sender is stuck waiting on the window, so the ack
+ * goes out right away.
  */
 
 enum mux_msgs {
@@ -56,11 +64,18 @@ enum mux_msgs {
      * version adds data after the version, older version should
      * ignore it.
      *
-     * This is version 1 of the protocol.
+     * This is version 3 of the protocol.  Version 2 adds the window
+     * message and the window limited flag on data, neither are sent
+     * to a version 1 remote end.  Version 3 adds the short data
+     * message and delayed acks.
      *
      * +----------------+--------+-------+----------------+----------------+
-     * |   1   |size(1) |    reserved    |    version     |   reserved     |
+     * |   1   |size(1) |     flags      |    version     |   reserved     |
      * +----------------+--------+-------+----------------+----------------+
+     *
+     * The flags were reserved (zero) before version 3.  If
+     * MUX_INIT_FLAG_DELAY_ACKS is set, the sender's data goes out
+     * as soon as it is written, so acks to it may be held back.
      */
     MUX_INIT		= 1,
 
@@ -136,19 +151,91 @@ enum mux_msgs {
      * +----------------+----------------+----------------+----------------+
      */
     MUX_DATA		= 5,
+
+    /*
+     * Change the receive window for a channel.  This carries a remote
+     * channel number and the new byte count window.  The remote end
+     * starts using the new window and responds with the same message
+     * with the ack flag set and the window it is now using, so the
+     * sender knows when it can free buffer space after a shrink.
+     * Only sent if both ends are version 2 or later.
+     *
+     * +----------------+----------------+----------------+----------------+
+     * |   6   |size(2) |     flags      |      remote channel id          |
+     * +----------------+----------------+----------------+----------------+
+     * |                          byte count window                        |
+     * +----------------+----------------+----------------+----------------+
+     */
+    MUX_WINDOW		= 6,
+
+    /*
+     * Data for the same channel as the last data message (full or
+     * short) that was sent.  The header is a single byte, the low
+     * four bits are the data message flags.  There is no ack, if an
+     * ack needs to be sent a full data message is used.  The data
+     * size and data follow like in a data message.  Only sent if both
+     * ends are version 3 or later.
+     *
+     * +----------------+----------------+----------------+----------------+
+     * |   7   | flags  |            data size            |    data....    |
+     * +----------------+----------------+----------------+----------------+
+     */
+    MUX_DATA_SHORT	= 7,
 };
 
-#define MUX_MAX_MSG_NUM MUX_DATA
+#define MUX_MAX_MSG_NUM MUX_DATA_SHORT
 
-static unsigned int mux_msg_hdr_sizes[] = { 0, 1, 2, 3, 2, 2 };
+static unsigned int mux_msg_hdr_sizes[] = { 0, 1, 2, 3, 2, 2, 2, 0 };
+
+#define MUX_PROTOCOL_VERSION	3
 
 /* External flags for MUX_DATA */
 #define MUX_FLAG_END_OF_MESSAGE		(1 << 0)
 #define MUX_FLAG_OUT_OF_BOUND		(1 << 1)
+/*
+ * Set by the sender if it had more data to send after this message
+ * but the window would not allow it.  Not stored with the data.
+ */
+#define MUX_FLAG_WINDOW_LIMITED		(1 << 2)
+
+/* Flags for MUX_INIT */
+#define MUX_INIT_FLAG_DELAY_ACKS	(1 << 0)
+
+/* Flags for MUX_WINDOW */
+#define MUX_WINDOW_FLAG_ACK		(1 << 0)
 
 #define MUX_MAX_HDR_SIZE	12
 #define MUX_MIN_SEND_WINDOW_SIZE	128
 
+/*
+ * When writing to the child, messages from up to this many channels
+ * and up to about this many bytes are gathered into one write.
+ */
+#define MUX_MAX_SEND_BATCH	64
+#define MUX_SEND_BATCH_BYTES	65536
+
+/*
+ * Channels with a higher priority always go first.  Channels with the
+ * same priority share the bandwidth with deficit round robin, each
+ * gets weight * MUX_DRR_QUANTUM bytes per round.  A channel may go
+ * over by up to one message, that is taken out of the next round.
+ */
+#define MUX_NR_PRIORITIES	8
+#define MUX_MAX_WEIGHT		1000
+#define MUX_DRR_QUANTUM		1024
+
+/*
+ * If the max_readbuf option is larger than readbuf, the receive
+ * window for a channel is doubled (up to max_readbuf) when the sender
+ * says it is window limited and the user is keeping up with the
+ * data.  A channel that receives nothing for MUX_WINDOW_IDLE_SECS has
+ * its window halved, down to readbuf.
+ */
+#define MUX_WINDOW_IDLE_SECS	1
+
+/* The longest an ack is held back, see the protocol description. */
+#define MUX_ACK_DELAY_MSECS	10
+
 #ifdef ENABLE_INTERNAL_TRACE
 #define MUX_TRACING
 #endif
@@ -210,17 +297,48 @@ struct mux_inst {
     unsigned char *read_data;
     gensiods read_data_pos;
     gensiods read_data_len;
-    gensiods max_read_size;
+    gensiods max_read_size; /* Size of read_data. */
     bool read_enabled;
     bool in_read_report;
 
+    /*
+     * The receive window we have told the remote end about.  This
+     * may be smaller than max_read_size after a shrink, the buffer
+     * is not shrunk until the remote end acks the new window.
+     */
+    gensiods read_window;
+    bool read_window_acked;
+    bool send_window_update;
+    gensiods rx_since_window_change;
+    bool rx_active; /* Received data since the last idle check. */
+
+    /* Need to ack a window update from the remote end. */
+    bool send_window_ack;
+
     /* Number of bytes we need to send an ack for. */
     gensiods received_unacked;
+    /*
+     * The ack timer went off or the remote end is waiting on the
+     * window, don't hold the ack.
+     */
+    bool ack_due;
+
+    /*
+     * Protects write_data_len, write_err, and the data past
+     * write_data_len, so muxc_write() doesn't need the mux lock to
+     * queue data.  The transmit side claims this with the mux lock
+     * held, never claim the mux lock while holding this.
+     * write_data_pos and send_window_size are only changed with both
+     * locks held, so they may be read with either.
+     */
+    struct gensio_lock *write_lock;
 
     unsigned char *write_data;
     gensiods write_data_pos;
     gensiods write_data_len;
     gensiods max_write_size;
+    /* What muxc_write() returns, 0 if the channel is writable. */
+    int write_err;
     bool write_ready_enabled;
     bool in_write_ready;
 
@@ -253,11 +371,35 @@ struct mux_inst {
 
     /* Link for list of channels waiting write. */
     struct gensio_link wrlink;
-    bool wr_ready; /* Also true if chan == muxdata->sending_chan. */
+    bool wr_ready; /* Also true if chan is in muxdata->sending. */
+
+    /* Transmit scheduling, see MUX_NR_PRIORITIES. */
+    unsigned int priority;
+    unsigned int weight;
+    long deficit; /* Bytes left in this round, may go negative. */
+    bool wr_next; /* On the next round list instead of the active one. */
+    unsigned int send_priority; /* Priority it was put in the batch at. */
 
     bool in_wrlist;
     bool in_open_chan;
 
+    /* On muxdata->ack_chans, holding back an ack. */
+    struct gensio_link ack_link;
+    bool in_ack_list;
+
+    /* On muxdata->window_chans, the read window is above the minimum. */
+    struct gensio_link window_link;
+    bool in_window_list;
+
+    /* Statistics, see muxc_control_stats(). */
+    unsigned long long bytes_in;
+    unsigned long long msgs_in;
+    unsigned long long bytes_out;
+    unsigned long long msgs_out;
+    bool window_blocked; /* Data is waiting on the send window. */
+    gensio_time window_blocked_start;
+    unsigned long long window_blocked_msecs;
+
     struct gensio_link link;
 };
 
@@ -271,13 +413,55 @@ chan_next_write_pos(struct mux_inst *chan, unsigned int count)
     return rv;
 }
 
-static void
+/* Take count bytes off the write buffer, returns what is left. */
+static gensiods
 chan_incr_write_pos(struct mux_inst *chan, unsigned int count)
 {
+    gensiods len;
+
+    chan->o->lock(chan->write_lock);
     chan->write_data_pos = chan_next_write_pos(chan, count);
     chan->write_data_len -= count;
+    len = chan->write_data_len;
+    chan->o->unlock(chan->write_lock);
+    return len;
+}
+
+/*
+ * The amount of data queued to write.  muxc_write() adds to this
+ * without the mux lock, but only the transmit side takes data out,
+ * so with the mux lock held this will not go down.
+ */
+static gensiods
+chan_write_queued(struct mux_inst *chan)
+{
+    gensiods len;
+
+    chan->o->lock(chan->write_lock);
+    len = chan->write_data_len;
+    chan->o->unlock(chan->write_lock);
+    return len;
+}
+
+/* Drop all queued write data. */
+static void
+chan_clear_wrbuf(struct mux_inst *chan)
+{
+    chan->o->lock(chan->write_lock);
+    chan->write_data_pos = 0;
+    chan->write_data_len = 0;
+    chan->o->unlock(chan->write_lock);
+}
+
+static void
+chan_set_send_window(struct mux_inst *chan, unsigned int size)
+{
+    chan->o->lock(chan->write_lock);
+    chan->send_window_size = size;
+    chan->o->unlock(chan->write_lock);
 }
 
+/* Must be called with the write lock held. */
 static void
 chan_addwrbuf(struct mux_inst *chan, const unsigned char *data, gensiods len)
 {
@@ -342,13 +526,58 @@ chan_rdbufleft(struct mux_inst *chan)
     return chan->max_read_size - chan->read_data_len;
 }
 
+/*
+ * Change the size of the read buffer, the data in it is moved to the
+ * beginning of the new one.  The user must not be looking at the
+ * buffer (in_read_report must be false).
+ */
+static int
+chan_resize_rdbuf(struct mux_inst *chan, gensiods size)
+{
+    struct gensio_os_funcs *o = chan->o;
+    unsigned char *data;
+    gensiods plen;
+
+    assert(!chan->in_read_report && size >= chan->read_data_len);
+    data = o->zalloc(o, size);
+    if (!data)
+	return GE_NOMEM;
+    plen = chan->max_read_size - chan->read_data_pos;
+    if (plen > chan->read_data_len)
+	plen = chan->read_data_len;
+    memcpy(data, chan->read_data + chan->read_data_pos, plen);
+    memcpy(data + plen, chan->read_data, chan->read_data_len - plen);
+    o->free(o, chan->read_data);
+    chan->read_data = data;
+    chan->read_data_pos = 0;
+    chan->max_read_size = size;
+    return 0;
+}
+
+/*
+ * Once the remote end is using a smaller window and the buffer is
+ * empty, give back the extra buffer space.
+ */
+static void
+chan_check_shrink_rdbuf(struct mux_inst *chan)
+{
+    if (chan->read_window_acked && chan->max_read_size > chan->read_window &&
+		chan->read_data_len == 0 && !chan->in_read_report)
+	/* On failure just keep the bigger buffer. */
+	chan_resize_rdbuf(chan, chan->read_window);
+}
+
 struct gensio_mux_config {
     struct gensio_os_funcs *o;
     gensiods max_read_size;
+    gensiods max_read_window;
     gensiods max_write_size;
     char *service;
     size_t service_len;
     unsigned int max_channels;
+    unsigned int priority;
+    unsigned int weight;
+    unsigned int max_version;
     bool is_client;
 };
 
@@ -422,6 +651,34 @@ struct mux_data {
 
     unsigned int max_channels;
 
+    /* The receive window may grow up to this, see MUX_WINDOW_IDLE_SECS. */
+    gensiods max_read_window;
+    struct gensio_timer *window_timer;
+    bool window_timer_running;
+    struct gensio_list window_chans; /* Only these are checked. */
+
+    /* Protocol version in use, the lower of ours and the remote end's. */
+    unsigned int version;
+    unsigned int max_version; /* The version we ask for. */
+
+    /* The remote end can take delayed acks, see MUX_INIT. */
+    bool delay_acks;
+
+    /* Flushes held back acks, see MUX_ACK_DELAY_MSECS. */
+    struct gensio_timer *ack_timer;
+    bool ack_timer_running;
+    struct gensio_list ack_chans; /* Channels with an ack held back. */
+
+    /*
+     * The remote channel id of the last data message sent, and the
+     * local channel id of the last data message received, for short
+     * data messages.
+     */
+    unsigned int tx_data_id;
+    bool tx_data_id_valid;
+    unsigned int rx_data_id;
+    bool rx_data_id_valid;
+
     /* Number of channels that are not closed. */
     unsigned int nr_not_closed;
 
@@ -444,9 +701,14 @@ struct mux_data {
     void *acc_open_data;
 
     /*
-     * Channel I am currently sending data on.
+     * Channels with a message in the current write batch, in the
+     * order they go out.  The first one may be partially sent.  If
+     * xmit_in_batch is set, xmit_data goes before all of them.
      */
-    struct mux_inst *sending_chan;
+    struct mux_inst *sending[MUX_MAX_SEND_BATCH];
+    unsigned int nr_sending;
+    bool xmit_in_batch;
+    struct gensio_sg send_sg[MUX_MAX_SEND_BATCH * 3 + 1];
 
     enum mux_state state;
 
@@ -474,18 +736,47 @@ struct mux_data {
     /* The last id we chose for a channel. */
     unsigned int last_id;
 
-    /* Mux instances with write pending. */
-    struct gensio_list wrchans;
+    /*
+     * Mux instances with write pending, per priority.  Channels with
+     * some of their quantum left are on the active list, the rest
+     * wait on the next list for a new round to start.  A new round
+     * can't start while channels from the priority are in the write
+     * batch, they may still have some of their quantum left.
+     */
+    struct {
+	struct gensio_list active;
+	struct gensio_list next;
+	unsigned int nr_sending;
+    } wrchans[MUX_NR_PRIORITIES];
+
+    /* Statistics for the whole mux, see muxc_control_stats(). */
+    unsigned long long hdr_errors;
+    unsigned long long write_stalls;
 
     /* Muxes waiting to open. */
     struct gensio_list openchans;
     unsigned int opencount;
 
+    /* All the channels in the mux, in the order they were created. */
+    struct gensio_list chans;
+
     /*
-     * All the channels in the mux.  The channels are kept in id
-     * order.
+     * Channels indexed by local id, max_channels entries, and a
+     * bitmap of the local ids in use, for finding a free one.  This
+     * keeps looking up the channel for a message and allocating a new
+     * channel from depending on the number of channels.
      */
-    struct gensio_list chans;
+    struct mux_inst **id_table;
+    uint32_t *id_map;
+
+    /*
+     * Channels indexed by the remote end's id for them.  The remote
+     * end may have a different max_channels, so this grows as needed.
+     * An entry may be stale (the channel's remote_id has changed), so
+     * check the channel's remote_id.
+     */
+    struct mux_inst **rid_table;
+    unsigned int rid_table_size;
 
 #ifdef MUX_TRACING
     struct mux_trace_info trace[MUX_TRACE_SIZE];
@@ -502,6 +793,14 @@ static void
 i_muxc_set_state(struct mux_inst *chan, enum mux_inst_state state)
 {
     chan->state = state;
+
+    /* Let muxc_write() check this without the mux lock. */
+    chan->o->lock(chan->write_lock);
+    if (state != MUX_INST_OPEN)
+	chan->write_err = GE_NOTREADY;
+    else
+	chan->write_err = chan->errcode;
+    chan->o->unlock(chan->write_lock);
 }
 
 #ifdef MUX_TRACING
@@ -552,6 +851,9 @@ static int muxc_gensio_handler(struct gensio *io, int func, gensiods *count,
 			       const void *cbuf, gensiods buflen, void *buf,
 			       const char *const *auxdata);
 static void muxc_add_to_wrlist(struct mux_inst *chan);
+static void mux_stop_window_timer(struct mux_data *muxdata);
+static void mux_stop_ack_timer(struct mux_data *muxdata);
+static bool chan_delay_ack(struct mux_inst *chan);
 static void mux_shutdown_channels(struct mux_data *muxdata, int err);
 
 static void
@@ -569,6 +871,16 @@ muxdata_free(struct mux_data *muxdata)
 {
     assert(gensio_list_empty(&muxdata->chans));
 
+    if (muxdata->id_table)
+	muxdata->o->free(muxdata->o, muxdata->id_table);
+    if (muxdata->id_map)
+	muxdata->o->free(muxdata->o, muxdata->id_map);
+    if (muxdata->rid_table)
+	muxdata->o->free(muxdata->o, muxdata->rid_table);
+    if (muxdata->window_timer)
+	muxdata->o->free_timer(muxdata->window_timer);
+    if (muxdata->ack_timer)
+	muxdata->o->free_timer(muxdata->ack_timer);
     if (muxdata->lock)
 	muxdata->o->free_lock(muxdata->lock);
     if (muxdata->child)
@@ -658,6 +970,8 @@ chan_free(struct mux_inst *chan)
 	o->free(o, chan->read_data);
     if (chan->write_data)
 	o->free(o, chan->write_data);
+    if (chan->write_lock)
+	o->free_lock(chan->write_lock);
     if (chan->service)
 	o->free(o, chan->service);
     if (chan->io)
@@ -667,6 +981,68 @@ chan_free(struct mux_inst *chan)
     o->free(o, chan);
 }
 
+static bool
+mux_id_in_use(struct mux_data *muxdata, unsigned int id)
+{
+    return muxdata->id_map[id / 32] & (1U << (id % 32));
+}
+
+static void
+mux_claim_id(struct mux_data *muxdata, struct mux_inst *chan,
+	     unsigned int id)
+{
+    chan->id = id;
+    muxdata->id_table[id] = chan;
+    muxdata->id_map[id / 32] |= 1U << (id % 32);
+}
+
+static void
+mux_release_id(struct mux_data *muxdata, struct mux_inst *chan)
+{
+    unsigned int id = chan->id;
+
+    if (muxdata->id_table[id] == chan) {
+	muxdata->id_table[id] = NULL;
+	muxdata->id_map[id / 32] &= ~(1U << (id % 32));
+    }
+    if (chan->remote_id < muxdata->rid_table_size &&
+		muxdata->rid_table[chan->remote_id] == chan)
+	muxdata->rid_table[chan->remote_id] = NULL;
+}
+
+/* Record the remote end's id for the channel. */
+static int
+mux_set_remote_id(struct mux_data *muxdata, struct mux_inst *chan,
+		  unsigned int remote_id)
+{
+    struct gensio_os_funcs *o = muxdata->o;
+    struct mux_inst **t;
+    unsigned int size = muxdata->rid_table_size;
+
+    if (remote_id >= size) {
+	if (size == 0)
+	    size = 64;
+	while (size <= remote_id)
+	    size *= 2;
+	t = o->zalloc(o, sizeof(*t) * size);
+	if (!t)
+	    return GE_NOMEM;
+	if (muxdata->rid_table) {
+	    memcpy(t, muxdata->rid_table,
+		   sizeof(*t) * muxdata->rid_table_size);
+	    o->free(o, muxdata->rid_table);
+	}
+	muxdata->rid_table = t;
+	muxdata->rid_table_size = size;
+    }
+    if (chan->remote_id < muxdata->rid_table_size &&
+		muxdata->rid_table[chan->remote_id] == chan)
+	muxdata->rid_table[chan->remote_id] = NULL;
+    chan->remote_id = remote_id;
+    muxdata->rid_table[remote_id] = chan;
+    return 0;
+}
+
 static void i_chan_ref(struct mux_inst *chan)
 {
     assert(chan->refcount > 0);
@@ -680,6 +1056,11 @@ static bool i_chan_deref(struct mux_inst *chan)
 	struct mux_data *mux = chan->mux;
 
 	gensio_list_rm(&mux->chans, &chan->link);
+	if (chan->in_ack_list)
+	    gensio_list_rm(&mux->ack_chans, &chan->ack_link);
+	if (chan->in_window_list)
+	    gensio_list_rm(&mux->window_chans, &chan->window_link);
+	mux_release_id(mux, chan);
 	chan_free(chan);
 	i_mux_deref(mux);
 	return true;
@@ -783,6 +1164,8 @@ mux_channel_set_closed(struct mux_inst *chan, gensio_done close_done,
     muxdata->nr_not_closed--;
     if (muxdata->nr_not_closed == 0) {
 	/* There are no open instances, shut the mux down. */
+	mux_stop_window_timer(muxdata);
+	mux_stop_ack_timer(muxdata);
 	mux_set_state(muxdata, MUX_IN_CLOSE);
 	err = gensio_close(muxdata->child, close_done, close_data);
 	if (!err)
@@ -846,12 +1229,34 @@ mux_send_new_channel_rsp(struct mux_data *muxdata, unsigned int remote_id,
     gensio_set_write_callback_enable(muxdata->child, true);
 }
 
+/*
+ * Does the child send what it is given right away?  If it holds small
+ * writes back waiting for acks from the other end (Nagle), delayed
+ * mux acks could hold up a sender that has run out of window until
+ * the ack timer goes off.  Children without the control don't delay.
+ */
+static bool
+mux_child_sends_now(struct mux_data *muxdata)
+{
+    char val[10];
+    gensiods len = sizeof(val);
+    int err;
+
+    err = gensio_control(muxdata->child, GENSIO_CONTROL_DEPTH_FIRST, true,
+			 GENSIO_CONTROL_NODELAY, val, &len);
+    if (err == GE_NOTSUP)
+	return true;
+    return !err && strtoul(val, NULL, 0);
+}
+
 static void
 mux_send_init(struct mux_data *muxdata)
 {
     muxdata->xmit_data[0] = (MUX_INIT << 4) | 0x1;
     muxdata->xmit_data[1] = 0;
-    muxdata->xmit_data[2] = 1;
+    if (muxdata->max_version >= 3 && mux_child_sends_now(muxdata))
+	muxdata->xmit_data[1] |= MUX_INIT_FLAG_DELAY_ACKS;
+    muxdata->xmit_data[2] = muxdata->max_version;
     muxdata->xmit_data[3] = 0;
     muxdata->xmit_data_pos = 0;
     muxdata->xmit_data_len = 4;
@@ -869,7 +1274,7 @@ chan_check_send_more(struct mux_inst *chan)
     chan->in_write_ready = true;
 
     /* Need at least 3 bytes to write a message. */
-    while (chan->write_data_len + 3 < chan->max_write_size &&
+    while (chan_write_queued(chan) + 3 < chan->max_write_size &&
 	   chan->write_ready_enabled && chan->state == MUX_INST_OPEN) {
 	chan_ref(chan);
 	mux_unlock(chan->mux);
@@ -986,17 +1391,70 @@ chan_check_read(struct mux_inst *chan)
 	}
 	chan->received_unacked += to_ack;
     }
+    chan_check_shrink_rdbuf(chan);
+
     /*
      * Schedule an ack send if we need it.  The send_close thing may
      * look strange, but we delay finishing the close until all read
      * data is delivered, so if all the data is processed and a close
      * is pending, we send it.
      */
-    if (chan->received_unacked ||
+    if ((chan->received_unacked && !chan_delay_ack(chan)) ||
 		(chan->send_close && chan->read_data_len == 0))
 	muxc_add_to_wrlist(chan);
 }
 
+/*
+ * Can a message be delivered to the user straight from the child's
+ * buffer?  Nothing can be queued ahead of it.
+ */
+static bool
+chan_read_direct_ok(struct mux_inst *chan)
+{
+    return chan->read_data_len == 0 && chan->read_enabled &&
+	!chan->in_read_report && !chan->errcode;
+}
+
+/*
+ * Deliver a whole message from the child's buffer.  Whatever the
+ * user doesn't take is put into the read buffer with its own header,
+ * like a partial read in chan_check_read().  Must be called with an
+ * extra refcount held.
+ */
+static void
+chan_read_direct(struct mux_inst *chan, unsigned char flags,
+		 unsigned char *buf, gensiods len)
+{
+    struct mux_data *muxdata = chan->mux;
+    gensiods rcount = len;
+    const char *flstr[3];
+    unsigned int i = 0;
+
+    if (flags & MUX_FLAG_OUT_OF_BOUND)
+	flstr[i++] = "oob";
+    if (flags & MUX_FLAG_END_OF_MESSAGE)
+	flstr[i++] = "eom";
+    flstr[i] = NULL;
+
+    chan->in_read_report = true;
+    mux_unlock(muxdata);
+    gensio_cb(chan->io, GENSIO_EVENT_READ, 0, buf, &rcount, flstr);
+    mux_lock(muxdata);
+    chan->in_read_report = false;
+    if (rcount > len)
+	rcount = len;
+
+    if (rcount < len) {
+	chan_addrdbyte(chan, flags);
+	chan_addrdbyte(chan, (len - rcount) >> 8);
+	chan_addrdbyte(chan, (len - rcount) & 0xff);
+	chan_addrdbuf(chan, buf + rcount, len - rcount);
+	chan->received_unacked += rcount;
+    } else {
+	chan->received_unacked += len + 3;
+    }
+}
+
 static void
 chan_deferred_op(struct gensio_runner *runner, void *cbdata)
 {
@@ -1031,67 +1489,366 @@ chan_sched_deferred_op(struct mux_inst *chan)
     }
 }
 
+static void
+mux_wrlist_add(struct mux_data *muxdata, struct mux_inst *chan, bool head)
+{
+    assert(!chan->in_wrlist);
+    chan->wr_next = chan->deficit <= 0;
+    if (chan->wr_next)
+	gensio_list_add_tail(&muxdata->wrchans[chan->priority].next,
+			     &chan->wrlink);
+    else if (head)
+	gensio_list_add_head(&muxdata->wrchans[chan->priority].active,
+			     &chan->wrlink);
+    else
+	gensio_list_add_tail(&muxdata->wrchans[chan->priority].active,
+			     &chan->wrlink);
+    chan->in_wrlist = true;
+}
+
+static void
+mux_wrlist_rm(struct mux_data *muxdata, struct mux_inst *chan)
+{
+    if (chan->wr_next)
+	gensio_list_rm(&muxdata->wrchans[chan->priority].next, &chan->wrlink);
+    else
+	gensio_list_rm(&muxdata->wrchans[chan->priority].active,
+		       &chan->wrlink);
+    chan->in_wrlist = false;
+}
+
+static bool
+mux_wrlist_empty(struct mux_data *muxdata)
+{
+    unsigned int i;
+
+    for (i = 0; i < MUX_NR_PRIORITIES; i++) {
+	if (!gensio_list_empty(&muxdata->wrchans[i].active) ||
+		!gensio_list_empty(&muxdata->wrchans[i].next))
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * Return the next channel to send from, NULL if there is none.  If
+ * every channel at the priority has used its quantum, a new round is
+ * started.
+ */
+static struct mux_inst *
+mux_wrlist_first(struct mux_data *muxdata)
+{
+    struct gensio_list *active, *next;
+    struct gensio_link *l, *l2;
+    struct mux_inst *chan;
+    unsigned int i;
+
+    for (i = MUX_NR_PRIORITIES; i > 0; i--) {
+	active = &muxdata->wrchans[i - 1].active;
+	next = &muxdata->wrchans[i - 1].next;
+	while (gensio_list_empty(active) && !gensio_list_empty(next) &&
+	       muxdata->wrchans[i - 1].nr_sending == 0) {
+	    /* Deficits always go up, so this ends. */
+	    gensio_list_for_each_safe(next, l, l2) {
+		chan = gensio_container_of(l, struct mux_inst, wrlink);
+		chan->deficit += (long) chan->weight * MUX_DRR_QUANTUM;
+		if (chan->deficit > 0) {
+		    gensio_list_rm(next, l);
+		    gensio_list_add_tail(active, l);
+		    chan->wr_next = false;
+		}
+	    }
+	}
+	if (!gensio_list_empty(active))
+	    return gensio_container_of(gensio_list_first(active),
+				       struct mux_inst, wrlink);
+    }
+    return NULL;
+}
+
+static void
+mux_reset_batch(struct mux_data *muxdata)
+{
+    unsigned int i;
+
+    muxdata->nr_sending = 0;
+    muxdata->xmit_in_batch = false;
+    for (i = 0; i < MUX_NR_PRIORITIES; i++)
+	muxdata->wrchans[i].nr_sending = 0;
+}
+
+/* The channel has nothing more to send. */
+static void
+chan_sched_idle(struct mux_inst *chan)
+{
+    chan->wr_ready = false;
+    /* Keep any debt so going idle can't be used to get ahead. */
+    if (chan->deficit > 0)
+	chan->deficit = 0;
+}
+
 static void
 muxc_add_to_wrlist(struct mux_inst *chan)
 {
     struct mux_data *muxdata = chan->mux;
 
     if (!chan->wr_ready && !muxdata->err_shutdown) {
-	assert(!chan->in_wrlist);
-	gensio_list_add_tail(&muxdata->wrchans, &chan->wrlink);
+	mux_wrlist_add(muxdata, chan, false);
 	chan->wr_ready = true;
-	chan->in_wrlist = true;
 	if (muxdata->state != MUX_CLOSED)
 	    gensio_set_write_callback_enable(muxdata->child, true);
     }
 }
 
-static int
-muxc_write(struct mux_inst *chan, gensiods *count,
-	   const struct gensio_sg *sg, gensiods sglen,
-	   const char *const *auxdata)
+static unsigned long long
+mux_msecs_since(struct mux_data *muxdata, gensio_time *start)
 {
-    struct mux_data *muxdata = chan->mux;
-    gensiods rcount, i, tot_len = 0;
-    unsigned char hdr[3];
-    gensiods len;
-    bool truncated = false;
+    gensio_time now;
 
-    for (i = 0; i < sglen; i++)
-	tot_len += sg[i].buflen;
-    if (tot_len == 0) {
-	*count = 0;
-	return 0;
+    muxdata->o->get_monotonic_time(muxdata->o, &now);
+    return ((now.secs - start->secs) * 1000 +
+	    (now.nsecs - start->nsecs) / 1000000);
+}
+
+static void
+mux_start_window_timer(struct mux_data *muxdata)
+{
+    gensio_time timeout = { MUX_WINDOW_IDLE_SECS, 0 };
+
+    if (muxdata->window_timer_running)
+	return;
+    if (!muxdata->o->start_timer(muxdata->window_timer, &timeout)) {
+	muxdata->window_timer_running = true;
+	mux_ref(muxdata);
     }
-    tot_len += 3; /* Add the header. */
+}
 
-    mux_lock(muxdata);
-    if (chan->state != MUX_INST_OPEN) {
-	mux_unlock(muxdata);
-	return GE_NOTREADY;
+static void
+mux_stop_window_timer(struct mux_data *muxdata)
+{
+    if (muxdata->window_timer_running &&
+		!muxdata->o->stop_timer(muxdata->window_timer)) {
+	muxdata->window_timer_running = false;
+	/* The caller holds a ref, so this can't go to zero. */
+	assert(muxdata->refcount > 1);
+	muxdata->refcount--;
     }
+}
 
-    if (chan->errcode) {
-	int err = chan->errcode;
+static bool
+mux_start_ack_timer(struct mux_data *muxdata)
+{
+    gensio_time timeout = { 0, MUX_ACK_DELAY_MSECS * 1000000 };
 
-	mux_unlock(muxdata);
-	return err;
-    }
+    if (muxdata->ack_timer_running)
+	return true;
+    if (muxdata->o->start_timer(muxdata->ack_timer, &timeout))
+	return false;
+    muxdata->ack_timer_running = true;
+    mux_ref(muxdata);
+    return true;
+}
 
-    /*
-     * Just return on buffer full.  We need 3 bytes for the header and at
-     * least a byte of data.
-     */
-    if (chan->max_write_size - chan->write_data_len < 4) {
-    out_unlock_nosend:
-	mux_unlock(muxdata);
-	if (count)
-	    *count = 0;
-	return 0;
+static void
+mux_stop_ack_timer(struct mux_data *muxdata)
+{
+    if (muxdata->ack_timer_running &&
+		!muxdata->o->stop_timer(muxdata->ack_timer)) {
+	muxdata->ack_timer_running = false;
+	/* The caller holds a ref, so this can't go to zero. */
+	assert(muxdata->refcount > 1);
+	muxdata->refcount--;
     }
+}
 
-    if (tot_len > chan->max_write_size - chan->write_data_len) {
-	/* Can only send as much as we have buffer for. */
+/*
+ * Can the ack for the channel be held back?  If so, the ack timer is
+ * running and the channel is on the ack list.  If the timer can't be
+ * started, ack now.
+ */
+static bool
+chan_delay_ack(struct mux_inst *chan)
+{
+    struct mux_data *muxdata = chan->mux;
+
+    if (!muxdata->delay_acks || chan->ack_due || chan->send_close ||
+		chan->received_unacked >= chan->read_window / 4)
+	return false;
+    if (!mux_start_ack_timer(muxdata))
+	return false;
+    if (!chan->in_ack_list) {
+	gensio_list_add_tail(&muxdata->ack_chans, &chan->ack_link);
+	chan->in_ack_list = true;
+    }
+    return true;
+}
+
+/* The channel's ack is going out or dropped, it's not held back. */
+static void
+chan_ack_sent(struct mux_inst *chan)
+{
+    chan->received_unacked = 0;
+    chan->ack_due = false;
+    if (chan->in_ack_list) {
+	gensio_list_rm(&chan->mux->ack_chans, &chan->ack_link);
+	chan->in_ack_list = false;
+    }
+}
+
+/* Send the acks that have been held back. */
+static void
+mux_ack_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct mux_data *muxdata = cb_data;
+    struct gensio_link *l, *l2;
+    struct mux_inst *chan;
+
+    mux_lock(muxdata);
+    muxdata->ack_timer_running = false;
+    if (muxdata->state != MUX_OPEN)
+	goto out_unlock;
+
+    gensio_list_for_each_safe(&muxdata->ack_chans, l, l2) {
+	chan = gensio_container_of(l, struct mux_inst, ack_link);
+	gensio_list_rm(&muxdata->ack_chans, &chan->ack_link);
+	chan->in_ack_list = false;
+	if (chan->received_unacked) {
+	    chan->ack_due = true;
+	    muxc_add_to_wrlist(chan);
+	}
+    }
+ out_unlock:
+    mux_deref_and_unlock(muxdata);
+}
+
+/* Tell the remote end about a new receive window for the channel. */
+static void
+chan_set_read_window(struct mux_inst *chan, gensiods window)
+{
+    chan->read_window = window;
+    chan->read_window_acked = false;
+    chan->rx_since_window_change = 0;
+    chan->send_window_update = true;
+    muxc_add_to_wrlist(chan);
+}
+
+/*
+ * A data message of len bytes is about to be stored for the channel.
+ * If the sender says the window is holding it back, the user is
+ * keeping up, and a full window has come in since the last change,
+ * double the window.
+ */
+static void
+chan_check_grow_window(struct mux_inst *chan, bool limited, gensiods len)
+{
+    struct mux_data *muxdata = chan->mux;
+    gensiods window;
+
+    chan->rx_active = true;
+    chan->rx_since_window_change += len;
+    if (!limited || muxdata->version < 2 ||
+		chan->read_window >= muxdata->max_read_window ||
+		chan->read_data_len > chan->read_window / 2 ||
+		chan->rx_since_window_change < chan->read_window)
+	return;
+
+    window = chan->read_window * 2;
+    if (window > muxdata->max_read_window)
+	window = muxdata->max_read_window;
+    if (window > chan->max_read_size) {
+	/* If the user is looking at the buffer, try again later. */
+	if (chan->in_read_report || chan_resize_rdbuf(chan, window))
+	    return;
+    }
+    chan_set_read_window(chan, window);
+    if (!chan->in_window_list) {
+	gensio_list_add_tail(&muxdata->window_chans, &chan->window_link);
+	chan->in_window_list = true;
+    }
+    mux_start_window_timer(muxdata);
+}
+
+/* Halve the window of channels that have gone idle. */
+static void
+mux_window_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct mux_data *muxdata = cb_data;
+    struct gensio_link *l, *l2;
+    struct mux_inst *chan;
+    gensiods window;
+
+    mux_lock(muxdata);
+    muxdata->window_timer_running = false;
+    if (muxdata->state != MUX_OPEN)
+	goto out_unlock;
+
+    gensio_list_for_each_safe(&muxdata->window_chans, l, l2) {
+	chan = gensio_container_of(l, struct mux_inst, window_link);
+	if (!chan->rx_active && chan->state == MUX_INST_OPEN) {
+	    window = chan->read_window / 2;
+	    if (window < muxdata->max_read_size)
+		window = muxdata->max_read_size;
+	    chan_set_read_window(chan, window);
+	}
+	chan->rx_active = false;
+	if (chan->read_window <= muxdata->max_read_size) {
+	    gensio_list_rm(&muxdata->window_chans, &chan->window_link);
+	    chan->in_window_list = false;
+	}
+    }
+    if (!gensio_list_empty(&muxdata->window_chans))
+	mux_start_window_timer(muxdata);
+ out_unlock:
+    mux_deref_and_unlock(muxdata);
+}
+
+static int
+muxc_write(struct mux_inst *chan, gensiods *count,
+	   const struct gensio_sg *sg, gensiods sglen,
+	   const char *const *auxdata)
+{
+    struct mux_data *muxdata = chan->mux;
+    gensiods rcount, i, tot_len = 0;
+    unsigned char hdr[3];
+    gensiods len;
+    bool truncated = false;
+    int err;
+
+    for (i = 0; i < sglen; i++)
+	tot_len += sg[i].buflen;
+    if (tot_len == 0) {
+	*count = 0;
+	return 0;
+    }
+    tot_len += 3; /* Add the header. */
+
+    /*
+     * The data goes into the channel's buffer under the write lock,
+     * the mux lock is only needed to put the channel on the send
+     * list, so writers on different channels don't hold each other
+     * up copying data.
+     */
+    chan->o->lock(chan->write_lock);
+    err = chan->write_err;
+    if (err) {
+	chan->o->unlock(chan->write_lock);
+	return err;
+    }
+
+    /*
+     * Just return on buffer full.  We need 3 bytes for the header and at
+     * least a byte of data.
+     */
+    if (chan->max_write_size - chan->write_data_len < 4) {
+    out_unlock_nosend:
+	chan->o->unlock(chan->write_lock);
+	if (count)
+	    *count = 0;
+	return 0;
+    }
+
+    if (tot_len > chan->max_write_size - chan->write_data_len) {
+	/* Can only send as much as we have buffer for. */
 	tot_len = chan->max_write_size - chan->write_data_len;
 	if (tot_len <= 3)
 	    goto out_unlock_nosend;
@@ -1106,6 +1863,12 @@ muxc_write(struct mux_inst *chan, gensiods *count,
 	truncated = true;
     }
 
+    if (tot_len > 0xffff + 3) {
+	/* The data size has to fit in 16 bits. */
+	tot_len = 0xffff + 3;
+	truncated = true;
+    }
+
     /* FIXME - consolidate writes if possible. */
 
     /* Construct the header and put it in first. */
@@ -1127,8 +1890,12 @@ muxc_write(struct mux_inst *chan, gensiods *count,
 	rcount += len;
 	tot_len -= len;
     }
+    chan->o->unlock(chan->write_lock);
 
-    muxc_add_to_wrlist(chan);
+    mux_lock(muxdata);
+    /* If the channel closed since the data was added, it's been dropped. */
+    if (chan->state == MUX_INST_OPEN)
+	muxc_add_to_wrlist(chan);
     mux_unlock(muxdata);
 
     if (count)
@@ -1325,7 +2092,10 @@ mux_new_channel(struct mux_data *muxdata, gensio_event cb, void *user_data,
     chan->refcount = 1;
     chan->freeref = 1;
     chan->is_client = is_client;
+    chan->weight = 1;
     chan->max_read_size = muxdata->max_read_size;
+    chan->read_window = chan->max_read_size;
+    chan->read_window_acked = true;
     chan->max_write_size = muxdata->max_write_size;
     chan->read_data = o->zalloc(o, chan->max_read_size);
     if (!chan->read_data)
@@ -1333,40 +2103,38 @@ mux_new_channel(struct mux_data *muxdata, gensio_event cb, void *user_data,
     chan->write_data = o->zalloc(o, chan->max_write_size);
     if (!chan->write_data)
 	goto out_free;
+    chan->write_lock = o->alloc_lock(o);
+    if (!chan->write_lock)
+	goto out_free;
 
     /*
-     * We maintain the list in number order and rotate through the
-     * numbers.  So we start after the last number used and rotate
-     * through the entries until we find an empty spot.
+     * We rotate through the numbers, starting after the last number
+     * used and going until we find a free one.  Full words of the
+     * bitmap are skipped at once.
      */
     if (gensio_list_empty(&muxdata->chans)) {
 	id = 0; /* This is always the automatic channel. */
+	mux_claim_id(muxdata, chan, id);
 	gensio_list_add_tail(&muxdata->chans, &chan->link);
 	/* Note that we do not claim a ref here, there is already one. */
     } else {
-	struct gensio_link *l, *p = &muxdata->chans.link, *f;
-	struct mux_inst *tchan = NULL;
-
-	/* First find the place at or before where the last number starts. */
-	id = muxdata->last_id;
-	gensio_list_for_each(&muxdata->chans, l) {
-	    tchan = gensio_container_of(l, struct mux_inst, link);
-	    if (tchan->id > id)
-		break;
-	    p = l;
-	}
-
-	id = next_chan_id(muxdata, id);
-	l = gensio_list_next_wrap(&muxdata->chans, p);
-	f = l;
-	do {
-	    tchan = gensio_container_of(l, struct mux_inst, link);
-	    if (id != tchan->id)
+	unsigned int count = 0;
+
+	id = next_chan_id(muxdata, muxdata->last_id);
+	while (count < muxdata->max_channels) {
+	    if (id % 32 == 0 && muxdata->id_map[id / 32] == 0xffffffff) {
+		/* Bits past max_channels are never set, this can't overrun. */
+		count += 32;
+		id += 32;
+		if (id >= muxdata->max_channels)
+		    id = 0;
+		continue;
+	    }
+	    if (!mux_id_in_use(muxdata, id))
 		goto found;
+	    count++;
 	    id = next_chan_id(muxdata, id);
-	    p = l;
-	    l = gensio_list_next_wrap(&muxdata->chans, p);
-	} while (f != l);
+	}
 
 	err = GE_INUSE;
 
@@ -1376,10 +2144,9 @@ mux_new_channel(struct mux_data *muxdata, gensio_event cb, void *user_data,
 	return err;
 
     found:
-	tchan = gensio_container_of(p, struct mux_inst, link);
-	chan->id = id;
+	mux_claim_id(muxdata, chan, id);
 	muxdata->last_id = id;
-	gensio_list_add_next(&muxdata->chans, p, &chan->link);
+	gensio_list_add_tail(&muxdata->chans, &chan->link);
 	mux_ref(muxdata);
     }
 
@@ -1413,6 +2180,8 @@ muxc_alloc_channel_data(struct mux_data *muxdata,
 	}
 	chan->service_len = data->service_len;
     }
+    chan->priority = data->priority;
+    chan->weight = data->weight;
 
     muxc_set_state(chan, MUX_INST_CLOSED);
 
@@ -1440,6 +2209,9 @@ gensio_mux_config(struct gensio_os_funcs *o,
     for (i = 0; args && args[i]; i++) {
 	if (gensio_check_keyds(args[i], "readbuf", &data->max_read_size) > 0)
 	    continue;
+	if (gensio_check_keyds(args[i], "max_readbuf",
+			       &data->max_read_window) > 0)
+	    continue;
 	if (gensio_check_keyds(args[i], "writebuf", &data->max_write_size) > 0)
 	    continue;
 	if (gensio_check_keyboolv(args[i], "mode", "client", "server",
@@ -1453,6 +2225,29 @@ gensio_mux_config(struct gensio_os_funcs *o,
 	    }
 	    continue;
 	}
+	if (gensio_check_keyuint(args[i], "priority", &data->priority) > 0) {
+	    if (data->priority >= MUX_NR_PRIORITIES) {
+		rv = GE_INVAL;
+		goto out_err;
+	    }
+	    continue;
+	}
+	if (gensio_check_keyuint(args[i], "weight", &data->weight) > 0) {
+	    if (data->weight < 1 || data->weight > MUX_MAX_WEIGHT) {
+		rv = GE_INVAL;
+		goto out_err;
+	    }
+	    continue;
+	}
+	if (gensio_check_keyuint(args[i], "protocol",
+				 &data->max_version) > 0) {
+	    if (data->max_version < 1 ||
+			data->max_version > MUX_PROTOCOL_VERSION) {
+		rv = GE_INVAL;
+		goto out_err;
+	    }
+	    continue;
+	}
 	if (gensio_check_keyvalue(args[i], "service", &str) > 0) {
 	    data->service = gensio_strdup(o, str);
 	    if (!data->service)
@@ -1528,17 +2323,16 @@ muxc_alloc_channel(struct mux_data *muxdata,
     data.max_read_size = muxdata->max_read_size;
     data.max_write_size = muxdata->max_write_size;
     data.max_channels = muxdata->max_channels;
+    data.weight = 1;
     data.is_client = true;
     err = get_default_mode(muxdata->o, &data.is_client);
     if (err)
-	return err;
+	goto out_unlock;
 
     err = gensio_mux_config(muxdata->o, ocdata->args, &data);
-    if (err)
-	return err;
-
-    err = muxc_alloc_channel_data(muxdata, ocdata->cb, ocdata->user_data,
-				  &data, &ocdata->new_io);
+    if (!err)
+	err = muxc_alloc_channel_data(muxdata, ocdata->cb, ocdata->user_data,
+				      &data, &ocdata->new_io);
     gensio_mux_config_cleanup(&data);
  out_unlock:
     mux_unlock(muxdata);
@@ -1596,9 +2390,8 @@ muxc_reinit(struct mux_inst *chan)
     chan->read_data_pos = 0;
     chan->read_data_len = 0;
     chan->in_read_report = false;
-    chan->received_unacked = 0;
-    chan->write_data_pos = 0;
-    chan->write_data_len = 0;
+    chan_ack_sent(chan);
+    chan_clear_wrbuf(chan);
     chan->write_ready_enabled = false;
     chan->in_write_ready = false;
     chan->sent_unacked = 0;
@@ -1607,6 +2400,16 @@ muxc_reinit(struct mux_inst *chan)
     chan->close_done = NULL;
     chan->wr_ready = false;
     chan->close_called = false;
+    chan->read_window = chan->mux->max_read_size;
+    if (chan->in_window_list) {
+	gensio_list_rm(&chan->mux->window_chans, &chan->window_link);
+	chan->in_window_list = false;
+    }
+    chan->read_window_acked = true;
+    chan->send_window_update = false;
+    chan->send_window_ack = false;
+    chan->rx_since_window_change = 0;
+    chan->rx_active = false;
 }
 
 static int
@@ -1618,10 +2421,12 @@ muxc_open(struct mux_inst *chan, gensio_done_err open_done, void *open_data,
 
     mux_lock(muxdata);
     if (muxdata->state == MUX_CLOSED) {
-	muxdata->sending_chan = NULL;
+	mux_reset_batch(muxdata);
 	muxdata->in_hdr = true;
 	muxdata->hdr_pos = 0;
 	muxdata->hdr_size = 0;
+	muxdata->tx_data_id_valid = false;
+	muxdata->rx_data_id_valid = false;
 	muxc_reinit(chan);
 	if (muxdata->is_client) {
 	    if (!chan->in_open_chan) {
@@ -1689,6 +2494,191 @@ muxc_open(struct mux_inst *chan, gensio_done_err open_done, void *open_data,
     return err;
 }
 
+static int
+muxc_control_priority(struct mux_inst *chan, bool get,
+		      char *data, gensiods *datalen)
+{
+    struct mux_data *muxdata = chan->mux;
+    unsigned int val;
+
+    if (get) {
+	if (strcmp(data, "priority") == 0)
+	    val = chan->priority;
+	else if (strcmp(data, "weight") == 0)
+	    val = chan->weight;
+	else
+	    return GE_INVAL;
+	*datalen = snprintf(data, *datalen, "%u", val);
+	return 0;
+    }
+
+    if (gensio_check_keyuint(data, "priority", &val) > 0) {
+	if (val >= MUX_NR_PRIORITIES)
+	    return GE_INVAL;
+	if (chan->in_wrlist) {
+	    /* Move it to the new priority's list. */
+	    mux_wrlist_rm(muxdata, chan);
+	    chan->priority = val;
+	    mux_wrlist_add(muxdata, chan, false);
+	} else {
+	    chan->priority = val;
+	}
+    } else if (gensio_check_keyuint(data, "weight", &val) > 0) {
+	if (val < 1 || val > MUX_MAX_WEIGHT)
+	    return GE_INVAL;
+	chan->weight = val;
+    } else {
+	return GE_INVAL;
+    }
+    return 0;
+}
+
+/*
+ * Where the channel is in the transmit schedule, the number of
+ * channels that will get to send before it.  -1 if it has nothing
+ * waiting to send or is being sent now.
+ */
+static long
+chan_sched_pos(struct mux_inst *chan)
+{
+    struct mux_data *muxdata = chan->mux;
+    struct gensio_link *l;
+    long pos = 0;
+    unsigned int i;
+
+    if (!chan->in_wrlist)
+	return -1;
+
+    for (i = MUX_NR_PRIORITIES; i > chan->priority + 1; i--) {
+	gensio_list_for_each(&muxdata->wrchans[i - 1].active, l)
+	    pos++;
+	gensio_list_for_each(&muxdata->wrchans[i - 1].next, l)
+	    pos++;
+    }
+    gensio_list_for_each(&muxdata->wrchans[chan->priority].active, l) {
+	if (l == &chan->wrlink)
+	    return pos;
+	pos++;
+    }
+    gensio_list_for_each(&muxdata->wrchans[chan->priority].next, l) {
+	if (l == &chan->wrlink)
+	    break;
+	pos++;
+    }
+    return pos;
+}
+
+enum mux_stat {
+    MUX_STAT_BYTES_IN,
+    MUX_STAT_MSGS_IN,
+    MUX_STAT_BYTES_OUT,
+    MUX_STAT_MSGS_OUT,
+    MUX_STAT_READ_WINDOW,
+    MUX_STAT_READ_USED,
+    MUX_STAT_SEND_WINDOW,
+    MUX_STAT_SEND_USED,
+    MUX_STAT_WRITE_QUEUED,
+    MUX_STAT_WINDOW_BLOCKED_MS,
+    MUX_STAT_SCHED_POS,
+    /* These are for the whole mux. */
+    MUX_STAT_HDR_ERRORS,
+    MUX_STAT_WRITE_STALLS,
+    MUX_NR_STATS
+};
+
+static const char *mux_stat_names[MUX_NR_STATS] = {
+    [MUX_STAT_BYTES_IN] = "bytes_in",
+    [MUX_STAT_MSGS_IN] = "msgs_in",
+    [MUX_STAT_BYTES_OUT] = "bytes_out",
+    [MUX_STAT_MSGS_OUT] = "msgs_out",
+    [MUX_STAT_READ_WINDOW] = "read_window",
+    [MUX_STAT_READ_USED] = "read_used",
+    [MUX_STAT_SEND_WINDOW] = "send_window",
+    [MUX_STAT_SEND_USED] = "send_used",
+    [MUX_STAT_WRITE_QUEUED] = "write_queued",
+    [MUX_STAT_WINDOW_BLOCKED_MS] = "window_blocked_ms",
+    [MUX_STAT_SCHED_POS] = "sched_pos",
+    [MUX_STAT_HDR_ERRORS] = "hdr_errors",
+    [MUX_STAT_WRITE_STALLS] = "write_stalls",
+};
+
+static long long
+muxc_stat(struct mux_inst *chan, enum mux_stat stat)
+{
+    struct mux_data *muxdata = chan->mux;
+    unsigned long long msecs;
+
+    switch (stat) {
+    case MUX_STAT_BYTES_IN:
+	return chan->bytes_in;
+    case MUX_STAT_MSGS_IN:
+	return chan->msgs_in;
+    case MUX_STAT_BYTES_OUT:
+	return chan->bytes_out;
+    case MUX_STAT_MSGS_OUT:
+	return chan->msgs_out;
+    case MUX_STAT_READ_WINDOW:
+	return chan->read_window;
+    case MUX_STAT_READ_USED:
+	/* Received but not acked yet, what the sender sees as used. */
+	return chan->read_data_len + chan->received_unacked;
+    case MUX_STAT_SEND_WINDOW:
+	return chan->send_window_size;
+    case MUX_STAT_SEND_USED:
+	return chan->sent_unacked;
+    case MUX_STAT_WRITE_QUEUED:
+	return chan_write_queued(chan);
+    case MUX_STAT_WINDOW_BLOCKED_MS:
+	msecs = chan->window_blocked_msecs;
+	if (chan->window_blocked)
+	    msecs += mux_msecs_since(muxdata, &chan->window_blocked_start);
+	return msecs;
+    case MUX_STAT_SCHED_POS:
+	return chan_sched_pos(chan);
+    case MUX_STAT_HDR_ERRORS:
+	return muxdata->hdr_errors;
+    case MUX_STAT_WRITE_STALLS:
+	return muxdata->write_stalls;
+    default:
+	abort();
+    }
+}
+
+/*
+ * Return a statistic by name, or all of them as name=value pairs
+ * separated by spaces if the name is empty.
+ */
+static int
+muxc_control_stats(struct mux_inst *chan, char *data, gensiods *datalen)
+{
+    gensiods pos = 0;
+    unsigned int i;
+
+    if (*data) {
+	for (i = 0; i < MUX_NR_STATS; i++) {
+	    if (strcmp(data, mux_stat_names[i]) == 0)
+		break;
+	}
+	if (i == MUX_NR_STATS)
+	    return GE_INVAL;
+	*datalen = snprintf(data, *datalen, "%lld", muxc_stat(chan, i));
+	return 0;
+    }
+
+    for (i = 0; i < MUX_NR_STATS; i++) {
+	/* Like snprintf, return the full length even if it won't fit. */
+	if (pos < *datalen)
+	    pos += snprintf(data + pos, *datalen - pos, "%s%s=%lld",
+			    i ? " " : "", mux_stat_names[i],
+			    muxc_stat(chan, i));
+	else
+	    pos += snprintf(NULL, 0, "%s%s=%lld", i ? " " : "",
+			    mux_stat_names[i], muxc_stat(chan, i));
+    }
+    *datalen = pos;
+    return 0;
+}
+
 static int
 muxc_control(struct mux_inst *chan, bool get, int op,
 	     char *data, gensiods *datalen)
@@ -1727,6 +2717,18 @@ muxc_control(struct mux_inst *chan, bool get, int op,
 	}
 	break;
 
+    case GENSIO_CONTROL_PRIORITY:
+	err = muxc_control_priority(chan, get, data, datalen);
+	break;
+
+    case GENSIO_CONTROL_STATS:
+	if (!get) {
+	    err = GE_NOTSUP;
+	    goto out;
+	}
+	err = muxc_control_stats(chan, data, datalen);
+	break;
+
     default:
 	err = GE_NOTSUP;
 	break;
@@ -1795,6 +2797,8 @@ mux_shutdown_channels(struct mux_data *muxdata, int err)
 
     muxdata->err_shutdown = true;
 
+    mux_stop_window_timer(muxdata);
+    mux_stop_ack_timer(muxdata);
     mux_set_state(muxdata, MUX_CLOSED);
     if (muxdata->acc_open_done &&
 		(muxdata->exit_state == MUX_WAITING_OPEN ||
@@ -1810,13 +2814,14 @@ mux_shutdown_channels(struct mux_data *muxdata, int err)
 	mux_lock(muxdata);
     }
 
+    /* Nothing more is going out, forget the current write batch. */
+    mux_reset_batch(muxdata);
+
     gensio_list_for_each_safe(&muxdata->chans, l, l2) {
 	chan = gensio_container_of(l, struct mux_inst, link);
-	if (chan->in_wrlist) {
-	    gensio_list_rm(&muxdata->wrchans, &chan->wrlink);
-	    chan->in_wrlist = false;
-	}
-	chan->wr_ready = false;
+	if (chan->in_wrlist)
+	    mux_wrlist_rm(muxdata, chan);
+	chan_sched_idle(chan);
 	if (chan->in_open_chan) {
 	    gensio_list_rm(&muxdata->openchans, &chan->wrlink);
 	    chan->in_open_chan = false;
@@ -1874,7 +2879,7 @@ chan_setup_send_new_channel(struct mux_inst *chan)
     chan->hdr[0] = (MUX_NEW_CHANNEL << 4) | 0x2;
     chan->hdr[1] = 0;
     gensio_u16_to_buf(&chan->hdr[2], chan->id);
-    gensio_u32_to_buf(&chan->hdr[4], chan->max_read_size);
+    gensio_u32_to_buf(&chan->hdr[4], chan->read_window);
     gensio_u16_to_buf(&chan->hdr[8], chan->service_len);
     chan->sg[0].buf = chan->hdr;
     chan->sg[0].buflen = 10;
@@ -1888,34 +2893,56 @@ chan_setup_send_new_channel(struct mux_inst *chan)
     chan->cur_msg_len = 0; /* Data isn't in chan->write_data. */
 }
 
-static bool
-chan_setup_send_data(struct mux_inst *chan)
+/*
+ * Set up a full data message header in chan->hdr.  This carries the
+ * ack, too.
+ */
+static void
+chan_setup_data_hdr(struct mux_inst *chan, unsigned char flags)
 {
-    unsigned char flags = 0;
-    gensiods pos;
-    gensiods window_left = chan->send_window_size - chan->sent_unacked;
+    struct mux_data *muxdata = chan->mux;
 
-    assert(chan->sglen == 0);
     chan->hdr[0] = (MUX_DATA << 4) | 0x2;
-    chan->hdr[1] = 0;
+    chan->hdr[1] = flags;
     gensio_u16_to_buf(chan->hdr + 2, chan->remote_id);
     gensio_u32_to_buf(chan->hdr + 4, chan->received_unacked);
+    chan_ack_sent(chan);
+    muxdata->tx_data_id = chan->remote_id;
+    muxdata->tx_data_id_valid = true;
+}
+
+/*
+ * Set up a data message, or just an ack.  queued is what
+ * chan_write_queued() returned, writers may add more after that, but
+ * what is there already won't change until we take it out.
+ */
+static bool
+chan_setup_send_data(struct mux_inst *chan, gensiods queued)
+{
+    struct mux_data *muxdata = chan->mux;
+    unsigned char flags = 0;
+    gensiods pos, start;
+    gensiods window_left = 0;
+
+    /* The window may have been shrunk below what is outstanding. */
+    if (chan->send_window_size > chan->sent_unacked)
+	window_left = chan->send_window_size - chan->sent_unacked;
 
+    assert(chan->sglen == 0);
     chan->sg[0].buf = chan->hdr;
-    chan->sg[0].buflen = 8;
 
-    if (chan->write_data_len == 0) {
+    if (queued == 0) {
     check_send_ack:
-	if (chan->received_unacked == 0)
+	if (chan->received_unacked == 0 || chan_delay_ack(chan))
 	    return false;
-	chan->received_unacked = 0;
 	/* Just sending an ack. */
+	chan_setup_data_hdr(chan, 0);
 	gensio_u16_to_buf(chan->hdr + 8, 0);
 	chan->sg[0].buflen = 10;
 	chan->sglen = 1;
 	return true;
     }
-    assert(chan->write_data_len > 3);
+    assert(queued > 3);
 
     pos = chan_next_write_pos(chan, 1);
     chan->cur_msg_len = chan->write_data[pos] << 8;
@@ -1927,33 +2954,88 @@ chan_setup_send_data(struct mux_inst *chan)
     /* Make sure to add 1 for the flags */
     if (chan->cur_msg_len + 1 > window_left) {
 	chan->cur_msg_len = 0;
+	if (!chan->window_blocked) {
+	    chan->window_blocked = true;
+	    muxdata->o->get_monotonic_time(muxdata->o,
+					   &chan->window_blocked_start);
+	}
 	goto check_send_ack;
     }
+    if (chan->window_blocked) {
+	chan->window_blocked = false;
+	chan->window_blocked_msecs += mux_msecs_since(muxdata,
+						&chan->window_blocked_start);
+    }
 
-    chan->received_unacked = 0;
-
+    /*
+     * The flags byte goes in the header.  It is taken off the buffer
+     * with the rest of the message in mux_chan_msg_sent().
+     */
     flags = chan->write_data[chan->write_data_pos];
-    chan_incr_write_pos(chan, 1);
-    chan->hdr[1] = flags;
+    start = chan_next_write_pos(chan, 1);
+    queued--;
     chan->sent_unacked++; /* Flags is stored as delivered data on remote end. */
 
-    if (chan->write_data_pos + chan->cur_msg_len > chan->max_write_size) {
+    if (start + chan->cur_msg_len > chan->max_write_size) {
 	/* Buffer wraps, need three parts for scatter/gatter. */
 	chan->sglen = 3;
-	chan->sg[1].buf = chan->write_data + chan->write_data_pos;
-	chan->sg[1].buflen = chan->max_write_size - chan->write_data_pos;
+	chan->sg[1].buf = chan->write_data + start;
+	chan->sg[1].buflen = chan->max_write_size - start;
 	chan->sg[2].buf = chan->write_data;
 	chan->sg[2].buflen = chan->cur_msg_len - chan->sg[1].buflen;
     } else {
 	chan->sglen = 2;
-	chan->sg[1].buf = chan->write_data + chan->write_data_pos;
+	chan->sg[1].buf = chan->write_data + start;
 	chan->sg[1].buflen = chan->cur_msg_len;
     }
     chan->sent_unacked += chan->cur_msg_len;
 
+    /* Let the remote end know if the window is holding us back. */
+    if (muxdata->version >= 2 &&
+		queued > chan->cur_msg_len &&
+		(chan->sent_unacked + queued - chan->cur_msg_len >
+		 chan->send_window_size))
+	flags |= MUX_FLAG_WINDOW_LIMITED;
+
+    /*
+     * Same channel as the last one and no ack to send, go short.  A
+     * held back ack goes with the data, it's cheaper than sending it
+     * by itself later.
+     */
+    if (muxdata->version >= 3 && muxdata->tx_data_id_valid &&
+		muxdata->tx_data_id == chan->remote_id &&
+		chan->received_unacked == 0) {
+	chan->hdr[0] = (MUX_DATA_SHORT << 4) | flags;
+	chan->sg[0].buflen = 1;
+    } else {
+	chan_setup_data_hdr(chan, flags);
+	chan->sg[0].buflen = 8;
+    }
+
     return true;
 }
 
+static void
+chan_setup_send_window(struct mux_inst *chan)
+{
+    assert(chan->sglen == 0);
+    chan->hdr[0] = (MUX_WINDOW << 4) | 0x2;
+    gensio_u16_to_buf(&chan->hdr[2], chan->remote_id);
+    if (chan->send_window_update) {
+	chan->hdr[1] = 0;
+	gensio_u32_to_buf(&chan->hdr[4], chan->read_window);
+	chan->send_window_update = false;
+    } else {
+	chan->hdr[1] = MUX_WINDOW_FLAG_ACK;
+	gensio_u32_to_buf(&chan->hdr[4], chan->send_window_size);
+	chan->send_window_ack = false;
+    }
+    chan->sg[0].buf = chan->hdr;
+    chan->sg[0].buflen = 8;
+    chan->sglen = 1;
+    chan->cur_msg_len = 0; /* Data isn't in chan->write_data. */
+}
+
 static void
 mux_on_err_close(struct gensio *child, void *close_data)
 {
@@ -1964,12 +3046,117 @@ mux_on_err_close(struct gensio *child, void *close_data)
     mux_deref_and_unlock(muxdata); /* Lose the open ref. */
 }
 
+/* A message on the channel has been completely written to the child. */
+static void
+mux_chan_msg_sent(struct mux_data *muxdata, struct mux_inst *chan)
+{
+    gensiods queued;
+
+    muxdata->wrchans[chan->send_priority].nr_sending--;
+    if (chan->cur_msg_len) {
+	/* A data message, don't count the size bytes. */
+	chan->msgs_out++;
+	chan->bytes_out += chan->cur_msg_len - 2;
+	/* Take the flags byte off, too. */
+	queued = chan_incr_write_pos(chan, chan->cur_msg_len + 1);
+    } else {
+	queued = chan_write_queued(chan);
+    }
+    chan->cur_msg_len = 0;
+    chan->sgpos = 0;
+    chan->sglen = 0;
+    if (queued > 0 || chan->send_new_channel ||
+		chan->send_close || chan->send_window_update ||
+		chan->send_window_ack) {
+	/*
+	 * More messages to send.  If the channel has some of its
+	 * quantum left it keeps going, otherwise it waits for the
+	 * next round.
+	 */
+	mux_wrlist_add(muxdata, chan, true);
+    } else {
+	chan_sched_idle(chan);
+    }
+    /*
+     * Maybe the user can write.  Also, if a close is pending,
+     * handle it there, too.
+     */
+    chan_sched_deferred_op(chan);
+}
+
+/*
+ * Set up the next message to send on the channel.  Returns false if
+ * the channel has nothing to send.
+ */
+static bool
+mux_chan_setup_msg(struct mux_inst *chan)
+{
+    gensiods queued = chan_write_queued(chan);
+
+    if (chan->send_new_channel) {
+	chan_setup_send_new_channel(chan);
+	chan->send_new_channel = false;
+    } else if ((chan->send_window_update || chan->send_window_ack) &&
+	       !chan->close_sent) {
+	chan_setup_send_window(chan);
+    } else if ((queued || chan->received_unacked) && !chan->close_sent) {
+	/*
+	 * Send a data packet, either for data delivery or an ack.
+	 * Once we send a close, we cannot send any more data,
+	 * thus the check in the if statement above.
+	 */
+	if (!chan_setup_send_data(chan, queued))
+	    return false;
+    } else if (chan->send_close &&
+	       (chan->read_data_len == 0 ||
+		chan->state == MUX_INST_IN_CLOSE ||
+		chan->state == MUX_INST_IN_CLOSE_FINAL)) {
+	/*
+	 * Do the close last so all data is sent.  The state
+	 * checks above are there because we want to delay the
+	 * send close if we are in MUX_INST_IN_REM_CLOSE to
+	 * deliver all the data the remote end sent before
+	 * reporting the close, but if our end requested the
+	 * close, send it after all local data has been sent.
+	 */
+	chan_send_close(chan);
+	chan->send_close = false;
+	chan->close_sent = true;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+/*
+ * Consume count bytes from the sg array, return true if the whole
+ * thing was written.
+ */
+static bool
+mux_sg_consume(struct gensio_sg *sg, unsigned int *sgpos, unsigned int sglen,
+	       gensiods *count)
+{
+    while (*count > 0 && *sgpos < sglen) {
+	if (sg[*sgpos].buflen <= *count) {
+	    *count -= sg[*sgpos].buflen;
+	    (*sgpos)++;
+	} else {
+	    sg[*sgpos].buflen -= *count;
+	    sg[*sgpos].buf = ((char *) sg[*sgpos].buf) + *count;
+	    *count = 0;
+	}
+    }
+    return *sgpos >= sglen;
+}
+
 static int
 mux_child_write_ready(struct mux_data *muxdata)
 {
     int err = 0;
     struct mux_inst *chan;
-    gensiods rcount;
+    struct gensio_sg *sg = muxdata->send_sg;
+    unsigned int i, j, sglen;
+    gensiods rcount, budget, total;
 
     mux_lock_and_ref(muxdata);
     if (muxdata->state == MUX_IN_CLOSE || muxdata->state == MUX_CLOSED) {
@@ -1979,66 +3166,87 @@ mux_child_write_ready(struct mux_data *muxdata)
 	return 0;
     }
 
-    /* Finish any pending channel data. */
-    if (muxdata->sending_chan) {
-	chan = muxdata->sending_chan;
-    next_channel:
-	assert(chan->sglen > 0 && chan->sgpos < chan->sglen);
-	err = gensio_write_sg(muxdata->child, &rcount, chan->sg + chan->sgpos,
-			      chan->sglen - chan->sgpos, NULL);
-	if (err)
-	    goto out_write_err;
-	while (rcount > 0 && chan->sgpos < chan->sglen) {
-	    if (chan->sg[chan->sgpos].buflen <= rcount) {
-		rcount -= chan->sg[chan->sgpos].buflen;
-		chan->sgpos++;
-		assert(chan->sgpos <= 3);
-	    } else {
-		chan->sg[chan->sgpos].buflen -= rcount;
-		chan->sg[chan->sgpos].buf =
-		    ((char *) chan->sg[chan->sgpos].buf) + rcount;
-		rcount = 0;
-	    }
+ next_batch:
+    /*
+     * Data not associated with an existing channel goes at the
+     * beginning of a batch, so wait for the current one to finish
+     * before adding it.  Don't add new channels until then, either,
+     * so it can't be held off forever.
+     */
+    if (muxdata->xmit_data_len && !muxdata->xmit_in_batch) {
+	if (muxdata->nr_sending > 0)
+	    goto send_batch;
+	muxdata->xmit_in_batch = true;
+    }
+
+    /*
+     * Gather messages from as many channels as we can, up to the
+     * byte budget, so they all go down in one write.  Anything left
+     * from the last write is first, and is counted against the
+     * budget.
+     */
+    budget = 0;
+    if (muxdata->xmit_in_batch)
+	budget += muxdata->xmit_data_len;
+    for (i = 0; i < muxdata->nr_sending; i++) {
+	chan = muxdata->sending[i];
+	for (j = chan->sgpos; j < chan->sglen; j++)
+	    budget += chan->sg[j].buflen;
+    }
+    while (muxdata->nr_sending < MUX_MAX_SEND_BATCH &&
+	   budget < MUX_SEND_BATCH_BYTES &&
+	   (chan = mux_wrlist_first(muxdata))) {
+	gensiods msglen = 0;
+
+	mux_wrlist_rm(muxdata, chan);
+
+	if (!mux_chan_setup_msg(chan)) {
+	    chan_sched_idle(chan);
+	    continue;
 	}
-	if (chan->sgpos >= chan->sglen) {
-	    /* Finished sending one message. */
-	    chan->write_data_pos = chan_next_write_pos(chan, chan->cur_msg_len);
-	    chan->write_data_len -= chan->cur_msg_len;
-	    chan->cur_msg_len = 0;
-	    chan->sgpos = 0;
-	    chan->sglen = 0;
-	    muxdata->sending_chan = NULL;
-	    if (chan->write_data_len > 0 || chan->send_new_channel ||
-			chan->send_close) {
-		/* More messages to send, add it to the tail for fairness. */
-		gensio_list_add_tail(&muxdata->wrchans, &chan->wrlink);
-		chan->in_wrlist = true;
-	    } else {
-		chan->wr_ready = false;
-	    }
-	    /*
-	     * Maybe the user can write.  Also, if a close is pending,
-	     * handle it there, too.
-	     */
-	    chan_sched_deferred_op(chan);
-	} else {
-	    /* Couldn't send all the data. */
-	    goto out;
+	assert(chan->sglen > 0);
+	for (j = 0; j < chan->sglen; j++)
+	    msglen += chan->sg[j].buflen;
+	chan->deficit -= msglen;
+	budget += msglen;
+	chan->send_priority = chan->priority;
+	muxdata->wrchans[chan->priority].nr_sending++;
+	muxdata->sending[muxdata->nr_sending++] = chan;
+    }
+
+ send_batch:
+    sglen = 0;
+    total = 0;
+    if (muxdata->xmit_in_batch) {
+	sg[sglen].buf = muxdata->xmit_data + muxdata->xmit_data_pos;
+	sg[sglen].buflen = muxdata->xmit_data_len;
+	total += sg[sglen].buflen;
+	sglen++;
+    }
+    for (i = 0; i < muxdata->nr_sending; i++) {
+	chan = muxdata->sending[i];
+	assert(chan->sglen > 0 && chan->sgpos < chan->sglen);
+	for (j = chan->sgpos; j < chan->sglen; j++) {
+	    total += chan->sg[j].buflen;
+	    sg[sglen++] = chan->sg[j];
 	}
     }
+    if (sglen == 0)
+	goto out;
 
-    /* Handle data not associated with an existing channel. */
-    if (muxdata->xmit_data_len) {
-	struct gensio_sg sg[1];
+    err = gensio_write_sg(muxdata->child, &rcount, sg, sglen, NULL);
+    if (err)
+	goto out_write_err;
+    if (rcount < total)
+	/* The child couldn't take it all, it's backed up. */
+	muxdata->write_stalls++;
 
-	sg[0].buf = muxdata->xmit_data + muxdata->xmit_data_pos;
-	sg[0].buflen = muxdata->xmit_data_len;
-	err = gensio_write_sg(muxdata->child, &rcount, sg, 1, NULL);
-	if (err)
-	    goto out_write_err;
+    if (muxdata->xmit_in_batch) {
 	if (rcount >= muxdata->xmit_data_len) {
+	    rcount -= muxdata->xmit_data_len;
 	    muxdata->xmit_data_len = 0;
 	    muxdata->xmit_data_pos = 0;
+	    muxdata->xmit_in_batch = false;
 	} else {
 	    /* Partial write, can't write anything else. */
 	    muxdata->xmit_data_len -= rcount;
@@ -2047,56 +3255,26 @@ mux_child_write_ready(struct mux_data *muxdata)
 	}
     }
 
-    /* Now look for a new channel to send. */
- check_next_channel:
-    if (!gensio_list_empty(&muxdata->wrchans)) {
-	assert(muxdata->sending_chan == NULL);
-	chan = gensio_container_of(gensio_list_first(&muxdata->wrchans),
-				   struct mux_inst, wrlink);
-	gensio_list_rm(&muxdata->wrchans, &chan->wrlink);
-	chan->in_wrlist = false;
-
-	if (chan->send_new_channel) {
-	    chan_setup_send_new_channel(chan);
-	    chan->send_new_channel = false;
-	    muxdata->sending_chan = chan;
-	} else if ((chan->write_data_len || chan->received_unacked) &&
-		   !chan->close_sent) {
-	    /*
-	     * Send a data packet, either for data delivery or an ack.
-	     * Once we send a close, we cannot send any more data,
-	     * thus the check in the if statement above.
-	     */
-	    if (!chan_setup_send_data(chan)) {
-		chan->wr_ready = false;
-		goto check_next_channel;
-	    }
-	    muxdata->sending_chan = chan;
-	} else if (chan->send_close &&
-		   (chan->read_data_len == 0 ||
-		    chan->state == MUX_INST_IN_CLOSE ||
-		    chan->state == MUX_INST_IN_CLOSE_FINAL)) {
-	    /*
-	     * Do the close last so all data is sent.  The state
-	     * checks above are there because we want to delay the
-	     * send close if we are in MUX_INST_IN_REM_CLOSE to
-	     * deliver all the data the remote end sent before
-	     * reporting the close, but if our end requested the
-	     * close, send it after all local data has been sent.
-	     */
-	    chan_send_close(chan);
-	    chan->send_close = false;
-	    chan->close_sent = true;
-	    muxdata->sending_chan = chan;
-	} else {
-	    chan->wr_ready = false;
-	    goto check_next_channel;
-	}
-	goto next_channel;
+    for (i = 0; i < muxdata->nr_sending; i++) {
+	chan = muxdata->sending[i];
+	if (!mux_sg_consume(chan->sg, &chan->sgpos, chan->sglen, &rcount))
+	    break;
+	/* Finished sending one message. */
+	mux_chan_msg_sent(muxdata, chan);
+    }
+    if (i > 0) {
+	muxdata->nr_sending -= i;
+	memmove(muxdata->sending, muxdata->sending + i,
+		muxdata->nr_sending * sizeof(muxdata->sending[0]));
     }
+    if (muxdata->nr_sending == 0)
+	/* Everything went, see if there is more. */
+	goto next_batch;
+
  out:
     gensio_set_write_callback_enable(muxdata->child,
-		muxdata->sending_chan || !gensio_list_empty(&muxdata->wrchans));
+		muxdata->nr_sending || muxdata->xmit_data_len ||
+		!mux_wrlist_empty(muxdata));
     mux_deref_and_unlock(muxdata);
     return 0;
 
@@ -2116,34 +3294,26 @@ mux_child_write_ready(struct mux_data *muxdata)
 static struct mux_inst *
 mux_get_channel(struct mux_data *muxdata)
 {
-    struct gensio_link *l;
     unsigned int id = gensio_buf_to_u16(muxdata->hdr + 2);
 
-    gensio_list_for_each(&muxdata->chans, l) {
-	struct mux_inst *chan = gensio_container_of(l, struct mux_inst, link);
-
-	if (chan->id == id)
-	    return chan;
-    }
-    return NULL;
+    if (id >= muxdata->max_channels)
+	return NULL;
+    return muxdata->id_table[id];
 }
 
 static bool
 mux_find_remote_id(struct mux_data *muxdata, unsigned int id)
 {
-    struct gensio_link *l;
-
-    gensio_list_for_each(&muxdata->chans, l) {
-	struct mux_inst *chan = gensio_container_of(l, struct mux_inst, link);
+    struct mux_inst *chan;
 
-	if (chan->remote_id == id &&
-		chan->state != MUX_INST_PENDING_OPEN &&
-		chan->state != MUX_INST_IN_OPEN &&
-		chan->state != MUX_INST_IN_OPEN_CLOSE &&
-		chan->state != MUX_INST_IN_CLOSE_FINAL)
-	    return true;
-    }
-    return false;
+    if (id >= muxdata->rid_table_size)
+	return false;
+    chan = muxdata->rid_table[id];
+    return chan && chan->remote_id == id &&
+	chan->state != MUX_INST_PENDING_OPEN &&
+	chan->state != MUX_INST_IN_OPEN &&
+	chan->state != MUX_INST_IN_OPEN_CLOSE &&
+	chan->state != MUX_INST_IN_CLOSE_FINAL;
 }
 
 static int
@@ -2183,12 +3353,30 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		 * to process the rest of the header.
 		 */
 		muxdata->hdr[muxdata->hdr_pos++] = *buf;
+		muxdata->msgid = *buf >> 4;
+		if (muxdata->msgid == MUX_DATA_SHORT) {
+		    if (muxdata->version < 3 || !muxdata->rx_data_id_valid) {
+			proto_err_str = "Unexpected short data";
+			goto protocol_err;
+		    }
+		    /*
+		     * Turn it into a data message with no ack for the
+		     * last channel.  The header is complete, the next
+		     * time around processes it without using any data.
+		     */
+		    muxdata->msgid = MUX_DATA;
+		    muxdata->hdr_size = 1;
+		    muxdata->hdr[1] = *buf & 0xf;
+		    gensio_u16_to_buf(muxdata->hdr + 2, muxdata->rx_data_id);
+		    gensio_u32_to_buf(muxdata->hdr + 4, 0);
+		    used = 1;
+		    goto more_data;
+		}
 		muxdata->hdr_size = (*buf & 0xf) * 4;
 		if (muxdata->hdr_size > MUX_MAX_HDR_SIZE) {
 		    proto_err_str = "Invalid header size";
 		    goto protocol_err;
 		}
-		muxdata->msgid = *buf >> 4;
 		if (muxdata->msgid == 0 || muxdata->msgid > MUX_MAX_MSG_NUM) {
 		    proto_err_str = "msgid out of range";
 		    goto protocol_err;
@@ -2211,7 +3399,8 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 
 	    /* We have the whole header now. */
 	    used = muxdata->hdr_size - muxdata->hdr_pos;
-	    memcpy(muxdata->hdr + muxdata->hdr_pos, buf, used);
+	    if (used)
+		memcpy(muxdata->hdr + muxdata->hdr_pos, buf, used);
 	    muxdata->hdr_pos = 0;
 
 	    if (muxdata->msgid == MUX_INIT) {
@@ -2219,6 +3408,11 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		    proto_err_str = "Init when already initialized";
 		    goto protocol_err;
 		}
+		muxdata->version = muxdata->hdr[2];
+		if (muxdata->version > muxdata->max_version)
+		    muxdata->version = muxdata->max_version;
+		muxdata->delay_acks = (muxdata->version >= 3 &&
+				       muxdata->hdr[1] & MUX_INIT_FLAG_DELAY_ACKS);
 		if (gensio_list_empty(&muxdata->openchans)) {
 		    mux_set_state(muxdata, MUX_WAITING_OPEN);
 		    goto more_data;
@@ -2256,13 +3450,16 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		muxdata->curr_chan = chan;
 		if (chan) {
 		    muxc_set_state(chan, MUX_INST_PENDING_OPEN);
-		    chan->send_window_size =
-			gensio_buf_to_u32(muxdata->hdr + 4);
+		    chan_set_send_window(chan,
+					 gensio_buf_to_u32(muxdata->hdr + 4));
 		    if (chan->send_window_size <= MUX_MIN_SEND_WINDOW_SIZE) {
 			proto_err_str = "Invalid send window size";
 			goto protocol_err;
 		    }
-		    chan->remote_id = remote_id;
+		    if (mux_set_remote_id(muxdata, chan, remote_id)) {
+			ierr = GE_NOMEM;
+			goto out_err;
+		    }
 		    muxdata->data_pos = 0;
 		    muxdata->in_hdr = false; /* Receive the service data */
 		}
@@ -2287,14 +3484,17 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		    proto_err_str = "New channel response in bad state";
 		    goto protocol_err;
 		}
-		chan->remote_id = gensio_buf_to_u16(muxdata->hdr + 8);
-		chan->send_window_size = gensio_buf_to_u32(muxdata->hdr + 4);
+		if (mux_set_remote_id(muxdata, chan,
+				      gensio_buf_to_u16(muxdata->hdr + 8))) {
+		    ierr = GE_NOMEM;
+		    goto out_err;
+		}
+		chan_set_send_window(chan, gensio_buf_to_u32(muxdata->hdr + 4));
 		if (chan->send_window_size <= MUX_MIN_SEND_WINDOW_SIZE) {
 		    proto_err_str = "Invalid send window size";
 		    goto protocol_err;
 		}
 		chan->errcode = gensio_buf_to_u16(muxdata->hdr + 10);
-		muxdata->sending_chan = NULL;
 
 		assert(muxdata->opencount > 0);
 		muxdata->opencount--;
@@ -2361,7 +3561,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		    chan_sched_deferred_op(chan);
 		}
 		/* If we receive a close, don't send any more data. */
-		chan->write_data_len = 0;
+		chan_clear_wrbuf(chan);
 		break;
 
 	    case MUX_DATA:
@@ -2384,13 +3584,54 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		    goto protocol_err;
 		}
 		chan->sent_unacked -= acked;
-		if (acked > 0 && chan->write_data_len)
+		if (acked > 0 && chan_write_queued(chan))
 		    muxc_add_to_wrlist(chan);
+		muxdata->rx_data_id = chan->id;
+		muxdata->rx_data_id_valid = true;
 		muxdata->curr_chan = chan;
 		muxdata->data_pos = 0;
 		muxdata->in_hdr = false; /* Receive the data */
 		break;
 
+	    case MUX_WINDOW: {
+		gensiods window = gensio_buf_to_u32(muxdata->hdr + 4);
+
+		if (muxdata->version < 2) {
+		    proto_err_str = "Window message before version 2";
+		    goto protocol_err;
+		}
+		chan = mux_get_channel(muxdata);
+		if (!chan) {
+		    proto_err_str = "No channel on window";
+		    goto protocol_err;
+		}
+		if (chan->state == MUX_INST_CLOSED ||
+			chan->state == MUX_INST_IN_OPEN ||
+			chan->state == MUX_INST_IN_OPEN_CLOSE ||
+			chan->state == MUX_INST_IN_CLOSE_FINAL ||
+			chan->state == MUX_INST_IN_REM_CLOSE) {
+		    proto_err_str = "Invalid channel state on window";
+		    goto protocol_err;
+		}
+		if (muxdata->hdr[1] & MUX_WINDOW_FLAG_ACK) {
+		    /* An ack for an older window doesn't count. */
+		    if (window == chan->read_window) {
+			chan->read_window_acked = true;
+			chan_check_shrink_rdbuf(chan);
+		    }
+		    break;
+		}
+		if (window <= MUX_MIN_SEND_WINDOW_SIZE) {
+		    proto_err_str = "Invalid send window size";
+		    goto protocol_err;
+		}
+		chan_set_send_window(chan, window);
+		chan->send_window_ack = true;
+		/* Also sends more data if the window grew. */
+		muxc_add_to_wrlist(chan);
+		break;
+	    }
+
 	    default:
 		abort();
 	    }
@@ -2435,14 +3676,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		case MUX_DATA:
 		    if (muxdata->data_size == 0)
 			goto handle_read_no_data;
-		    if (chan_rdbufleft(chan) < muxdata->data_size + 3) {
-			proto_err_str = "Too much data from remote end";
-			goto protocol_err;
-		    }
-		    /* Add the message flags first. */
-		    chan_addrdbyte(chan, muxdata->hdr[1]);
-		    chan_addrdbyte(chan, muxdata->data_size >> 8);
-		    chan_addrdbyte(chan, muxdata->data_size & 0xff);
+		    /* Data is handled when the first of it arrives. */
 		    break;
 
 		default:
@@ -2488,7 +3722,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		     */
 		    mux_set_state(muxdata, MUX_OPEN);
 		    mux_send_new_channel_rsp(muxdata, chan->remote_id,
-					     chan->max_read_size,
+					     chan->read_window,
 					     chan->id, 0);
 		    if (muxdata->acc_open_done) {
 			mux_unlock(muxdata);
@@ -2506,7 +3740,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 			goto protocol_err;
 		    }
 		    mux_send_new_channel_rsp(muxdata, chan->remote_id,
-					     chan->max_read_size,
+					     chan->read_window,
 					     chan->id, 0);
 		    if (chan->service_len) {
 			/* Ack the service data. */
@@ -2525,6 +3759,34 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 		goto more_data;
 
 	    case MUX_DATA:
+		if (muxdata->data_pos == 2) {
+		    unsigned char flags =
+			muxdata->hdr[1] & ~MUX_FLAG_WINDOW_LIMITED;
+
+		    if (chan_rdbufleft(chan) < muxdata->data_size + 3) {
+			proto_err_str = "Too much data from remote end";
+			goto protocol_err;
+		    }
+		    chan_check_grow_window(chan,
+				muxdata->hdr[1] & MUX_FLAG_WINDOW_LIMITED,
+				muxdata->data_size + 3);
+		    if (muxdata->hdr[1] & MUX_FLAG_WINDOW_LIMITED)
+			chan->ack_due = true;
+		    chan->msgs_in++;
+		    chan->bytes_in += muxdata->data_size;
+		    if (buflen >= muxdata->data_size &&
+				chan_read_direct_ok(chan)) {
+			/* The whole message is here, skip the read buffer. */
+			chan_ref(chan);
+			chan_read_direct(chan, flags, buf, muxdata->data_size);
+			used = muxdata->data_size;
+			goto handle_read_reffed;
+		    }
+		    /* Add the message flags first. */
+		    chan_addrdbyte(chan, flags);
+		    chan_addrdbyte(chan, muxdata->data_size >> 8);
+		    chan_addrdbyte(chan, muxdata->data_size & 0xff);
+		}
 		if (buflen + muxdata->data_pos < muxdata->data_size + 2) {
 		    /* Not all data received yet. */
 		    chan_addrdbuf(chan, buf, buflen);
@@ -2537,6 +3799,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 
 	    handle_read_no_data:
 		chan_ref(chan);
+	    handle_read_reffed:
 		chan_check_send_more(chan);
 		if (muxdata->data_size)
 		    chan_check_read(chan);
@@ -2557,6 +3820,7 @@ mux_child_read(struct mux_data *muxdata, int ierr,
 
  protocol_err:
     gmux_log_err(muxdata, "Protocol error: %s\n", proto_err_str);
+    muxdata->hdr_errors++;
     ierr = GE_PROTOERR;
  out_err:
     gensio_set_read_callback_enable(muxdata->child, false);
@@ -2604,10 +3868,13 @@ mux_gensio_alloc_data(struct gensio *child, struct gensio_mux_config *data,
 {
     struct gensio_os_funcs *o = data->o;
     struct mux_data *muxdata;
+    unsigned int i;
     int rv;
 
     if (data->max_write_size < MUX_MIN_SEND_WINDOW_SIZE ||
-		data->max_read_size < MUX_MIN_SEND_WINDOW_SIZE)
+		data->max_read_size < MUX_MIN_SEND_WINDOW_SIZE ||
+		data->max_read_size > UINT32_MAX ||
+		data->max_read_window > UINT32_MAX)
 	return GE_INVAL;
 
     muxdata = o->zalloc(o, sizeof(*muxdata));
@@ -2622,13 +3889,43 @@ mux_gensio_alloc_data(struct gensio *child, struct gensio_mux_config *data,
     muxdata->in_hdr = true;
     muxdata->max_write_size = data->max_write_size;
     muxdata->max_read_size = data->max_read_size;
+    muxdata->max_read_window = data->max_read_window;
+    if (muxdata->max_read_window < muxdata->max_read_size)
+	muxdata->max_read_window = muxdata->max_read_size;
+    muxdata->version = 1;
+    muxdata->max_version = data->max_version;
+    if (!muxdata->max_version)
+	muxdata->max_version = MUX_PROTOCOL_VERSION;
     muxdata->max_channels = data->max_channels;
     gensio_list_init(&muxdata->chans);
     gensio_list_init(&muxdata->openchans);
-    gensio_list_init(&muxdata->wrchans);
+    gensio_list_init(&muxdata->ack_chans);
+    gensio_list_init(&muxdata->window_chans);
+    for (i = 0; i < MUX_NR_PRIORITIES; i++) {
+	gensio_list_init(&muxdata->wrchans[i].active);
+	gensio_list_init(&muxdata->wrchans[i].next);
+    }
+    muxdata->id_table = o->zalloc(o, sizeof(*muxdata->id_table) *
+				  data->max_channels);
+    if (!muxdata->id_table)
+	goto out_nomem;
+    muxdata->id_map = o->zalloc(o, sizeof(*muxdata->id_map) *
+				((data->max_channels + 31) / 32));
+    if (!muxdata->id_map)
+	goto out_nomem;
     muxdata->lock = o->alloc_lock(o);
     if (!muxdata->lock)
 	goto out_nomem;
+    if (muxdata->max_read_window > muxdata->max_read_size) {
+	muxdata->window_timer = o->alloc_timer(o, mux_window_timeout, muxdata);
+	if (!muxdata->window_timer)
+	    goto out_nomem;
+    }
+    if (muxdata->max_version >= 3) {
+	muxdata->ack_timer = o->alloc_timer(o, mux_ack_timeout, muxdata);
+	if (!muxdata->ack_timer)
+	    goto out_nomem;
+    }
     gensio_set_callback(child, mux_child_cb, muxdata);
 
     /* Set up to send the init message. */
@@ -2649,6 +3946,16 @@ mux_gensio_alloc_data(struct gensio *child, struct gensio_mux_config *data,
 	chan_deref(gensio_container_of(
 				gensio_list_first(&muxdata->chans),
 				struct mux_inst, link));
+    if (muxdata->id_table)
+	o->free(o, muxdata->id_table);
+    if (muxdata->id_map)
+	o->free(o, muxdata->id_map);
+    if (muxdata->rid_table)
+	o->free(o, muxdata->rid_table);
+    if (muxdata->window_timer)
+	o->free_timer(muxdata->window_timer);
+    if (muxdata->ack_timer)
+	o->free_timer(muxdata->ack_timer);
     if (muxdata->lock)
 	o->free_lock(muxdata->lock);
     o->free(o, muxdata);
@@ -2680,6 +3987,7 @@ mux_gensio_alloc(struct gensio *child, const char *const args[],
     if (err)
 	return err;
     data.max_channels = ival;
+    data.weight = 1;
     data.is_client = true;
     err = get_default_mode(o, &data.is_client);
     if (err)
@@ -2828,6 +4136,7 @@ mux_gensio_accepter_alloc(struct gensio_accepter *child,
 	return err;
     }
     nadata->data.max_channels = ival;
+    nadata->data.weight = 1;
     nadata->data.is_client = false;
     err = get_default_mode(o, &nadata->data.is_client);
     if (err) {
@@ -32,6 +32,19 @@
 #include <gensio/gensio_osops.h>
 #include <gensio/gensio_builtins.h>
 
+/*
+ * A parallel connection attempt to an address other than the one the
+ * fd ll is currently waiting on.  See the connection racing comment
+ * below.
+ */
+struct net_attempt {
+    struct gensio_link link;
+    struct net_data *tdata;
+    int fd;
+    unsigned int pos; /* Position in the address list. */
+    bool clearing; /* fd handlers being cleared, fd closed when done. */
+};
+
 struct net_data {
     struct gensio_os_funcs *o;
 
@@ -42,58 +55,370 @@ struct net_data {
 
     bool nodelay;
 
+    struct gensio_sockopts sockopts;
+
     bool istcp;
 
     int last_err;
 
     int oob_char;
+
+    /*
+     * Connection racing (RFC 8305 "happy eyeballs") for connecting
+     * gensios with more than one remote address.  The fd ll waits on
+     * one connection attempt, and every NET_CONN_ATTEMPT_DELAY
+     * another address is tried in parallel without waiting for the
+     * previous ones to fail.  Addresses are tried alternating
+     * between address families.  If one of the parallel attempts
+     * completes first, it is handed to the fd ll through
+     * retry_open() and everything else is cancelled.
+     *
+     * Everything below is protected by lock.
+     */
+    struct gensio_lock *lock;
+    struct gensio_addr *raceai; /* Iterator for parallel attempts. */
+    unsigned int nr_addrs;
+    unsigned int *addr_order;
+    unsigned int next_attempt; /* Index into addr_order. */
+    struct gensio_list attempts;
+    struct gensio_timer *attempt_timer;
+    bool attempt_timer_running;
+    bool racing;
+    int winner_fd;
+    unsigned int winner_pos;
+    bool freed;
+    bool close_waiting; /* The fd ll close waits for the attempts. */
+
+    /*
+     * With asyncresolve, the remote address string is looked up when
+     * the gensio is opened, ai is NULL until then.  open_pending is
+     * set if the fd ll is waiting for the lookup to start the
+     * connection.
+     */
+    char *resolve_str;
+    bool resolving;
+    bool open_pending;
 };
 
-static int net_check_open(void *handler_data, int fd)
-{
-    struct net_data *tdata = handler_data;
+/* RFC 8305 recommended Connection Attempt Delay. */
+#define NET_CONN_ATTEMPT_DELAY_US 250000
 
-    tdata->last_err = gensio_os_check_socket_open(tdata->o, fd);
-    return tdata->last_err;
+static void net_finish_free(struct net_data *tdata);
+static void net_attempt_ready(int fd, void *cb_data);
+static void net_resolve_done(struct gensio_os_funcs *o, int err,
+			     struct gensio_addr *addr, void *cb_data);
+static int net_set_addr(struct net_data *tdata, struct gensio_addr *addr);
+
+static void
+net_addr_seek(struct gensio_addr *addr, unsigned int pos)
+{
+    gensio_addr_rewind(addr);
+    while (pos-- > 0)
+	gensio_addr_next(addr);
 }
 
 static int
-net_try_open(struct net_data *tdata, int *fd)
+net_open_addr(struct net_data *tdata, struct gensio_addr *addr, int *fd)
 {
-    int new_fd = -1, err = GE_INUSE;
+    int new_fd = -1, err;
     int protocol = tdata->istcp ? GENSIO_NET_PROTOCOL_TCP
 				: GENSIO_NET_PROTOCOL_UNIX;
 
-    err = gensio_os_socket_open(tdata->o, tdata->ai, protocol, &new_fd);
+    err = gensio_os_socket_open(tdata->o, addr, protocol, &new_fd);
     if (err)
-	goto out;
+	return err;
 
-    err = gensio_os_socket_setup(tdata->o, new_fd, protocol, tdata->istcp,
-				 tdata->nodelay, GENSIO_OPENSOCK_REUSEADDR,
-				 tdata->lai);
-    if (err)
-	goto out;
+    err = gensio_os_socket_setup_opts(tdata->o, new_fd, protocol,
+				      tdata->istcp, tdata->nodelay,
+				      tdata->istcp ? &tdata->sockopts : NULL,
+				      GENSIO_OPENSOCK_REUSEADDR, tdata->lai);
+    if (!err)
+	err = gensio_os_connect(tdata->o, new_fd, addr);
+    if (err && err != GE_INPROGRESS) {
+	gensio_os_close(tdata->o, &new_fd);
+	return err;
+    }
+
+    *fd = new_fd;
+    return err;
+}
 
- retry:
-    err = gensio_os_connect(tdata->o, new_fd, tdata->ai);
-    if (err == GE_INPROGRESS) {
-	*fd = new_fd;
-	goto out_return;
+static bool
+net_attempts_done(struct net_data *tdata)
+{
+    return gensio_list_empty(&tdata->attempts) &&
+	!tdata->attempt_timer_running && !tdata->resolving;
+}
+
+/*
+ * If a close is waiting for the attempts to finish and they have,
+ * return true to have the caller continue the close after releasing
+ * the lock.  Called with the lock held.
+ */
+static bool
+net_close_ready(struct net_data *tdata)
+{
+    if (!tdata->close_waiting || !net_attempts_done(tdata))
+	return false;
+    tdata->close_waiting = false;
+    return true;
+}
+
+/* Must be called with the handlers cleared.  Called with no locks. */
+static void
+net_attempt_cleared(int fd, void *cb_data)
+{
+    struct net_attempt *a = cb_data;
+    struct net_data *tdata = a->tdata;
+    bool do_free, do_continue;
+
+    gensio_os_close(tdata->o, &a->fd);
+
+    tdata->o->lock(tdata->lock);
+    gensio_list_rm(&tdata->attempts, &a->link);
+    do_free = tdata->freed && net_attempts_done(tdata);
+    do_continue = net_close_ready(tdata);
+    tdata->o->unlock(tdata->lock);
+
+    tdata->o->free(tdata->o, a);
+    if (do_free)
+	net_finish_free(tdata);
+    else if (do_continue)
+	gensio_fd_ll_close_continue(tdata->ll);
+}
+
+static void
+net_attempt_cancel(struct net_attempt *a)
+{
+    if (!a->clearing) {
+	a->clearing = true;
+	a->tdata->o->clear_fd_handlers(a->tdata->o, a->fd);
     }
+}
 
-    if (err) {
-	if (gensio_addr_next(tdata->ai))
-	    goto retry;
+static void
+net_attempt_timer_stopped(struct gensio_timer *t, void *cb_data)
+{
+    struct net_data *tdata = cb_data;
+    bool do_free, do_continue;
+
+    tdata->o->lock(tdata->lock);
+    tdata->attempt_timer_running = false;
+    do_free = tdata->freed && net_attempts_done(tdata);
+    do_continue = net_close_ready(tdata);
+    tdata->o->unlock(tdata->lock);
+
+    if (do_free)
+	net_finish_free(tdata);
+    else if (do_continue)
+	gensio_fd_ll_close_continue(tdata->ll);
+}
+
+/*
+ * Stop all the parallel connection attempts, but leave any winner
+ * alone.  Called with the lock held.
+ */
+static void
+net_stop_racing(struct net_data *tdata)
+{
+    struct gensio_link *l;
+
+    tdata->racing = false;
+    /*
+     * If this fails, the timeout handler is already running and will
+     * clear attempt_timer_running itself.
+     */
+    if (tdata->attempt_timer_running)
+	tdata->o->stop_timer_with_done(tdata->attempt_timer,
+				       net_attempt_timer_stopped, tdata);
+    gensio_list_for_each(&tdata->attempts, l) {
+	struct net_attempt *a = gensio_container_of(l, struct net_attempt,
+						    link);
+
+	net_attempt_cancel(a);
     }
- out:
+}
+
+static void
+net_close_winner(struct net_data *tdata)
+{
+    if (tdata->winner_fd != -1)
+	gensio_os_close(tdata->o, &tdata->winner_fd);
+}
+
+static void
+net_start_attempt_timer(struct net_data *tdata)
+{
+    gensio_time timeout = { 0, NET_CONN_ATTEMPT_DELAY_US * 1000 };
+
+    if (tdata->racing && !tdata->attempt_timer_running &&
+		tdata->next_attempt < tdata->nr_addrs) {
+	if (tdata->o->start_timer(tdata->attempt_timer, &timeout) == 0)
+	    tdata->attempt_timer_running = true;
+    }
+}
+
+/*
+ * Start a parallel connection attempt on the next address that can
+ * be started.  Called with the lock held.
+ */
+static void
+net_start_next_attempt(struct net_data *tdata)
+{
+    struct gensio_os_funcs *o = tdata->o;
+    struct net_attempt *a;
+    unsigned int pos;
+    int err, fd = -1;
+
+    while (tdata->next_attempt < tdata->nr_addrs) {
+	pos = tdata->addr_order[tdata->next_attempt++];
+	net_addr_seek(tdata->raceai, pos);
+	err = net_open_addr(tdata, tdata->raceai, &fd);
+	if (err && err != GE_INPROGRESS) {
+	    tdata->last_err = err;
+	    continue;
+	}
+
+	a = o->zalloc(o, sizeof(*a));
+	if (!a) {
+	    gensio_os_close(o, &fd);
+	    tdata->last_err = GE_NOMEM;
+	    return;
+	}
+	a->tdata = tdata;
+	a->fd = fd;
+	a->pos = pos;
+	if (o->set_fd_handlers(o, fd, a, NULL, net_attempt_ready,
+			       net_attempt_ready, net_attempt_cleared)) {
+	    gensio_os_close(o, &fd);
+	    o->free(o, a);
+	    tdata->last_err = GE_NOMEM;
+	    return;
+	}
+	gensio_list_add_tail(&tdata->attempts, &a->link);
+	o->set_write_handler(o, fd, true);
+	o->set_except_handler(o, fd, true);
+	return;
+    }
+}
+
+static void
+net_attempt_ready(int fd, void *cb_data)
+{
+    struct net_attempt *a = cb_data;
+    struct net_data *tdata = a->tdata;
+    bool do_retry = false;
+    int err;
+
+    tdata->o->lock(tdata->lock);
+    if (a->clearing)
+	goto out_unlock;
+    tdata->o->set_write_handler(tdata->o, a->fd, false);
+    tdata->o->set_except_handler(tdata->o, a->fd, false);
+
+    err = gensio_os_check_socket_open(tdata->o, a->fd);
+    if (!err && tdata->racing && tdata->winner_fd == -1) {
+	err = gensio_os_dup(tdata->o, a->fd, &tdata->winner_fd);
+	if (!err) {
+	    tdata->winner_pos = a->pos;
+	    net_stop_racing(tdata);
+	    do_retry = true;
+	}
+    }
+    net_attempt_cancel(a);
+
     if (err) {
-	if (new_fd != -1)
-	    gensio_os_close(tdata->o, &new_fd);
-    } else {
-	*fd = new_fd;
+	tdata->last_err = err;
+	/* Don't wait for the delay when one fails, start the next now. */
+	if (tdata->racing) {
+	    if (tdata->attempt_timer_running &&
+		    tdata->o->stop_timer(tdata->attempt_timer) == 0)
+		tdata->attempt_timer_running = false;
+	    if (!tdata->attempt_timer_running) {
+		net_start_next_attempt(tdata);
+		net_start_attempt_timer(tdata);
+	    }
+	}
     }
+ out_unlock:
+    tdata->o->unlock(tdata->lock);
+
+    if (do_retry)
+	gensio_fd_ll_retry_open(tdata->ll);
+}
+
+static void
+net_attempt_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct net_data *tdata = cb_data;
+    bool do_free, do_continue;
+
+    tdata->o->lock(tdata->lock);
+    tdata->attempt_timer_running = false;
+    if (tdata->racing) {
+	net_start_next_attempt(tdata);
+	net_start_attempt_timer(tdata);
+    }
+    do_free = tdata->freed && net_attempts_done(tdata);
+    do_continue = net_close_ready(tdata);
+    tdata->o->unlock(tdata->lock);
+
+    if (do_free)
+	net_finish_free(tdata);
+    else if (do_continue)
+	gensio_fd_ll_close_continue(tdata->ll);
+}
+
+static int net_check_open(void *handler_data, int fd)
+{
+    struct net_data *tdata = handler_data;
+
+    tdata->last_err = gensio_os_check_socket_open(tdata->o, fd);
+    if (!tdata->last_err) {
+	tdata->o->lock(tdata->lock);
+	net_stop_racing(tdata);
+	net_close_winner(tdata);
+	tdata->o->unlock(tdata->lock);
+    }
+    return tdata->last_err;
+}
+
+/*
+ * Open a socket on the next address the fd ll can wait on.  Called
+ * with the lock held.
+ */
+static int
+net_try_open(struct net_data *tdata, int *fd)
+{
+    unsigned int pos;
+    int err;
+
+    while (tdata->next_attempt < tdata->nr_addrs) {
+	pos = tdata->addr_order[tdata->next_attempt++];
+	net_addr_seek(tdata->ai, pos);
+	err = net_open_addr(tdata, tdata->ai, fd);
+	if (!err || err == GE_INPROGRESS)
+	    return err;
+	tdata->last_err = err;
+    }
+
+    return tdata->last_err;
+}
+
+/* Start connecting to the first address.  Called with the lock held. */
+static int
+net_start_open(struct net_data *tdata, int *fd)
+{
+    int err;
+
+    tdata->next_attempt = 0;
+    tdata->racing = tdata->nr_addrs > 1;
+    err = net_try_open(tdata, fd);
+    if (err == GE_INPROGRESS)
+	net_start_attempt_timer(tdata);
+    else
+	net_stop_racing(tdata);
 
- out_return:
     return err;
 }
 
@@ -101,33 +426,158 @@ static int
 net_retry_open(void *handler_data, int *fd)
 {
     struct net_data *tdata = handler_data;
+    struct gensio_link *l;
+    int err;
+
+    tdata->o->lock(tdata->lock);
+    if (tdata->open_pending) {
+	/* The lookup finished. */
+	tdata->open_pending = false;
+	if (tdata->ai)
+	    err = net_start_open(tdata, fd);
+	else
+	    err = tdata->last_err;
+	goto out_unlock;
+    }
 
-    if (!gensio_addr_next(tdata->ai))
-	return tdata->last_err;
-    return net_try_open(tdata, fd);
+    if (tdata->winner_fd != -1) {
+	*fd = tdata->winner_fd;
+	tdata->winner_fd = -1;
+	net_addr_seek(tdata->ai, tdata->winner_pos);
+	err = GE_INPROGRESS;
+	goto out_unlock;
+    }
+
+    err = net_try_open(tdata, fd);
+    if (!err || err == GE_INPROGRESS) {
+	net_start_attempt_timer(tdata);
+	goto out_unlock;
+    }
+
+    /*
+     * Nothing left to try, let the fd ll wait on one of the parallel
+     * attempts that is still going.
+     */
+    gensio_list_for_each(&tdata->attempts, l) {
+	struct net_attempt *a = gensio_container_of(l, struct net_attempt,
+						    link);
+
+	if (a->clearing)
+	    continue;
+	if (gensio_os_dup(tdata->o, a->fd, fd))
+	    continue;
+	net_addr_seek(tdata->ai, a->pos);
+	net_attempt_cancel(a);
+	err = GE_INPROGRESS;
+	goto out_unlock;
+    }
+    net_stop_racing(tdata);
+
+ out_unlock:
+    tdata->o->unlock(tdata->lock);
+    return err;
 }
 
 static int
 net_sub_open(void *handler_data, int *fd)
 {
     struct net_data *tdata = handler_data;
+    struct gensio_addr *addr;
+    int err;
+
+    tdata->o->lock(tdata->lock);
+    tdata->open_pending = false;
+    if (!tdata->ai) {
+	/* Don't block on the lookup, the fd ll waits with no fd. */
+	tdata->open_pending = true;
+	if (tdata->resolving) {
+	    err = GE_INPROGRESS;
+	    goto out_unlock;
+	}
+	err = gensio_os_scan_netaddr_async(tdata->o, tdata->resolve_str,
+					   false, GENSIO_NET_PROTOCOL_TCP,
+					   net_resolve_done, tdata, &addr);
+	if (err == GE_INPROGRESS)
+	    tdata->resolving = true;
+	if (err)
+	    goto out_unlock;
+	tdata->open_pending = false;
+	err = net_set_addr(tdata, addr);
+	if (err)
+	    goto out_unlock;
+    }
+    err = net_start_open(tdata, fd);
+ out_unlock:
+    tdata->o->unlock(tdata->lock);
 
-    gensio_addr_rewind(tdata->ai);
-    return net_try_open(tdata, fd);
+    return err;
 }
 
-static void
-net_free(void *handler_data)
+static int
+net_check_close(void *handler_data, enum gensio_ll_close_state state,
+		gensio_time *next_timeout)
 {
     struct net_data *tdata = handler_data;
+    int err = 0;
+
+    tdata->o->lock(tdata->lock);
+    if (state == GENSIO_LL_CLOSE_STATE_START) {
+	net_stop_racing(tdata);
+	net_close_winner(tdata);
+    } else if (!net_attempts_done(tdata)) {
+	/*
+	 * Wait for the parallel connection attempts to finish closing,
+	 * whatever finishes last continues the close.
+	 */
+	tdata->close_waiting = true;
+	next_timeout->secs = -1;
+	next_timeout->nsecs = 0;
+	err = GE_INPROGRESS;
+    }
+    tdata->o->unlock(tdata->lock);
 
+    return err;
+}
+
+static void
+net_finish_free(struct net_data *tdata)
+{
     if (tdata->ai)
 	gensio_addr_free(tdata->ai);
     if (tdata->lai)
 	gensio_addr_free(tdata->lai);
+    if (tdata->raceai)
+	gensio_addr_free(tdata->raceai);
+    if (tdata->resolve_str)
+	tdata->o->free(tdata->o, tdata->resolve_str);
+    if (tdata->addr_order)
+	tdata->o->free(tdata->o, tdata->addr_order);
+    if (tdata->attempt_timer)
+	tdata->o->free_timer(tdata->attempt_timer);
+    if (tdata->lock)
+	tdata->o->free_lock(tdata->lock);
     tdata->o->free(tdata->o, tdata);
 }
 
+static void
+net_free(void *handler_data)
+{
+    struct net_data *tdata = handler_data;
+    bool done = true;
+
+    if (tdata->lock) {
+	tdata->o->lock(tdata->lock);
+	tdata->freed = true;
+	net_stop_racing(tdata);
+	net_close_winner(tdata);
+	done = net_attempts_done(tdata);
+	tdata->o->unlock(tdata->lock);
+    }
+
+    if (done)
+	net_finish_free(tdata);
+}
+
 static int
 net_control(void *handler_data, int fd, bool get, unsigned int option,
 	    char *data, gensiods *datalen)
@@ -164,6 +614,12 @@ net_control(void *handler_data, int fd, bool get, unsigned int option,
 	}
 	return 0;
 
+    case GENSIO_CONTROL_SOCKOPT:
+	if (!tdata->istcp)
+	    return GE_NOTSUP;
+	return gensio_os_sockopt_control(tdata->o, fd, GENSIO_NET_PROTOCOL_TCP,
+					 &tdata->sockopts, get, data, datalen);
+
     case GENSIO_CONTROL_LADDR:
 	if (!get)
 	    return GE_NOTSUP;
@@ -190,6 +646,8 @@ net_control(void *handler_data, int fd, bool get, unsigned int option,
 
 	if (strtoul(data, NULL, 0) > 0)
 	    return GE_NOTFOUND;
+	if (!tdata->ai)
+	    return GE_NOTREADY;
 
 	pos = 0;
 	rv = gensio_addr_to_str(tdata->ai, data, &pos, *datalen);
@@ -202,6 +660,8 @@ net_control(void *handler_data, int fd, bool get, unsigned int option,
     case GENSIO_CONTROL_RADDR_BIN:
 	if (!get)
 	    return GE_NOTSUP;
+	if (!tdata->ai)
+	    return GE_NOTREADY;
 	gensio_addr_getaddr(tdata->ai, data, datalen);
 	return 0;
 
@@ -223,6 +683,7 @@ net_read(int fd, void *data, gensiods count, gensiods *rcount,
 {
     struct net_data *tdata = cb_data;
     static const char *argv[3] = { "oob", "oobtcp", NULL };
+    int rv;
 
     if (tdata->oob_char >= 0) {
 	*auxdata = argv;
@@ -236,7 +697,14 @@ net_read(int fd, void *data, gensiods count, gensiods *rcount,
 	return 0;
     }
 
-    return gensio_os_recv(tdata->o, fd, data, count, rcount, 0);
+    rv = gensio_os_recv(tdata->o, fd, data, count, rcount, 0);
+    /*
+     * The kernel may turn quickack off, turn it back on after data
+     * came in.  Not before every read, that would double the calls.
+     */
+    if (!rv && *rcount && tdata->sockopts.quickack)
+	gensio_os_set_quickack(tdata->o, fd, 1);
+    return rv;
 }
 
 static void
@@ -295,23 +763,129 @@ static const struct gensio_fd_ll_ops net_fd_ll_ops = {
     .sub_open = net_sub_open,
     .check_open = net_check_open,
     .retry_open = net_retry_open,
+    .check_close = net_check_close,
     .free = net_free,
     .control = net_control,
     .except_ready = net_except_ready,
     .write = net_write
 };
 
+/*
+ * Set up the connection racing data.  The addresses are tried
+ * alternating between the family of the first address and the other
+ * families.
+ */
 static int
-net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
-		 struct gensio_os_funcs *o,
-		 gensio_event cb, void *user_data, const char *type,
-		 struct gensio **new_gensio)
+net_setup_racing(struct net_data *tdata, struct gensio_addr *addr)
+{
+    struct gensio_os_funcs *o = tdata->o;
+    unsigned int i, j = 0, k = 0, n = 1, *fam;
+    unsigned int nsame = 0, nother = 0;
+    bool use_same = true;
+    int family;
+
+    gensio_addr_rewind(addr);
+    while (gensio_addr_next(addr))
+	n++;
+
+    tdata->addr_order = o->zalloc(o, sizeof(unsigned int) * n);
+    if (!tdata->addr_order)
+	return GE_NOMEM;
+    if (n == 1)
+	goto out;
+
+    tdata->attempt_timer = o->alloc_timer(o, net_attempt_timeout, tdata);
+    if (!tdata->attempt_timer)
+	return GE_NOMEM;
+    tdata->raceai = gensio_addr_dup(addr);
+    if (!tdata->raceai)
+	return GE_NOMEM;
+
+    /* The first family goes at the start, the others at the end. */
+    fam = o->zalloc(o, sizeof(unsigned int) * n);
+    if (!fam)
+	return GE_NOMEM;
+    gensio_addr_rewind(addr);
+    family = gensio_addr_get_nettype(addr);
+    for (i = 0; i < n; i++) {
+	if (gensio_addr_get_nettype(addr) == family)
+	    fam[nsame++] = i;
+	else
+	    fam[n - ++nother] = i;
+	gensio_addr_next(addr);
+    }
+    for (i = 0; i < n; i++) {
+	if (k >= nother || (use_same && j < nsame))
+	    tdata->addr_order[i] = fam[j++];
+	else
+	    tdata->addr_order[i] = fam[n - ++k];
+	use_same = !use_same;
+    }
+    o->free(o, fam);
+
+ out:
+    gensio_addr_rewind(addr);
+    /* Set this last, nothing is tried until it is set. */
+    tdata->nr_addrs = n;
+    return 0;
+}
+
+/* Called with the lock held. */
+static int
+net_set_addr(struct net_data *tdata, struct gensio_addr *addr)
+{
+    int err;
+
+    tdata->ai = addr;
+    err = net_setup_racing(tdata, addr);
+    if (err) {
+	gensio_addr_free(tdata->ai);
+	tdata->ai = NULL;
+    }
+    return err;
+}
+
+static void
+net_resolve_done(struct gensio_os_funcs *o, int err, struct gensio_addr *addr,
+		 void *cb_data)
+{
+    struct net_data *tdata = cb_data;
+    bool do_free, do_continue;
+
+    o->lock(tdata->lock);
+    tdata->resolving = false;
+    if (!err)
+	err = net_set_addr(tdata, addr);
+    tdata->last_err = err;
+    do_free = tdata->freed && net_attempts_done(tdata);
+    do_continue = net_close_ready(tdata);
+    o->unlock(tdata->lock);
+
+    if (do_free)
+	net_finish_free(tdata);
+    else if (do_continue)
+	gensio_fd_ll_close_continue(tdata->ll);
+    else
+	gensio_fd_ll_retry_open(tdata->ll);
+}
+
+/*
+ * If iai is NULL, resolve_str is the remote address string to look up
+ * at open time.
+ */
+static int
+i_net_gensio_alloc(struct gensio_addr *iai, const char *resolve_str,
+		   const char * const args[],
+		   struct gensio_os_funcs *o,
+		   gensio_event cb, void *user_data, const char *type,
+		   struct gensio **new_gensio)
 {
     struct net_data *tdata = NULL;
     struct gensio_addr *laddr = NULL, *laddr2, *addr = NULL;
     struct gensio *io;
     gensiods max_read_size = GENSIO_DEFAULT_BUF_SIZE;
-    bool nodelay = false;
+    bool nodelay = false, asyncresolve;
+    struct gensio_sockopts sockopts;
     unsigned int i;
     int ival;
     int err;
@@ -323,6 +897,13 @@ net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
 	return err;
     nodelay = ival;
 
+    memset(&sockopts, 0, sizeof(sockopts));
+    if (istcp) {
+	err = gensio_get_default_sockopts(o, type, &sockopts);
+	if (err)
+	    return err;
+    }
+
     err = gensio_get_defaultaddr(o, type, "laddr", false,
 				 GENSIO_NET_PROTOCOL_TCP, true, false, &laddr);
     if (err && err != GE_NOTSUP) {
@@ -344,6 +925,12 @@ net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
 	}
 	if (istcp && gensio_check_keybool(args[i], "nodelay", &nodelay) > 0)
 	    continue;
+	if (istcp && gensio_check_sockopt(args[i], &sockopts) > 0)
+	    continue;
+	/* Handled in str_to_net_gensio(). */
+	if (istcp && gensio_check_keybool(args[i], "asyncresolve",
+					  &asyncresolve) > 0)
+	    continue;
 	return GE_INVAL;
     }
 
@@ -354,12 +941,29 @@ net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
     tdata->istcp = istcp;
     tdata->oob_char = -1;
 
-    addr = gensio_addr_dup(iai);
-    if (!addr)
-	goto out_nomem;
-
     tdata->o = o;
     tdata->nodelay = nodelay;
+    tdata->sockopts = sockopts;
+    tdata->winner_fd = -1;
+    gensio_list_init(&tdata->attempts);
+
+    tdata->lock = o->alloc_lock(o);
+    if (!tdata->lock)
+	goto out_nomem;
+
+    if (iai) {
+	addr = gensio_addr_dup(iai);
+	if (!addr)
+	    goto out_nomem;
+
+	err = net_setup_racing(tdata, addr);
+	if (err)
+	    goto out_nomem;
+    } else {
+	tdata->resolve_str = gensio_strdup(o, resolve_str);
+	if (!tdata->resolve_str)
+	    goto out_nomem;
+    }
 
     tdata->ll = fd_gensio_ll_alloc(o, -1, &net_fd_ll_ops, tdata, max_read_size,
 				   false);
@@ -389,11 +993,21 @@ net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
 	    gensio_ll_free(tdata->ll);
 	else
 	    /* gensio_ll_free() frees it otherwise. */
-	    o->free(o, tdata);
+	    net_finish_free(tdata);
     }
     return GE_NOMEM;
 }
 
+static int
+net_gensio_alloc(struct gensio_addr *iai, const char * const args[],
+		 struct gensio_os_funcs *o,
+		 gensio_event cb, void *user_data, const char *type,
+		 struct gensio **new_gensio)
+{
+    return i_net_gensio_alloc(iai, NULL, args, o, cb, user_data, type,
+			      new_gensio);
+}
+
 static int
 str_to_net_gensio(const char *str, const char * const args[],
 		  int protocol, const char *typestr,
@@ -402,7 +1016,29 @@ str_to_net_gensio(const char *str, const char * const args[],
 		  struct gensio **new_gensio)
 {
     struct gensio_addr *addr;
-    int err;
+    bool asyncresolve = false;
+    unsigned int i;
+    int err, ival;
+
+    if (protocol == GENSIO_NET_PROTOCOL_TCP) {
+	err = gensio_get_default(o, typestr, "asyncresolve", false,
+				 GENSIO_DEFAULT_BOOL, NULL, &ival);
+	if (err)
+	    return err;
+	asyncresolve = ival;
+	for (i = 0; args && args[i]; i++)
+	    gensio_check_keybool(args[i], "asyncresolve", &asyncresolve);
+    }
+
+#ifndef USE_PTHREADS
+    if (asyncresolve)
+	/* No resolver thread, the lookup would block the event loop. */
+	return GE_NOTSUP;
+#endif
+    if (asyncresolve)
+	/* Look the name up at open time so this never blocks. */
+	return i_net_gensio_alloc(NULL, str, args, o, cb, user_data, typestr,
+				  new_gensio);
 
     err = gensio_os_scan_netaddr(o, str, false, protocol, &addr);
     if (err)
@@ -467,6 +1103,7 @@ struct netna_data {
 
     gensiods max_read_size;
     bool nodelay;
+    struct gensio_sockopts sockopts;
 
     gensio_acc_done shutdown_done;
     gensio_acc_done cb_en_done;
@@ -590,13 +1227,18 @@ netna_readhandler(int fd, void *cbdata)
 
     tdata->o = nadata->o;
     tdata->oob_char = -1;
+    tdata->winner_fd = -1;
+    gensio_list_init(&tdata->attempts);
     tdata->ai = raddr;
     tdata->istcp = nadata->istcp;
+    tdata->nodelay = nadata->nodelay;
+    tdata->sockopts = nadata->sockopts;
     raddr = NULL;
-    
-    err = gensio_os_socket_setup(tdata->o, new_fd, protocol, tdata->istcp,
-				 tdata->nodelay, GENSIO_OPENSOCK_REUSEADDR,
-				 tdata->lai);
+
+    err = gensio_os_socket_setup_opts(tdata->o, new_fd, protocol,
+				      tdata->istcp, tdata->nodelay,
+				      tdata->istcp ? &tdata->sockopts : NULL,
+				      GENSIO_OPENSOCK_REUSEADDR, tdata->lai);
     if (err) {
 	gensio_acc_log(nadata->acc, GENSIO_LOG_ERR,
 		       "Error setting up net port: %s", gensio_err_to_str(err));
@@ -690,7 +1332,14 @@ netna_b4_listen(int fd, void *data)
     char unpath[MAX_UNIX_ADDR_PATH];
 
     if (nadata->istcp)
-	return 0;
+	/*
+	 * Accepted sockets inherit these from the listening socket,
+	 * and the receive buffer size must be set before the
+	 * connection is established for window scaling to take it
+	 * into account.
+	 */
+	return gensio_os_set_sockopts(nadata->o, fd, GENSIO_NET_PROTOCOL_TCP,
+				      &nadata->sockopts);
 
     get_unix_addr_path(nadata->ai, unpath);
 
@@ -790,7 +1439,9 @@ netna_set_accept_callback_enable(struct gensio_accepter *accepter,
 {
     unsigned int i;
 
-    nadata->cb_en_done = done;
+    /* Internal throttling passes no done, don't lose a pending one. */
+    if (done)
+	nadata->cb_en_done = done;
     for (i = 0; i < nadata->nr_acceptfds; i++)
 	nadata->o->set_read_handler(nadata->o, nadata->acceptfds[i].fd,
 				    enabled);
@@ -1049,14 +1700,23 @@ net_gensio_accepter_alloc(struct gensio_addr *iai,
 #ifdef HAVE_TCPD_H
     const char *tcpdname = NULL;
 #endif
+    struct gensio_sockopts sockopts;
+    struct gensio_acc_limits limits;
     unsigned int i;
     int err, ival;
 
+    memset(&sockopts, 0, sizeof(sockopts));
+    err = gensio_get_default_acc_limits(o, type, &limits);
+    if (err)
+	return err;
     if (istcp) {
 	err = gensio_get_default(o, type, "reuseaddr", false,
 				 GENSIO_DEFAULT_BOOL, NULL, &ival);
 	if (err)
 	    return err;
+	err = gensio_get_default_sockopts(o, type, &sockopts);
+	if (err)
+	    return err;
     } else {
 	err = gensio_get_default(o, type, "delsock", false,
 				 GENSIO_DEFAULT_BOOL, NULL, &ival);
@@ -1076,6 +1736,10 @@ net_gensio_accepter_alloc(struct gensio_addr *iai,
 	if (istcp &&
 		gensio_check_keybool(args[i], "reuseaddr", &reuseaddr) > 0)
 	    continue;
+	if (istcp && gensio_check_sockopt(args[i], &sockopts) > 0)
+	    continue;
+	if (gensio_check_acc_limit(args[i], &limits) > 0)
+	    continue;
 #ifdef HAVE_TCPD_H
 	if (istcp && gensio_check_keyvalue(args[i], "tcpdname", &tcpdname))
 	    continue;
@@ -1159,6 +1823,8 @@ net_gensio_accepter_alloc(struct gensio_addr *iai,
     gensio_acc_set_is_reliable(nadata->acc, true);
     nadata->max_read_size = max_read_size;
     nadata->nodelay = nodelay;
+    nadata->sockopts = sockopts;
+    base_gensio_accepter_set_limits(nadata->acc, &limits);
 
     return 0;
 
@@ -6,7 +6,7 @@
  */
 
 #include "config.h"
-#define _DEFAULT_SOURCE /* Get getgrouplist(), setgroups() */
+#define _GNU_SOURCE /* Get getgrouplist(), setgroups(), recvmmsg() */
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -19,9 +19,16 @@
 #include <grp.h>
 #include <pwd.h>
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #if HAVE_LIBSCTP
 #include <netinet/sctp.h>
 #endif
@@ -43,6 +50,7 @@
 #include <gensio/argvutils.h>
 
 #include "errtrig.h"
+#include "utils.h"
 
 /* MacOS doesn't have IPV6_ADD_MEMBERSHIP, but has an equivalent. */
 #ifndef IPV6_ADD_MEMBERSHIP
@@ -245,8 +253,10 @@ gensio_os_sendto(struct gensio_os_funcs *o,
 	return GE_NOMEM;
 
     memset(&hdr, 0, sizeof(hdr));
-    hdr.msg_name = (void *) raddr->curr->ai_addr;
-    hdr.msg_namelen = raddr->curr->ai_addrlen;
+    if (raddr) {
+	hdr.msg_name = (void *) raddr->curr->ai_addr;
+	hdr.msg_namelen = raddr->curr->ai_addrlen;
+    }
     hdr.msg_iov = (struct iovec *) sg;
     hdr.msg_iovlen = sglen;
  retry:
@@ -335,6 +345,431 @@ gensio_os_recvfrom(struct gensio_os_funcs *o,
     return gensio_os_err_to_err(o, err);
 }
 
+/* Room for the control messages gensio_os_recvmmsg() looks at. */
+#define RECVMSG_CMSG_SPACE	(CMSG_SPACE(sizeof(int)) +		\
+				 CMSG_SPACE(sizeof(struct timespec)) +	\
+				 CMSG_SPACE(sizeof(uint32_t)))
+
+static void
+recvmsg_get_cmsgs(struct msghdr *hdr, struct gensio_os_recvmsg *msg)
+{
+    struct cmsghdr *cm;
+
+    msg->segsize = 0;
+    msg->has_stamp = false;
+    msg->has_drops = false;
+    if (hdr->msg_controllen == 0)
+	return;
+    for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+#ifdef SCM_TIMESTAMPNS
+	if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+	    struct timespec ts;
+
+	    memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+	    msg->stamp.secs = ts.tv_sec;
+	    msg->stamp.nsecs = ts.tv_nsec;
+	    msg->has_stamp = true;
+	}
+#endif
+#ifdef SO_RXQ_OVFL
+	if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+	    memcpy(&msg->drops, CMSG_DATA(cm), sizeof(msg->drops));
+	    msg->has_drops = true;
+	}
+#endif
+#ifdef UDP_GRO
+	if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+	    int segsize;
+
+	    memcpy(&segsize, CMSG_DATA(cm), sizeof(segsize));
+	    /* A single datagram may be reported as coalesced, too. */
+	    if (segsize > 0 && (gensiods) segsize < msg->len)
+		msg->segsize = segsize;
+	}
+#endif
+    }
+}
+
+#ifndef HAVE_RECVMMSG
+static int
+recvmsg_one(struct gensio_os_funcs *o, int fd, struct gensio_os_recvmsg *msg,
+	    int flags)
+{
+    struct msghdr hdr;
+    struct iovec iov;
+    union {
+	struct cmsghdr align;
+	char buf[RECVMSG_CMSG_SPACE];
+    } cbuf;
+    struct addrinfo *ai = msg->addr ? msg->addr->curr : NULL;
+    ssize_t rv;
+
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = msg->buf;
+    iov.iov_len = msg->buflen;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (ai) {
+	hdr.msg_name = ai->ai_addr;
+	hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    hdr.msg_control = cbuf.buf;
+    hdr.msg_controllen = sizeof(cbuf.buf);
+
+ retry:
+    rv = recvmsg(fd, &hdr, flags);
+    if (rv < 0) {
+	if (errno == EINTR)
+	    goto retry;
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    msg->len = 0;
+	    return 0;
+	}
+	return gensio_os_err_to_err(o, errno);
+    }
+    if (ai) {
+	ai->ai_addrlen = hdr.msg_namelen;
+	ai->ai_family = ai->ai_addr->sa_family;
+    }
+    msg->len = rv;
+    recvmsg_get_cmsgs(&hdr, msg);
+    return 0;
+}
+#endif
+
+int
+gensio_os_recvmmsg(struct gensio_os_funcs *o, int fd,
+		   struct gensio_os_recvmsg *msgs, unsigned int nr_msgs,
+		   unsigned int *nr_recvd, int flags)
+{
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr hdrs[GENSIO_OS_MAX_MMSG];
+    struct iovec iovs[GENSIO_OS_MAX_MMSG];
+    union {
+	struct cmsghdr align;
+	char buf[RECVMSG_CMSG_SPACE];
+    } cbufs[GENSIO_OS_MAX_MMSG];
+    struct addrinfo *ai;
+    unsigned int i;
+    int rv;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    if (nr_msgs > GENSIO_OS_MAX_MMSG)
+	nr_msgs = GENSIO_OS_MAX_MMSG;
+
+    memset(hdrs, 0, nr_msgs * sizeof(*hdrs));
+    for (i = 0; i < nr_msgs; i++) {
+	iovs[i].iov_base = msgs[i].buf;
+	iovs[i].iov_len = msgs[i].buflen;
+	hdrs[i].msg_hdr.msg_iov = &iovs[i];
+	hdrs[i].msg_hdr.msg_iovlen = 1;
+	if (msgs[i].addr) {
+	    ai = msgs[i].addr->curr;
+	    hdrs[i].msg_hdr.msg_name = ai->ai_addr;
+	    hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+	hdrs[i].msg_hdr.msg_control = cbufs[i].buf;
+	hdrs[i].msg_hdr.msg_controllen = sizeof(cbufs[i].buf);
+    }
+
+ retry:
+    rv = recvmmsg(fd, hdrs, nr_msgs, flags, NULL);
+    if (rv < 0) {
+	if (errno == EINTR)
+	    goto retry;
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    *nr_recvd = 0;
+	    return 0;
+	}
+	return gensio_os_err_to_err(o, errno);
+    }
+
+    for (i = 0; i < (unsigned int) rv; i++) {
+	if (msgs[i].addr) {
+	    ai = msgs[i].addr->curr;
+	    ai->ai_addrlen = hdrs[i].msg_hdr.msg_namelen;
+	    ai->ai_family = ai->ai_addr->sa_family;
+	}
+	msgs[i].len = hdrs[i].msg_len;
+	recvmsg_get_cmsgs(&hdrs[i].msg_hdr, &msgs[i]);
+    }
+    *nr_recvd = rv;
+    return 0;
+#else
+    unsigned int i;
+    int err = 0;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    for (i = 0; i < nr_msgs && i < GENSIO_OS_MAX_MMSG; i++) {
+	err = recvmsg_one(o, fd, &msgs[i], flags);
+	/* 0 bytes means nothing is there. */
+	if (err || msgs[i].len == 0)
+	    break;
+    }
+    *nr_recvd = i;
+    if (i > 0)
+	return 0;
+    return err;
+#endif
+}
+
+int
+gensio_os_sendmmsg(struct gensio_os_funcs *o, int fd,
+		   const struct gensio_os_sendmsg *msgs,
+		   unsigned int nr_msgs, unsigned int *nr_sent, int flags)
+{
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr hdrs[GENSIO_OS_MAX_MMSG];
+    unsigned int i;
+    int rv;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    if (nr_msgs > GENSIO_OS_MAX_MMSG)
+	nr_msgs = GENSIO_OS_MAX_MMSG;
+
+    memset(hdrs, 0, nr_msgs * sizeof(*hdrs));
+    for (i = 0; i < nr_msgs; i++) {
+	if (msgs[i].addr) {
+	    hdrs[i].msg_hdr.msg_name = (void *) msgs[i].addr->curr->ai_addr;
+	    hdrs[i].msg_hdr.msg_namelen = msgs[i].addr->curr->ai_addrlen;
+	}
+	hdrs[i].msg_hdr.msg_iov = (struct iovec *) msgs[i].sg;
+	hdrs[i].msg_hdr.msg_iovlen = msgs[i].sglen;
+    }
+
+ retry:
+    rv = sendmmsg(fd, hdrs, nr_msgs, flags);
+    if (rv < 0) {
+	if (errno == EINTR)
+	    goto retry;
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    *nr_sent = 0;
+	    return 0;
+	}
+	return gensio_os_err_to_err(o, errno);
+    }
+    *nr_sent = rv;
+    return 0;
+#else
+    unsigned int i;
+    gensiods count;
+    int err = 0;
+
+    for (i = 0; i < nr_msgs && i < GENSIO_OS_MAX_MMSG; i++) {
+	err = gensio_os_sendto(o, fd, msgs[i].sg, msgs[i].sglen, &count,
+			       flags, msgs[i].addr);
+	if (err || count == 0)
+	    /* A zero count is a full socket. */
+	    break;
+    }
+    *nr_sent = i;
+    if (i > 0)
+	return 0;
+    return err;
+#endif
+}
+
+/*
+ * Fill in iov with the part of sg from off for len bytes, returning
+ * the number of iov entries used.  iov must have sglen entries.
+ */
+static unsigned int
+sg_slice(const struct gensio_sg *sg, gensiods sglen, gensiods off,
+	 gensiods len, struct iovec *iov)
+{
+    unsigned int i, n = 0;
+    gensiods l;
+
+    for (i = 0; i < sglen && len > 0; i++) {
+	if (off >= sg[i].buflen) {
+	    off -= sg[i].buflen;
+	    continue;
+	}
+	l = sg[i].buflen - off;
+	if (l > len)
+	    l = len;
+	iov[n].iov_base = (char *) sg[i].buf + off;
+	iov[n].iov_len = l;
+	n++;
+	len -= l;
+	off = 0;
+    }
+    return n;
+}
+
+/* Biggest chunk handed to the kernel at once with UDP_SEGMENT. */
+#define GSO_MAX_BYTES		65000
+#define GSO_MAX_SEGMENTS	64
+
+static int
+sendto_one(struct gensio_os_funcs *o, int fd, struct iovec *iov,
+	   unsigned int iovlen, int flags, const struct gensio_addr *raddr,
+	   gensiods segsize, ssize_t *rv)
+{
+    struct msghdr hdr;
+#ifdef UDP_SEGMENT
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+    } cbuf;
+    struct cmsghdr *cm;
+    uint16_t seg = segsize;
+#endif
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (raddr) {
+	hdr.msg_name = (void *) raddr->curr->ai_addr;
+	hdr.msg_namelen = raddr->curr->ai_addrlen;
+    }
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovlen;
+#ifdef UDP_SEGMENT
+    if (segsize) {
+	memset(&cbuf, 0, sizeof(cbuf));
+	hdr.msg_control = cbuf.buf;
+	hdr.msg_controllen = sizeof(cbuf.buf);
+	cm = CMSG_FIRSTHDR(&hdr);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(seg));
+	memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    }
+#endif
+ retry:
+    *rv = sendmsg(fd, &hdr, flags);
+    if (*rv < 0) {
+	if (errno == EINTR)
+	    goto retry;
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    *rv = 0;
+	    return 0;
+	}
+	return errno;
+    }
+    return 0;
+}
+
+int
+gensio_os_sendto_gso(struct gensio_os_funcs *o,
+		     int fd, const struct gensio_sg *sg, gensiods sglen,
+		     gensiods *rcount, int flags,
+		     const struct gensio_addr *raddr, gensiods segsize)
+{
+    struct iovec *iov;
+    gensiods total = 0, pos = 0, chunk;
+    unsigned int i, iovlen;
+    bool use_gso = false;
+    ssize_t rv;
+    int err = 0;
+
+    for (i = 0; i < sglen; i++)
+	total += sg[i].buflen;
+
+    if (segsize == 0 || total <= segsize)
+	return gensio_os_sendto(o, fd, sg, sglen, rcount, flags, raddr);
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    iov = o->zalloc(o, sizeof(*iov) * sglen);
+    if (!iov)
+	return GE_NOMEM;
+
+#ifdef UDP_SEGMENT
+    use_gso = segsize <= GSO_MAX_BYTES;
+#endif
+
+    while (pos < total) {
+	if (use_gso) {
+	    chunk = (GSO_MAX_BYTES / segsize) * segsize;
+	    if (chunk > segsize * GSO_MAX_SEGMENTS)
+		chunk = segsize * GSO_MAX_SEGMENTS;
+	} else {
+	    chunk = segsize;
+	}
+	if (chunk > total - pos)
+	    chunk = total - pos;
+	iovlen = sg_slice(sg, sglen, pos, chunk, iov);
+	err = sendto_one(o, fd, iov, iovlen, flags, raddr,
+			 use_gso ? segsize : 0, &rv);
+	if (err && use_gso && pos == 0 &&
+		(err == EIO || err == EINVAL || err == ENOPROTOOPT ||
+		 err == EOPNOTSUPP)) {
+	    /* No offload support here, send them one at a time. */
+	    use_gso = false;
+	    err = 0;
+	    continue;
+	}
+	if (err || rv == 0)
+	    break;
+	pos += rv;
+    }
+    o->free(o, iov);
+
+    if (err && pos == 0)
+	return gensio_os_err_to_err(o, err);
+    if (rcount)
+	*rcount = pos;
+    return 0;
+}
+
+int
+gensio_os_set_udp_gro(struct gensio_os_funcs *o, int fd, bool ival)
+{
+#ifdef UDP_GRO
+    int val = ival;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1)
+	return gensio_os_err_to_err(o, errno);
+    return 0;
+#else
+    return GE_NOTSUP;
+#endif
+}
+
+int
+gensio_os_set_rx_timestamp(struct gensio_os_funcs *o, int fd, bool ival)
+{
+#ifdef SO_TIMESTAMPNS
+    int val = ival;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)) == -1)
+	return gensio_os_err_to_err(o, errno);
+    return 0;
+#else
+    return GE_NOTSUP;
+#endif
+}
+
+int
+gensio_os_set_rx_drops(struct gensio_os_funcs *o, int fd, bool ival)
+{
+#ifdef SO_RXQ_OVFL
+    int val = ival;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &val, sizeof(val)) == -1)
+	return gensio_os_err_to_err(o, errno);
+    return 0;
+#else
+    return GE_NOTSUP;
+#endif
+}
+
 int
 gensio_os_accept(struct gensio_os_funcs *o, int fd,
 		 struct gensio_addr **raddr, int *newsock)
@@ -894,6 +1329,21 @@ int gensio_os_close(struct gensio_os_funcs *o, int *fd)
     return 0;
 }
 
+int
+gensio_os_dup(struct gensio_os_funcs *o, int fd, int *newfd)
+{
+    int rv;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    rv = dup(fd);
+    if (rv == -1)
+	return gensio_os_err_to_err(o, errno);
+    *newfd = rv;
+    return 0;
+}
+
 int gensio_os_check_socket_open(struct gensio_os_funcs *o, int fd)
 {
     int err, optval;
@@ -942,29 +1392,370 @@ gensio_os_socket_open(struct gensio_os_funcs *o,
 	socktype = SOCK_DGRAM;
 	break;
 
-#if HAVE_LIBSCTP
-    case GENSIO_NET_PROTOCOL_SCTP:
-	sockproto = IPPROTO_SCTP;
-	socktype = SOCK_STREAM;
-	break;
-#endif
+#if HAVE_LIBSCTP
+    case GENSIO_NET_PROTOCOL_SCTP:
+	sockproto = IPPROTO_SCTP;
+	socktype = SOCK_STREAM;
+	break;
+#endif
+
+    default:
+	return GE_INVAL;
+    }
+
+    newfd = socket(addr->curr->ai_family, socktype, sockproto);
+    if (newfd == -1)
+	return gensio_os_err_to_err(o, errno);
+    *fd = newfd;
+    return 0;
+}
+
+enum gensio_sockopt_type {
+    GENSIO_SOCKOPT_INT,
+    GENSIO_SOCKOPT_BOOL,
+    GENSIO_SOCKOPT_STR
+};
+
+struct gensio_sockopt_def {
+    const char *name;
+    enum gensio_sockopt_type type;
+    bool tcp_only;
+    bool supported;
+    int level;
+    int optname;
+    int force_optname; /* Tried first if not zero, for privileged users. */
+    size_t offset;
+};
+
+/*
+ * Options that are not available on this platform are still
+ * recognized so the same strings can be used everywhere, but
+ * setting them returns GE_NOTSUP.
+ */
+#define SOCKOPT_DEF(name, type, tcp_only, level, optname, field) \
+    { name, type, tcp_only, true, level, optname, 0,			\
+      offsetof(struct gensio_sockopts, field) }
+#define SOCKOPT_DEF_FORCE(name, type, tcp_only, level, optname,		\
+			  force_optname, field)				\
+    { name, type, tcp_only, true, level, optname, force_optname,	\
+      offsetof(struct gensio_sockopts, field) }
+#define SOCKOPT_NOTSUP(name, type, tcp_only, field)			\
+    { name, type, tcp_only, false, 0, 0, 0,				\
+      offsetof(struct gensio_sockopts, field) }
+
+/*
+ * The FORCE versions of the buffer sizes go past the system limits
+ * (rmem_max and wmem_max) if the process is privileged.
+ */
+static const struct gensio_sockopt_def sockopt_defs[] = {
+#ifdef SO_SNDBUFFORCE
+    SOCKOPT_DEF_FORCE("sndbuf", GENSIO_SOCKOPT_INT, false,
+		      SOL_SOCKET, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf),
+#else
+    SOCKOPT_DEF("sndbuf", GENSIO_SOCKOPT_INT, false,
+		SOL_SOCKET, SO_SNDBUF, sndbuf),
+#endif
+#ifdef SO_RCVBUFFORCE
+    SOCKOPT_DEF_FORCE("rcvbuf", GENSIO_SOCKOPT_INT, false,
+		      SOL_SOCKET, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf),
+#else
+    SOCKOPT_DEF("rcvbuf", GENSIO_SOCKOPT_INT, false,
+		SOL_SOCKET, SO_RCVBUF, rcvbuf),
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    SOCKOPT_DEF("notsent_lowat", GENSIO_SOCKOPT_INT, true,
+		IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat),
+#else
+    SOCKOPT_NOTSUP("notsent_lowat", GENSIO_SOCKOPT_INT, true, notsent_lowat),
+#endif
+#ifdef TCP_QUICKACK
+    SOCKOPT_DEF("quickack", GENSIO_SOCKOPT_BOOL, true,
+		IPPROTO_TCP, TCP_QUICKACK, quickack),
+#else
+    SOCKOPT_NOTSUP("quickack", GENSIO_SOCKOPT_BOOL, true, quickack),
+#endif
+#ifdef TCP_USER_TIMEOUT
+    SOCKOPT_DEF("user_timeout", GENSIO_SOCKOPT_INT, true,
+		IPPROTO_TCP, TCP_USER_TIMEOUT, user_timeout),
+#else
+    SOCKOPT_NOTSUP("user_timeout", GENSIO_SOCKOPT_INT, true, user_timeout),
+#endif
+#ifdef TCP_KEEPIDLE
+    SOCKOPT_DEF("keepidle", GENSIO_SOCKOPT_INT, true,
+		IPPROTO_TCP, TCP_KEEPIDLE, keepidle),
+#else
+    SOCKOPT_NOTSUP("keepidle", GENSIO_SOCKOPT_INT, true, keepidle),
+#endif
+#ifdef TCP_KEEPINTVL
+    SOCKOPT_DEF("keepintvl", GENSIO_SOCKOPT_INT, true,
+		IPPROTO_TCP, TCP_KEEPINTVL, keepintvl),
+#else
+    SOCKOPT_NOTSUP("keepintvl", GENSIO_SOCKOPT_INT, true, keepintvl),
+#endif
+#ifdef TCP_KEEPCNT
+    SOCKOPT_DEF("keepcnt", GENSIO_SOCKOPT_INT, true,
+		IPPROTO_TCP, TCP_KEEPCNT, keepcnt),
+#else
+    SOCKOPT_NOTSUP("keepcnt", GENSIO_SOCKOPT_INT, true, keepcnt),
+#endif
+#ifdef SO_BUSY_POLL
+    SOCKOPT_DEF("busy_poll", GENSIO_SOCKOPT_INT, false,
+		SOL_SOCKET, SO_BUSY_POLL, busy_poll),
+#else
+    SOCKOPT_NOTSUP("busy_poll", GENSIO_SOCKOPT_INT, false, busy_poll),
+#endif
+#ifdef TCP_CONGESTION
+    SOCKOPT_DEF("congestion", GENSIO_SOCKOPT_STR, true,
+		IPPROTO_TCP, TCP_CONGESTION, congestion),
+#else
+    SOCKOPT_NOTSUP("congestion", GENSIO_SOCKOPT_STR, true, congestion),
+#endif
+    { NULL }
+};
+
+static int *
+sockopt_intval(const struct gensio_sockopt_def *d,
+	       struct gensio_sockopts *sockopts)
+{
+    return (int *) (((char *) sockopts) + d->offset);
+}
+
+static char *
+sockopt_strval(const struct gensio_sockopt_def *d,
+	       struct gensio_sockopts *sockopts)
+{
+    return ((char *) sockopts) + d->offset;
+}
+
+static bool
+sockopt_is_set(const struct gensio_sockopt_def *d,
+	       const struct gensio_sockopts *sockopts)
+{
+    struct gensio_sockopts *s = (struct gensio_sockopts *) sockopts;
+
+    if (d->type == GENSIO_SOCKOPT_STR)
+	return *sockopt_strval(d, s) != '\0';
+    return *sockopt_intval(d, s) != 0;
+}
+
+static int
+sockopt_apply(struct gensio_os_funcs *o, int fd, int protocol,
+	      const struct gensio_sockopt_def *d,
+	      const struct gensio_sockopts *sockopts)
+{
+    struct gensio_sockopts *s = (struct gensio_sockopts *) sockopts;
+    int rv;
+
+    if (!d->supported)
+	return GE_NOTSUP;
+    if (d->tcp_only && protocol != GENSIO_NET_PROTOCOL_TCP)
+	return GE_NOTSUP;
+
+    if (d->force_optname &&
+	    setsockopt(fd, d->level, d->force_optname, sockopt_intval(d, s),
+		       sizeof(int)) == 0)
+	return 0;
+
+    /* Not privileged for the force version, do what we can. */
+    if (d->type == GENSIO_SOCKOPT_STR)
+	rv = setsockopt(fd, d->level, d->optname, sockopt_strval(d, s),
+			strlen(sockopt_strval(d, s)));
+    else
+	rv = setsockopt(fd, d->level, d->optname, sockopt_intval(d, s),
+			sizeof(int));
+    if (rv == -1)
+	return gensio_os_err_to_err(o, errno);
+    return 0;
+}
+
+static int
+sockopt_check_one(const struct gensio_sockopt_def *d, const char *str,
+		  struct gensio_sockopts *sockopts)
+{
+    const char *sval;
+    unsigned int uval;
+    bool bval;
+    int rv;
+
+    switch (d->type) {
+    case GENSIO_SOCKOPT_INT:
+	rv = gensio_check_keyuint(str, d->name, &uval);
+	if (rv > 0) {
+	    if (uval > INT_MAX)
+		return -1;
+	    *sockopt_intval(d, sockopts) = uval;
+	}
+	return rv;
+
+    case GENSIO_SOCKOPT_BOOL:
+	rv = gensio_check_keybool(str, d->name, &bval);
+	if (rv > 0)
+	    *sockopt_intval(d, sockopts) = bval;
+	return rv;
+
+    case GENSIO_SOCKOPT_STR:
+	rv = gensio_check_keyvalue(str, d->name, &sval);
+	if (rv > 0) {
+	    if (strlen(sval) >= GENSIO_SOCKOPT_CONGESTION_LEN)
+		return -1;
+	    strcpy(sockopt_strval(d, sockopts), sval);
+	}
+	return rv;
+    }
+
+    return 0;
+}
+
+int
+gensio_check_sockopt(const char *str, struct gensio_sockopts *sockopts)
+{
+    unsigned int i;
+    int rv;
+
+    for (i = 0; sockopt_defs[i].name; i++) {
+	rv = sockopt_check_one(&sockopt_defs[i], str, sockopts);
+	if (rv)
+	    return rv;
+    }
+    return 0;
+}
+
+int
+gensio_get_default_sockopts(struct gensio_os_funcs *o, const char *class,
+			    struct gensio_sockopts *sockopts)
+{
+    const struct gensio_sockopt_def *d;
+    char *str;
+    int err, ival;
+    bool istcp = strcmp(class, "tcp") == 0;
+
+    for (d = sockopt_defs; d->name; d++) {
+	if (d->tcp_only && !istcp)
+	    continue;
+	if (d->type == GENSIO_SOCKOPT_STR) {
+	    str = NULL;
+	    err = gensio_get_default(o, class, d->name, false,
+				     GENSIO_DEFAULT_STR, &str, NULL);
+	    if (err)
+		return err;
+	    if (str) {
+		if (strlen(str) >= GENSIO_SOCKOPT_CONGESTION_LEN) {
+		    o->free(o, str);
+		    return GE_INVAL;
+		}
+		strcpy(sockopt_strval(d, sockopts), str);
+		o->free(o, str);
+	    }
+	} else {
+	    err = gensio_get_default(o, class, d->name, false,
+				     GENSIO_DEFAULT_INT, NULL, &ival);
+	    if (err)
+		return err;
+	    *sockopt_intval(d, sockopts) = ival;
+	}
+    }
+
+    return 0;
+}
+
+int
+gensio_os_set_sockopts(struct gensio_os_funcs *o, int fd, int protocol,
+		       const struct gensio_sockopts *sockopts)
+{
+    const struct gensio_sockopt_def *d;
+    int err;
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    for (d = sockopt_defs; d->name; d++) {
+	if (!sockopt_is_set(d, sockopts))
+	    continue;
+	err = sockopt_apply(o, fd, protocol, d, sockopts);
+	if (err)
+	    return err;
+    }
+
+    return 0;
+}
+
+int
+gensio_os_sockopt_control(struct gensio_os_funcs *o, int fd, int protocol,
+			  struct gensio_sockopts *sockopts, bool get,
+			  char *data, gensiods *datalen)
+{
+    const struct gensio_sockopt_def *d;
+    struct gensio_sockopts tmp;
+    char strval[GENSIO_SOCKOPT_CONGESTION_LEN];
+    socklen_t len;
+    int rv, val;
+
+    if (get) {
+	for (d = sockopt_defs; d->name; d++) {
+	    if (strcmp(data, d->name) == 0)
+		break;
+	}
+	if (!d->name)
+	    return GE_NOTFOUND;
+	if (!d->supported ||
+		(d->tcp_only && protocol != GENSIO_NET_PROTOCOL_TCP))
+	    return GE_NOTSUP;
+
+	if (fd == -1) {
+	    if (d->type == GENSIO_SOCKOPT_STR)
+		*datalen = snprintf(data, *datalen, "%s",
+				    sockopt_strval(d, sockopts));
+	    else
+		*datalen = snprintf(data, *datalen, "%d",
+				    *sockopt_intval(d, sockopts));
+	    return 0;
+	}
+
+	if (d->type == GENSIO_SOCKOPT_STR) {
+	    len = sizeof(strval) - 1;
+	    rv = getsockopt(fd, d->level, d->optname, strval, &len);
+	    if (rv != -1) {
+		strval[len] = '\0';
+		*datalen = snprintf(data, *datalen, "%s", strval);
+	    }
+	} else {
+	    len = sizeof(val);
+	    rv = getsockopt(fd, d->level, d->optname, &val, &len);
+	    if (rv != -1)
+		*datalen = snprintf(data, *datalen, "%d", val);
+	}
+	if (rv == -1)
+	    return gensio_os_err_to_err(o, errno);
+	return 0;
+    }
 
-    default:
-	return GE_INVAL;
+    tmp = *sockopts;
+    for (d = sockopt_defs; d->name; d++) {
+	rv = sockopt_check_one(d, data, &tmp);
+	if (rv < 0)
+	    return GE_INVAL;
+	if (rv > 0)
+	    break;
     }
+    if (!d->name)
+	return GE_NOTFOUND;
 
-    newfd = socket(addr->a->ai_family, socktype, sockproto);
-    if (newfd == -1)
-	return gensio_os_err_to_err(o, errno);
-    *fd = newfd;
+    if (fd != -1 &&
+	    (d->type == GENSIO_SOCKOPT_BOOL || sockopt_is_set(d, &tmp))) {
+	rv = sockopt_apply(o, fd, protocol, d, &tmp);
+	if (rv)
+	    return rv;
+    }
+    *sockopts = tmp;
     return 0;
 }
 
 int
-gensio_os_socket_setup(struct gensio_os_funcs *o, int fd,
-		       int protocol, bool keepalive, bool nodelay,
-		       unsigned int opensock_flags,
-		       struct gensio_addr *bindaddr)
+gensio_os_socket_setup_opts(struct gensio_os_funcs *o, int fd,
+			    int protocol, bool keepalive, bool nodelay,
+			    const struct gensio_sockopts *sockopts,
+			    unsigned int opensock_flags,
+			    struct gensio_addr *bindaddr)
 {
     int err;
     int val = 1;
@@ -973,6 +1764,12 @@ gensio_os_socket_setup(struct gensio_os_funcs *o, int fd,
     if (err)
 	return err;
 
+    if (sockopts) {
+	err = gensio_os_set_sockopts(o, fd, protocol, sockopts);
+	if (err)
+	    return err;
+    }
+
     if (keepalive) {
 	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE,
 		       (void *)&val, sizeof(val)) == -1)
@@ -1027,6 +1824,16 @@ gensio_os_socket_setup(struct gensio_os_funcs *o, int fd,
     return 0;
 }
 
+int
+gensio_os_socket_setup(struct gensio_os_funcs *o, int fd,
+		       int protocol, bool keepalive, bool nodelay,
+		       unsigned int opensock_flags,
+		       struct gensio_addr *bindaddr)
+{
+    return gensio_os_socket_setup_opts(o, fd, protocol, keepalive, nodelay,
+				       NULL, opensock_flags, bindaddr);
+}
+
 int
 gensio_os_mcast_add(struct gensio_os_funcs *o, int fd,
 		    struct gensio_addr *mcast_addrs, int interface,
@@ -1239,6 +2046,18 @@ gensio_os_set_nodelay(struct gensio_os_funcs *o, int fd, int protocol, int val)
     return 0;
 }
 
+int
+gensio_os_set_quickack(struct gensio_os_funcs *o, int fd, int val)
+{
+#ifdef TCP_QUICKACK
+    if (setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &val, sizeof(val)) == -1)
+	return gensio_os_err_to_err(o, errno);
+    return 0;
+#else
+    return GE_NOTSUP;
+#endif
+}
+
 int
 gensio_os_getsockname(struct gensio_os_funcs *o, int fd,
 		      struct gensio_addr **raddr)
@@ -1766,6 +2585,78 @@ sockaddr_equal(const struct sockaddr *a1, socklen_t l1,
     return true;
 }
 
+/* FNV-1a, cheap and spreads small keys well. */
+static uint32_t
+hash_bytes(uint32_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+	h ^= *p++;
+	h *= 16777619;
+    }
+    return h;
+}
+
+uint32_t
+gensio_addr_hash(const struct gensio_addr *addr, bool hash_port)
+{
+    const struct sockaddr *sa = addr->curr->ai_addr;
+    uint32_t h = 2166136261U;
+    uint16_t family = sa->sa_family;
+
+    switch (sa->sa_family) {
+    case AF_INET:
+	{
+	    const struct sockaddr_in *s = (const struct sockaddr_in *) sa;
+
+	    h = hash_bytes(h, &family, sizeof(family));
+	    if (hash_port)
+		h = hash_bytes(h, &s->sin_port, sizeof(s->sin_port));
+	    h = hash_bytes(h, &s->sin_addr.s_addr, sizeof(s->sin_addr.s_addr));
+	}
+	break;
+
+    case AF_INET6:
+	{
+	    const struct sockaddr_in6 *s = (const struct sockaddr_in6 *) sa;
+
+	    /* Mapped addresses must hash like the IPv4 ones they equal. */
+	    if (IN6_IS_ADDR_V4MAPPED(&s->sin6_addr)) {
+		family = AF_INET;
+		h = hash_bytes(h, &family, sizeof(family));
+		if (hash_port)
+		    h = hash_bytes(h, &s->sin6_port, sizeof(s->sin6_port));
+		h = hash_bytes(h, s->sin6_addr.s6_addr + 12, 4);
+	    } else {
+		h = hash_bytes(h, &family, sizeof(family));
+		if (hash_port)
+		    h = hash_bytes(h, &s->sin6_port, sizeof(s->sin6_port));
+		h = hash_bytes(h, s->sin6_addr.s6_addr,
+			       sizeof(s->sin6_addr.s6_addr));
+	    }
+	}
+	break;
+
+#if HAVE_UNIX
+    case AF_UNIX:
+	{
+	    const struct sockaddr_un *s = (const struct sockaddr_un *) sa;
+
+	    h = hash_bytes(h, &family, sizeof(family));
+	    h = hash_bytes(h, s->sun_path, strlen(s->sun_path));
+	}
+	break;
+#endif
+
+    default:
+	h = hash_bytes(h, &family, sizeof(family));
+	break;
+    }
+
+    return h;
+}
+
 bool
 gensio_addr_equal(const struct gensio_addr *a1,
 		  const struct gensio_addr *a2,
@@ -2246,6 +3137,451 @@ gensio_os_scan_netaddr(struct gensio_os_funcs *o, const char *str, bool listen,
     return rv;
 }
 
+/*
+ * Asynchronous name resolution.  getaddrinfo() can block for a long
+ * time, so gensio_os_scan_netaddr_async() does the lookup in a small
+ * pool of resolver threads and reports the result from a runner.
+ * Successful results are kept in a small cache for a while as
+ * numeric address strings, those can be scanned again without
+ * blocking.
+ *
+ * Without pthreads there are no resolver threads, the lookup is done
+ * in the runner before the result is delivered.  The caller doesn't
+ * block, but the lookup still blocks whatever thread runs the
+ * runner.
+ *
+ * The os funcs have no refcount, so a resolver thread marks the os
+ * funcs it is using as active while it does a lookup and
+ * gensio_cleanup_mem() waits for that to finish before the os funcs
+ * can be freed.
+ */
+#define RESOLVE_CACHE_SIZE	32
+#define RESOLVE_CACHE_TTL	30 /* seconds */
+#define RESOLVE_MAX_THREADS	4
+#define RESOLVE_THREAD_IDLE	10 /* seconds before an idle thread exits */
+
+struct resolve_cache_entry {
+    struct gensio_os_funcs *o; /* What key and result were allocated with. */
+    char *key;
+    char *result;
+    int64_t expires;
+};
+
+struct gensio_resolve_req {
+    struct gensio_link link;
+    struct gensio_os_funcs *o;
+    struct gensio_runner *runner;
+    char *str;
+    char *key;
+    bool listen;
+    int gprotocol;
+    gensio_os_resolve_done done;
+    void *cb_data;
+    int err;
+    struct gensio_addr *addr;
+};
+
+static gensio_os_resolver resolve_func = gensio_os_scan_netaddr;
+static struct resolve_cache_entry resolve_cache[RESOLVE_CACHE_SIZE];
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static struct gensio_list resolve_queue;
+static bool resolve_queue_inited;
+static unsigned int resolve_nr_threads;
+static unsigned int resolve_idle_threads;
+
+/*
+ * The os funcs resolver threads are doing lookups for.
+ * resolve_active_cond is signalled when one finishes.
+ */
+struct resolve_active {
+    struct gensio_link link;
+    struct gensio_os_funcs *o;
+};
+static struct gensio_list resolve_active_list;
+static pthread_cond_t resolve_active_cond = PTHREAD_COND_INITIALIZER;
+
+#define resolve_lock()		pthread_mutex_lock(&resolve_lock)
+#define resolve_unlock()	pthread_mutex_unlock(&resolve_lock)
+#else
+#define resolve_lock()		do { } while (0)
+#define resolve_unlock()	do { } while (0)
+#endif
+
+static int64_t
+resolve_now(struct gensio_os_funcs *o)
+{
+    gensio_time now;
+
+    o->get_monotonic_time(o, &now);
+    return now.secs;
+}
+
+static void
+resolve_cache_clear_entry(struct resolve_cache_entry *c)
+{
+    if (c->key)
+	c->o->free(c->o, c->key);
+    if (c->result)
+	c->o->free(c->o, c->result);
+    c->key = NULL;
+    c->result = NULL;
+    c->o = NULL;
+}
+
+/* Returns an allocated copy of the cached result.  Call with the lock. */
+static char *
+resolve_cache_lookup(struct gensio_os_funcs *o, const char *key, int64_t now)
+{
+    unsigned int i;
+
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+	struct resolve_cache_entry *c = &resolve_cache[i];
+
+	if (!c->key || strcmp(c->key, key) != 0)
+	    continue;
+	if (c->expires <= now) {
+	    resolve_cache_clear_entry(c);
+	    return NULL;
+	}
+	return gensio_strdup(o, c->result);
+    }
+    return NULL;
+}
+
+/* Call with the lock. */
+static void
+resolve_cache_add(struct gensio_os_funcs *o, const char *key,
+		  const char *result, int64_t now)
+{
+    struct resolve_cache_entry *c = NULL;
+    unsigned int i;
+    char *nkey, *nresult;
+
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+	struct resolve_cache_entry *c2 = &resolve_cache[i];
+
+	if (!c2->key || strcmp(c2->key, key) == 0) {
+	    c = c2;
+	    break;
+	}
+	/* Full, replace whatever expires first. */
+	if (!c || c2->expires < c->expires)
+	    c = c2;
+    }
+
+    nkey = gensio_strdup(o, key);
+    nresult = gensio_strdup(o, result);
+    if (!nkey || !nresult) {
+	if (nkey)
+	    o->free(o, nkey);
+	if (nresult)
+	    o->free(o, nresult);
+	return;
+    }
+    resolve_cache_clear_entry(c);
+    c->o = o;
+    c->key = nkey;
+    c->result = nresult;
+    c->expires = now + RESOLVE_CACHE_TTL;
+}
+
+/* Convert all the addresses to a string gensio_os_scan_netaddr() takes. */
+static char *
+resolve_addr_to_numeric(struct gensio_os_funcs *o,
+			const struct gensio_addr *addr)
+{
+    struct gensio_addr a = *addr;
+    gensiods pos = 0, len = 0;
+    char *buf = NULL;
+    bool first;
+
+    for (;;) {
+	first = true;
+	for (a.curr = a.a; a.curr; a.curr = a.curr->ai_next) {
+	    if (!first)
+		gensio_pos_snprintf(buf, len, &pos, ",");
+	    first = false;
+	    if (gensio_addr_to_str(&a, buf, &pos, len)) {
+		if (buf)
+		    o->free(o, buf);
+		return NULL;
+	    }
+	}
+	if (buf)
+	    return buf;
+	len = pos + 1;
+	pos = 0;
+	buf = o->zalloc(o, len);
+	if (!buf)
+	    return NULL;
+    }
+}
+
+static void
+resolve_lookup(struct gensio_resolve_req *req)
+{
+    struct gensio_os_funcs *o = req->o;
+    gensio_os_resolver func;
+    char *numeric;
+
+    /* gensio_os_set_resolver() may change this from another thread. */
+    resolve_lock();
+    func = resolve_func;
+    resolve_unlock();
+
+    req->err = func(o, req->str, req->listen, req->gprotocol, &req->addr);
+    if (req->err)
+	return;
+
+    numeric = resolve_addr_to_numeric(o, req->addr);
+    if (numeric) {
+	int64_t now = resolve_now(o);
+
+	resolve_lock();
+	resolve_cache_add(o, req->key, numeric, now);
+	resolve_unlock();
+	o->free(o, numeric);
+    }
+}
+
+static void
+resolve_req_free(struct gensio_resolve_req *req)
+{
+    struct gensio_os_funcs *o = req->o;
+
+    if (req->runner)
+	o->free_runner(req->runner);
+    if (req->str)
+	o->free(o, req->str);
+    if (req->key)
+	o->free(o, req->key);
+    o->free(o, req);
+}
+
+static void
+resolve_deliver(struct gensio_runner *runner, void *cb_data)
+{
+    struct gensio_resolve_req *req = cb_data;
+
+#ifndef USE_PTHREADS
+    /* No threads, do it here so at least the caller doesn't block. */
+    resolve_lookup(req);
+#endif
+    req->done(req->o, req->err, req->addr, req->cb_data);
+    resolve_req_free(req);
+}
+
+#ifdef USE_PTHREADS
+static void *
+resolve_thread(void *data)
+{
+    struct gensio_resolve_req *req;
+    struct resolve_active active;
+    struct timespec ts;
+    int rv;
+
+    resolve_lock();
+    for (;;) {
+	while (gensio_list_empty(&resolve_queue)) {
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += RESOLVE_THREAD_IDLE;
+	    resolve_idle_threads++;
+	    rv = pthread_cond_timedwait(&resolve_cond, &resolve_lock, &ts);
+	    resolve_idle_threads--;
+	    if (rv == ETIMEDOUT && gensio_list_empty(&resolve_queue)) {
+		resolve_nr_threads--;
+		resolve_unlock();
+		return NULL;
+	    }
+	}
+	req = gensio_container_of(gensio_list_first(&resolve_queue),
+				  struct gensio_resolve_req, link);
+	gensio_list_rm(&resolve_queue, &req->link);
+	/* Keep gensio_cleanup_mem() from finishing while we use req->o. */
+	active.o = req->o;
+	gensio_list_add_tail(&resolve_active_list, &active.link);
+	resolve_unlock();
+
+	resolve_lookup(req);
+	/* req may be freed as soon as this is run. */
+	req->o->run(req->runner);
+
+	resolve_lock();
+	gensio_list_rm(&resolve_active_list, &active.link);
+	pthread_cond_broadcast(&resolve_active_cond);
+    }
+}
+
+static int
+resolve_queue_req(struct gensio_resolve_req *req)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int rv = 0;
+
+    resolve_lock();
+    if (!resolve_queue_inited) {
+	gensio_list_init(&resolve_queue);
+	gensio_list_init(&resolve_active_list);
+	resolve_queue_inited = true;
+    }
+    gensio_list_add_tail(&resolve_queue, &req->link);
+    if (resolve_idle_threads > 0) {
+	pthread_cond_signal(&resolve_cond);
+    } else if (resolve_nr_threads < RESOLVE_MAX_THREADS) {
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rv = pthread_create(&tid, &attr, resolve_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (!rv) {
+	    resolve_nr_threads++;
+	} else if (resolve_nr_threads > 0) {
+	    /* A running thread will get to it. */
+	    rv = 0;
+	} else {
+	    gensio_list_rm(&resolve_queue, &req->link);
+	    rv = GE_NOMEM;
+	}
+    }
+    resolve_unlock();
+
+    return rv;
+}
+#else
+static int
+resolve_queue_req(struct gensio_resolve_req *req)
+{
+    return req->o->run(req->runner);
+}
+#endif
+
+int
+gensio_os_scan_netaddr_async(struct gensio_os_funcs *o, const char *str,
+			     bool listen, int gprotocol,
+			     gensio_os_resolve_done done, void *cb_data,
+			     struct gensio_addr **raddr)
+{
+    struct gensio_resolve_req *req;
+    char *key, *cached;
+    int rv;
+
+    /* Unix addresses never need a lookup. */
+    if (gprotocol == GENSIO_NET_PROTOCOL_UNIX)
+	return gensio_os_scan_netaddr(o, str, listen, gprotocol, raddr);
+
+    if (do_errtrig())
+	return GE_NOMEM;
+
+    key = gensio_alloc_sprintf(o, "%d,%d,%s", listen, gprotocol, str);
+    if (!key)
+	return GE_NOMEM;
+
+    resolve_lock();
+    cached = resolve_cache_lookup(o, key, resolve_now(o));
+    resolve_unlock();
+    if (cached) {
+	rv = gensio_os_scan_netaddr(o, cached, listen, gprotocol, raddr);
+	o->free(o, cached);
+	if (!rv) {
+	    o->free(o, key);
+	    return 0;
+	}
+    }
+
+    req = o->zalloc(o, sizeof(*req));
+    if (!req) {
+	o->free(o, key);
+	return GE_NOMEM;
+    }
+    req->o = o;
+    req->key = key;
+    req->listen = listen;
+    req->gprotocol = gprotocol;
+    req->done = done;
+    req->cb_data = cb_data;
+    req->str = gensio_strdup(o, str);
+    if (!req->str)
+	goto out_nomem;
+    req->runner = o->alloc_runner(o, resolve_deliver, req);
+    if (!req->runner)
+	goto out_nomem;
+
+    rv = resolve_queue_req(req);
+    if (rv) {
+	resolve_req_free(req);
+	return rv;
+    }
+
+    return GE_INPROGRESS;
+
+ out_nomem:
+    resolve_req_free(req);
+    return GE_NOMEM;
+}
+
+void
+gensio_os_set_resolver(gensio_os_resolver resolver)
+{
+    unsigned int i;
+
+    resolve_lock();
+    if (resolver)
+	resolve_func = resolver;
+    else
+	resolve_func = gensio_os_scan_netaddr;
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++)
+	resolve_cache_clear_entry(&resolve_cache[i]);
+    resolve_unlock();
+}
+
+void
+gensio_os_resolve_cleanup_mem(struct gensio_os_funcs *o)
+{
+    unsigned int i;
+#ifdef USE_PTHREADS
+    struct gensio_link *l, *l2;
+    struct gensio_resolve_req *req;
+    struct resolve_active *active;
+    bool busy;
+#endif
+
+    resolve_lock();
+#ifdef USE_PTHREADS
+    if (resolve_queue_inited) {
+	/* Nobody is waiting for these any more, just drop them. */
+	gensio_list_for_each_safe(&resolve_queue, l, l2) {
+	    req = gensio_container_of(l, struct gensio_resolve_req, link);
+	    if (req->o == o) {
+		gensio_list_rm(&resolve_queue, l);
+		resolve_req_free(req);
+	    }
+	}
+
+	/* Wait for lookups in progress on o. */
+	do {
+	    busy = false;
+	    gensio_list_for_each(&resolve_active_list, l) {
+		active = gensio_container_of(l, struct resolve_active, link);
+		if (active->o == o) {
+		    busy = true;
+		    break;
+		}
+	    }
+	    if (busy)
+		pthread_cond_wait(&resolve_active_cond, &resolve_lock);
+	} while (busy);
+    }
+#endif
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+	if (resolve_cache[i].o == o)
+	    resolve_cache_clear_entry(&resolve_cache[i]);
+    }
+    resolve_unlock();
+}
+
 static struct addrinfo *
 addrinfo_dup(struct gensio_os_funcs *o, struct addrinfo *iai)
 {
@@ -2386,6 +3722,29 @@ gensio_addr_cat(const struct gensio_addr *addr1,
     return NULL;
 }
 
+struct gensio_addr *
+gensio_addr_copy(const struct gensio_addr *iaddr)
+{
+    struct gensio_os_funcs *o = iaddr->o;
+    struct gensio_addr *addr;
+    int rv;
+
+    addr = gensio_addr_make(o, 0);
+    if (!addr)
+	return NULL;
+
+    rv = addrinfo_list_dup(o, iaddr->a, &addr->a, NULL);
+    if (rv) {
+	addrinfo_list_free(o, addr->a);
+	addr->a = NULL;
+	gensio_addr_free(addr);
+	return NULL;
+    }
+    addr->curr = addr->a;
+
+    return addr;
+}
+
 bool
 gensio_addr_cmp(const struct gensio_addr *addr1,
 		const struct gensio_addr *addr2,
@@ -0,0 +1,541 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: LGPL-2.1-only
+ */
+
+/*
+ * This code keeps a pool of open client gensios created from the
+ * same string so they can be reused without going through the whole
+ * connection setup again.
+ */
+
+#include "config.h"
+#include <gensio/gensio.h>
+#include <gensio/gensio_list.h>
+
+enum pool_entry_state {
+    POOL_ENTRY_IN_OPEN,
+    POOL_ENTRY_IN_USE,
+    POOL_ENTRY_IDLE,
+    POOL_ENTRY_IN_CLOSE
+};
+
+struct pool_entry {
+    struct gensio_link link; /* On the all list. */
+    struct gensio_link idle_link; /* On the idle or deliver list. */
+    struct gensio_pool *pool;
+    struct gensio *io;
+    enum pool_entry_state state;
+    gensio_time idle_since;
+
+    gensio_pool_done done;
+    void *done_data;
+};
+
+struct gensio_pool {
+    struct gensio_os_funcs *o;
+    struct gensio_lock *lock;
+    unsigned int refcount;
+    bool freed;
+
+    char *str;
+    unsigned int max_size;
+    gensio_time idle_timeout;
+
+    struct gensio_list all; /* Every entry, however it is being used. */
+    unsigned int nr_entries;
+
+    /* Oldest at the head, get takes from the tail. */
+    struct gensio_list idle;
+
+    struct gensio_timer *timer;
+    bool timer_running;
+
+    /* Idle entries handed out that need their done called. */
+    struct gensio_list deliver;
+    struct gensio_runner *runner;
+    bool runner_pending;
+};
+
+static void
+pool_lock(struct gensio_pool *pool)
+{
+    pool->o->lock(pool->lock);
+}
+
+static void
+pool_unlock(struct gensio_pool *pool)
+{
+    pool->o->unlock(pool->lock);
+}
+
+static void
+pool_finish_free(struct gensio_pool *pool)
+{
+    struct gensio_os_funcs *o = pool->o;
+
+    if (pool->runner)
+	o->free_runner(pool->runner);
+    if (pool->timer)
+	o->free_timer(pool->timer);
+    if (pool->lock)
+	o->free_lock(pool->lock);
+    if (pool->str)
+	o->free(o, pool->str);
+    o->free(o, pool);
+}
+
+static void
+pool_deref_and_unlock(struct gensio_pool *pool)
+{
+    unsigned int count;
+
+    count = --pool->refcount;
+    pool_unlock(pool);
+    if (count == 0)
+	pool_finish_free(pool);
+}
+
+static int64_t
+pool_time_diff_ns(const gensio_time *a, const gensio_time *b)
+{
+    return (a->secs - b->secs) * 1000000000 + (a->nsecs - b->nsecs);
+}
+
+/* Called with the lock held. */
+static void
+pool_start_timer(struct gensio_pool *pool)
+{
+    struct pool_entry *e;
+    gensio_time now, timeout;
+    int64_t left;
+
+    if (pool->timer_running || pool->freed || gensio_list_empty(&pool->idle))
+	return;
+
+    e = gensio_container_of(gensio_list_first(&pool->idle),
+			    struct pool_entry, idle_link);
+    pool->o->get_monotonic_time(pool->o, &now);
+    left = (pool->idle_timeout.secs * 1000000000 + pool->idle_timeout.nsecs
+	    - pool_time_diff_ns(&now, &e->idle_since));
+    if (left < 0)
+	left = 0;
+    timeout.secs = left / 1000000000;
+    timeout.nsecs = left % 1000000000;
+    if (pool->o->start_timer(pool->timer, &timeout) == 0) {
+	pool->timer_running = true;
+	pool->refcount++;
+    }
+}
+
+static void
+pool_entry_close_done(struct gensio *io, void *close_data)
+{
+    struct pool_entry *e = close_data;
+    struct gensio_pool *pool = e->pool;
+
+    gensio_free(io);
+    pool_lock(pool);
+    gensio_list_rm(&pool->all, &e->link);
+    pool->nr_entries--;
+    pool->o->free(pool->o, e);
+    pool_deref_and_unlock(pool);
+}
+
+/*
+ * Take an entry out of use and shut it down.  The entry must already
+ * be in the IN_CLOSE state and off the idle list.  Called without
+ * the lock.
+ */
+static void
+pool_entry_close(struct pool_entry *e)
+{
+    gensio_set_read_callback_enable(e->io, false);
+    gensio_set_write_callback_enable(e->io, false);
+    if (gensio_close(e->io, pool_entry_close_done, e))
+	/* Already closed by an error, just get rid of it. */
+	pool_entry_close_done(e->io, e);
+}
+
+/* Called with the lock held. */
+static void
+pool_entry_evict(struct pool_entry *e, struct gensio_list *to_close)
+{
+    gensio_list_rm(&e->pool->idle, &e->idle_link);
+    e->state = POOL_ENTRY_IN_CLOSE;
+    gensio_list_add_tail(to_close, &e->idle_link);
+}
+
+static void
+pool_close_list(struct gensio_list *to_close)
+{
+    struct gensio_link *l, *l2;
+
+    gensio_list_for_each_safe(to_close, l, l2) {
+	struct pool_entry *e = gensio_container_of(l, struct pool_entry,
+						   idle_link);
+
+	gensio_list_rm(to_close, l);
+	pool_entry_close(e);
+    }
+}
+
+/*
+ * The pool's callback while it owns the gensio.  An idle connection
+ * should never have anything to read, so any data or error means it
+ * is dead or out of sync with the remote end and it is thrown away.
+ */
+static int
+pool_entry_event(struct gensio *io, void *user_data, int event, int err,
+		 unsigned char *buf, gensiods *buflen,
+		 const char *const *auxdata)
+{
+    struct pool_entry *e = user_data;
+    struct gensio_pool *pool = e->pool;
+    struct gensio_list to_close;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+
+    gensio_list_init(&to_close);
+    pool_lock(pool);
+    if (e->state == POOL_ENTRY_IDLE) {
+	pool_entry_evict(e, &to_close);
+    } else {
+	/* Handed out while this was coming in, leave it for the user. */
+	gensio_set_read_callback_enable(io, false);
+	if (buflen)
+	    *buflen = 0;
+    }
+    pool_unlock(pool);
+
+    pool_close_list(&to_close);
+    return 0;
+}
+
+/*
+ * Close idle entries that have been idle too long.  This only looks
+ * at the age, it doesn't probe them, dead ones are only found by
+ * pool_entry_event().
+ */
+static void
+pool_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct gensio_pool *pool = cb_data;
+    struct gensio_list to_close;
+    struct gensio_link *l, *l2;
+    gensio_time now;
+    int64_t timeout_ns;
+
+    gensio_list_init(&to_close);
+    timeout_ns = pool->idle_timeout.secs * 1000000000
+	+ pool->idle_timeout.nsecs;
+    pool->o->get_monotonic_time(pool->o, &now);
+
+    pool_lock(pool);
+    pool->timer_running = false;
+    gensio_list_for_each_safe(&pool->idle, l, l2) {
+	struct pool_entry *e = gensio_container_of(l, struct pool_entry,
+						   idle_link);
+
+	if (pool_time_diff_ns(&now, &e->idle_since) < timeout_ns)
+	    break;
+	pool_entry_evict(e, &to_close);
+    }
+    pool_start_timer(pool);
+    pool_unlock(pool);
+
+    pool_close_list(&to_close);
+
+    pool_lock(pool);
+    pool_deref_and_unlock(pool);
+}
+
+static void
+pool_timer_stopped(struct gensio_timer *t, void *cb_data)
+{
+    struct gensio_pool *pool = cb_data;
+
+    pool_lock(pool);
+    pool->timer_running = false;
+    pool_deref_and_unlock(pool);
+}
+
+static void
+pool_deliver(struct gensio_runner *runner, void *cb_data)
+{
+    struct gensio_pool *pool = cb_data;
+    struct pool_entry *e;
+
+    pool_lock(pool);
+    while (!gensio_list_empty(&pool->deliver)) {
+	e = gensio_container_of(gensio_list_first(&pool->deliver),
+				struct pool_entry, idle_link);
+	gensio_list_rm(&pool->deliver, &e->idle_link);
+	pool_unlock(pool);
+	e->done(pool, e->io, 0, e->done_data);
+	pool_lock(pool);
+    }
+    pool->runner_pending = false;
+    pool_deref_and_unlock(pool);
+}
+
+static void
+pool_entry_open_done(struct gensio *io, int err, void *open_data)
+{
+    struct pool_entry *e = open_data;
+    struct gensio_pool *pool = e->pool;
+
+    pool_lock(pool);
+    if (err) {
+	gensio_list_rm(&pool->all, &e->link);
+	pool->nr_entries--;
+    } else {
+	e->state = POOL_ENTRY_IN_USE;
+    }
+    pool_unlock(pool);
+
+    if (err) {
+	gensio_free(io);
+	e->done(pool, NULL, err, e->done_data);
+	pool->o->free(pool->o, e);
+	pool_lock(pool);
+	pool_deref_and_unlock(pool);
+    } else {
+	e->done(pool, io, 0, e->done_data);
+    }
+}
+
+int
+gensio_pool_alloc(struct gensio_os_funcs *o, const char *str,
+		  unsigned int max_size, const gensio_time *idle_timeout,
+		  struct gensio_pool **rpool)
+{
+    struct gensio_pool *pool;
+
+    if (!str)
+	return GE_INVAL;
+
+    pool = o->zalloc(o, sizeof(*pool));
+    if (!pool)
+	return GE_NOMEM;
+
+    pool->o = o;
+    pool->refcount = 1;
+    pool->max_size = max_size;
+    if (idle_timeout) {
+	pool->idle_timeout = *idle_timeout;
+    } else {
+	pool->idle_timeout.secs = GENSIO_POOL_DEFAULT_IDLE_TIMEOUT;
+	pool->idle_timeout.nsecs = 0;
+    }
+    gensio_list_init(&pool->all);
+    gensio_list_init(&pool->idle);
+    gensio_list_init(&pool->deliver);
+
+    pool->str = gensio_strdup(o, str);
+    if (!pool->str)
+	goto out_nomem;
+    pool->lock = o->alloc_lock(o);
+    if (!pool->lock)
+	goto out_nomem;
+    pool->timer = o->alloc_timer(o, pool_timeout, pool);
+    if (!pool->timer)
+	goto out_nomem;
+    pool->runner = o->alloc_runner(o, pool_deliver, pool);
+    if (!pool->runner)
+	goto out_nomem;
+
+    *rpool = pool;
+    return 0;
+
+ out_nomem:
+    pool_finish_free(pool);
+    return GE_NOMEM;
+}
+
+int
+gensio_pool_get(struct gensio_pool *pool, gensio_pool_done done,
+		void *done_data)
+{
+    struct gensio_os_funcs *o = pool->o;
+    struct pool_entry *e;
+    int err;
+
+    pool_lock(pool);
+    if (pool->freed) {
+	err = GE_NOTREADY;
+	goto out_unlock;
+    }
+
+    if (!gensio_list_empty(&pool->idle)) {
+	/* Use the most recently used one, it's the least likely to be stale. */
+	e = gensio_container_of(gensio_list_last(&pool->idle),
+				struct pool_entry, idle_link);
+	gensio_list_rm(&pool->idle, &e->idle_link);
+	e->state = POOL_ENTRY_IN_USE;
+	e->done = done;
+	e->done_data = done_data;
+	gensio_set_read_callback_enable(e->io, false);
+	gensio_list_add_tail(&pool->deliver, &e->idle_link);
+	if (!pool->runner_pending) {
+	    pool->runner_pending = true;
+	    pool->refcount++;
+	    o->run(pool->runner);
+	}
+	err = 0;
+	goto out_unlock;
+    }
+
+    if (pool->max_size && pool->nr_entries >= pool->max_size) {
+	err = GE_INUSE;
+	goto out_unlock;
+    }
+
+    e = o->zalloc(o, sizeof(*e));
+    if (!e) {
+	err = GE_NOMEM;
+	goto out_unlock;
+    }
+    e->pool = pool;
+    e->state = POOL_ENTRY_IN_OPEN;
+    e->done = done;
+    e->done_data = done_data;
+
+    err = str_to_gensio(pool->str, o, pool_entry_event, e, &e->io);
+    if (err) {
+	o->free(o, e);
+	goto out_unlock;
+    }
+
+    gensio_list_add_tail(&pool->all, &e->link);
+    pool->nr_entries++;
+    pool->refcount++;
+    pool_unlock(pool);
+
+    err = gensio_open(e->io, pool_entry_open_done, e);
+    if (err) {
+	gensio_free(e->io);
+	pool_lock(pool);
+	gensio_list_rm(&pool->all, &e->link);
+	pool->nr_entries--;
+	o->free(o, e);
+	pool->refcount--;
+	goto out_unlock;
+    }
+    return 0;
+
+ out_unlock:
+    pool_unlock(pool);
+    return err;
+}
+
+struct gensio_pool_get_s_data {
+    struct gensio_os_funcs *o;
+    struct gensio_waiter *waiter;
+    struct gensio *io;
+    int err;
+};
+
+static void
+gensio_pool_get_s_done(struct gensio_pool *pool, struct gensio *io, int err,
+		       void *done_data)
+{
+    struct gensio_pool_get_s_data *data = done_data;
+
+    data->io = io;
+    data->err = err;
+    data->o->wake(data->waiter);
+}
+
+int
+gensio_pool_get_s(struct gensio_pool *pool, struct gensio **io)
+{
+    struct gensio_os_funcs *o = pool->o;
+    struct gensio_pool_get_s_data data;
+    int err;
+
+    data.o = o;
+    data.io = NULL;
+    data.err = 0;
+    data.waiter = o->alloc_waiter(o);
+    if (!data.waiter)
+	return GE_NOMEM;
+    err = gensio_pool_get(pool, gensio_pool_get_s_done, &data);
+    if (!err) {
+	o->wait(data.waiter, 1, NULL);
+	err = data.err;
+	if (!err)
+	    *io = data.io;
+    }
+    o->free_waiter(data.waiter);
+    return err;
+}
+
+int
+gensio_pool_put(struct gensio_pool *pool, struct gensio *io, bool reuse)
+{
+    struct gensio_link *l;
+    struct pool_entry *e = NULL;
+
+    pool_lock(pool);
+    gensio_list_for_each(&pool->all, l) {
+	struct pool_entry *e2 = gensio_container_of(l, struct pool_entry,
+						    link);
+
+	if (e2->io == io && e2->state == POOL_ENTRY_IN_USE) {
+	    e = e2;
+	    break;
+	}
+    }
+    if (!e) {
+	pool_unlock(pool);
+	return GE_NOTFOUND;
+    }
+
+    gensio_set_write_callback_enable(io, false);
+    gensio_set_callback(io, pool_entry_event, e);
+    if (!reuse || pool->freed) {
+	e->state = POOL_ENTRY_IN_CLOSE;
+	pool_unlock(pool);
+	pool_entry_close(e);
+	return 0;
+    }
+
+    e->state = POOL_ENTRY_IDLE;
+    pool->o->get_monotonic_time(pool->o, &e->idle_since);
+    gensio_list_add_tail(&pool->idle, &e->idle_link);
+    /* Catch the remote end closing or sending garbage while idle. */
+    gensio_set_read_callback_enable(io, true);
+    pool_start_timer(pool);
+    pool_unlock(pool);
+
+    return 0;
+}
+
+void
+gensio_pool_free(struct gensio_pool *pool)
+{
+    struct gensio_list to_close;
+    struct gensio_link *l, *l2;
+
+    gensio_list_init(&to_close);
+    pool_lock(pool);
+    pool->freed = true;
+    if (pool->timer_running)
+	pool->o->stop_timer_with_done(pool->timer, pool_timer_stopped, pool);
+    gensio_list_for_each_safe(&pool->idle, l, l2) {
+	struct pool_entry *e = gensio_container_of(l, struct pool_entry,
+						   idle_link);
+
+	pool_entry_evict(e, &to_close);
+    }
+    pool_unlock(pool);
+
+    pool_close_list(&to_close);
+
+    pool_lock(pool);
+    pool_deref_and_unlock(pool);
+}
@@ -753,7 +753,9 @@ sctpna_set_accept_callback_enable(struct gensio_accepter *accepter,
 {
     unsigned int i;
 
-    nadata->cb_en_done = done;
+    /* Internal throttling passes no done, don't lose a pending one. */
+    if (done)
+	nadata->cb_en_done = done;
     for (i = 0; i < nadata->nr_acceptfds; i++)
 	sctpna_set_fd_enables(nadata, enabled);
 
@@ -986,9 +988,14 @@ sctp_gensio_accepter_alloc(struct gensio_addr *iai,
     unsigned int instreams = 1, ostreams = 1;
     unsigned int sack_freq = 1, sack_delay = 10;
     bool nodelay = false, reuseaddr = true;
+    struct gensio_acc_limits limits;
     unsigned int i;
     int err, ival;
 
+    err = gensio_get_default_acc_limits(o, "sctp", &limits);
+    if (err)
+	return err;
+
     err = gensio_get_default(o, "sctp", "reuseaddr", false,
 			     GENSIO_DEFAULT_BOOL, NULL, &ival);
     if (err)
@@ -1022,6 +1029,8 @@ sctp_gensio_accepter_alloc(struct gensio_addr *iai,
 	    continue;
 	if (gensio_check_keybool(args[i], "reuseaddr", &reuseaddr) > 0)
 	    continue;
+	if (gensio_check_acc_limit(args[i], &limits) > 0)
+	    continue;
 	return GE_INVAL;
     }
 
@@ -1061,6 +1070,7 @@ sctp_gensio_accepter_alloc(struct gensio_addr *iai,
 
     nadata->max_read_size = max_read_size;
     nadata->nodelay = nodelay;
+    base_gensio_accepter_set_limits(nadata->acc, &limits);
 
     return 0;
 
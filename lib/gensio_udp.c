@@ -19,6 +19,8 @@
 #include <gensio/gensio_osops.h>
 #include <gensio/gensio_builtins.h>
 
+#include "utils.h"
+
 #ifdef ENABLE_INTERNAL_TRACE
 #define DEBUG_STATE
 #endif
@@ -29,8 +31,52 @@
  */
 #define GENSIO_DEFAULT_UDP_BUF_SIZE	65536
 
+/* The largest UDP payload, the biggest "segsize" makes sense for. */
+#define UDP_MAX_SEGSIZE			65507
+
+/* Space for queuing writes done while a receive batch is delivered. */
+#define UDP_TXQ_BUF_SIZE		65536
+
+static struct gensio_enum_val rxdrop_enums[] = {
+    { "tail",	0 },
+    { "head",	1 },
+    { NULL }
+};
+
 struct udpna_data;
 
+/* What the kernel told us about a received datagram. */
+struct udpn_rxinfo {
+    bool has_stamp;
+    gensio_time stamp;
+    uint64_t drops; /* Socket drops so far, when it was received. */
+};
+
+struct udpn_buf;
+
+/* A received datagram waiting on a connection's read queue. */
+struct udpn_pkt {
+    struct udpn_pkt *next;
+    struct udpn_buf *buf;
+    gensiods pos;
+};
+
+/*
+ * The data of a received datagram.  On a multicast hub one of these
+ * is shared by the read queues of all the consumers, it's freed when
+ * the last one is done with it.  The first queue uses the embedded
+ * pkt, so the normal unshared case is a single allocation.
+ */
+struct udpn_buf {
+    struct udpn_pkt pkt;
+    bool pkt_used;
+    unsigned int refcount;
+    struct gensio_addr *addr; /* Only for nocon, otherwise raddr. */
+    struct udpn_rxinfo info;
+    gensiods len;
+    unsigned char data[];
+};
+
 enum udpn_state {
     UDPN_CLOSED = 0,
     UDPN_IN_OPEN,
@@ -51,11 +97,12 @@ struct udpn_data {
     bool read_enabled;	/* Read callbacks are enabled. */
     bool write_enabled;	/* Write callbacks are enabled. */
     bool in_read;	/* Currently in a read callback. */
-    bool deferred_read;
+    bool deferred_read; /* Deliver the read queue from the deferred op. */
     bool in_write;	/* Currently in a write callback. */
     bool write_pending; /* Need to redo the write callback. */
     bool in_open_cb;	/* Currently in an open callback. */
     bool in_close_cb;	/* Currently in a close callback. */
+    int write_err;	/* A queued write failed, for the next write. */
 
     enum udpn_state state;
     bool freed;		/* Freed during the close process. */
@@ -71,9 +118,57 @@ struct udpn_data {
 
     struct gensio_addr *raddr;		/* Points to remote, for convenience. */
 
+    /* The "addr:" read auxdata, preformatted on connected sockets. */
+    char *raddr_aux;
+
+    /*
+     * Datagrams received while the user is not reading, or is still
+     * handling an earlier one.  At most rq_max are held, past that
+     * the newest (tail drop) or oldest (head drop) one is dropped.
+     */
+    struct udpn_pkt *rq_head;
+    struct udpn_pkt *rq_tail;
+    unsigned int rq_len;
+    unsigned int rq_max;
+    bool rq_drop_head;
+    uint64_t rq_drops;
+
     struct gensio_link link;
+
+    /*
+     * The idle sweep generation when a datagram last came in, and set
+     * when the idle sweep times the connection out.  A timed out
+     * connection is moved to closed_udpns, so it gets no more data
+     * and new data from the remote end starts a new connection.  The
+     * user gets a GE_TIMEDOUT read error, writes fail with
+     * GE_TIMEDOUT, and the user must close it.
+     */
+    unsigned int rx_gen;
+    bool idled;
+    bool idle_reported;
+    bool deferred_idle; /* Report the timeout from the deferred op. */
+
+    /* Hash of raddr and the next entry in the udpn_list hash chain. */
+    uint32_t hashval;
+    struct udpn_data *hash_next;
+};
+
+/*
+ * A list of udpns, kept in order of addition for iteration, with a
+ * hash table on the remote address so a received packet can be
+ * matched with its udpn quickly.  The table grows as needed.
+ */
+struct udpn_list {
+    struct gensio_list list;
+    struct udpn_data **hash;
+    unsigned int hash_size; /* Always a power of 2 */
+    unsigned int count;
 };
 
+#define UDPN_HASH_INIT_SIZE	16
+
+#define UDPNA_IDLE_SWEEPS	4
+
 #define gensio_link_to_ndata(l) \
     gensio_container_of(l, struct udpn_data, link);
 
@@ -102,7 +197,7 @@ struct udp_state_trace {
 
 struct udpna_data {
     struct gensio_accepter *acc;
-    struct gensio_list udpns;
+    struct udpn_list udpns;
     unsigned int udpn_count;
     unsigned int refcount;
 
@@ -112,13 +207,64 @@ struct udpna_data {
 
     gensiods max_read_size;
 
-    unsigned char *read_data;
+    /* Received datagrams, up to nr_rmsgs are read at once. */
+    unsigned char *rbuf;
+    struct gensio_os_recvmsg *rmsgs;
+    unsigned int nr_rmsgs;
 
-    gensiods data_pending_len;
-    gensiods data_pos;
-    struct udpn_data *pending_data_owner;
+    /* Per-connection read queue settings, see udpn_data. */
+    unsigned int rq_max;
+    bool rq_drop_head;
 
-    struct gensio_list closed_udpns;
+    /*
+     * Turn on UDP_GRO for the sockets, coalesced receives are split
+     * back into datagrams in the read handler.
+     */
+    bool gro;
+
+    /* Pass the kernel receive timestamp up in the read auxdata. */
+    bool rx_timestamp;
+
+    /*
+     * Idle connection reaping.  Rather than a timer per connection,
+     * one timer sweeps all the connections every idle_timeout / 4
+     * and bumps idle_gen.  A connection that hasn't received
+     * anything for more than UDPNA_IDLE_SWEEPS sweeps is timed out.
+     */
+    unsigned int idle_timeout; /* In milliseconds, 0 is off. */
+    unsigned int idle_gen;
+    struct gensio_timer *idle_timer;
+    bool idle_timer_running;
+
+    /*
+     * Datagrams the kernel dropped on our sockets because they were
+     * full.  The kernel gives a running count per socket, fd_drops
+     * holds the last one seen for each of fds.
+     */
+    uint64_t kernel_drops;
+    uint32_t *fd_drops;
+
+    /*
+     * Set while received datagrams are being handed out.  Writes done
+     * while a batch of received datagrams is being delivered are
+     * copied into txq_buf and sent together with one
+     * gensio_os_sendmmsg() at the end of the batch.  If the socket
+     * can't take them all, the rest stay on the queue, txq_blocked
+     * is set, and they are sent from the write handler.  Writes
+     * return a zero count until then.  txq_owner is the gensio that
+     * did each write, to report a send error to it.
+     */
+    bool in_rx_batch;
+    bool txq_blocked;
+    unsigned char *txq_buf;
+    gensiods txq_buf_used;
+    int txq_fd;
+    unsigned int txq_count;
+    struct gensio_sg txq_sg[GENSIO_OS_MAX_MMSG];
+    struct gensio_os_sendmsg txq[GENSIO_OS_MAX_MMSG];
+    struct udpn_data *txq_owner[GENSIO_OS_MAX_MMSG];
+
+    struct udpn_list closed_udpns;
 
     /*
      * Used to run read callbacks from the selector to avoid running
@@ -147,8 +293,30 @@ struct udpna_data {
     unsigned int   nr_fds;
     unsigned int opensock_flags;
 
+    /* sndbuf, rcvbuf, and busy_poll, applied to every socket. */
+    struct gensio_sockopts sockopts;
+
     bool nocon;		/* Disable connection-oriented handling. */
-    struct gensio_addr *curr_recvaddr;	/* Address of current received packet */
+
+    /*
+     * The client socket is connect()ed to the remote address.  The
+     * kernel filters out anything from elsewhere, so received
+     * datagrams all go to the one gensio without looking at the
+     * source address, and sends don't give a destination.
+     */
+    bool connected;
+
+    /*
+     * A multicast hub, one socket shared by all the client gensios
+     * in the process with the same laddr and mcast addresses.  Every
+     * datagram goes on the read queue of every consumer.  The hub is
+     * found on udp_hubs by hub_laddr and hub_mcast, these are only
+     * set while it is on the list.
+     */
+    bool hub;
+    struct gensio_addr *hub_laddr;
+    struct gensio_addr *hub_mcast;
+    struct gensio_link hub_link;
 
     bool in_write;
     unsigned int read_disable_count;
@@ -163,6 +331,40 @@ struct udpna_data {
 
 static void udpna_do_free(struct udpna_data *nadata);
 
+/* The multicast hubs, udp_hub_lock nests outside the udpna locks. */
+static struct gensio_once udp_hub_initialized;
+static struct gensio_lock *udp_hub_lock;
+static struct gensio_list udp_hubs;
+static int udp_hub_init_rv;
+
+static void
+udp_hub_do_init(void *cb_data)
+{
+    struct gensio_os_funcs *o = cb_data;
+
+    gensio_list_init(&udp_hubs);
+    udp_hub_lock = o->alloc_lock(o);
+    if (!udp_hub_lock)
+	udp_hub_init_rv = GE_NOMEM;
+}
+
+static int
+udp_hub_init(struct gensio_os_funcs *o)
+{
+    o->call_once(o, &udp_hub_initialized, udp_hub_do_init, o);
+    return udp_hub_init_rv;
+}
+
+void
+udp_gensio_cleanup_mem(struct gensio_os_funcs *o)
+{
+    if (udp_hub_lock)
+	o->free_lock(udp_hub_lock);
+    udp_hub_lock = NULL;
+    udp_hub_init_rv = 0;
+    memset(&udp_hub_initialized, 0, sizeof(udp_hub_initialized));
+}
+
 static void
 i_udpna_lock(struct udpna_data *nadata)
 {
@@ -291,30 +493,100 @@ static void udpna_start_deferred_op(struct udpna_data *nadata)
     }
 }
 
+static int
+udpn_list_init(struct gensio_os_funcs *o, struct udpn_list *list)
+{
+    gensio_list_init(&list->list);
+    list->count = 0;
+    list->hash = o->zalloc(o, sizeof(*list->hash) * UDPN_HASH_INIT_SIZE);
+    if (!list->hash)
+	return GE_NOMEM;
+    list->hash_size = UDPN_HASH_INIT_SIZE;
+    return 0;
+}
+
 static void
-udpn_remove_from_list(struct gensio_list *list, struct udpn_data *ndata)
+udpn_list_cleanup(struct gensio_os_funcs *o, struct udpn_list *list)
 {
-    gensio_list_rm(list, &ndata->link);
+    if (list->hash)
+	o->free(o, list->hash);
+    list->hash = NULL;
 }
 
-static struct udpn_data *
-udpn_find(struct gensio_list *list, struct gensio_addr *addr)
+/*
+ * Grow the hash table to new_size.  If the allocation fails the old
+ * table is kept, it still works, just with longer chains.
+ */
+static void
+udpn_list_rehash(struct gensio_os_funcs *o, struct udpn_list *list,
+		 unsigned int new_size)
 {
-    struct gensio_link *l;
+    struct udpn_data **new_hash, *ndata, *next;
+    unsigned int i, bucket;
 
-    gensio_list_for_each(list, l) {
-	struct udpn_data *ndata = gensio_link_to_ndata(l);
+    new_hash = o->zalloc(o, sizeof(*new_hash) * new_size);
+    if (!new_hash)
+	return;
+
+    for (i = 0; i < list->hash_size; i++) {
+	for (ndata = list->hash[i]; ndata; ndata = next) {
+	    next = ndata->hash_next;
+	    bucket = ndata->hashval & (new_size - 1);
+	    ndata->hash_next = new_hash[bucket];
+	    new_hash[bucket] = ndata;
+	}
+    }
+    if (list->hash)
+	o->free(o, list->hash);
+    list->hash = new_hash;
+    list->hash_size = new_size;
+}
 
-	if (gensio_addr_equal(ndata->raddr, addr, true, false))
+static void
+udpn_remove_from_list(struct udpn_list *list, struct udpn_data *ndata)
+{
+    struct udpn_data **p;
+
+    gensio_list_rm(&list->list, &ndata->link);
+    list->count--;
+    p = &list->hash[ndata->hashval & (list->hash_size - 1)];
+    for (; *p; p = &(*p)->hash_next) {
+	if (*p == ndata) {
+	    *p = ndata->hash_next;
+	    break;
+	}
+    }
+    ndata->hash_next = NULL;
+}
+
+static struct udpn_data *
+udpn_find(struct udpn_list *list, struct gensio_addr *addr)
+{
+    struct udpn_data *ndata;
+    uint32_t hashval;
+
+    hashval = gensio_addr_hash(addr, true);
+    ndata = list->hash[hashval & (list->hash_size - 1)];
+    for (; ndata; ndata = ndata->hash_next) {
+	if (ndata->hashval == hashval &&
+		gensio_addr_equal(ndata->raddr, addr, true, false))
 	    return ndata;
     }
 
     return NULL;
 }
 
-static void udpn_add_to_list(struct gensio_list *list, struct udpn_data *ndata)
+static void udpn_add_to_list(struct udpn_list *list, struct udpn_data *ndata)
 {
-    gensio_list_add_tail(list, &ndata->link);
+    unsigned int bucket;
+
+    gensio_list_add_tail(&list->list, &ndata->link);
+    list->count++;
+    if (list->count > list->hash_size * 2)
+	udpn_list_rehash(ndata->o, list, list->hash_size * 2);
+    bucket = ndata->hashval & (list->hash_size - 1);
+    ndata->hash_next = list->hash[bucket];
+    list->hash[bucket] = ndata;
 }
 
 static void
@@ -404,6 +676,14 @@ udpna_do_free(struct udpna_data *nadata)
 {
     unsigned int i;
 
+    if (nadata->hub_laddr) {
+	nadata->o->lock(udp_hub_lock);
+	gensio_list_rm(&udp_hubs, &nadata->hub_link);
+	nadata->o->unlock(udp_hub_lock);
+	gensio_addr_free(nadata->hub_laddr);
+	gensio_addr_free(nadata->hub_mcast);
+    }
+
     for (i = 0; i < nadata->nr_fds; i++) {
 	if (nadata->fds[i].fd != -1)
 	    gensio_os_close(nadata->o, &nadata->fds[i].fd);
@@ -411,14 +691,29 @@ udpna_do_free(struct udpna_data *nadata)
 
     if (nadata->deferred_op_runner)
 	nadata->o->free_runner(nadata->deferred_op_runner);
+    if (nadata->idle_timer)
+	nadata->o->free_timer(nadata->idle_timer);
     if (nadata->ai)
 	gensio_addr_free(nadata->ai);
     if (nadata->fds)
 	nadata->o->free(nadata->o, nadata->fds);
-    if (nadata->curr_recvaddr)
-	gensio_addr_free(nadata->curr_recvaddr);
-    if (nadata->read_data)
-	nadata->o->free(nadata->o, nadata->read_data);
+    if (nadata->fd_drops)
+	nadata->o->free(nadata->o, nadata->fd_drops);
+    if (nadata->rmsgs) {
+	for (i = 0; i < nadata->nr_rmsgs; i++) {
+	    if (nadata->rmsgs[i].addr)
+		gensio_addr_free(nadata->rmsgs[i].addr);
+	}
+	nadata->o->free(nadata->o, nadata->rmsgs);
+    }
+    if (nadata->rbuf)
+	nadata->o->free(nadata->o, nadata->rbuf);
+    for (i = 0; i < nadata->txq_count; i++)
+	gensio_addr_free((struct gensio_addr *) nadata->txq[i].addr);
+    if (nadata->txq_buf)
+	nadata->o->free(nadata->o, nadata->txq_buf);
+    udpn_list_cleanup(nadata->o, &nadata->udpns);
+    udpn_list_cleanup(nadata->o, &nadata->closed_udpns);
     if (nadata->lock)
 	nadata->o->free_lock(nadata->lock);
     if (nadata->acc)
@@ -454,15 +749,184 @@ udpna_check_finish_free(struct udpna_data *nadata)
     }
 }
 
+static struct udpn_buf *
+udpn_buf_alloc(struct udpna_data *nadata, const unsigned char *data,
+	       gensiods len, struct gensio_addr *addr,
+	       const struct udpn_rxinfo *info)
+{
+    struct gensio_os_funcs *o = nadata->o;
+    struct udpn_buf *b;
+
+    b = o->zalloc(o, sizeof(*b) + len);
+    if (!b)
+	return NULL;
+    if (nadata->nocon) {
+	b->addr = gensio_addr_copy(addr);
+	if (!b->addr) {
+	    o->free(o, b);
+	    return NULL;
+	}
+    }
+    memcpy(b->data, data, len);
+    b->len = len;
+    b->info = *info;
+    b->refcount = 1;
+    return b;
+}
+
+static void
+udpn_buf_deref(struct gensio_os_funcs *o, struct udpn_buf *b)
+{
+    assert(b->refcount > 0);
+    if (--b->refcount > 0)
+	return;
+    if (b->addr)
+	gensio_addr_free(b->addr);
+    o->free(o, b);
+}
+
+/* Get a queue entry referencing b. */
+static struct udpn_pkt *
+udpn_buf_get_pkt(struct gensio_os_funcs *o, struct udpn_buf *b)
+{
+    struct udpn_pkt *pkt;
+
+    if (!b->pkt_used) {
+	pkt = &b->pkt;
+	b->pkt_used = true;
+    } else {
+	pkt = o->zalloc(o, sizeof(*pkt));
+	if (!pkt)
+	    return NULL;
+    }
+    pkt->buf = b;
+    b->refcount++;
+    return pkt;
+}
+
+static void
+udpn_pkt_free(struct udpn_data *ndata, struct udpn_pkt *pkt)
+{
+    struct udpn_buf *b = pkt->buf;
+
+    if (pkt != &b->pkt)
+	ndata->o->free(ndata->o, pkt);
+    udpn_buf_deref(ndata->o, b);
+}
+
+static struct udpn_pkt *
+udpn_rq_pop(struct udpn_data *ndata)
+{
+    struct udpn_pkt *pkt = ndata->rq_head;
+
+    if (pkt) {
+	ndata->rq_head = pkt->next;
+	if (!ndata->rq_head)
+	    ndata->rq_tail = NULL;
+	ndata->rq_len--;
+	pkt->next = NULL;
+    }
+    return pkt;
+}
+
+static void
+udpn_rq_flush(struct udpn_data *ndata)
+{
+    struct udpn_pkt *pkt;
+
+    while ((pkt = udpn_rq_pop(ndata)))
+	udpn_pkt_free(ndata, pkt);
+}
+
+static void
+udpn_rq_put(struct udpn_data *ndata, struct udpn_pkt *pkt, bool at_head)
+{
+    if (at_head) {
+	pkt->next = ndata->rq_head;
+	ndata->rq_head = pkt;
+	if (!ndata->rq_tail)
+	    ndata->rq_tail = pkt;
+    } else {
+	if (ndata->rq_tail)
+	    ndata->rq_tail->next = pkt;
+	else
+	    ndata->rq_head = pkt;
+	ndata->rq_tail = pkt;
+    }
+    ndata->rq_len++;
+}
+
+/*
+ * Make room on the read queue for a new datagram per the drop
+ * policy.  Returns false if the new datagram should be dropped.
+ */
+static bool
+udpn_rq_make_room(struct udpn_data *ndata)
+{
+    if (ndata->rq_len < ndata->rq_max)
+	return true;
+    ndata->rq_drops++;
+    if (!ndata->rq_drop_head || !ndata->rq_head)
+	return false;
+    udpn_pkt_free(ndata, udpn_rq_pop(ndata));
+    return true;
+}
+
+/*
+ * Copy a datagram (or what is left of one) onto the connection's
+ * read queue, at the front if it's the remains of a partially read
+ * one.  Applies the drop policy if the queue is full.
+ */
+static void
+udpn_rq_add(struct udpn_data *ndata, const unsigned char *buf, gensiods len,
+	    struct gensio_addr *addr, const struct udpn_rxinfo *info,
+	    bool at_head)
+{
+    struct udpn_buf *b;
+
+    if (!at_head && !udpn_rq_make_room(ndata))
+	return;
+
+    b = udpn_buf_alloc(ndata->nadata, buf, len, addr, info);
+    if (!b) {
+	ndata->rq_drops++;
+	return;
+    }
+    /* The embedded pkt is always free here, this takes over b's ref. */
+    b->pkt_used = true;
+    b->pkt.buf = b;
+    udpn_rq_put(ndata, &b->pkt, at_head);
+}
+
+/* Add a reference to a shared datagram to the connection's read queue. */
+static void
+udpn_rq_add_shared(struct udpn_data *ndata, struct udpn_buf *b)
+{
+    struct udpn_pkt *pkt;
+
+    if (!udpn_rq_make_room(ndata))
+	return;
+
+    pkt = udpn_buf_get_pkt(ndata->o, b);
+    if (!pkt) {
+	ndata->rq_drops++;
+	return;
+    }
+    udpn_rq_put(ndata, pkt, false);
+}
+
 static void
 udpn_do_free(struct udpn_data *ndata)
 {
+    udpn_rq_flush(ndata);
     if (ndata->deferred_op_runner)
 	ndata->o->free_runner(ndata->deferred_op_runner);
     if (ndata->io)
 	gensio_data_free(ndata->io);
     if (ndata->raddr)
 	gensio_addr_free(ndata->raddr);
+    if (ndata->raddr_aux)
+	ndata->o->free(ndata->o, ndata->raddr_aux);
     ndata->o->free(ndata->o, ndata);
 }
 
@@ -470,7 +934,13 @@ static void
 udpn_finish_free(struct udpn_data *ndata)
 {
     struct udpna_data *nadata = ndata->nadata;
+    unsigned int i;
 
+    /* Its queued writes still go out, but there's no one to tell. */
+    for (i = 0; i < nadata->txq_count; i++) {
+	if (nadata->txq_owner[i] == ndata)
+	    nadata->txq_owner[i] = NULL;
+    }
     udpn_remove_from_list(&nadata->closed_udpns, ndata);
     assert(nadata->udpn_count > 0);
     nadata->udpn_count--;
@@ -478,19 +948,127 @@ udpn_finish_free(struct udpn_data *ndata)
     udpna_check_finish_free(nadata);
 }
 
+/*
+ * Send what is on the write queue.  Whatever the socket won't take
+ * stays on the queue and the write handler is enabled to send it.
+ * Must be called with the lock held.
+ */
+static void
+udpna_flush_txq(struct udpna_data *nadata)
+{
+    unsigned int i, pos = 0, sent;
+    gensiods used;
+    int err;
+
+    while (pos < nadata->txq_count) {
+	err = gensio_os_sendmmsg(nadata->o, nadata->txq_fd, nadata->txq + pos,
+				 nadata->txq_count - pos, &sent, 0);
+	if (err) {
+	    /* The first one failed, the writer gets it on its next write. */
+	    if (nadata->txq_owner[pos])
+		nadata->txq_owner[pos]->write_err = err;
+	    sent = 1;
+	} else if (sent == 0) {
+	    /* Socket is full. */
+	    break;
+	}
+	pos += sent;
+    }
+
+    for (i = 0; i < pos; i++)
+	gensio_addr_free((struct gensio_addr *) nadata->txq[i].addr);
+
+    if (pos == nadata->txq_count) {
+	nadata->txq_count = 0;
+	nadata->txq_buf_used = 0;
+	if (nadata->txq_blocked) {
+	    nadata->txq_blocked = false;
+	    udpna_fd_write_disable(nadata);
+	}
+	return;
+    }
+
+    /* Move what is left to the front. */
+    used = (const unsigned char *) nadata->txq_sg[pos].buf - nadata->txq_buf;
+    memmove(nadata->txq_buf, nadata->txq_buf + used,
+	    nadata->txq_buf_used - used);
+    nadata->txq_buf_used -= used;
+    for (i = pos; i < nadata->txq_count; i++) {
+	nadata->txq_sg[i - pos].buf =
+	    (const unsigned char *) nadata->txq_sg[i].buf - used;
+	nadata->txq_sg[i - pos].buflen = nadata->txq_sg[i].buflen;
+	nadata->txq[i - pos].sg = &nadata->txq_sg[i - pos];
+	nadata->txq[i - pos].sglen = 1;
+	nadata->txq[i - pos].addr = nadata->txq[i].addr;
+	nadata->txq_owner[i - pos] = nadata->txq_owner[i];
+    }
+    nadata->txq_count -= pos;
+    if (!nadata->txq_blocked) {
+	nadata->txq_blocked = true;
+	udpna_fd_write_enable(nadata);
+    }
+}
+
+/*
+ * Queue a write to go out at the end of the receive batch.  This
+ * takes over addr.  Returns false if the queue is full and the socket
+ * won't take what is on it, the write can't be done now.  Must be
+ * called with the lock held.
+ */
+static bool
+udpna_queue_write(struct udpna_data *nadata, struct udpn_data *ndata,
+		  const struct gensio_sg *sg, gensiods sglen,
+		  gensiods total, struct gensio_addr *addr)
+{
+    unsigned int i, n;
+    unsigned char *p;
+
+    if (nadata->txq_count && (nadata->txq_fd != ndata->myfd ||
+			      nadata->txq_count == GENSIO_OS_MAX_MMSG ||
+			      nadata->txq_buf_used + total > UDP_TXQ_BUF_SIZE))
+	udpna_flush_txq(nadata);
+    if (nadata->txq_blocked)
+	return false;
+
+    n = nadata->txq_count++;
+    p = nadata->txq_buf + nadata->txq_buf_used;
+    nadata->txq_sg[n].buf = p;
+    nadata->txq_sg[n].buflen = total;
+    for (i = 0; i < sglen; i++) {
+	memcpy(p, sg[i].buf, sg[i].buflen);
+	p += sg[i].buflen;
+    }
+    nadata->txq[n].sg = &nadata->txq_sg[n];
+    nadata->txq[n].sglen = 1;
+    nadata->txq[n].addr = addr;
+    nadata->txq_owner[n] = ndata;
+    nadata->txq_buf_used += total;
+    nadata->txq_fd = ndata->myfd;
+    return true;
+}
+
 static int
 udpn_write(struct gensio *io, gensiods *count,
 	   const struct gensio_sg *sg, gensiods sglen,
 	   const char *const *auxdata)
 {
     struct udpn_data *ndata = gensio_get_gensio_data(io);
+    struct udpna_data *nadata = ndata->nadata;
     struct gensio_addr *addr = NULL;
+    gensiods total = 0, segsize = 0;
     unsigned int i;
+    char *end;
     bool free_addr = false;
     int err;
 
     for (i = 0; auxdata && auxdata[i]; i++) {
-	if (strncmp(auxdata[i], "addr:", 5) == 0) {
+	if (strncmp(auxdata[i], "segsize:", 8) == 0) {
+	    segsize = strtoul(auxdata[i] + 8, &end, 0);
+	    if (*end || segsize > UDP_MAX_SEGSIZE) {
+		err = GE_INVAL;
+		goto out_err;
+	    }
+	} else if (strncmp(auxdata[i], "addr:", 5) == 0) {
 	    if (addr)
 		gensio_addr_free(addr);
 	    err = gensio_os_scan_netaddr(ndata->o, auxdata[i] + 5, false,
@@ -499,14 +1077,71 @@ udpn_write(struct gensio *io, gensiods *count,
 		return err;
 	    free_addr = true;
 	} else {
-	    return GE_INVAL;
+	    err = GE_INVAL;
+	    goto out_err;
 	}
     }
 
-    if (!addr)
+    /* A connected socket already knows where to send. */
+    if (!addr && !nadata->connected)
 	addr = ndata->raddr;
 
+    for (i = 0; i < sglen; i++)
+	total += sg[i].buflen;
+
+    udpna_lock(nadata);
+    if (ndata->idled) {
+	udpna_unlock(nadata);
+	err = GE_TIMEDOUT;
+	goto out_err;
+    }
+    if (ndata->write_err) {
+	err = ndata->write_err;
+	ndata->write_err = 0;
+	udpna_unlock(nadata);
+	goto out_err;
+    }
+    if (nadata->txq_blocked) {
+	/* Wait for the queue to go out, write ready will come. */
+	udpna_unlock(nadata);
+	if (count)
+	    *count = 0;
+	err = 0;
+	goto out_err;
+    }
+
+    if (segsize && total > segsize) {
+	udpna_unlock(nadata);
+	/* Multiple datagrams, these go straight out. */
+	err = gensio_os_sendto_gso(ndata->o, ndata->myfd, sg, sglen, count, 0,
+				   addr, segsize);
+	goto out_err;
+    }
+    if (nadata->in_rx_batch && nadata->txq_buf && total <= UDP_TXQ_BUF_SIZE) {
+	if (!free_addr && addr) {
+	    addr = gensio_addr_dup(addr);
+	    if (!addr) {
+		udpna_unlock(nadata);
+		return GE_NOMEM;
+	    }
+	}
+	if (!udpna_queue_write(nadata, ndata, sg, sglen, total, addr)) {
+	    udpna_unlock(nadata);
+	    if (addr)
+		gensio_addr_free(addr);
+	    if (count)
+		*count = 0;
+	    return 0;
+	}
+	udpna_unlock(nadata);
+	if (count)
+	    *count = total;
+	return 0;
+    }
+    udpna_unlock(nadata);
+
     err = gensio_os_sendto(ndata->o, ndata->myfd, sg, sglen, count, 0, addr);
+ out_err:
     if (free_addr)
 	gensio_addr_free(addr);
     return err;
@@ -533,64 +1168,148 @@ udpn_finish_close(struct udpna_data *nadata, struct udpn_data *ndata)
 	ndata->in_close_cb = false;
     }
 
-    if (nadata->pending_data_owner == ndata) {
-	nadata->pending_data_owner = NULL;
-	nadata->data_pending_len = 0;
-    }
+    udpn_rq_flush(ndata);
 
     if (ndata->freed && !ndata->deferred_op_pending)
 	udpn_finish_free(ndata);
 }
 
-static void
-udpn_finish_read(struct udpn_data *ndata)
+/*
+ * Call the user's read callback with a datagram, returning how much
+ * was consumed.  Must be called with the lock held and in_read set,
+ * the lock is released around the callback.
+ */
+static gensiods
+udpn_read_cb(struct udpn_data *ndata, unsigned char *buf, gensiods len,
+	     struct gensio_addr *addr, const struct udpn_rxinfo *info)
 {
     struct udpna_data *nadata = ndata->nadata;
-    struct gensio *io = ndata->io;
-    gensiods count;
-    char raddrdata[200];
-    const char *auxmem[2] = { NULL, NULL };
-    const char *const *auxdata;
+    gensiods count = len;
+    char raddrdata[200], stampdata[40], dropdata[30];
+    const char *auxmem[4] = { NULL, NULL, NULL, NULL };
+    unsigned int naux = 0;
     int err;
     gensiods addrlen = sizeof(raddrdata), pos = 5;
 
- retry:
     udpna_unlock(nadata);
-    count = nadata->data_pending_len;
-    auxdata = NULL;
-
-    auxdata = auxmem;
-    auxmem[0] = raddrdata;
-    strcpy(raddrdata, "addr:");
-    err = gensio_addr_to_str(nadata->curr_recvaddr, raddrdata, &pos,
-			     addrlen);
-    if (err) {
-	strcpy(raddrdata, "err:addr:");
-	strncpy(raddrdata + 9, gensio_err_to_str(err), sizeof(raddrdata) - 9);
-	raddrdata[sizeof(raddrdata) - 1] = '\0';
+    if (ndata->raddr_aux) {
+	auxmem[naux++] = ndata->raddr_aux;
+    } else {
+	auxmem[naux++] = raddrdata;
+	strcpy(raddrdata, "addr:");
+	err = gensio_addr_to_str(addr, raddrdata, &pos, addrlen);
+	if (err) {
+	    strcpy(raddrdata, "err:addr:");
+	    strncpy(raddrdata + 9, gensio_err_to_str(err),
+		    sizeof(raddrdata) - 9);
+	    raddrdata[sizeof(raddrdata) - 1] = '\0';
+	}
+    }
+    if (info->has_stamp) {
+	snprintf(stampdata, sizeof(stampdata), "timestamp:%lld.%9.9ld",
+		 (long long) info->stamp.secs, (long) info->stamp.nsecs);
+	auxmem[naux++] = stampdata;
+    }
+    if (info->drops) {
+	snprintf(dropdata, sizeof(dropdata), "drops:%llu",
+		 (unsigned long long) info->drops);
+	auxmem[naux++] = dropdata;
     }
 
-    gensio_cb(io, GENSIO_EVENT_READ, 0, nadata->read_data, &count, auxdata);
+    gensio_cb(ndata->io, GENSIO_EVENT_READ, 0, buf, &count, auxmem);
     udpna_lock(nadata);
 
-    if (ndata->state == UDPN_IN_CLOSE) {
-	udpn_finish_close(nadata, ndata);
-	goto out;
+    if (count > len)
+	count = len;
+    return count;
+}
+
+static bool
+udpn_can_read(struct udpn_data *ndata)
+{
+    return ndata->state == UDPN_OPEN && ndata->read_enabled;
+}
+
+/*
+ * Tell the user the connection timed out if it hasn't been told and
+ * is reading.  Must be called with the lock held and in_read set.
+ */
+static void
+udpn_report_idle(struct udpn_data *ndata)
+{
+    struct udpna_data *nadata = ndata->nadata;
+
+    if (!ndata->idled || ndata->idle_reported || !udpn_can_read(ndata))
+	return;
+    ndata->idle_reported = true;
+    udpna_unlock(nadata);
+    gensio_cb(ndata->io, GENSIO_EVENT_READ, GE_TIMEDOUT, NULL, NULL, NULL);
+    udpna_lock(nadata);
+}
+
+/*
+ * Deliver whatever is on the read queue while the user is reading.
+ * Must be called with the lock held and in_read set.
+ */
+static void
+udpn_deliver_rq(struct udpn_data *ndata)
+{
+    struct udpn_pkt *pkt;
+    struct udpn_buf *b;
+    gensiods count;
+
+    while (udpn_can_read(ndata) && ndata->rq_head) {
+	/* Take it off the queue so a close can't free it under us. */
+	pkt = udpn_rq_pop(ndata);
+	b = pkt->buf;
+	count = udpn_read_cb(ndata, b->data + pkt->pos, b->len - pkt->pos,
+			     b->addr ? b->addr : ndata->raddr, &b->info);
+	pkt->pos += count;
+	if (pkt->pos < b->len && ndata->state == UDPN_OPEN) {
+	    /* The user didn't consume all the data, it goes back first. */
+	    pkt->next = ndata->rq_head;
+	    ndata->rq_head = pkt;
+	    if (!ndata->rq_tail)
+		ndata->rq_tail = pkt;
+	    ndata->rq_len++;
+	} else {
+	    udpn_pkt_free(ndata, pkt);
+	}
     }
+}
 
-    if (count < nadata->data_pending_len) {
-	/* The user didn't comsume all the data */
-	nadata->data_pending_len -= count;
-	nadata->data_pos += count;
-	if (ndata->state == UDPN_OPEN && ndata->read_enabled)
-	    goto retry;
-    } else {
-	nadata->pending_data_owner = NULL;
-	nadata->data_pending_len = 0;
+/*
+ * A datagram has come in for ndata.  Hand it straight to the user if
+ * it's reading and nothing is queued ahead of it, otherwise queue
+ * it.  Must be called with the lock held.
+ */
+static void
+udpn_handle_data(struct udpn_data *ndata, unsigned char *buf, gensiods len,
+		 struct gensio_addr *addr, const struct udpn_rxinfo *info)
+{
+    struct udpna_data *nadata = ndata->nadata;
+    gensiods count;
+
+    if (ndata->state != UDPN_OPEN)
+	return;
+
+    ndata->rx_gen = nadata->idle_gen;
+    if (ndata->in_read || ndata->rq_head || !ndata->read_enabled) {
+	udpn_rq_add(ndata, buf, len, addr, info, false);
+	return;
     }
- out:
+
+    ndata->in_read = true;
+    count = udpn_read_cb(ndata, buf, len, addr, info);
+    if (count < len && ndata->state == UDPN_OPEN)
+	udpn_rq_add(ndata, buf + count, len - count, addr, info, true);
+    udpn_deliver_rq(ndata);
+    /* It may have timed out while the user was reading. */
+    udpn_report_idle(ndata);
     ndata->in_read = false;
-    udpna_check_read_state(nadata);
+
+    if (ndata->state == UDPN_IN_CLOSE)
+	udpn_finish_close(nadata, ndata);
 }
 
 static void
@@ -600,18 +1319,6 @@ udpna_deferred_op(struct gensio_runner *runner, void *cbdata)
 
     udpna_lock(nadata);
     nadata->deferred_op_pending = false;
-    if (nadata->pending_data_owner) {
-	struct udpn_data *ndata = nadata->pending_data_owner;
-	if (ndata->deferred_read) {
-	    ndata->deferred_read = false;
-	    if (ndata->read_enabled) {
-		udpn_finish_read(ndata);
-	    } else {
-		/* We started to read, but didn't get to do it. */
-		ndata->in_read = false;
-	    }
-	}
-    }
 
     if (nadata->in_shutdown && !nadata->in_new_connection) {
 	struct gensio_accepter *accepter = nadata->acc;
@@ -650,6 +1357,35 @@ udpn_deferred_op(struct gensio_runner *runner, void *cbdata)
 	udpna_check_read_state(nadata);
     }
 
+    if (ndata->deferred_read) {
+	ndata->deferred_read = false;
+	udpn_deliver_rq(ndata);
+	udpn_report_idle(ndata);
+	ndata->in_read = false;
+    }
+
+    if (ndata->deferred_idle) {
+	ndata->deferred_idle = false;
+	if (!ndata->in_read) {
+	    ndata->in_read = true;
+	    udpn_report_idle(ndata);
+	    ndata->in_read = false;
+	}
+	/*
+	 * The connection is off the socket's write handling, call the
+	 * write callback here so a user that isn't reading finds out
+	 * from its write.
+	 */
+	if (ndata->write_enabled && ndata->state == UDPN_OPEN &&
+		!ndata->in_write) {
+	    ndata->in_write = true;
+	    udpna_unlock(nadata);
+	    gensio_cb(ndata->io, GENSIO_EVENT_WRITE_READY, 0, NULL, NULL, NULL);
+	    udpna_lock(nadata);
+	    ndata->in_write = false;
+	}
+    }
+
     if (ndata->state == UDPN_IN_CLOSE)
 	udpn_finish_close(nadata, ndata);
     else if (ndata->freed && !ndata->in_close_cb &&
@@ -668,6 +1404,86 @@ static void udpn_start_deferred_op(struct udpn_data *ndata)
     }
 }
 
+static void
+udpna_start_idle_timer(struct udpna_data *nadata)
+{
+    unsigned int interval;
+    gensio_time timeout;
+
+    if (!nadata->idle_timer || nadata->idle_timer_running || nadata->closed)
+	return;
+
+    interval = nadata->idle_timeout / UDPNA_IDLE_SWEEPS;
+    if (interval == 0)
+	interval = 1;
+    timeout.secs = interval / 1000;
+    timeout.nsecs = (interval % 1000) * 1000000;
+    if (!nadata->o->start_timer(nadata->idle_timer, &timeout)) {
+	nadata->idle_timer_running = true;
+	udpna_ref(nadata);
+    }
+}
+
+static void
+udpna_stop_idle_timer(struct udpna_data *nadata)
+{
+    if (nadata->idle_timer_running &&
+		!nadata->o->stop_timer(nadata->idle_timer)) {
+	nadata->idle_timer_running = false;
+	/* The caller holds a ref, so this can't go to zero. */
+	udpna_deref(nadata);
+    }
+}
+
+/*
+ * Time out a connection that hasn't received anything.  It is moved
+ * to the closed list, so it's out of the address lookup and the
+ * sweeps and a new datagram from the remote end starts a new
+ * connection.  Anything queued is thrown away.  The user still holds
+ * the gensio and must close it, it is told with a GE_TIMEDOUT read
+ * error, or from its write callback and a GE_TIMEDOUT write error if
+ * it's not reading.
+ */
+static void
+udpn_idle_out(struct udpn_data *ndata)
+{
+    struct udpna_data *nadata = ndata->nadata;
+
+    ndata->idled = true;
+    udpn_rq_flush(ndata);
+    udpn_remove_from_list(&nadata->udpns, ndata);
+    udpn_add_to_list(&nadata->closed_udpns, ndata);
+    if (ndata->write_enabled)
+	udpna_fd_write_disable(nadata);
+    ndata->deferred_idle = true;
+    udpn_start_deferred_op(ndata);
+}
+
+static void
+udpna_idle_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct udpna_data *nadata = cb_data;
+    struct gensio_link *l, *l2;
+    struct udpn_data *ndata;
+    bool active = false;
+
+    udpna_lock(nadata);
+    nadata->idle_timer_running = false;
+    nadata->idle_gen++;
+    gensio_list_for_each_safe(&nadata->udpns.list, l, l2) {
+	ndata = gensio_link_to_ndata(l);
+	if (ndata->state != UDPN_OPEN)
+	    continue;
+	if (nadata->idle_gen - ndata->rx_gen > UDPNA_IDLE_SWEEPS)
+	    udpn_idle_out(ndata);
+	else
+	    active = true;
+    }
+    if (active)
+	udpna_start_idle_timer(nadata);
+    udpna_deref_and_unlock(nadata);
+}
+
 static int
 udpn_open(struct gensio *io, gensio_done_err open_done, void *open_data)
 {
@@ -681,7 +1497,6 @@ udpn_open(struct gensio *io, gensio_done_err open_done, void *open_data)
     } else if (ndata->state == UDPN_CLOSED) {
 	udpn_remove_from_list(&nadata->closed_udpns, ndata);
 	udpn_add_to_list(&nadata->udpns, ndata);
-	udpna_fd_read_disable(nadata);
 	udpn_set_state(ndata, UDPN_IN_OPEN);
 	ndata->open_done = open_done;
 	ndata->open_data = open_data;
@@ -699,25 +1514,22 @@ udpn_start_close(struct udpn_data *ndata,
 {
     struct udpna_data *nadata = ndata->nadata;
 
-    if (nadata->pending_data_owner == ndata) {
-	nadata->pending_data_owner = NULL;
-	nadata->data_pending_len = 0;
-    }
+    udpn_rq_flush(ndata);
     ndata->close_done = close_done;
     ndata->close_data = close_data;
-
-    if (ndata->read_enabled)
-	ndata->read_enabled = false;
-    else
-	udpna_fd_read_enable(nadata);
+    ndata->read_enabled = false;
 
     if (ndata->write_enabled) {
 	ndata->write_enabled = false;
-	udpna_fd_write_disable(nadata);
+	if (!ndata->idled)
+	    udpna_fd_write_disable(nadata);
     }
 
-    udpn_remove_from_list(&nadata->udpns, ndata);
-    udpn_add_to_list(&nadata->closed_udpns, ndata);
+    /* A timed out connection is already on the closed list. */
+    if (!ndata->idled) {
+	udpn_remove_from_list(&nadata->udpns, ndata);
+	udpn_add_to_list(&nadata->closed_udpns, ndata);
+    }
     udpn_set_state(ndata, UDPN_IN_CLOSE);
 
     udpn_start_deferred_op(ndata);
@@ -784,35 +1596,23 @@ udpn_set_read_callback_enable(struct gensio *io, bool enabled)
 {
     struct udpn_data *ndata = gensio_get_gensio_data(io);
     struct udpna_data *nadata = ndata->nadata;
-    bool my_data_pending;
 
     udpna_lock(nadata);
     if (udpn_is_closed(ndata) || ndata->read_enabled == enabled)
 	goto out_unlock;
 
-    if (enabled) {
-	assert(nadata->read_disable_count > 0);
-	nadata->read_disable_count--;
-	i_udp_add_trace(nadata, NULL, 5300 + nadata->read_disable_count,
-			__LINE__);
-    } else {
-	nadata->read_disable_count++;
-	i_udp_add_trace(nadata, NULL, 5400 + nadata->read_disable_count,
-			__LINE__);
-    }
+    /*
+     * This only affects this connection, datagrams for it get queued
+     * while it's not reading and the socket keeps being read for
+     * everyone else.
+     */
     ndata->read_enabled = enabled;
-    my_data_pending = (nadata->data_pending_len &&
-		       nadata->pending_data_owner == ndata);
-    if (ndata->in_read || ndata->state == UDPN_IN_OPEN ||
-		(my_data_pending && !enabled)) {
-	/* Nothing to do. */
-    } else if (enabled && my_data_pending) {
+    if (enabled && (ndata->rq_head || (ndata->idled && !ndata->idle_reported))
+		&& !ndata->in_read && ndata->state == UDPN_OPEN) {
 	ndata->in_read = true;
 	ndata->deferred_read = true;
 	/* Call the read from the selector to avoid lock nesting issues. */
-	udpna_start_deferred_op(nadata);
-    } else {
-	udpna_check_read_state(ndata->nadata);
+	udpn_start_deferred_op(ndata);
     }
  out_unlock:
     udpna_unlock(nadata);
@@ -831,6 +1631,14 @@ udpn_set_write_callback_enable(struct gensio *io, bool enabled)
 	ndata->write_enabled = enabled;
 	if (ndata->state == UDPN_IN_OPEN)
 	    goto out_unlock;
+	if (ndata->idled) {
+	    /* Not on the socket any more, report it from here. */
+	    if (enabled) {
+		ndata->deferred_idle = true;
+		udpn_start_deferred_op(ndata);
+	    }
+	    goto out_unlock;
+	}
 	if (enabled)
 	    udpna_fd_write_enable(ndata->nadata);
 	else
@@ -846,19 +1654,19 @@ udpn_disable(struct gensio *io)
     struct udpn_data *ndata = gensio_get_gensio_data(io);
     struct udpna_data *nadata = ndata->nadata;
 
-    if (ndata->read_enabled) {
-	udpna_fd_read_disable(nadata);
-	ndata->read_enabled = false;
-    }
+    ndata->read_enabled = false;
 
     if (ndata->write_enabled) {
-	udpna_fd_write_disable(nadata);
+	if (!ndata->idled)
+	    udpna_fd_write_disable(nadata);
 	ndata->write_enabled = false;
     }
 
     ndata->close_done = NULL;
-    udpn_remove_from_list(&nadata->udpns, ndata);
-    udpn_add_to_list(&nadata->closed_udpns, ndata);
+    if (!ndata->idled) {
+	udpn_remove_from_list(&nadata->udpns, ndata);
+	udpn_add_to_list(&nadata->closed_udpns, ndata);
+    }
     udpn_set_state(ndata, UDPN_CLOSED);
     nadata->disabled = true;
 }
@@ -901,7 +1709,12 @@ udpna_writehandler(int fd, void *cbdata)
 	goto out_unlock;
 
     udpna_disable_write(nadata);
-    gensio_list_for_each(&nadata->udpns, l) {
+    if (nadata->txq_blocked && !nadata->in_rx_batch)
+	udpna_flush_txq(nadata);
+    if (nadata->txq_blocked)
+	/* The writers can't do anything until the queue goes out. */
+	goto out_enable;
+    gensio_list_for_each(&nadata->udpns.list, l) {
 	struct udpn_data *ndata = gensio_link_to_ndata(l);
 
 	if (ndata->write_enabled) {
@@ -913,6 +1726,7 @@ udpna_writehandler(int fd, void *cbdata)
 	    break;
 	}
     }
+ out_enable:
     if (nadata->write_enable_count > 0)
 	udpna_enable_write(nadata);
  out_unlock:
@@ -1004,8 +1818,9 @@ udpn_control(struct gensio *io, bool get, int option,
 {
     struct udpn_data *ndata = gensio_get_gensio_data(io);
     struct udpna_data *nadata = ndata->nadata;
-    int err;
+    int err = 0;
     struct gensio_addr *addr;
+    uint64_t drops = 0;
 
     switch(option) {
     case GENSIO_CONTROL_MAX_WRITE_PACKET:
@@ -1034,6 +1849,33 @@ udpn_control(struct gensio *io, bool get, int option,
     case GENSIO_CONTROL_LPORT:
 	return udpna_control_lport(nadata, get, data, datalen);
 
+    case GENSIO_CONTROL_SOCKOPT:
+	/* The socket may be shared with other gensios from an accepter. */
+	udpna_lock(nadata);
+	err = gensio_os_sockopt_control(nadata->o, ndata->myfd,
+					GENSIO_NET_PROTOCOL_UDP,
+					&nadata->sockopts, get, data, datalen);
+	udpna_unlock(nadata);
+	return err;
+
+    case GENSIO_CONTROL_DROPS:
+	if (!get)
+	    return GE_NOTSUP;
+	udpna_lock(nadata);
+	if (strcmp(data, "kernel") == 0)
+	    drops = nadata->kernel_drops;
+	else if (strcmp(data, "queue") == 0)
+	    drops = ndata->rq_drops;
+	else if (!*data || strcmp(data, "total") == 0)
+	    drops = nadata->kernel_drops + ndata->rq_drops;
+	else
+	    err = GE_INVAL;
+	udpna_unlock(nadata);
+	if (err)
+	    return err;
+	*datalen = snprintf(data, *datalen, "%llu", (unsigned long long) drops);
+	break;
+
     case GENSIO_CONTROL_ADD_MCAST:
     case GENSIO_CONTROL_DEL_MCAST:
 	err = gensio_scan_network_addr(nadata->o, data,
@@ -1104,7 +1946,7 @@ static struct udpn_data *
 udp_alloc_gensio(struct udpna_data *nadata, int fd,
 		 struct gensio_addr *addr,
 		 gensio_event cb, void *user_data,
-		 struct gensio_list *starting_list)
+		 struct udpn_list *starting_list)
 {
     struct udpn_data *ndata = nadata->o->zalloc(nadata->o, sizeof(*ndata));
 
@@ -1122,12 +1964,16 @@ udp_alloc_gensio(struct udpna_data *nadata, int fd,
 	return NULL;
     }
 
-    ndata->raddr = gensio_addr_dup(addr);
+    ndata->raddr = gensio_addr_copy(addr);
     if (!ndata->raddr) {
 	ndata->o->free_runner(ndata->deferred_op_runner);
 	nadata->o->free(nadata->o, ndata);
 	return NULL;
     }
+    ndata->hashval = gensio_addr_hash(ndata->raddr, true);
+    ndata->rx_gen = nadata->idle_gen;
+    ndata->rq_max = nadata->rq_max;
+    ndata->rq_drop_head = nadata->rq_drop_head;
 
     ndata->io = gensio_data_alloc(nadata->o, cb, user_data, gensio_udp_func,
 				  NULL, "udp", ndata);
@@ -1148,69 +1994,143 @@ udp_alloc_gensio(struct udpna_data *nadata, int fd,
     return ndata;
 }
 
+/*
+ * Look for a hub matching laddr and mcast and add a new consumer
+ * gensio to it.  Returns GE_NOTFOUND if there is no such hub.  Must
+ * be called with udp_hub_lock held.
+ */
+static int
+udp_hub_join(struct gensio_os_funcs *o,
+	     struct gensio_addr *laddr, struct gensio_addr *mcast,
+	     struct gensio_addr *addr, gensio_event cb, void *user_data,
+	     unsigned int rxqueue, bool rxdrop_head,
+	     struct gensio **new_gensio)
+{
+    struct gensio_link *l;
+    struct udpna_data *nadata;
+    struct udpn_data *ndata;
+    int err = GE_NOTFOUND;
+
+    gensio_list_for_each(&udp_hubs, l) {
+	nadata = gensio_container_of(l, struct udpna_data, hub_link);
+	if (nadata->o != o ||
+		!gensio_addr_equal(nadata->hub_laddr, laddr, true, true) ||
+		!gensio_addr_equal(nadata->hub_mcast, mcast, false, true))
+	    continue;
+
+	udpna_lock(nadata);
+	if (nadata->finished_free) {
+	    /* The last consumer is gone, it's going away. */
+	    udpna_unlock(nadata);
+	    continue;
+	}
+	ndata = udp_alloc_gensio(nadata, nadata->fds->fd, addr, cb, user_data,
+				 &nadata->closed_udpns);
+	if (ndata) {
+	    gensio_set_is_client(ndata->io, true);
+	    ndata->rq_max = rxqueue;
+	    ndata->rq_drop_head = rxdrop_head;
+	    *new_gensio = ndata->io;
+	    err = 0;
+	} else {
+	    err = GE_NOMEM;
+	}
+	udpna_unlock(nadata);
+	break;
+    }
+
+    return err;
+}
+
+/* Must be called with udp_hub_lock held. */
+static void
+udp_hub_add(struct udpna_data *nadata)
+{
+    gensio_list_add_tail(&udp_hubs, &nadata->hub_link);
+}
+
+/*
+ * Put a datagram on the read queue of every consumer of a hub.  The
+ * data is copied once and shared by all the queues, it's delivered
+ * from each consumer's deferred op so one consumer's read callback
+ * doesn't hold up the others.  Must be called with the lock held.
+ */
+static void
+udpna_hub_dispatch(struct udpna_data *nadata,
+		   unsigned char *buf, gensiods datalen,
+		   struct gensio_addr *addr, const struct udpn_rxinfo *info)
+{
+    struct gensio_link *l;
+    struct udpn_data *ndata;
+    struct udpn_buf *b = NULL;
+
+    gensio_list_for_each(&nadata->udpns.list, l) {
+	ndata = gensio_link_to_ndata(l);
+	if (ndata->state != UDPN_OPEN)
+	    continue;
+	if (!b) {
+	    b = udpn_buf_alloc(nadata, buf, datalen, addr, info);
+	    if (!b) {
+		ndata->rq_drops++;
+		continue;
+	    }
+	}
+	udpn_rq_add_shared(ndata, b);
+	if (udpn_can_read(ndata) && !ndata->in_read && ndata->rq_head) {
+	    ndata->in_read = true;
+	    ndata->deferred_read = true;
+	    udpn_start_deferred_op(ndata);
+	}
+    }
+    if (b)
+	udpn_buf_deref(nadata->o, b);
+}
+
+/*
+ * Handle a datagram from addr that came in on fd.  Must be called
+ * with the lock held and reads disabled.  Any accept disable waiters
+ * that need to be called are added to waiters.
+ */
 static void
-udpna_readhandler(int fd, void *cbdata)
+udpna_handle_datagram(struct udpna_data *nadata, int fd,
+		      unsigned char *buf, gensiods datalen,
+		      struct gensio_addr *addr, const struct udpn_rxinfo *info,
+		      struct udpna_waiters **waiters)
 {
-    struct udpna_data *nadata = cbdata;
     struct udpn_data *ndata;
-    struct udpna_waiters *waiters = NULL, *next;
-    gensiods datalen;
-    int err;
-
-    udpna_lock_and_ref(nadata);
-    if (nadata->data_pending_len)
-	goto out_unlock;
+    struct udpna_waiters *w;
 
-    err = gensio_os_recvfrom(nadata->o,
-			     fd, nadata->read_data, nadata->max_read_size,
-			     &datalen, 0, nadata->curr_recvaddr);
-    if (err) {
-	if (!nadata->is_dummy)
-	    /* Don't log on dummy accepters. */
-	    gensio_acc_log(nadata->acc, GENSIO_LOG_ERR,
-			   "Could not accept on UDP: %s",
-			   gensio_err_to_str(err));
-	goto out_unlock;
+    if (nadata->hub) {
+	udpna_hub_dispatch(nadata, buf, datalen, addr, info);
+	return;
     }
-    if (datalen == 0)
-	goto out_unlock;
-
-    udpna_fd_read_disable(nadata);
 
-    nadata->data_pending_len = datalen;
-    nadata->data_pos = 0;
-
-    if (nadata->nocon) {
-	if (gensio_list_empty(&nadata->udpns)) {
+    if (nadata->nocon || nadata->connected) {
+	if (gensio_list_empty(&nadata->udpns.list)) {
 	    ndata = NULL;
 	} else {
-	    ndata = gensio_link_to_ndata(gensio_list_first(&nadata->udpns));
+	    ndata = gensio_link_to_ndata(gensio_list_first(&nadata->udpns.list));
 	}
     } else {
-	ndata = udpn_find(&nadata->udpns, nadata->curr_recvaddr);
+	ndata = udpn_find(&nadata->udpns, addr);
     }
     if (ndata) {
 	/* Data belongs to an existing connection. */
-	nadata->pending_data_owner = ndata;
-	goto got_ndata;
+	udpn_handle_data(ndata, buf, datalen, addr, info);
+	return;
     }
 
-    if (nadata->closed || !nadata->enabled) {
-	nadata->data_pending_len = 0;
-	goto out_unlock_enable;
-    }
+    if (nadata->closed || !nadata->enabled)
+	return;
 
     /* New connection. */
-    ndata = udp_alloc_gensio(nadata, fd, nadata->curr_recvaddr,
-			     NULL, NULL, &nadata->udpns);
+    ndata = udp_alloc_gensio(nadata, fd, addr, NULL, NULL, &nadata->udpns);
     if (!ndata)
 	goto out_nomem;
 
     udpn_set_state(ndata, UDPN_OPEN);
-    nadata->read_disable_count++;
-    i_udp_add_trace(nadata, NULL, 5500 + nadata->read_disable_count, __LINE__);
+    udpna_start_idle_timer(nadata);
 
-    nadata->pending_data_owner = ndata;
     nadata->in_new_connection = true;
     ndata->in_read = true;
     udpna_unlock(nadata);
@@ -1220,24 +2140,21 @@ udpna_readhandler(int fd, void *cbdata)
     udpna_lock(nadata);
     ndata->in_read = false;
     nadata->in_new_connection = false;
-    waiters = nadata->acc_disable_waiters;
-    nadata->acc_disable_waiters = NULL;
-
-    if (ndata->state == UDPN_OPEN) {
-    got_ndata:
-	if (ndata->read_enabled && !ndata->in_read) {
-	    ndata->in_read = true;
-	    udpn_finish_read(ndata);
-	}
-    } else {
-	nadata->data_pending_len = 0;
+    if (nadata->acc_disable_waiters) {
+	for (w = nadata->acc_disable_waiters; w->next; w = w->next)
+	    ;
+	w->next = *waiters;
+	*waiters = nadata->acc_disable_waiters;
+	nadata->acc_disable_waiters = NULL;
     }
 
     if (ndata->state == UDPN_IN_CLOSE) {
 	udpn_finish_close(nadata, ndata);
-	goto out_unlock_enable;
+	return;
     }
 
+    udpn_handle_data(ndata, buf, datalen, addr, info);
+
     if (nadata->in_shutdown) {
 	struct gensio_accepter *accepter = nadata->acc;
 
@@ -1248,18 +2165,21 @@ udpna_readhandler(int fd, void *cbdata)
 	    nadata->shutdown_done(accepter, nadata->shutdown_data);
 	udpna_lock(nadata);
 	ndata->in_read = false;
+	if (ndata->state == UDPN_IN_CLOSE)
+	    udpn_finish_close(nadata, ndata);
     }
     udpna_check_finish_free(nadata);
-    goto out_unlock_enable;
+    return;
 
  out_nomem:
-    nadata->data_pending_len = 0;
     gensio_acc_log(nadata->acc, GENSIO_LOG_ERR,
 		   "Out of memory allocating for udp port");
- out_unlock_enable:
-    udpna_fd_read_enable(nadata);
- out_unlock:
-    udpna_deref_and_unlock(nadata);
+}
+
+static void
+udpna_call_waiters(struct udpna_data *nadata, struct udpna_waiters *waiters)
+{
+    struct udpna_waiters *next;
 
     while (waiters) {
 	next = waiters->next;
@@ -1267,8 +2187,145 @@ udpna_readhandler(int fd, void *cbdata)
 	nadata->o->free(nadata->o, waiters);
 	waiters = next;
     }
+}
 
-    return;
+/*
+ * Pull what the kernel reported about a received message into info,
+ * and add any new socket drops to the total.  Must be called with
+ * the lock held.
+ */
+static void
+udpna_get_rxinfo(struct udpna_data *nadata, int fd,
+		 const struct gensio_os_recvmsg *m, struct udpn_rxinfo *info)
+{
+    unsigned int i;
+
+    info->has_stamp = m->has_stamp;
+    info->stamp = m->stamp;
+    if (m->has_drops && nadata->fd_drops) {
+	for (i = 0; i < nadata->nr_fds; i++) {
+	    if (nadata->fds[i].fd == fd)
+		break;
+	}
+	if (i < nadata->nr_fds && m->drops != nadata->fd_drops[i]) {
+	    /* The kernel's count is 32 bits and may wrap. */
+	    nadata->kernel_drops += (uint32_t) (m->drops - nadata->fd_drops[i]);
+	    nadata->fd_drops[i] = m->drops;
+	}
+    }
+    info->drops = nadata->kernel_drops;
+}
+
+static void
+udpna_readhandler(int fd, void *cbdata)
+{
+    struct udpna_data *nadata = cbdata;
+    struct udpna_waiters *waiters = NULL;
+    struct gensio_os_recvmsg *m;
+    struct udpn_rxinfo info;
+    unsigned int i, count;
+    gensiods pos, len;
+    int err;
+
+    udpna_lock_and_ref(nadata);
+    /* Another thread is handing out the receive buffers. */
+    if (nadata->in_rx_batch)
+	goto out_unlock;
+
+    err = gensio_os_recvmmsg(nadata->o, fd, nadata->rmsgs, nadata->nr_rmsgs,
+			     &count, 0);
+    if (err) {
+	if (!nadata->is_dummy)
+	    /* Don't log on dummy accepters. */
+	    gensio_acc_log(nadata->acc, GENSIO_LOG_ERR,
+			   "Could not accept on UDP: %s",
+			   gensio_err_to_str(err));
+	goto out_unlock;
+    }
+
+    /*
+     * Everything read gets handed out or queued here, so the socket
+     * is never held up by a single connection that isn't reading.
+     * Reads are turned off once for the whole batch, turning them
+     * off and on is a system call per fd.
+     */
+    udpna_fd_read_disable(nadata);
+    nadata->in_rx_batch = true;
+    for (i = 0; i < count; i++) {
+	m = &nadata->rmsgs[i];
+	if (m->len == 0)
+	    continue;
+	udpna_get_rxinfo(nadata, fd, m, &info);
+	if (m->segsize) {
+	    /* GRO coalesced these, hand them out one datagram at a time. */
+	    for (pos = 0; pos < m->len; pos += len) {
+		len = m->len - pos;
+		if (len > m->segsize)
+		    len = m->segsize;
+		udpna_handle_datagram(nadata, fd, m->buf + pos, len, m->addr,
+				      &info, &waiters);
+	    }
+	    continue;
+	}
+	udpna_handle_datagram(nadata, fd, m->buf, m->len, m->addr, &info,
+			      &waiters);
+    }
+    nadata->in_rx_batch = false;
+    if (nadata->txq_count)
+	udpna_flush_txq(nadata);
+    udpna_fd_read_enable(nadata);
+
+ out_unlock:
+    udpna_deref_and_unlock(nadata);
+
+    udpna_call_waiters(nadata, waiters);
+}
+
+static void
+udpna_setup_log(struct udpna_data *nadata, const char *what, int rv)
+{
+    if (rv && rv != GE_NOTSUP && !nadata->is_dummy)
+	gensio_acc_log(nadata->acc, GENSIO_LOG_WARNING,
+		       "Could not enable UDP %s: %s", what,
+		       gensio_err_to_str(rv));
+}
+
+/*
+ * Set the receive options on newly opened sockets.  These are all
+ * optional, if the OS doesn't do them things work like always, just
+ * without the extra information or optimization.
+ */
+static void
+udpna_setup_fds(struct udpna_data *nadata)
+{
+    struct gensio_os_funcs *o = nadata->o;
+    unsigned int i;
+    int fd;
+
+    if (!nadata->fd_drops)
+	nadata->fd_drops = o->zalloc(o, sizeof(*nadata->fd_drops) *
+				     nadata->nr_fds);
+
+    for (i = 0; i < nadata->nr_fds; i++) {
+	fd = nadata->fds[i].fd;
+	if (nadata->fd_drops)
+	    udpna_setup_log(nadata, "drop counts",
+			    gensio_os_set_rx_drops(o, fd, true));
+	if (nadata->rx_timestamp)
+	    udpna_setup_log(nadata, "timestamps",
+			    gensio_os_set_rx_timestamp(o, fd, true));
+	if (nadata->gro)
+	    udpna_setup_log(nadata, "GRO", gensio_os_set_udp_gro(o, fd, true));
+    }
+}
+
+static int
+udpna_b4_listen(int fd, void *data)
+{
+    struct udpna_data *nadata = data;
+
+    return gensio_os_set_sockopts(nadata->o, fd, GENSIO_NET_PROTOCOL_UDP,
+				  &nadata->sockopts);
 }
 
 static int
@@ -1281,11 +2338,12 @@ udpna_startup(struct gensio_accepter *accepter)
     if (!nadata->fds) {
 	rv = gensio_os_open_socket(nadata->o, nadata->ai,
 				   udpna_readhandler, udpna_writehandler,
-				   udpna_fd_cleared, NULL, nadata,
+				   udpna_fd_cleared, udpna_b4_listen, nadata,
 				   nadata->opensock_flags,
 				   &nadata->fds, &nadata->nr_fds);
 	if (rv)
 	    goto out_unlock;
+	udpna_setup_fds(nadata);
     }
 
     nadata->enabled = true;
@@ -1310,6 +2368,7 @@ udpna_shutdown(struct gensio_accepter *accepter,
 	nadata->closed = true;
 	nadata->shutdown_done = shutdown_done;
 	nadata->shutdown_data = shutdown_data;
+	udpna_stop_idle_timer(nadata);
 	if (!nadata->in_new_connection)
 	    udpna_start_deferred_op(nadata);
     } else {
@@ -1385,6 +2444,7 @@ udpna_free(struct gensio_accepter *accepter)
     nadata->enabled = false;
     nadata->closed = true;
     nadata->freed = true;
+    udpna_stop_idle_timer(nadata);
 
     if (!nadata->disabled) {
 	udpna_check_finish_free(nadata);
@@ -1413,6 +2473,11 @@ udpna_disable(struct gensio_accepter *accepter)
     nadata->in_shutdown = false;
     nadata->shutdown_done = NULL;
     nadata->disabled = true;
+    if (nadata->idle_timer_running) {
+	nadata->o->stop_timer(nadata->idle_timer);
+	nadata->idle_timer_running = false;
+	nadata->refcount--;
+    }
 }
 
 static int
@@ -1488,6 +2553,37 @@ udpna_str_to_gensio(struct gensio_accepter *accepter, const char *addrstr,
     return err;
 }
 
+/*
+ * A get comes from the first socket, the other ones (for other
+ * address families) are set the same.  A set goes to all of them.
+ */
+static int
+udpna_control_sockopt(struct udpna_data *nadata, bool get,
+		      char *data, gensiods *datalen)
+{
+    unsigned int i;
+    int err;
+
+    udpna_lock(nadata);
+    if (get || nadata->nr_fds == 0) {
+	err = gensio_os_sockopt_control(nadata->o,
+					nadata->nr_fds ? nadata->fds[0].fd : -1,
+					GENSIO_NET_PROTOCOL_UDP,
+					&nadata->sockopts, get, data, datalen);
+	goto out_unlock;
+    }
+    for (i = 0; i < nadata->nr_fds; i++) {
+	err = gensio_os_sockopt_control(nadata->o, nadata->fds[i].fd,
+					GENSIO_NET_PROTOCOL_UDP,
+					&nadata->sockopts, get, data, datalen);
+	if (err)
+	    break;
+    }
+ out_unlock:
+    udpna_unlock(nadata);
+    return err;
+}
+
 static int
 udpna_control(struct gensio_accepter *acc, bool get,
 	      unsigned int option, char *data, gensiods *datalen)
@@ -1501,6 +2597,18 @@ udpna_control(struct gensio_accepter *acc, bool get,
     case GENSIO_ACC_CONTROL_LPORT:
 	return udpna_control_lport(nadata, get, data, datalen);
 
+    case GENSIO_ACC_CONTROL_SOCKOPT:
+	return udpna_control_sockopt(nadata, get, data, datalen);
+
+    case GENSIO_ACC_CONTROL_DROPS:
+	if (!get)
+	    return GE_NOTSUP;
+	udpna_lock(nadata);
+	*datalen = snprintf(data, *datalen, "%llu",
+			    (unsigned long long) nadata->kernel_drops);
+	udpna_unlock(nadata);
+	return 0;
+
     default:
 	return GE_NOTSUP;
     }
@@ -1543,19 +2651,25 @@ gensio_acc_udp_func(struct gensio_accepter *acc, int func, int val,
 
 static int
 i_udp_gensio_accepter_alloc(struct gensio_addr *iai, gensiods max_read_size,
+			    unsigned int nr_rmsgs, unsigned int rq_max,
+			    bool rq_drop_head, bool gro, bool rx_timestamp,
+			    unsigned int idle_timeout,
+			    const struct gensio_sockopts *sockopts,
 			    bool reuseaddr, struct gensio_os_funcs *o,
 			    gensio_accepter_event cb, void *user_data,
 			    struct gensio_accepter **accepter)
 {
     struct udpna_data *nadata;
+    unsigned int i;
 
     nadata = o->zalloc(o, sizeof(*nadata));
     if (!nadata)
 	return GE_NOMEM;
     nadata->o = o;
-    gensio_list_init(&nadata->udpns);
-    gensio_list_init(&nadata->closed_udpns);
     nadata->refcount = 1;
+    if (udpn_list_init(o, &nadata->udpns) ||
+		udpn_list_init(o, &nadata->closed_udpns))
+	goto out_nomem;
     if (reuseaddr)
 	nadata->opensock_flags |= GENSIO_OPENSOCK_REUSEADDR;
 
@@ -1564,9 +2678,26 @@ i_udp_gensio_accepter_alloc(struct gensio_addr *iai, gensiods max_read_size,
     if (!nadata->ai && iai) /* Allow a null ai if it was passed in. */
 	goto out_nomem;
 
-    nadata->read_data = o->zalloc(o, max_read_size);
-    if (!nadata->read_data)
+    nadata->rbuf = o->zalloc(o, max_read_size * nr_rmsgs);
+    if (!nadata->rbuf)
 	goto out_nomem;
+    nadata->rmsgs = o->zalloc(o, sizeof(*nadata->rmsgs) * nr_rmsgs);
+    if (!nadata->rmsgs)
+	goto out_nomem;
+    nadata->nr_rmsgs = nr_rmsgs;
+    for (i = 0; i < nr_rmsgs; i++) {
+	nadata->rmsgs[i].buf = nadata->rbuf + max_read_size * i;
+	nadata->rmsgs[i].buflen = max_read_size;
+	nadata->rmsgs[i].addr = gensio_addr_alloc_recvfrom(o);
+	if (!nadata->rmsgs[i].addr)
+	    goto out_nomem;
+    }
+
+    if (nr_rmsgs > 1) {
+	nadata->txq_buf = o->zalloc(o, UDP_TXQ_BUF_SIZE);
+	if (!nadata->txq_buf)
+	    goto out_nomem;
+    }
 
     nadata->deferred_op_runner = o->alloc_runner(o, udpna_deferred_op, nadata);
     if (!nadata->deferred_op_runner)
@@ -1576,9 +2707,11 @@ i_udp_gensio_accepter_alloc(struct gensio_addr *iai, gensiods max_read_size,
     if (!nadata->lock)
 	goto out_nomem;
 
-    nadata->curr_recvaddr = gensio_addr_alloc_recvfrom(o);
-    if (!nadata->curr_recvaddr)
-	goto out_nomem;
+    if (idle_timeout) {
+	nadata->idle_timer = o->alloc_timer(o, udpna_idle_timeout, nadata);
+	if (!nadata->idle_timer)
+	    goto out_nomem;
+    }
 
     nadata->acc = gensio_acc_data_alloc(o, cb, user_data, gensio_acc_udp_func,
 					NULL, "udp", nadata);
@@ -1587,6 +2720,14 @@ i_udp_gensio_accepter_alloc(struct gensio_addr *iai, gensiods max_read_size,
     gensio_acc_set_is_packet(nadata->acc, true);
 
     nadata->max_read_size = max_read_size;
+    nadata->rq_max = rq_max;
+    nadata->rq_drop_head = rq_drop_head;
+    nadata->gro = gro;
+    nadata->rx_timestamp = rx_timestamp;
+    nadata->idle_timeout = idle_timeout;
+    nadata->sockopts = *sockopts;
+    /* The fds start out with read off, get them turned on when needed. */
+    nadata->read_disabled = true;
 
     *accepter = nadata->acc;
     return 0;
@@ -1604,22 +2745,75 @@ udp_gensio_accepter_alloc(struct gensio_addr *iai,
 			  struct gensio_accepter **accepter)
 {
     gensiods max_read_size = GENSIO_DEFAULT_UDP_BUF_SIZE;
-    unsigned int i;
-    bool reuseaddr = false;
-    int err, ival;
+    unsigned int i, rxbatch, rxqueue, idle_timeout;
+    bool reuseaddr = false, gro, rx_timestamp;
+    struct gensio_sockopts sockopts;
+    int err, ival, rxdrop;
+
+    err = gensio_get_default(o, "udp", "rxbatch", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    rxbatch = ival;
+    err = gensio_get_default(o, "udp", "rxqueue", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    rxqueue = ival;
+    err = gensio_get_default(o, "udp", "rxdrop", false,
+			     GENSIO_DEFAULT_ENUM, NULL, &rxdrop);
+    if (err)
+	return err;
+    err = gensio_get_default(o, "udp", "gro", false,
+			     GENSIO_DEFAULT_BOOL, NULL, &ival);
+    if (err)
+	return err;
+    gro = ival;
+    err = gensio_get_default(o, "udp", "timestamp", false,
+			     GENSIO_DEFAULT_BOOL, NULL, &ival);
+    if (err)
+	return err;
+    rx_timestamp = ival;
+    err = gensio_get_default(o, "udp", "idle_timeout", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	return err;
+    idle_timeout = ival;
+    memset(&sockopts, 0, sizeof(sockopts));
+    err = gensio_get_default_sockopts(o, "udp", &sockopts);
+    if (err)
+	return err;
 
     for (i = 0; args && args[i]; i++) {
 	if (gensio_check_keyds(args[i], "readbuf", &max_read_size) > 0)
 	    continue;
+	if (gensio_check_keyuint(args[i], "rxbatch", &rxbatch) > 0)
+	    continue;
+	if (gensio_check_keyuint(args[i], "rxqueue", &rxqueue) > 0)
+	    continue;
+	if (gensio_check_keyenum(args[i], "rxdrop", rxdrop_enums, &rxdrop) > 0)
+	    continue;
+	if (gensio_check_keybool(args[i], "gro", &gro) > 0)
+	    continue;
+	if (gensio_check_keybool(args[i], "timestamp", &rx_timestamp) > 0)
+	    continue;
+	if (gensio_check_keyuint(args[i], "idle_timeout", &idle_timeout) > 0)
+	    continue;
+	if (gensio_check_sockopt(args[i], &sockopts) > 0)
+	    continue;
 	return GE_INVAL;
     }
+    if (rxbatch < 1 || rxbatch > GENSIO_OS_MAX_MMSG)
+	return GE_INVAL;
     err = gensio_get_default(o, "udp", "reuseaddr", false,
 			     GENSIO_DEFAULT_BOOL, NULL, &ival);
     if (err)
 	return err;
     reuseaddr = ival;
 
-    return i_udp_gensio_accepter_alloc(iai, max_read_size, reuseaddr,
+    return i_udp_gensio_accepter_alloc(iai, max_read_size, rxbatch, rxqueue,
+				       rxdrop, gro, rx_timestamp, idle_timeout,
+				       &sockopts, reuseaddr,
 				       o, cb, user_data, accepter);
 }
 
@@ -1653,11 +2847,17 @@ udp_gensio_alloc(struct gensio_addr *addr, const char * const args[],
     struct gensio_accepter *accepter;
     struct udpna_data *nadata = NULL;
     struct gensio_addr *laddr = NULL, *mcast = NULL, *tmpaddr, *tmpaddr2;
-    int err, new_fd, ival;
+    struct gensio_addr *hub_laddr = NULL, *hub_mcast = NULL;
+    int err, new_fd = -1, ival;
     gensiods max_read_size = GENSIO_DEFAULT_UDP_BUF_SIZE;
-    unsigned int i;
+    unsigned int i, rxbatch, rxqueue;
+    int rxdrop;
     bool nocon = false, mcast_loop_set = false, mcast_loop = true;
-    bool reuseaddr = false;
+    bool reuseaddr = false, gro, rx_timestamp, mhub = false, connected;
+    bool hub_locked = false;
+    struct gensio_sockopts sockopts;
+    char raddrdata[200];
+    gensiods pos;
 
     err = gensio_get_defaultaddr(o, "udp", "laddr", false,
 				 GENSIO_NET_PROTOCOL_UDP, true, false, &laddr);
@@ -1671,11 +2871,54 @@ udp_gensio_alloc(struct gensio_addr *addr, const char * const args[],
     if (err)
 	return err;
     reuseaddr = ival;
+    err = gensio_get_default(o, "udp", "rxbatch", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	goto parm_err;
+    rxbatch = ival;
+    err = gensio_get_default(o, "udp", "rxqueue", false,
+			     GENSIO_DEFAULT_INT, NULL, &ival);
+    if (err)
+	goto parm_err;
+    rxqueue = ival;
+    err = gensio_get_default(o, "udp", "rxdrop", false,
+			     GENSIO_DEFAULT_ENUM, NULL, &rxdrop);
+    if (err)
+	goto parm_err;
+    err = gensio_get_default(o, "udp", "gro", false,
+			     GENSIO_DEFAULT_BOOL, NULL, &ival);
+    if (err)
+	goto parm_err;
+    gro = ival;
+    err = gensio_get_default(o, "udp", "timestamp", false,
+			     GENSIO_DEFAULT_BOOL, NULL, &ival);
+    if (err)
+	goto parm_err;
+    rx_timestamp = ival;
+    err = gensio_get_default(o, "udp", "connected", false,
+			     GENSIO_DEFAULT_BOOL, NULL, &ival);
+    if (err)
+	goto parm_err;
+    connected = ival;
+    memset(&sockopts, 0, sizeof(sockopts));
+    err = gensio_get_default_sockopts(o, "udp", &sockopts);
+    if (err)
+	goto parm_err;
 
     err = GE_INVAL;
     for (i = 0; args && args[i]; i++) {
 	if (gensio_check_keyds(args[i], "readbuf", &max_read_size) > 0)
 	    continue;
+	if (gensio_check_keyuint(args[i], "rxbatch", &rxbatch) > 0)
+	    continue;
+	if (gensio_check_keyuint(args[i], "rxqueue", &rxqueue) > 0)
+	    continue;
+	if (gensio_check_keyenum(args[i], "rxdrop", rxdrop_enums, &rxdrop) > 0)
+	    continue;
+	if (gensio_check_keybool(args[i], "gro", &gro) > 0)
+	    continue;
+	if (gensio_check_keybool(args[i], "timestamp", &rx_timestamp) > 0)
+	    continue;
 	tmpaddr = NULL;
 	if (gensio_check_keyaddrs(o, args[i], "laddr", GENSIO_NET_PROTOCOL_UDP,
 				  true, false, &tmpaddr) > 0) {
@@ -1703,6 +2946,12 @@ udp_gensio_alloc(struct gensio_addr *addr, const char * const args[],
 	}
 	if (gensio_check_keybool(args[i], "nocon", &nocon) > 0)
 	    continue;
+	if (gensio_check_keybool(args[i], "mhub", &mhub) > 0)
+	    continue;
+	if (gensio_check_keybool(args[i], "connected", &connected) > 0)
+	    continue;
+	if (gensio_check_sockopt(args[i], &sockopts) > 0)
+	    continue;
 	if (gensio_check_keybool(args[i], "mloop", &mcast_loop) > 0) {
 	    mcast_loop_set = true;
 	    continue;
@@ -1717,27 +2966,57 @@ udp_gensio_alloc(struct gensio_addr *addr, const char * const args[],
 	return err;
     }
 
-    err = gensio_os_socket_open(o, addr, GENSIO_NET_PROTOCOL_UDP, &new_fd);
-    if (err) {
-	if (laddr)
-	    gensio_addr_free(laddr);
-	if (mcast)
-	    gensio_addr_free(mcast);
-	return err;
+    if (rxbatch < 1 || rxbatch > GENSIO_OS_MAX_MMSG) {
+	err = GE_INVAL;
+	goto parm_err;
+    }
+
+    /* These all take datagrams from anywhere. */
+    if (connected && (nocon || mhub || mcast)) {
+	err = GE_INVAL;
+	goto parm_err;
+    }
+
+    if (mhub) {
+	/* The hub is looked up by these, so they must be given. */
+	if (!laddr || !mcast) {
+	    err = GE_INVAL;
+	    goto parm_err;
+	}
+	nocon = true;
+	err = udp_hub_init(o);
+	if (err)
+	    goto parm_err;
+	o->lock(udp_hub_lock);
+	hub_locked = true;
+	err = udp_hub_join(o, laddr, mcast, addr, cb, user_data,
+			   rxqueue, rxdrop, new_gensio);
+	if (err != GE_NOTFOUND)
+	    goto out_free_addrs;
+	/* Keep these to find the hub by. */
+	hub_laddr = gensio_addr_dup(laddr);
+	hub_mcast = gensio_addr_dup(mcast);
+	if (!hub_laddr || !hub_mcast) {
+	    err = GE_NOMEM;
+	    goto out_free_addrs;
+	}
     }
 
+    err = gensio_os_socket_open(o, addr, GENSIO_NET_PROTOCOL_UDP, &new_fd);
+    if (err)
+	goto out_free_addrs;
+
     err = gensio_os_socket_setup(o, new_fd, GENSIO_NET_PROTOCOL_UDP,
 				 false, false,
 				 reuseaddr ? GENSIO_OPENSOCK_REUSEADDR : 0,
 				 laddr);
-    if (err) {
-	gensio_os_close(o, &new_fd);
-	if (laddr)
-	    gensio_addr_free(laddr);
-	if (mcast)
-	    gensio_addr_free(mcast);
-	return err;
-    }
+    if (err)
+	goto out_close;
+
+    err = gensio_os_set_sockopts(o, new_fd, GENSIO_NET_PROTOCOL_UDP,
+				 &sockopts);
+    if (err)
+	goto out_close;
 
     if (laddr) {
 	gensio_addr_free(laddr);
@@ -1746,67 +3025,114 @@ udp_gensio_alloc(struct gensio_addr *addr, const char * const args[],
 
     if (mcast) {
 	err = gensio_os_mcast_add(o, new_fd, mcast, 0, false);
+	if (err)
+	    goto out_close;
 	gensio_addr_free(mcast);
-	if (err) {
-	    gensio_os_close(o, &new_fd);
-	    return err;
-	}
 	mcast = NULL;
     }
 
     if (mcast_loop_set) {
 	err = gensio_os_set_mcast_loop(o, new_fd, addr, mcast_loop);
-	if (err) {
-	    gensio_os_close(o, &new_fd);
-	    return err;
-	}
+	if (err)
+	    goto out_close;
     }
 
-    /* Allocate a dummy network accepter. */
-    err = i_udp_gensio_accepter_alloc(NULL, max_read_size, reuseaddr, o,
-				      NULL, NULL, &accepter);
-    if (err) {
-	gensio_os_close(o, &new_fd);
-	return err;
+    if (connected) {
+	err = gensio_os_connect(o, new_fd, addr);
+	if (err)
+	    goto out_close;
     }
+
+    /* Allocate a dummy network accepter. */
+    err = i_udp_gensio_accepter_alloc(NULL, max_read_size, rxbatch,
+				      rxqueue, rxdrop, gro, rx_timestamp, 0,
+				      &sockopts, reuseaddr, o, NULL, NULL, &accepter);
+    if (err)
+	goto out_close;
     nadata = gensio_acc_get_gensio_data(accepter);
     nadata->is_dummy = true;
     nadata->nocon = nocon;
+    nadata->hub = mhub;
+    nadata->connected = connected;
+    if (connected) {
+	/* The kernel only hands up datagrams from raddr. */
+	for (i = 0; i < nadata->nr_rmsgs; i++) {
+	    gensio_addr_free(nadata->rmsgs[i].addr);
+	    nadata->rmsgs[i].addr = NULL;
+	}
+    }
 
     nadata->fds = o->zalloc(o, sizeof(*nadata->fds));
     if (!nadata->fds) {
-	gensio_os_close(o, &new_fd);
-	udpna_do_free(nadata);
-	return GE_NOMEM;
+	err = GE_NOMEM;
+	goto out_free_nadata;
     }
     nadata->fds->family = gensio_addr_get_nettype(addr);
     nadata->fds->fd = new_fd;
     nadata->nr_fds = 1;
     /* fd belongs to udpn now, updn_do_free() will close it. */
+    new_fd = -1;
+    udpna_setup_fds(nadata);
 
     nadata->closed = true; /* Free nadata when ndata is freed. */
     nadata->freed = true;
 
-    ndata = udp_alloc_gensio(nadata, new_fd, addr,
+    ndata = udp_alloc_gensio(nadata, nadata->fds->fd, addr,
 			     cb, user_data, &nadata->closed_udpns);
     if (!ndata) {
 	err = GE_NOMEM;
-    } else {
-	gensio_set_is_client(ndata->io, true);
-	nadata->udpn_count = 1;
-	err = o->set_fd_handlers(o, new_fd, nadata,
-				 udpna_readhandler, udpna_writehandler, NULL,
-				 udpna_fd_cleared);
+	goto out_free_nadata;
     }
-
-    if (err) {
-	if (ndata)
+    gensio_set_is_client(ndata->io, true);
+    nadata->udpn_count = 1;
+    if (connected) {
+	strcpy(raddrdata, "addr:");
+	pos = 5;
+	err = gensio_addr_to_str(addr, raddrdata, &pos, sizeof(raddrdata));
+	if (!err) {
+	    ndata->raddr_aux = gensio_strdup(o, raddrdata);
+	    if (!ndata->raddr_aux)
+		err = GE_NOMEM;
+	}
+	if (err) {
 	    udpn_do_free(ndata);
-	udpna_do_free(nadata);
-    } else {
-	*new_gensio = ndata->io;
+	    goto out_free_nadata;
+	}
+    }
+    err = o->set_fd_handlers(o, nadata->fds->fd, nadata,
+			     udpna_readhandler, udpna_writehandler, NULL,
+			     udpna_fd_cleared);
+    if (err) {
+	udpn_do_free(ndata);
+	goto out_free_nadata;
     }
 
+    if (mhub) {
+	nadata->hub_laddr = hub_laddr;
+	nadata->hub_mcast = hub_mcast;
+	udp_hub_add(nadata);
+	o->unlock(udp_hub_lock);
+    }
+
+    *new_gensio = ndata->io;
+    return 0;
+
+ out_free_nadata:
+    udpna_do_free(nadata);
+ out_close:
+    if (new_fd != -1)
+	gensio_os_close(o, &new_fd);
+ out_free_addrs:
+    if (hub_locked)
+	o->unlock(udp_hub_lock);
+    if (hub_laddr)
+	gensio_addr_free(hub_laddr);
+    if (hub_mcast)
+	gensio_addr_free(hub_mcast);
+    if (laddr)
+	gensio_addr_free(laddr);
+    if (mcast)
+	gensio_addr_free(mcast);
     return err;
 }
 
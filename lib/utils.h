@@ -22,6 +22,15 @@ int strncasecmp(const char *s1, const char *s2, int n);
 
 int gensio_time_cmp(gensio_time *t1, gensio_time *t2);
 
+/* Free the global data in the udp gensio, for gensio_cleanup_mem(). */
+void udp_gensio_cleanup_mem(struct gensio_os_funcs *o);
+
+/*
+ * Free the resolve cache entries for o and wait for resolver threads
+ * to finish with o, for gensio_cleanup_mem().
+ */
+void gensio_os_resolve_cleanup_mem(struct gensio_os_funcs *o);
+
 struct enum_val
 {
     char *str;
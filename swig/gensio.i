@@ -288,6 +288,10 @@ struct waiter { };
 %constant int GENSIO_CONTROL_RADDR = GENSIO_CONTROL_RADDR;
 %constant int GENSIO_CONTROL_RADDR_BIN = GENSIO_CONTROL_RADDR_BIN;
 %constant int GENSIO_CONTROL_REMOTE_ID = GENSIO_CONTROL_REMOTE_ID;
+%constant int GENSIO_CONTROL_SOCKOPT = GENSIO_CONTROL_SOCKOPT;
+%constant int GENSIO_CONTROL_DROPS = GENSIO_CONTROL_DROPS;
+%constant int GENSIO_CONTROL_PRIORITY = GENSIO_CONTROL_PRIORITY;
+%constant int GENSIO_CONTROL_STATS = GENSIO_CONTROL_STATS;
 
 %extend gensio {
     gensio(struct gensio_os_funcs *o, char *str, swig_cb *handler) {
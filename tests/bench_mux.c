@@ -0,0 +1,292 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Per-message cost benchmark for the mux gensio.  A mux client
+ * connects to a mux accepter over TCP on loopback and opens a number
+ * of channels, then small messages are sent round-robin over all the
+ * channels and the time and CPU used per message are reported.  Both
+ * ends run in this process on one thread.
+ *
+ *   bench_mux [-c channels] [-m messages] [-s size] [-p protocol]
+ *             [-n] [-w tracefile]
+ *
+ * The cost per message should not depend on the number of channels.
+ * The time to open the channels is reported, too, and should grow
+ * linearly with the number of channels.
+ *
+ * -p sets the mux protocol version to use, to compare against older
+ * versions.  -n turns on nodelay for the TCP connection, the mux only
+ * holds acks back for a remote end that sends right away.  -w puts a
+ * trace gensio under the client's mux that writes everything going
+ * over the connection in both directions to the given file, and
+ * reports the wire bytes per message from its size.  The trace slows
+ * things down, so don't use it for timing.
+ *
+ * This is not run as part of the test suite, it's for measuring.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gensio/gensio.h>
+
+static struct gensio_os_funcs *o;
+static unsigned int nr_chans = 1000;
+static unsigned long long nr_msgs = 1000000;
+static unsigned int msg_size = 16;
+static unsigned int protocol;
+static const char *tracefile;
+static const char *tcp = "tcp";
+
+static struct gensio **cli_chans, **srv_chans;
+static gensiods *cli_pos;
+static unsigned int nr_srv_chans;
+static unsigned long long nr_rcvd_bytes;
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    struct gensio *nio;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	if (!err)
+	    nr_rcvd_bytes += *buflen;
+	return 0;
+
+    case GENSIO_EVENT_NEW_CHANNEL:
+	nio = (struct gensio *) buf;
+	if (nr_srv_chans < nr_chans)
+	    srv_chans[nr_srv_chans++] = nio;
+	gensio_set_callback(nio, srv_event, NULL);
+	gensio_set_read_callback_enable(nio, true);
+	return 0;
+
+    default:
+	return GE_NOTSUP;
+    }
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    return GE_NOTSUP;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_srv_chans > 0) {
+	gensio_free(io);
+	return 0;
+    }
+    srv_chans[nr_srv_chans++] = io;
+    gensio_set_callback(io, srv_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static double
+now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+service(void)
+{
+    gensio_time timeout = { 0, 1000000 };
+
+    o->service(o, &timeout);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-c channels] [-m messages] [-s size]"
+	    " [-p protocol] [-n] [-w tracefile]\n", name);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    unsigned char *buf;
+    char port[20], str[300], opts[50] = "";
+    struct stat st;
+    gensiods len, count;
+    unsigned long long nr_sent = 0;
+    off_t wire_start = 0;
+    unsigned int i;
+    double start, start_cpu, open_time, msg_time, msg_cpu;
+    int rv, c;
+
+    while ((c = getopt(argc, argv, "c:m:s:p:nw:")) != -1) {
+	switch (c) {
+	case 'c': nr_chans = strtoul(optarg, NULL, 0); break;
+	case 'm': nr_msgs = strtoull(optarg, NULL, 0); break;
+	case 's': msg_size = strtoul(optarg, NULL, 0); break;
+	case 'p': protocol = strtoul(optarg, NULL, 0); break;
+	case 'n': tcp = "tcp(nodelay)"; break;
+	case 'w': tracefile = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (nr_chans < 1 || nr_chans > 65535 || !nr_msgs || !msg_size)
+	usage(argv[0]);
+
+    cli_chans = calloc(nr_chans, sizeof(*cli_chans));
+    cli_pos = calloc(nr_chans, sizeof(*cli_pos));
+    srv_chans = calloc(nr_chans, sizeof(*srv_chans));
+    buf = calloc(1, msg_size);
+    if (!cli_chans || !cli_pos || !srv_chans || !buf) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    rv = gensio_default_os_hnd(0, &o);
+    if (rv) {
+	fprintf(stderr, "Could not allocate OS handler: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+
+    if (protocol)
+	snprintf(opts, sizeof(opts), ",protocol=%u", protocol);
+
+    snprintf(str, sizeof(str), "mux(max_channels=%u%s),%s,127.0.0.1,0",
+	     nr_chans + 1, opts, tcp);
+    rv = str_to_gensio_accepter(str, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+
+    if (tracefile) {
+	unlink(tracefile);
+	snprintf(str, sizeof(str),
+		 "mux(max_channels=%u%s),trace(dir=both,raw,file=%s),"
+		 "%s,127.0.0.1,%s", nr_chans + 1, opts, tracefile, tcp, port);
+    } else {
+	snprintf(str, sizeof(str), "mux(max_channels=%u%s),%s,127.0.0.1,%s",
+		 nr_chans + 1, opts, tcp, port);
+    }
+    rv = str_to_gensio(str, o, cli_event, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open mux: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+    cli_chans[0] = io;
+
+    start = now_ns(CLOCK_MONOTONIC);
+    for (i = 1; i < nr_chans; i++) {
+	rv = gensio_alloc_channel(io, NULL, cli_event, NULL, &cli_chans[i]);
+	if (!rv)
+	    rv = gensio_open_s(cli_chans[i]);
+	if (rv) {
+	    fprintf(stderr, "Could not open channel %u: %s\n", i,
+		    gensio_err_to_str(rv));
+	    return 1;
+	}
+    }
+    while (nr_srv_chans < nr_chans)
+	service();
+    open_time = now_ns(CLOCK_MONOTONIC) - start;
+    if (tracefile && stat(tracefile, &st) == 0)
+	wire_start = st.st_size;
+
+    start = now_ns(CLOCK_MONOTONIC);
+    start_cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    i = 0;
+    while (nr_rcvd_bytes < nr_msgs * msg_size) {
+	/*
+	 * Go around once.  The mux may take only part of a message,
+	 * the rest goes the next time around.
+	 */
+	for (c = nr_chans; c > 0 && nr_sent < nr_msgs; c--) {
+	    rv = gensio_write(cli_chans[i], &count, buf + cli_pos[i],
+			      msg_size - cli_pos[i], NULL);
+	    if (rv) {
+		fprintf(stderr, "Write error: %s\n", gensio_err_to_str(rv));
+		return 1;
+	    }
+	    cli_pos[i] += count;
+	    if (cli_pos[i] >= msg_size) {
+		cli_pos[i] = 0;
+		nr_sent++;
+	    }
+	    if (++i >= nr_chans)
+		i = 0;
+	}
+	service();
+    }
+    msg_time = now_ns(CLOCK_MONOTONIC) - start;
+    msg_cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+
+    printf("channels %u size %u messages %llu\n", nr_chans, msg_size,
+	   nr_msgs);
+    printf("  open     %12.0f ns/channel\n", open_time / nr_chans);
+    printf("  rate     %12.0f msgs/sec\n", nr_msgs / (msg_time / 1e9));
+    printf("  cpu      %12.0f ns/msg\n", msg_cpu / nr_msgs);
+
+    if (tracefile) {
+	/* Let the last acks get there. */
+	for (i = 0; i < 100; i++)
+	    service();
+	if (stat(tracefile, &st) == 0)
+	    printf("  wire     %12.1f bytes/msg\n",
+		   (double) (st.st_size - wire_start) / nr_msgs);
+    }
+
+    for (i = 0; i < nr_chans; i++) {
+	gensio_close_s(cli_chans[i]);
+	gensio_free(cli_chans[i]);
+    }
+    for (i = 0; i < nr_srv_chans; i++) {
+	gensio_close_s(srv_chans[i]);
+	gensio_free(srv_chans[i]);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    free(cli_chans);
+    free(cli_pos);
+    free(srv_chans);
+    free(buf);
+    o->free_funcs(o);
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Packet rate benchmark for the UDP accepter.  A separate thread
+ * blasts small datagrams at a udp accepter and the accepter counts
+ * what it receives, optionally echoing each packet back.
+ *
+ *   bench_udp [-t secs] [-s size] [-p peers] [-b rxbatch] [-e]
+ *
+ * Each peer is a different loopback source address (127.1.0.0 and
+ * up, picked with IP_PKTINFO), so a large number of peers can be
+ * simulated from one socket.  Before measuring, every peer is sent
+ * packets until it has a connection on the accepter.  Then the
+ * peers are sent to round-robin and the receive rate and the CPU time
+ * the event loop thread spends per packet are reported; the latter
+ * should not depend on the number of peers.
+ *
+ * This is not run as part of the test suite, it's for measuring.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+
+static struct gensio_os_funcs *o;
+static unsigned int run_secs = 5;
+static unsigned int pkt_size = 64;
+static unsigned int nr_peers = 1;
+static unsigned int rxbatch = 16;
+static int echo;
+
+static volatile int done, warm;
+static unsigned long long nr_sent, nr_echoed;
+static unsigned long long nr_rcvd;
+static unsigned int nr_conns;
+static struct gensio **conns;
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    gensiods count;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    nr_rcvd++;
+    if (echo)
+	gensio_write(io, &count, buf, *buflen, NULL);
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_conns >= nr_peers) {
+	gensio_free(io);
+	return 0;
+    }
+    conns[nr_conns] = io;
+    __atomic_add_fetch(&nr_conns, 1, __ATOMIC_SEQ_CST);
+    gensio_set_callback(io, io_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+/* Send one packet from the given peer, false if the socket is full. */
+static int
+send_from(int fd, struct sockaddr_in *dest, unsigned int peer,
+	  unsigned char *buf)
+{
+    struct msghdr hdr;
+    struct iovec iov;
+    union {
+	struct cmsghdr cm;
+	char data[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    } cbuf;
+    struct cmsghdr *cm;
+    struct in_pktinfo *pi;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&cbuf, 0, sizeof(cbuf));
+    iov.iov_base = buf;
+    iov.iov_len = pkt_size;
+    hdr.msg_name = dest;
+    hdr.msg_namelen = sizeof(*dest);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cbuf.data;
+    hdr.msg_controllen = sizeof(cbuf.data);
+    cm = CMSG_FIRSTHDR(&hdr);
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(*pi));
+    pi = (struct in_pktinfo *) CMSG_DATA(cm);
+    pi->ipi_spec_dst.s_addr = htonl((127 << 24) + (1 << 16) + peer);
+
+    if (sendmsg(fd, &hdr, MSG_DONTWAIT) < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+	    return 0;
+	perror("sendmsg");
+	exit(1);
+    }
+    return 1;
+}
+
+static void *
+sender(void *arg)
+{
+    struct sockaddr_in *dest = arg;
+    struct pollfd pfd;
+    unsigned char buf[65536], rbuf[65536];
+    unsigned int peer = 0;
+
+    pfd.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (pfd.fd == -1) {
+	perror("sender socket");
+	exit(1);
+    }
+    pfd.events = POLLIN | POLLOUT;
+    memset(buf, 0x5a, sizeof(buf));
+
+    while (!done) {
+	if (poll(&pfd, 1, 100) <= 0)
+	    continue;
+	if (pfd.revents & POLLIN) {
+	    while (recv(pfd.fd, rbuf, sizeof(rbuf), MSG_DONTWAIT) > 0)
+		nr_echoed++;
+	}
+	if (!(pfd.revents & POLLOUT))
+	    continue;
+	if (!warm) {
+	    /*
+	     * Keep going around until every peer has a connection,
+	     * pacing so the accepter's socket buffer doesn't overflow
+	     * too badly.
+	     */
+	    if (__atomic_load_n(&nr_conns, __ATOMIC_SEQ_CST) >= nr_peers) {
+		warm = 1;
+		continue;
+	    }
+	    if (send_from(pfd.fd, dest, peer, buf)) {
+		peer = (peer + 1) % nr_peers;
+		if (peer % 64 == 0)
+		    usleep(100);
+	    }
+	    continue;
+	}
+	while (!done && send_from(pfd.fd, dest, peer, buf)) {
+	    nr_sent++;
+	    peer = (peer + 1) % nr_peers;
+	    if (peer % 64 == 0)
+		break; /* Go check for echoes. */
+	}
+    }
+
+    close(pfd.fd);
+    return NULL;
+}
+
+static double
+thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+	    "Usage: %s [-t secs] [-s size] [-p peers] [-b rxbatch] [-e]\n",
+	    name);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio_waiter *w;
+    struct sockaddr_in dest;
+    pthread_t thread;
+    gensio_time timeout;
+    char port[20], str[100];
+    gensiods len;
+    unsigned int i;
+    unsigned long long start_rcvd, start_sent, start_echoed;
+    double start_cpu, cpu;
+    int rv, c;
+
+    while ((c = getopt(argc, argv, "t:s:p:b:e")) != -1) {
+	switch (c) {
+	case 't': run_secs = strtoul(optarg, NULL, 0); break;
+	case 's': pkt_size = strtoul(optarg, NULL, 0); break;
+	case 'p': nr_peers = strtoul(optarg, NULL, 0); break;
+	case 'b': rxbatch = strtoul(optarg, NULL, 0); break;
+	case 'e': echo = 1; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (!nr_peers || nr_peers > (1 << 22) || !pkt_size || pkt_size > 65507)
+	usage(argv[0]);
+
+    conns = calloc(nr_peers, sizeof(*conns));
+    if (!conns) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    rv = gensio_default_os_hnd(0, &o);
+    if (rv) {
+	fprintf(stderr, "Could not allocate OS handler: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    w = o->alloc_waiter(o);
+    if (!w) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    snprintf(str, sizeof(str), "udp(rxbatch=%u),127.0.0.1,0", rxbatch);
+    rv = str_to_gensio_accepter(str, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(strtoul(port, NULL, 0));
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (pthread_create(&thread, NULL, sender, &dest)) {
+	fprintf(stderr, "Could not start sender thread\n");
+	return 1;
+    }
+
+    /* Wait for all the peers to get connected. */
+    while (!warm) {
+	timeout.secs = 0;
+	timeout.nsecs = 10000000;
+	o->wait(w, 1, &timeout);
+    }
+
+    start_rcvd = nr_rcvd;
+    start_sent = nr_sent;
+    start_echoed = nr_echoed;
+    start_cpu = thread_cpu_ns();
+    timeout.secs = run_secs;
+    timeout.nsecs = 0;
+    o->wait(w, 1, &timeout);
+    cpu = thread_cpu_ns() - start_cpu;
+    done = 1;
+    pthread_join(thread, NULL);
+
+    nr_rcvd -= start_rcvd;
+    nr_sent -= start_sent;
+    nr_echoed -= start_echoed;
+    printf("size %u peers %u rxbatch %u%s\n", pkt_size, nr_peers, rxbatch,
+	   echo ? " echo" : "");
+    printf("  sent     %12.0f pkts/sec\n", (double) nr_sent / run_secs);
+    printf("  received %12.0f pkts/sec (%u connections)\n",
+	   (double) nr_rcvd / run_secs, nr_conns);
+    if (echo)
+	printf("  echoed   %12.0f pkts/sec\n", (double) nr_echoed / run_secs);
+    if (nr_rcvd)
+	printf("  cpu      %12.0f ns/pkt\n", cpu / nr_rcvd);
+
+    for (i = 0; i < nr_conns; i++) {
+	gensio_close_s(conns[i]);
+	gensio_free(conns[i]);
+    }
+    free(conns);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    /* Let the fd handlers get cleared so everything gets freed. */
+    timeout.secs = 0;
+    timeout.nsecs = 100000000;
+    o->wait(w, 1, &timeout);
+    o->free_waiter(w);
+    o->free_funcs(o);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the accepter limits (maxconns, acceptrate, acceptburst).
+ * Connections over the limit should wait in the kernel and be
+ * accepted when the accepter comes back under the limit.  conacc
+ * should not re-open its child until the limit allows it.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_CLIENTS 5
+
+static struct gensio *accepted[NR_CLIENTS];
+static unsigned int nr_accepted;
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_accepted < NR_CLIENTS)
+	accepted[nr_accepted++] = data;
+    else
+	gensio_free(data);
+    return 0;
+}
+
+static struct gensio *conacc_ios[NR_CLIENTS];
+static unsigned int nr_conacc;
+
+static int
+conacc_event(struct gensio_accepter *acc, void *user_data, int event,
+	     void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_conacc < NR_CLIENTS)
+	conacc_ios[nr_conacc++] = data;
+    else
+	gensio_free(data);
+    return 0;
+}
+
+static void
+open_done(struct gensio *io, int err, void *open_data)
+{
+}
+
+static unsigned long
+get_limit(struct gensio_accepter *acc, const char *name)
+{
+    char buf[30];
+    gensiods len = sizeof(buf);
+    int rv;
+
+    strcpy(buf, name);
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LIMIT, buf, &len);
+    check(!rv, "get %s: %s", name, gensio_err_to_str(rv));
+    if (rv)
+	return 0;
+    return strtoul(buf, NULL, 0);
+}
+
+static struct gensio_accepter *
+start_clients(const char *str, struct gensio *clients[])
+{
+    struct gensio_accepter *acc;
+    char port[20], cstr[100];
+    unsigned int i;
+    int rv;
+
+    nr_accepted = 0;
+    acc = start_acc(str, acc_event, port, sizeof(port));
+
+    snprintf(cstr, sizeof(cstr), "tcp,127.0.0.1,%s", port);
+    for (i = 0; i < NR_CLIENTS; i++) {
+	rv = str_to_gensio(cstr, o, NULL, NULL, &clients[i]);
+	if (!rv)
+	    rv = gensio_open(clients[i], open_done, NULL);
+	if (rv) {
+	    fprintf(stderr, "Could not start client: %s\n",
+		    gensio_err_to_str(rv));
+	    exit(1);
+	}
+    }
+
+    return acc;
+}
+
+static void
+stop_acc(struct gensio_accepter *acc, struct gensio *clients[])
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_accepted; i++) {
+	if (accepted[i])
+	    gensio_free(accepted[i]);
+    }
+    for (i = 0; i < NR_CLIENTS; i++)
+	gensio_free(clients[i]);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+}
+
+static void
+test_conacc(void)
+{
+    struct gensio_accepter *acc, *cacc;
+    char port[20], str[100];
+    unsigned int i;
+    int rv;
+
+    nr_accepted = 0;
+    acc = start_acc("tcp,127.0.0.1,0", acc_event, port, sizeof(port));
+    snprintf(str, sizeof(str), "conacc(maxconns=1),tcp,127.0.0.1,%s", port);
+    rv = str_to_gensio_accepter(str, o, conacc_event, NULL, &cacc);
+    if (!rv)
+	rv = gensio_acc_startup(cacc);
+    if (rv) {
+	fprintf(stderr, "Could not start conacc: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+    run_for(200);
+    check(nr_conacc == 1, "conacc opened %u", nr_conacc);
+
+    /* Closed but not freed, it still counts. */
+    gensio_close_s(conacc_ios[0]);
+    run_for(200);
+    check(nr_conacc == 1, "conacc opened %u after close", nr_conacc);
+    check(get_limit(cacc, "conns") == 1, "conacc conns not 1");
+
+    gensio_free(conacc_ios[0]);
+    run_for(200);
+    check(nr_conacc == 2, "conacc opened %u after free", nr_conacc);
+
+    gensio_acc_shutdown_s(cacc);
+    for (i = 1; i < nr_conacc; i++)
+	gensio_free(conacc_ios[i]);
+    gensio_acc_free(cacc);
+    for (i = 0; i < nr_accepted; i++)
+	gensio_free(accepted[i]);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio *clients[NR_CLIENTS];
+    char buf[30];
+    gensiods len;
+    int rv;
+
+    test_setup(0);
+
+    /* Only two connections at a time. */
+    acc = start_clients("tcp(maxconns=2),127.0.0.1,0", clients);
+    run_for(300);
+    check(nr_accepted == 2, "maxconns accepted %u", nr_accepted);
+    check(get_limit(acc, "conns") == 2, "conns not 2");
+    check(get_limit(acc, "throttled") >= 1, "not throttled");
+    gensio_free(accepted[0]);
+    accepted[0] = NULL;
+    run_for(300);
+    check(nr_accepted == 3, "after free accepted %u", nr_accepted);
+    check(get_limit(acc, "conns") == 2, "conns not 2");
+
+    /* Raising the limit lets the rest in. */
+    strcpy(buf, "maxconns=10");
+    len = sizeof(buf);
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, false,
+			    GENSIO_ACC_CONTROL_LIMIT, buf, &len);
+    check(!rv, "set maxconns: %s", gensio_err_to_str(rv));
+    run_for(300);
+    check(nr_accepted == NR_CLIENTS, "after raise accepted %u", nr_accepted);
+    check(get_limit(acc, "maxconns") == 10, "maxconns not 10");
+    stop_acc(acc, clients);
+
+    /* Two right away, then one every 100ms. */
+    acc = start_clients("tcp(acceptrate=10,acceptburst=2),127.0.0.1,0",
+			clients);
+    run_for(50);
+    check(nr_accepted == 2, "burst accepted %u", nr_accepted);
+    run_for(120);
+    check(nr_accepted == 3, "rate accepted %u", nr_accepted);
+    run_for(400);
+    check(nr_accepted == NR_CLIENTS, "all accepted %u", nr_accepted);
+    stop_acc(acc, clients);
+
+    test_conacc();
+
+    /* Limits can't be given bad values. */
+    rv = str_to_gensio_accepter("tcp(maxconns=x),127.0.0.1,0", o,
+				acc_event, NULL, &acc);
+    check(rv == GE_INVAL, "bad maxconns gave %s", gensio_err_to_str(rv));
+
+    return test_finish();
+}
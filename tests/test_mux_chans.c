@@ -0,0 +1,197 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test mux channel id handling.  Every channel id gets used, the
+ * next allocation must fail, and a freed id must be usable again.
+ * Each channel sends its own number to an echo on the other end and
+ * must get back only its own number.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define MAX_CHANS 16
+
+struct chan {
+    struct gensio *io;
+    unsigned int nr_rcvd;
+    unsigned int bad_rcvd;
+};
+
+static struct chan cli_chans[MAX_CHANS];
+static struct test_pair pair;
+static struct gensio *srv_chans[MAX_CHANS * 2];
+static unsigned int nr_srv_chans;
+
+static void
+srv_close_done(struct gensio *io, void *close_data)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_srv_chans; i++) {
+	if (srv_chans[i] == io)
+	    srv_chans[i] = NULL;
+    }
+    gensio_free(io);
+}
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    struct gensio *nio;
+    gensiods count;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	if (err)
+	    /* The other end closed the channel. */
+	    gensio_close(io, srv_close_done, NULL);
+	else
+	    gensio_write(io, &count, buf, *buflen, NULL);
+	return 0;
+
+    case GENSIO_EVENT_NEW_CHANNEL:
+	nio = (struct gensio *) buf;
+	if (nr_srv_chans < MAX_CHANS * 2)
+	    srv_chans[nr_srv_chans++] = nio;
+	gensio_set_callback(nio, srv_event, NULL);
+	gensio_set_read_callback_enable(nio, true);
+	return 0;
+
+    default:
+	return GE_NOTSUP;
+    }
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    struct chan *c = user_data;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    if (*buflen == 1 && buf[0] == c - cli_chans)
+	c->nr_rcvd++;
+    else
+	c->bad_rcvd++;
+    return 0;
+}
+
+static int
+open_chan(struct gensio *io, unsigned int i)
+{
+    int rv;
+
+    rv = gensio_alloc_channel(io, NULL, cli_event, &cli_chans[i],
+			      &cli_chans[i].io);
+    if (rv)
+	return rv;
+    rv = gensio_open_s(cli_chans[i].io);
+    if (rv) {
+	gensio_free(cli_chans[i].io);
+	cli_chans[i].io = NULL;
+	return rv;
+    }
+    gensio_set_read_callback_enable(cli_chans[i].io, true);
+    return 0;
+}
+
+static void
+send_all(void)
+{
+    unsigned char c;
+    gensiods count;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < MAX_CHANS; i++) {
+	c = i;
+	cli_chans[i].nr_rcvd = 0;
+	rv = gensio_write(cli_chans[i].io, &count, &c, 1, NULL);
+	check(!rv && count == 1, "write chan %u: %s", i,
+	      gensio_err_to_str(rv));
+    }
+    run_for(200);
+    for (i = 0; i < MAX_CHANS; i++) {
+	check(cli_chans[i].nr_rcvd == 1, "chan %u got %u", i,
+	      cli_chans[i].nr_rcvd);
+	check(cli_chans[i].bad_rcvd == 0, "chan %u got %u bad", i,
+	      cli_chans[i].bad_rcvd);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio *io, *extra;
+    char accstr[100], clistr[100];
+    unsigned int i;
+    int rv;
+
+    test_setup(0);
+
+    snprintf(accstr, sizeof(accstr), "mux(max_channels=%d),tcp,127.0.0.1,0",
+	     MAX_CHANS * 2);
+    snprintf(clistr, sizeof(clistr), "mux(max_channels=%d),tcp,127.0.0.1,",
+	     MAX_CHANS);
+    start_pair(&pair, accstr, srv_event, NULL, clistr, cli_event,
+	       &cli_chans[0]);
+    io = pair.cli;
+    cli_chans[0].io = io;
+    gensio_set_read_callback_enable(io, true);
+
+    /* Use up every id. */
+    for (i = 1; i < MAX_CHANS; i++) {
+	rv = open_chan(io, i);
+	check(!rv, "open chan %u: %s", i, gensio_err_to_str(rv));
+	if (rv)
+	    return 1;
+    }
+    rv = gensio_alloc_channel(io, NULL, cli_event, NULL, &extra);
+    check(rv == GE_INUSE, "alloc when full gave %s", gensio_err_to_str(rv));
+    if (!rv)
+	gensio_free(extra);
+    send_all();
+
+    /* Free one in the middle, its id must come back. */
+    gensio_close_s(cli_chans[5].io);
+    gensio_free(cli_chans[5].io);
+    cli_chans[5].io = NULL;
+    run_for(100);
+    rv = open_chan(io, 5);
+    check(!rv, "reopen chan 5: %s", gensio_err_to_str(rv));
+    if (rv)
+	return 1;
+    rv = gensio_alloc_channel(io, NULL, cli_event, NULL, &extra);
+    check(rv == GE_INUSE, "alloc when full gave %s", gensio_err_to_str(rv));
+    if (!rv)
+	gensio_free(extra);
+    send_all();
+
+    for (i = MAX_CHANS; i > 1; i--) {
+	gensio_close_s(cli_chans[i - 1].io);
+	gensio_free(cli_chans[i - 1].io);
+    }
+    run_for(100);
+    for (i = 0; i < nr_srv_chans; i++) {
+	if (srv_chans[i])
+	    gensio_free(srv_chans[i]);
+    }
+    stop_pair(&pair);
+    return test_finish();
+}
@@ -0,0 +1,377 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test mux channel priorities and weights.  A high priority channel
+ * must get its data out ahead of queued bulk data, channels with
+ * different weights must share the link in proportion, and a round
+ * trip on a high priority channel must finish ahead of the bulk data
+ * queued before it.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define MSG_SIZE 1000
+#define BUFSIZE "262144"
+#define NR_BULK 4
+#define NR_PINGS 20
+#define NR_QUEUED 20
+#define MAX_SRV_CHANS 20
+
+/* Server side channels, identified by their service. */
+struct srvchan {
+    struct gensio *io;
+    char service[20];
+    unsigned long long bytes;
+    int echo;
+};
+
+static struct test_pair pair;
+static struct srvchan srv_chans[MAX_SRV_CHANS];
+static unsigned int nr_srv_chans;
+
+/* The service of the first read on the server. */
+static char first_service[20];
+
+static unsigned int nr_pongs;
+
+/* What the server had received on the bulk channels at the last pong. */
+static unsigned long long pong_bulk_rcvd;
+
+static unsigned char msg[MSG_SIZE];
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    struct srvchan *c = user_data;
+    struct srvchan *nc;
+    gensiods count;
+    char prio[20];
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	if (err) {
+	    /* The other end closed the channel. */
+	    c->io = NULL;
+	    c->service[0] = '\0';
+	    gensio_close(io, close_free_done, NULL);
+	    return 0;
+	}
+	if (!first_service[0])
+	    strcpy(first_service, c->service);
+	c->bytes += *buflen;
+	if (c->echo)
+	    gensio_write(io, &count, buf, *buflen, NULL);
+	return 0;
+
+    case GENSIO_EVENT_NEW_CHANNEL:
+	if (nr_srv_chans >= MAX_SRV_CHANS) {
+	    gensio_free((struct gensio *) buf);
+	    return 0;
+	}
+	nc = &srv_chans[nr_srv_chans++];
+	nc->io = (struct gensio *) buf;
+	snprintf(nc->service, sizeof(nc->service), "%s", auxdata[0]);
+	if (strcmp(nc->service, "ctl") == 0) {
+	    /* Answer pings with the same priority they came with. */
+	    nc->echo = 1;
+	    strcpy(prio, "priority=7");
+	    count = sizeof(prio);
+	    gensio_control(nc->io, 0, false, GENSIO_CONTROL_PRIORITY,
+			   prio, &count);
+	}
+	gensio_set_callback(nc->io, srv_event, nc);
+	gensio_set_read_callback_enable(nc->io, true);
+	return 0;
+
+    default:
+	return GE_NOTSUP;
+    }
+}
+
+static unsigned long long
+bulk_rcvd(void)
+{
+    unsigned long long total = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_srv_chans; i++) {
+	if (strncmp(srv_chans[i].service, "bulk", 4) == 0)
+	    total += srv_chans[i].bytes;
+    }
+    return total;
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (!err) {
+	nr_pongs++;
+	pong_bulk_rcvd = bulk_rcvd();
+    }
+    return 0;
+}
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static struct gensio *
+open_chan(struct gensio *mux, const char *service, const char *sched)
+{
+    const char *args[3];
+    char svcarg[30];
+    struct gensio *io;
+    int rv;
+
+    snprintf(svcarg, sizeof(svcarg), "service=%s", service);
+    args[0] = svcarg;
+    args[1] = sched;
+    args[2] = NULL;
+    rv = gensio_alloc_channel(mux, args, cli_event, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open channel %s: %s\n", service,
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    gensio_set_read_callback_enable(io, true);
+    return io;
+}
+
+/* Queue up count messages on the channel without running the loop. */
+static void
+queue_msgs(struct gensio *io, unsigned int count)
+{
+    gensiods len;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < count; i++) {
+	rv = gensio_write(io, &len, msg, MSG_SIZE, NULL);
+	if (rv || len != MSG_SIZE) {
+	    fprintf(stderr, "Could not queue message: %s\n",
+		    gensio_err_to_str(rv));
+	    exit(1);
+	}
+    }
+}
+
+static struct srvchan *
+find_srv(const char *service)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_srv_chans; i++) {
+	if (strcmp(srv_chans[i].service, service) == 0)
+	    return &srv_chans[i];
+    }
+    return NULL;
+}
+
+static void
+close_chan(struct gensio *io)
+{
+    gensio_close_s(io);
+    gensio_free(io);
+}
+
+static void
+test_controls(struct gensio *mux)
+{
+    const char *args[] = { "priority=8", NULL };
+    struct gensio *io;
+    char buf[30];
+    gensiods len;
+    int rv;
+
+    rv = gensio_alloc_channel(mux, args, cli_event, NULL, &io);
+    check(rv == GE_INVAL, "priority 8 gave %s", gensio_err_to_str(rv));
+    args[0] = "weight=0";
+    rv = gensio_alloc_channel(mux, args, cli_event, NULL, &io);
+    check(rv == GE_INVAL, "weight 0 gave %s", gensio_err_to_str(rv));
+
+    io = open_chan(mux, "ctl", "priority=3");
+    strcpy(buf, "priority");
+    len = sizeof(buf);
+    rv = gensio_control(io, 0, true, GENSIO_CONTROL_PRIORITY, buf, &len);
+    check(!rv && strcmp(buf, "3") == 0, "get priority: %s %s",
+	  gensio_err_to_str(rv), buf);
+    strcpy(buf, "weight=10");
+    len = sizeof(buf);
+    rv = gensio_control(io, 0, false, GENSIO_CONTROL_PRIORITY, buf, &len);
+    check(!rv, "set weight: %s", gensio_err_to_str(rv));
+    strcpy(buf, "weight");
+    len = sizeof(buf);
+    rv = gensio_control(io, 0, true, GENSIO_CONTROL_PRIORITY, buf, &len);
+    check(!rv && strcmp(buf, "10") == 0, "get weight: %s %s",
+	  gensio_err_to_str(rv), buf);
+    strcpy(buf, "priority=8");
+    len = sizeof(buf);
+    rv = gensio_control(io, 0, false, GENSIO_CONTROL_PRIORITY, buf, &len);
+    check(rv == GE_INVAL, "set priority 8: %s", gensio_err_to_str(rv));
+    close_chan(io);
+}
+
+/* Data on a high priority channel goes ahead of queued bulk data. */
+static void
+test_priority(struct gensio *mux)
+{
+    struct gensio *bulk, *ctl;
+
+    bulk = open_chan(mux, "bulk0", NULL);
+    ctl = open_chan(mux, "ctl", "priority=7");
+    run_for(50);
+
+    first_service[0] = '\0';
+    queue_msgs(bulk, 50);
+    queue_msgs(ctl, 1);
+    run_for(200);
+    check(strcmp(first_service, "ctl") == 0, "first data was on %s",
+	  first_service);
+    close_chan(bulk);
+    close_chan(ctl);
+}
+
+/* Channels at the same priority share by weight. */
+static void
+test_weight(struct gensio *mux)
+{
+    struct gensio *light, *heavy;
+    struct srvchan *lc, *hc;
+    unsigned int i;
+
+    light = open_chan(mux, "light", "weight=1");
+    heavy = open_chan(mux, "heavy", "weight=4");
+    run_for(50);
+    lc = find_srv("light");
+    hc = find_srv("heavy");
+    if (!lc || !hc) {
+	fprintf(stderr, "Weight channels did not show up\n");
+	exit(1);
+    }
+
+    queue_msgs(light, 100);
+    queue_msgs(heavy, 100);
+    /* Stop well before either one runs out. */
+    for (i = 0; i < 1000 && lc->bytes + hc->bytes < 50 * MSG_SIZE; i++)
+	o->service(o, NULL);
+    check(hc->bytes >= 3 * lc->bytes, "heavy got %llu, light got %llu",
+	  hc->bytes, lc->bytes);
+    check(lc->bytes > 0, "light got nothing");
+    run_for(200);
+    close_chan(light);
+    close_chan(heavy);
+}
+
+/*
+ * Ping on a high priority channel with bulk data queued ahead of it.
+ * The pong must come back before most of that bulk data has made it
+ * to the other end.  This doesn't use wall clock times, they depend
+ * too much on what else the machine is doing.
+ */
+static void
+test_latency(struct gensio *mux)
+{
+    struct gensio *bulk[NR_BULK], *ctl;
+    char name[20];
+    unsigned long long sent = 0, base, ahead, passed;
+    double start;
+    gensiods len;
+    unsigned int i, j;
+    int rv;
+
+    for (i = 0; i < NR_BULK; i++) {
+	snprintf(name, sizeof(name), "bulk%u", i + 1);
+	bulk[i] = open_chan(mux, name, NULL);
+    }
+    ctl = open_chan(mux, "ctl", "priority=7");
+    run_for(50);
+
+    for (i = 0; i < NR_PINGS; i++) {
+	/* Start each ping from an empty link. */
+	start = now_ms();
+	while (bulk_rcvd() < sent && now_ms() - start < 10000)
+	    o->service(o, NULL);
+	base = bulk_rcvd();
+	check(base == sent, "bulk data did not drain before ping %u", i);
+
+	for (j = 0; j < NR_BULK; j++)
+	    queue_msgs(bulk[j], NR_QUEUED);
+	ahead = NR_BULK * NR_QUEUED * MSG_SIZE;
+	sent += ahead;
+
+	nr_pongs = 0;
+	rv = gensio_write(ctl, &len, msg, 10, NULL);
+	check(!rv && len == 10, "ping write: %s", gensio_err_to_str(rv));
+	start = now_ms();
+	while (!nr_pongs && now_ms() - start < 10000)
+	    o->service(o, NULL);
+	check(nr_pongs, "ping %u not answered", i);
+	passed = pong_bulk_rcvd - base;
+	check(passed < ahead / 2,
+	      "ping %u: %llu of %llu bulk bytes went ahead of the pong",
+	      i, passed, ahead);
+    }
+
+    run_for(100);
+    for (i = 0; i < NR_BULK; i++)
+	close_chan(bulk[i]);
+    close_chan(ctl);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio *mux;
+    unsigned int i;
+
+    test_setup(0);
+    for (i = 0; i < MSG_SIZE; i++)
+	msg[i] = i;
+
+    /* The server end of the mux itself is the first channel. */
+    strcpy(srv_chans[0].service, "chan0");
+    nr_srv_chans = 1;
+    start_pair(&pair,
+	       "mux(readbuf=" BUFSIZE ",writebuf=" BUFSIZE "),tcp,127.0.0.1,0",
+	       srv_event, &srv_chans[0],
+	       "mux(readbuf=" BUFSIZE ",writebuf=" BUFSIZE "),tcp,127.0.0.1,",
+	       cli_event, NULL);
+    mux = pair.cli;
+    srv_chans[0].io = pair.srv;
+
+    test_controls(mux);
+    test_priority(mux);
+    test_weight(mux);
+    test_latency(mux);
+
+    for (i = 1; i < nr_srv_chans; i++) {
+	if (srv_chans[i].io)
+	    gensio_free(srv_chans[i].io);
+    }
+    stop_pair(&pair);
+    return test_finish();
+}
@@ -0,0 +1,217 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test mux protocol versions against each other.  Messages are sent
+ * between ends asking for different versions, with and without
+ * nodelay on the tcp connection so acks get held back or not, and
+ * must all arrive intact.  What the client writes is traced so the
+ * short data headers of version 3 can be seen to cut the bytes on
+ * the wire.  A hand built version 1 remote end sending a window
+ * message must get its connection closed.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_MSGS 2000
+#define MAX_MSG 600
+#define TRACEFILE "test_mux_proto.trc"
+
+static struct test_pair pair;
+static struct test_msgs msgs;
+
+static gensiods
+msg_len(unsigned int msg)
+{
+    /* Mostly small messages, with a big one now and then. */
+    if (msg % 50 == 0)
+	return MAX_MSG;
+    return msg % 20 + 1;
+}
+
+/* Returns the number of bytes the client wrote. */
+static off_t
+run_test(unsigned int srv_proto, unsigned int cli_proto, const char *tcp,
+	 bool npause)
+{
+    char accstr[100], clistr[200];
+    struct stat st;
+
+    msgs.nr_msgs = NR_MSGS;
+    msgs.msg_len = msg_len;
+    msgs.pause_reads = npause;
+
+    snprintf(accstr, sizeof(accstr),
+	     "mux(readbuf=2048,protocol=%u),%s,127.0.0.1,0", srv_proto, tcp);
+    unlink(TRACEFILE);
+    snprintf(clistr, sizeof(clistr), "mux(writebuf=16384,protocol=%u),"
+	     "trace(dir=write,raw,file=" TRACEFILE "),%s,127.0.0.1,",
+	     cli_proto, tcp);
+    start_pair(&pair, accstr, test_msgs_srv_event, &msgs,
+	       clistr, test_msgs_cli_event, &msgs);
+    run_msgs(&pair, &msgs);
+    check(msgs.rcvd == NR_MSGS, "protocol %u/%u %s pause %d: got %u messages",
+	  srv_proto, cli_proto, tcp, npause, msgs.rcvd);
+    stop_pair(&pair);
+
+    st.st_size = 0;
+    check(stat(TRACEFILE, &st) == 0, "No trace file");
+    unlink(TRACEFILE);
+    return st.st_size;
+}
+
+static struct gensio *srv_io;
+static unsigned char raw_rcvd[100];
+static gensiods raw_len;
+static bool raw_closed;
+
+static int
+raw_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    gensiods len;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err) {
+	raw_closed = true;
+	gensio_set_read_callback_enable(io, false);
+	return 0;
+    }
+    len = *buflen;
+    if (len > sizeof(raw_rcvd) - raw_len)
+	len = sizeof(raw_rcvd) - raw_len;
+    memcpy(raw_rcvd + raw_len, buf, len);
+    raw_len += len;
+    return 0;
+}
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err) {
+	srv_io = NULL;
+	gensio_close(io, close_free_done, NULL);
+    }
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    srv_io = data;
+    gensio_set_callback(srv_io, srv_event, NULL);
+    gensio_set_read_callback_enable(srv_io, true);
+    return 0;
+}
+
+/*
+ * Talk to a mux server with a plain tcp connection, claiming to be
+ * the given version, and send it a window message once the first
+ * channel is up.  Only version 2 and later may send those.
+ */
+static void
+test_window_version(unsigned int version)
+{
+    unsigned char msg[16] = {
+	/* Init */
+	0x11, 0, 0, 0,
+	/* New channel 1, window 65536, no service */
+	0x22, 0, 0, 1, 0, 1, 0, 0, 0, 0
+    };
+    unsigned char win[8] = { 0x62, 0, 0, 0, 0, 2, 0, 0 };
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    char port[20], str[100];
+    gensiods count;
+    unsigned int i;
+    int rv;
+
+    srv_io = NULL;
+    raw_len = 0;
+    raw_closed = false;
+    acc = start_acc("mux,tcp,127.0.0.1,0", acc_event, port, sizeof(port));
+
+    snprintf(str, sizeof(str), "tcp,127.0.0.1,%s", port);
+    rv = str_to_gensio(str, o, raw_event, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open raw client: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    gensio_set_read_callback_enable(io, true);
+
+    msg[2] = version;
+    rv = gensio_write(io, &count, msg, 14, NULL);
+    check(!rv && count == 14, "raw write: %s", gensio_err_to_str(rv));
+    /* The server's init and its new channel response. */
+    for (i = 0; i < 100 && raw_len < 16; i++)
+	run_for(10);
+    check(raw_len == 16 && raw_rcvd[4] >> 4 == 3 && !raw_rcvd[14] &&
+	  !raw_rcvd[15], "version %u: bad channel response", version);
+    check(srv_io, "version %u: no server channel", version);
+
+    /* Send it to the server's channel id. */
+    win[2] = raw_rcvd[12];
+    win[3] = raw_rcvd[13];
+    rv = gensio_write(io, &count, win, sizeof(win), NULL);
+    check(!rv && count == sizeof(win), "raw write: %s",
+	  gensio_err_to_str(rv));
+    for (i = 0; i < 20 && !raw_closed; i++)
+	run_for(10);
+    if (version < 2)
+	check(raw_closed, "version %u: window message accepted", version);
+    else
+	check(!raw_closed, "version %u: window message refused", version);
+
+    gensio_close_s(io);
+    gensio_free(io);
+    run_for(100);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+}
+
+int
+main(int argc, char *argv[])
+{
+    off_t v2_size, v3_size;
+
+    test_setup(0);
+
+    v3_size = run_test(3, 3, "tcp", false);
+    run_test(3, 3, "tcp(nodelay)", false);
+    run_test(3, 3, "tcp(nodelay)", true);
+    v2_size = run_test(2, 3, "tcp(nodelay)", false);
+    run_test(3, 2, "tcp(nodelay)", true);
+    run_test(1, 3, "tcp", false);
+    run_test(3, 1, "tcp(nodelay)", false);
+    test_window_version(1);
+    test_window_version(2);
+
+    /* The small messages should mostly go with a one byte header. */
+    check(v3_size < v2_size * 9 / 10, "version 3 sent %ld, version 2 %ld",
+	  (long) v3_size, (long) v2_size);
+
+    return test_finish();
+}
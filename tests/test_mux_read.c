@@ -0,0 +1,66 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test mux read delivery when the user doesn't take everything it is
+ * given.  Whole messages are handed to the user straight from the
+ * child's buffer if they can be, whatever is left over has to come
+ * back later in order with the message flags intact.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_MSGS 200
+#define MAX_MSG 3000
+
+static struct test_pair pair;
+static struct test_msgs msgs;
+
+static gensiods
+msg_len(unsigned int msg)
+{
+    return (msg * 997) % MAX_MSG + 1;
+}
+
+/*
+ * Take at most ntake bytes per read callback, 0 means everything, and
+ * stop reading after each callback if npause is set.
+ */
+static void
+run_test(gensiods ntake, bool npause)
+{
+    msgs.nr_msgs = NR_MSGS;
+    msgs.msg_len = msg_len;
+    msgs.take = ntake;
+    msgs.pause_reads = npause;
+
+    start_pair(&pair, "mux(readbuf=16384),tcp,127.0.0.1,0",
+	       test_msgs_srv_event, &msgs,
+	       "mux(writebuf=16384),tcp,127.0.0.1,",
+	       test_msgs_cli_event, &msgs);
+    run_msgs(&pair, &msgs);
+    check(msgs.rcvd == NR_MSGS, "take %lu pause %d: got %u messages",
+	  (unsigned long) ntake, npause, msgs.rcvd);
+    stop_pair(&pair);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_setup(0);
+
+    run_test(0, false);
+    run_test(100, false);
+    run_test(1000, true);
+
+    return test_finish();
+}
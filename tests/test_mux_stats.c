@@ -0,0 +1,222 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the mux statistics control.  The byte and message counts on
+ * both ends must match what was sent, a channel whose receiver stops
+ * reading must show its window used up and time blocked on it, and
+ * garbage from the other end must show up as a header error.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_MSGS 100
+#define READBUF 4096
+
+static struct test_pair pair;
+static struct gensio *srv_io;
+static unsigned long long srv_bytes;
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    srv_bytes += *buflen;
+    return 0;
+}
+
+/* Sends garbage to whatever connects. */
+static int
+bad_acc_event(struct gensio_accepter *acc, void *user_data, int event,
+	      void *data)
+{
+    static const unsigned char junk[4] = { 0xff, 0xff, 0xff, 0xff };
+    struct gensio *io = data;
+    gensiods count;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    srv_io = io;
+    gensio_set_callback(io, srv_event, NULL);
+    gensio_write(io, &count, junk, sizeof(junk), NULL);
+    return 0;
+}
+
+/* The garbage test logs a protocol error, count instead of print. */
+static unsigned int logs;
+
+static void
+do_vlog(struct gensio_os_funcs *f, enum gensio_log_levels level,
+	const char *log, va_list args)
+{
+    logs++;
+}
+
+static long long
+get_stat(struct gensio *io, const char *name)
+{
+    char buf[100];
+    gensiods len = sizeof(buf);
+    int rv;
+
+    strcpy(buf, name);
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_STATS, buf, &len);
+    if (rv) {
+	check(0, "Get %s: %s", name, gensio_err_to_str(rv));
+	return -2;
+    }
+    return strtoll(buf, NULL, 0);
+}
+
+static void
+test_counts(void)
+{
+    struct gensio *io;
+    unsigned char data[100];
+    unsigned long long total = 0;
+    char str[100], all[500];
+    gensiods len, count;
+    unsigned int i;
+    int rv;
+
+    srv_bytes = 0;
+    snprintf(str, sizeof(str), "mux(readbuf=%d),tcp,127.0.0.1,0", READBUF);
+    start_pair(&pair, str, srv_event, NULL,
+	       "mux(writebuf=65536),tcp,127.0.0.1,", NULL, NULL);
+    io = pair.cli;
+    srv_io = pair.srv;
+
+    memset(data, 0, sizeof(data));
+    for (i = 0; i < NR_MSGS; i++) {
+	rv = gensio_write(io, &count, data, i % sizeof(data) + 1, NULL);
+	check(!rv && count == i % sizeof(data) + 1, "Write %u failed", i);
+	total += count;
+    }
+    for (i = 0; i < 100 && srv_bytes < total; i++)
+	run_for(10);
+    check(srv_bytes == total, "Got %llu of %llu bytes", srv_bytes, total);
+
+    check(get_stat(io, "msgs_out") == NR_MSGS, "Client msgs_out %lld",
+	  get_stat(io, "msgs_out"));
+    check(get_stat(io, "bytes_out") == total, "Client bytes_out %lld",
+	  get_stat(io, "bytes_out"));
+    check(get_stat(srv_io, "msgs_in") == NR_MSGS, "Server msgs_in %lld",
+	  get_stat(srv_io, "msgs_in"));
+    check(get_stat(srv_io, "bytes_in") == total, "Server bytes_in %lld",
+	  get_stat(srv_io, "bytes_in"));
+    check(get_stat(io, "msgs_in") == 0, "Client msgs_in %lld",
+	  get_stat(io, "msgs_in"));
+    check(get_stat(srv_io, "read_window") == READBUF,
+	  "Server read_window %lld", get_stat(srv_io, "read_window"));
+    check(get_stat(io, "send_window") == READBUF,
+	  "Client send_window %lld", get_stat(io, "send_window"));
+    check(get_stat(io, "sched_pos") == -1, "Client sched_pos %lld",
+	  get_stat(io, "sched_pos"));
+    check(get_stat(io, "hdr_errors") == 0, "Client hdr_errors %lld",
+	  get_stat(io, "hdr_errors"));
+    check(logs == 0, "Got %u logs", logs);
+
+    /* Stop the receiver, the sender should fill the window and block. */
+    gensio_set_read_callback_enable(srv_io, false);
+    for (i = 0; i < 10000 / sizeof(data); i++)
+	gensio_write(io, &count, data, sizeof(data), NULL);
+    run_for(100);
+    check(get_stat(io, "send_used") > READBUF - 110, "Client send_used %lld",
+	  get_stat(io, "send_used"));
+    check(get_stat(srv_io, "read_used") == get_stat(io, "send_used"),
+	  "Server read_used %lld, client send_used %lld",
+	  get_stat(srv_io, "read_used"), get_stat(io, "send_used"));
+    check(get_stat(io, "write_queued") > 0, "Client write_queued %lld",
+	  get_stat(io, "write_queued"));
+    check(get_stat(io, "window_blocked_ms") >= 50,
+	  "Client window_blocked_ms %lld",
+	  get_stat(io, "window_blocked_ms"));
+
+    /* All of them at once. */
+    strcpy(all, "");
+    len = sizeof(all);
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_STATS, all, &len);
+    check(!rv && len == strlen(all), "Get all: %s", gensio_err_to_str(rv));
+    check(strstr(all, "msgs_out=") && strstr(all, " write_stalls="),
+	  "Bad stats: %s", all);
+    /* Too small a buffer still returns the full length. */
+    count = 10;
+    strcpy(str, "");
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_STATS, str, &count);
+    check(!rv && count == len, "Short get returned %lu, not %lu",
+	  (unsigned long) count, (unsigned long) len);
+
+    strcpy(str, "nosuchstat");
+    len = sizeof(str);
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_STATS, str, &len);
+    check(rv == GE_INVAL, "Bad stat name returned %s",
+	  gensio_err_to_str(rv));
+    rv = gensio_control(io, 0, false, GENSIO_CONTROL_STATS, str, &len);
+    check(rv == GE_NOTSUP, "Set returned %s", gensio_err_to_str(rv));
+
+    gensio_set_read_callback_enable(srv_io, true);
+    stop_pair(&pair);
+}
+
+static void
+test_hdr_errors(void)
+{
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    char port[20], str[100];
+    int rv;
+
+    srv_io = NULL;
+    acc = start_acc("tcp,127.0.0.1,0", bad_acc_event, port, sizeof(port));
+
+    snprintf(str, sizeof(str), "mux,tcp,127.0.0.1,%s", port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    if (rv) {
+	fprintf(stderr, "Could not alloc client: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    rv = gensio_open_s(io);
+    check(rv, "Open with garbage worked");
+    check(logs == 1, "Got %u logs", logs);
+    check(get_stat(io, "hdr_errors") == 1, "Client hdr_errors %lld",
+	  get_stat(io, "hdr_errors"));
+    gensio_free(io);
+
+    if (srv_io) {
+	gensio_close_s(srv_io);
+	gensio_free(srv_io);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_setup(0);
+    o->vlog = do_vlog;
+
+    test_counts();
+    test_hdr_errors();
+
+    return test_finish();
+}
@@ -0,0 +1,228 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test a mux with several threads.  A thread per channel writes to
+ * its own channel while more than one thread runs the event loop, and
+ * the other end checks that each channel's data arrives intact and in
+ * order.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+
+#define NR_CHANS 8
+#define NR_LOOP_THREADS 4
+#define XFER_SIZE (2 * 1024 * 1024)
+
+struct chan {
+    unsigned int num;
+    struct gensio *io;
+    unsigned long long sent;
+    unsigned long long rcvd;
+    int bad;
+};
+
+static struct test_pair pair;
+static struct chan chans[NR_CHANS];
+static volatile int done;
+
+static unsigned char
+chan_byte(struct chan *c, unsigned long long pos)
+{
+    return (c->num * 7 + pos) % 251;
+}
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    struct chan *c = user_data;
+    struct gensio *nio;
+    unsigned int num;
+    gensiods i;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	if (err) {
+	    gensio_close(io, close_free_done, NULL);
+	    return 0;
+	}
+	if (!c)
+	    return 0;
+	for (i = 0; i < *buflen; i++) {
+	    if (buf[i] != chan_byte(c, c->rcvd + i)) {
+		c->bad++;
+		break;
+	    }
+	}
+	c->rcvd += *buflen;
+	return 0;
+
+    case GENSIO_EVENT_NEW_CHANNEL:
+	nio = (struct gensio *) buf;
+	c = NULL;
+	if (sscanf(auxdata[0], "c%u", &num) == 1 && num < NR_CHANS)
+	    c = &chans[num];
+	gensio_set_callback(nio, srv_event, c);
+	gensio_set_read_callback_enable(nio, true);
+	return 0;
+
+    default:
+	return GE_NOTSUP;
+    }
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    /* Nothing is sent this way, this is just for the close. */
+    return 0;
+}
+
+static void
+handle_sigusr1(int sig)
+{
+}
+
+static void *
+loop_thread(void *arg)
+{
+    gensio_time timeout;
+
+    while (!done) {
+	timeout.secs = 0;
+	timeout.nsecs = 10000000;
+	o->wait(w, 1, &timeout);
+    }
+    return NULL;
+}
+
+static void *
+write_thread(void *arg)
+{
+    struct chan *c = arg;
+    unsigned char buf[4096];
+    gensiods i, count;
+    int rv;
+
+    while (c->sent < XFER_SIZE) {
+	for (i = 0; i < sizeof(buf); i++)
+	    buf[i] = chan_byte(c, c->sent + i);
+	rv = gensio_write(c->io, &count, buf, sizeof(buf), NULL);
+	if (rv) {
+	    check(0, "chan %u write: %s", c->num, gensio_err_to_str(rv));
+	    break;
+	}
+	c->sent += count;
+	if (count == 0)
+	    usleep(100);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio *io;
+    pthread_t loop_threads[NR_LOOP_THREADS], write_threads[NR_CHANS];
+    char service[20];
+    const char *args[2] = { service, NULL };
+    struct sigaction sigdo;
+    unsigned int i;
+    int rv;
+
+    /* Used to wake the other threads waiting in the selector. */
+    memset(&sigdo, 0, sizeof(sigdo));
+    sigdo.sa_handler = handle_sigusr1;
+    rv = sigaction(SIGUSR1, &sigdo, NULL);
+    if (rv) {
+	perror("Could not set up siguser1 handler");
+	return 1;
+    }
+
+    test_setup(SIGUSR1);
+
+    start_pair(&pair, "mux(readbuf=65536),tcp,127.0.0.1,0", srv_event, NULL,
+	       "mux(writebuf=65536),tcp,127.0.0.1,", NULL, NULL);
+    io = pair.cli;
+
+    for (i = 0; i < NR_CHANS; i++) {
+	chans[i].num = i;
+	snprintf(service, sizeof(service), "service=c%u", i);
+	rv = gensio_alloc_channel(io, args, cli_event, NULL,
+				  &chans[i].io);
+	if (!rv)
+	    rv = gensio_open_s(chans[i].io);
+	if (rv) {
+	    fprintf(stderr, "Could not open channel %u: %s\n", i,
+		    gensio_err_to_str(rv));
+	    return 1;
+	}
+	gensio_set_read_callback_enable(chans[i].io, true);
+    }
+
+    for (i = 0; i < NR_LOOP_THREADS; i++)
+	pthread_create(&loop_threads[i], NULL, loop_thread, NULL);
+    for (i = 0; i < NR_CHANS; i++)
+	pthread_create(&write_threads[i], NULL, write_thread, &chans[i]);
+    for (i = 0; i < NR_CHANS; i++)
+	pthread_join(write_threads[i], NULL);
+
+    for (i = 0; i < 300; i++) {
+	unsigned int j;
+
+	for (j = 0; j < NR_CHANS; j++) {
+	    if (chans[j].rcvd < chans[j].sent)
+		break;
+	}
+	if (j == NR_CHANS)
+	    break;
+	usleep(10000);
+    }
+    for (i = 0; i < NR_CHANS; i++) {
+	check(chans[i].rcvd == chans[i].sent, "chan %u sent %llu got %llu",
+	      i, chans[i].sent, chans[i].rcvd);
+	check(!chans[i].bad, "chan %u got bad data", i);
+    }
+
+    for (i = 0; i < NR_CHANS; i++) {
+	gensio_close_s(chans[i].io);
+	gensio_free(chans[i].io);
+    }
+    stop_pair(&pair);
+    done = 1;
+    for (i = 0; i < NR_LOOP_THREADS; i++)
+	pthread_join(loop_threads[i], NULL);
+
+    return test_finish();
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+    /* Skip the test. */
+    return 77;
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test mux receive window tuning.  With max_readbuf set, a channel
+ * that keeps its window full should get a bigger window, which shows
+ * up as bigger writes being accepted on the sending side, and the
+ * window should go back down after the channel is idle for a while.
+ * Without max_readbuf the window must stay where it is.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define READBUF 1024
+#define WRITEBUF "262144"
+#define XFER_SIZE (4 * 1024 * 1024)
+
+static struct test_pair pair;
+static unsigned long long bytes_sent, bytes_rcvd;
+static gensiods max_write, max_read;
+static unsigned char data[65536];
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    gensiods i;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    for (i = 0; i < *buflen; i++) {
+	if (buf[i] != (bytes_rcvd + i) % 251) {
+	    check(0, "Bad data at %llu", bytes_rcvd + i);
+	    exit(1);
+	}
+    }
+    bytes_rcvd += *buflen;
+    if (*buflen > max_read)
+	max_read = *buflen;
+    return 0;
+}
+
+/* Write as much as will be taken, noting the biggest write. */
+static void
+do_write(struct gensio *io)
+{
+    gensiods count;
+    int rv;
+
+    rv = gensio_write(io, &count, data + bytes_sent % 251,
+		      sizeof(data) - 251, NULL);
+    if (rv) {
+	check(0, "write: %s", gensio_err_to_str(rv));
+	exit(1);
+    }
+    bytes_sent += count;
+    if (count > max_write)
+	max_write = count;
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_WRITE_READY)
+	return GE_NOTSUP;
+    if (bytes_sent >= XFER_SIZE)
+	gensio_set_write_callback_enable(io, false);
+    else
+	do_write(io);
+    return 0;
+}
+
+static void
+run_test(const char *srvopts, bool tuned)
+{
+    struct gensio *io;
+    char str[100];
+    gensiods len;
+    unsigned int i;
+
+    bytes_sent = 0;
+    bytes_rcvd = 0;
+    max_write = 0;
+    max_read = 0;
+
+    snprintf(str, sizeof(str), "mux(%s),tcp,127.0.0.1,0", srvopts);
+    start_pair(&pair, str, srv_event, NULL,
+	       "mux(writebuf=" WRITEBUF "),tcp,127.0.0.1,", cli_event, NULL);
+    io = pair.cli;
+
+    gensio_set_write_callback_enable(io, true);
+    for (i = 0; i < 200 && bytes_rcvd < XFER_SIZE; i++)
+	run_for(100);
+    run_for(100);
+    check(bytes_rcvd == bytes_sent, "%s: sent %llu received %llu", srvopts,
+	  bytes_sent, bytes_rcvd);
+
+    /* Only half the window can go in one write. */
+    if (tuned) {
+	check(max_write > READBUF * 4, "%s: window did not grow, max write %lu",
+	      srvopts, (unsigned long) max_write);
+	check(max_read > READBUF, "%s: buffer did not grow, max read %lu",
+	      srvopts, (unsigned long) max_read);
+    } else {
+	check(max_write < READBUF, "%s: window grew, max write %lu",
+	      srvopts, (unsigned long) max_write);
+    }
+
+    /* Go idle, the window should shrink. */
+    run_for(3500);
+    if (tuned) {
+	len = max_write;
+	max_write = 0;
+	do_write(io);
+	check(max_write < len / 2, "%s: window did not shrink, %lu then %lu",
+	      srvopts, (unsigned long) len, (unsigned long) max_write);
+	run_for(100);
+	check(bytes_rcvd == bytes_sent, "%s: sent %llu received %llu",
+	      srvopts, bytes_sent, bytes_rcvd);
+    }
+
+    stop_pair(&pair);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int i;
+
+    test_setup(0);
+    for (i = 0; i < sizeof(data); i++)
+	data[i] = i % 251;
+
+    run_test("readbuf=1024", false);
+    run_test("readbuf=1024,max_readbuf=131072", true);
+
+    return test_finish();
+}
@@ -0,0 +1,260 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test connection racing in the tcp gensio.  Addresses that never
+ * answer are made with listening sockets that are never accepted on
+ * and have a full backlog, the kernel drops the SYNs for those so the
+ * connect hangs like it would for a black-holed route.  The listener
+ * that works is IPv4 only, the address list starts with IPv6
+ * addresses that hang.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_FILL 3
+
+struct blackhole {
+    int fd;
+    int fill[NR_FILL];
+    unsigned int port;
+};
+
+static struct gensio *srv_io;
+static unsigned int nr_srv;
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    nr_srv++;
+    if (srv_io) {
+	gensio_free(io);
+	return 0;
+    }
+    srv_io = io;
+    gensio_set_callback(io, srv_event, NULL);
+    return 0;
+}
+
+static int
+blackhole_open(struct blackhole *b, int family)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *s4 = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) &ss;
+    socklen_t len;
+    unsigned int i;
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET6) {
+	s6->sin6_family = AF_INET6;
+	s6->sin6_addr = in6addr_loopback;
+	len = sizeof(*s6);
+    } else {
+	s4->sin_family = AF_INET;
+	s4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(*s4);
+    }
+
+    b->fd = socket(family, SOCK_STREAM, 0);
+    if (b->fd == -1)
+	return -1;
+    if (bind(b->fd, (struct sockaddr *) &ss, len) == -1 ||
+		listen(b->fd, 0) == -1 ||
+		getsockname(b->fd, (struct sockaddr *) &ss, &len) == -1) {
+	close(b->fd);
+	return -1;
+    }
+    b->port = ntohs(family == AF_INET6 ? s6->sin6_port : s4->sin_port);
+
+    /* Fill the backlog, these never get accepted. */
+    for (i = 0; i < NR_FILL; i++) {
+	b->fill[i] = socket(family, SOCK_STREAM, 0);
+	if (b->fill[i] == -1)
+	    continue;
+	fcntl(b->fill[i], F_SETFL, O_NONBLOCK);
+	connect(b->fill[i], (struct sockaddr *) &ss, len);
+    }
+    /* Let the handshakes finish so the queue is full. */
+    usleep(100000);
+    return 0;
+}
+
+static void
+blackhole_close(struct blackhole *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_FILL; i++) {
+	if (b->fill[i] != -1)
+	    close(b->fill[i]);
+    }
+    close(b->fd);
+}
+
+/* Return the number of open fds, or -1 if it can't be found. */
+static int
+count_fds(void)
+{
+    DIR *d = opendir("/proc/self/fd");
+    struct dirent *e;
+    int count = 0;
+
+    if (!d)
+	return -1;
+    while ((e = readdir(d)))
+	count++;
+    closedir(d);
+    return count;
+}
+
+static unsigned int
+msecs_since(const gensio_time *start)
+{
+    gensio_time now;
+
+    o->get_monotonic_time(o, &now);
+    return ((now.secs - start->secs) * 1000 +
+	    (now.nsecs - start->nsecs) / 1000000);
+}
+
+static int open_err;
+static bool open_finished;
+
+static void
+open_done(struct gensio *io, int err, void *open_data)
+{
+    open_err = err;
+    open_finished = true;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct blackhole h6a, h6b, h4;
+    struct gensio *io;
+    gensio_time start;
+    char port[20], str[200];
+    unsigned int elapsed;
+    int rv, base_fds, nfds;
+
+    test_setup(0);
+
+    if (blackhole_open(&h6a, AF_INET6) || blackhole_open(&h6b, AF_INET6)) {
+	fprintf(stderr, "IPv6 loopback is not available, skipping\n");
+	return 77;
+    }
+    if (blackhole_open(&h4, AF_INET)) {
+	perror("IPv4 listener");
+	return 1;
+    }
+
+    acc = start_acc("tcp,ipv4,127.0.0.1,0", acc_event, port, sizeof(port));
+    run_for(10);
+    base_fds = count_fds();
+
+    /*
+     * The two IPv6 addresses hang.  Alternating families, the IPv4
+     * address is started one delay after the first IPv6 one instead
+     * of two.  Trying them one after another would not connect until
+     * the kernel gives up on the hanging ones, which takes minutes.
+     * The upper limit is loose so a busy machine doesn't fail this.
+     */
+    snprintf(str, sizeof(str),
+	     "tcp,ipv6,::1,%u,ipv6,::1,%u,ipv4,127.0.0.1,%s",
+	     h6a.port, h6b.port, port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc %s: %s", str, gensio_err_to_str(rv));
+    if (rv)
+	return test_finish();
+    o->get_monotonic_time(o, &start);
+    rv = gensio_open_s(io);
+    elapsed = msecs_since(&start);
+    check(!rv, "open: %s", gensio_err_to_str(rv));
+    check(elapsed >= 200 && elapsed < 2000,
+	  "connect took %u ms, expected about 250", elapsed);
+    run_for(50);
+    check(nr_srv == 1, "%u server connections", nr_srv);
+
+    /* The losing attempt is gone, only the client and server fds. */
+    nfds = count_fds();
+    if (base_fds >= 0)
+	check(nfds == base_fds + 2, "%d fds open, expected %d", nfds,
+	      base_fds + 2);
+
+    gensio_close_s(io);
+    gensio_free(io);
+    if (srv_io)
+	gensio_free(srv_io);
+    srv_io = NULL;
+    run_for(10);
+
+    /*
+     * Close while attempts are racing, none of them will finish.  The
+     * close must complete once the cancelled attempts are cleared.
+     */
+    snprintf(str, sizeof(str),
+	     "tcp,ipv6,::1,%u,ipv4,127.0.0.1,%u,ipv6,::1,%u",
+	     h6a.port, h4.port, h6b.port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc %s: %s", str, gensio_err_to_str(rv));
+    if (rv)
+	return test_finish();
+    rv = gensio_open(io, open_done, NULL);
+    check(!rv, "open: %s", gensio_err_to_str(rv));
+    run_for(300);
+    check(!open_finished, "open finished with %s",
+	  gensio_err_to_str(open_err));
+    o->get_monotonic_time(o, &start);
+    rv = gensio_close_s(io);
+    elapsed = msecs_since(&start);
+    check(!rv, "close: %s", gensio_err_to_str(rv));
+    /* Waiting on the hanging attempts would take minutes. */
+    check(elapsed < 1000, "close took %u ms", elapsed);
+    check(open_finished, "open never finished");
+    gensio_free(io);
+    run_for(10);
+    nfds = count_fds();
+    if (base_fds >= 0)
+	check(nfds == base_fds, "%d fds open after close, expected %d", nfds,
+	      base_fds);
+    check(nr_srv == 1, "%u server connections", nr_srv);
+
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    blackhole_close(&h6a);
+    blackhole_close(&h6b);
+    blackhole_close(&h4);
+
+    return test_finish();
+}
@@ -0,0 +1,180 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test gensio pools against a tcp accepter.  The accepter side counts
+ * connections and closes, that tells whether the pool reused a
+ * connection or made a new one, and whether it closed one.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define MAX_SRV 10
+
+static struct gensio *srv[MAX_SRV];
+static unsigned int nr_srv;
+static unsigned int nr_srv_closed;
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err) {
+	nr_srv_closed++;
+	gensio_set_read_callback_enable(io, false);
+    }
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_srv >= MAX_SRV) {
+	gensio_free(io);
+	return 0;
+    }
+    srv[nr_srv++] = io;
+    gensio_set_callback(io, srv_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static struct gensio *
+pool_get(struct gensio_pool *pool)
+{
+    struct gensio *io = NULL;
+    int rv;
+
+    rv = gensio_pool_get_s(pool, &io);
+    check(!rv, "pool get: %s", gensio_err_to_str(rv));
+    return io;
+}
+
+static struct gensio_pool *
+alloc_pool(const char *port, unsigned int max_size, unsigned int idle_ms)
+{
+    struct gensio_pool *pool;
+    gensio_time timeout;
+    char str[100];
+    int rv;
+
+    timeout.secs = idle_ms / 1000;
+    timeout.nsecs = (idle_ms % 1000) * 1000000;
+    snprintf(str, sizeof(str), "tcp,127.0.0.1,%s", port);
+    rv = gensio_pool_alloc(o, str, max_size, &timeout, &pool);
+    if (rv) {
+	fprintf(stderr, "Could not allocate pool: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    return pool;
+}
+
+static void
+pool_done(struct gensio_pool *pool, struct gensio *io, int err,
+	  void *done_data)
+{
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio_pool *pool;
+    struct gensio *io, *io2;
+    char port[20];
+    unsigned int i;
+    int rv;
+
+    test_setup(0);
+
+    acc = start_acc("tcp,127.0.0.1,0", acc_event, port, sizeof(port));
+    pool = alloc_pool(port, 1, 300);
+
+    /* Put back for reuse, the next get gets the same connection. */
+    io = pool_get(pool);
+    rv = gensio_pool_put(pool, io, true);
+    check(!rv, "put: %s", gensio_err_to_str(rv));
+    io2 = pool_get(pool);
+    check(io2 == io, "reuse gave a different gensio");
+    run_for(50);
+    check(nr_srv == 1, "reuse made %u connections", nr_srv);
+
+    /* Only one is allowed. */
+    rv = gensio_pool_get(pool, pool_done, NULL);
+    check(rv == GE_INUSE, "get past max_size gave %s",
+	  gensio_err_to_str(rv));
+
+    /* Not reused, it gets closed and the next get makes a new one. */
+    rv = gensio_pool_put(pool, io2, false);
+    check(!rv, "put no reuse: %s", gensio_err_to_str(rv));
+    run_for(50);
+    check(nr_srv_closed == 1, "no reuse put closed %u", nr_srv_closed);
+    io = pool_get(pool);
+    run_for(50);
+    check(nr_srv == 2, "after no reuse put %u connections", nr_srv);
+
+    /* A gensio the pool doesn't have out can't be put. */
+    rv = gensio_pool_put(pool, srv[0], true);
+    check(rv == GE_NOTFOUND, "put of a foreign gensio gave %s",
+	  gensio_err_to_str(rv));
+
+    /* Idle for too long, it gets closed. */
+    gensio_pool_put(pool, io, true);
+    run_for(150);
+    check(nr_srv_closed == 1, "closed early, %u", nr_srv_closed);
+    run_for(300);
+    check(nr_srv_closed == 2, "idle timeout closed %u", nr_srv_closed);
+    io = pool_get(pool);
+    run_for(50);
+    check(nr_srv == 3, "after idle timeout %u connections", nr_srv);
+
+    /* The remote end closes while idle, the pool drops it. */
+    gensio_pool_put(pool, io, true);
+    gensio_close_s(srv[2]);
+    run_for(50);
+    io = pool_get(pool);
+    run_for(50);
+    check(nr_srv == 4, "after remote close %u connections", nr_srv);
+
+    /* Free with one still out, it is closed when it comes back. */
+    gensio_pool_free(pool);
+    run_for(50);
+    check(nr_srv_closed == 2, "free closed an in use gensio");
+    rv = gensio_pool_put(pool, io, true);
+    check(!rv, "put after free: %s", gensio_err_to_str(rv));
+    run_for(50);
+    check(nr_srv_closed == 3, "put after free closed %u", nr_srv_closed);
+
+    /* Free with idle ones, they get closed. */
+    pool = alloc_pool(port, 0, 10000);
+    io = pool_get(pool);
+    gensio_pool_put(pool, io, true);
+    gensio_pool_free(pool);
+    run_for(50);
+    check(nr_srv == 5, "second pool made %u connections", nr_srv);
+    check(nr_srv_closed == 4, "free closed %u", nr_srv_closed);
+
+    for (i = 0; i < nr_srv; i++)
+	gensio_free(srv[i]);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+
+    return test_finish();
+}
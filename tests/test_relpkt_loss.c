@@ -0,0 +1,391 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test relpkt loss recovery.  relpkt runs over UDP through a small
+ * proxy that passes datagrams between the two ends and throws some
+ * of the data, ack and resend request packets away.  All the data
+ * must still arrive in order, and lost packets must be recovered
+ * quickly instead of waiting on a long fixed timer.
+ *
+ * Run with "-l <percent>", "-s <bytes>" and "-p <protocol>" to try
+ * other loss rates, sizes and protocol versions by hand.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define XFER_SIZE (256 * 1024)
+#define PKTSIZE 1000
+
+/* The proxy's two sides, cli_side talks to the client. */
+static struct gensio *cli_side, *srv_side;
+static char srv_port[20];
+static unsigned int loss_pct;
+static unsigned int nr_dropped, nr_passed;
+static unsigned int rand_state = 1;
+
+static struct gensio *srv_io;
+static unsigned long long xfer_size, bytes_sent, bytes_rcvd;
+static int bad_data;
+static int srv_err;
+
+static unsigned int
+next_rand(void)
+{
+    /* Our own generator so every run drops the same packets. */
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) & 0x7fff;
+}
+
+static unsigned char
+xfer_byte(unsigned long long pos)
+{
+    return pos % 251;
+}
+
+static void
+proxy_close_done(struct gensio *io, void *close_data)
+{
+    gensio_free(io);
+}
+
+static int
+proxy_event(struct gensio *io, void *user_data, int event, int err,
+	    unsigned char *buf, gensiods *buflen,
+	    const char *const *auxdata)
+{
+    struct gensio *other = io == cli_side ? srv_side : cli_side;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err || !other)
+	return 0;
+
+    /*
+     * Only drop data, ack and resend request packets, the handshake
+     * should go through.
+     */
+    if (*buflen >= 3 && (buf[0] >> 4 == 2 || buf[0] >> 4 == 3) &&
+		next_rand() % 100 < loss_pct) {
+	nr_dropped++;
+	return 0;
+    }
+    nr_passed++;
+    gensio_write(other, NULL, buf, *buflen, NULL);
+    return 0;
+}
+
+static int
+proxy_acc_event(struct gensio_accepter *acc, void *user_data, int event,
+		void *data)
+{
+    struct gensio *io = data;
+    char str[100];
+    int rv;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (cli_side) {
+	gensio_free(io);
+	return 0;
+    }
+
+    snprintf(str, sizeof(str), "udp,127.0.0.1,%s", srv_port);
+    rv = str_to_gensio(str, o, proxy_event, NULL, &srv_side);
+    if (!rv)
+	rv = gensio_open_s(srv_side);
+    if (rv) {
+	fprintf(stderr, "Could not open proxy: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+    gensio_set_read_callback_enable(srv_side, true);
+
+    cli_side = io;
+    gensio_set_callback(io, proxy_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static void
+srv_close_done(struct gensio *io, void *close_data)
+{
+    gensio_free(io);
+}
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    gensiods i;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err) {
+	srv_err = err;
+	gensio_close(io, srv_close_done, NULL);
+	srv_io = NULL;
+	return 0;
+    }
+    for (i = 0; i < *buflen; i++) {
+	if (buf[i] != xfer_byte(bytes_rcvd + i)) {
+	    bad_data++;
+	    break;
+	}
+    }
+    bytes_rcvd += *buflen;
+    return 0;
+}
+
+static int
+srv_acc_event(struct gensio_accepter *acc, void *user_data, int event,
+	      void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    srv_io = data;
+    gensio_set_callback(srv_io, srv_event, NULL);
+    gensio_set_read_callback_enable(srv_io, true);
+    return 0;
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    unsigned char data[PKTSIZE];
+    gensiods i, len, count;
+    int rv;
+
+    if (event == GENSIO_EVENT_READ)
+	return 0;
+    if (event != GENSIO_EVENT_WRITE_READY)
+	return GE_NOTSUP;
+    while (bytes_sent < xfer_size) {
+	len = sizeof(data);
+	if (len > xfer_size - bytes_sent)
+	    len = xfer_size - bytes_sent;
+	for (i = 0; i < len; i++)
+	    data[i] = xfer_byte(bytes_sent + i);
+	rv = gensio_write(io, &count, data, len, NULL);
+	if (rv) {
+	    check(0, "write: %s", gensio_err_to_str(rv));
+	    exit(1);
+	}
+	if (count == 0)
+	    return 0;
+	bytes_sent += count;
+    }
+    gensio_set_write_callback_enable(io, false);
+    return 0;
+}
+
+static int64_t
+msecs_now(void)
+{
+    gensio_time now;
+
+    o->get_monotonic_time(o, &now);
+    return now.secs * 1000 + now.nsecs / 1000000;
+}
+
+/* Returns the time the transfer took in milliseconds. */
+static int64_t
+run_test(unsigned int loss, unsigned long long size, unsigned int protocol)
+{
+    struct gensio_accepter *srv_acc, *proxy_acc;
+    struct gensio *io;
+    char proxy_port[20], str[200];
+    int64_t start, end;
+    unsigned int i;
+    int rv;
+
+    loss_pct = loss;
+    xfer_size = size;
+    bytes_sent = 0;
+    bytes_rcvd = 0;
+    bad_data = 0;
+    nr_dropped = 0;
+    nr_passed = 0;
+    cli_side = NULL;
+    srv_side = NULL;
+    srv_io = NULL;
+
+    snprintf(str, sizeof(str),
+	     "relpkt(max_pktsize=%d),udp,127.0.0.1,0", PKTSIZE);
+    srv_acc = start_acc(str, srv_acc_event, srv_port, sizeof(srv_port));
+    proxy_acc = start_acc("udp,127.0.0.1,0", proxy_acc_event,
+			  proxy_port, sizeof(proxy_port));
+
+    snprintf(str, sizeof(str),
+	     "relpkt(max_pktsize=%d,protocol=%u),udp,127.0.0.1,%s",
+	     PKTSIZE, protocol, proxy_port);
+    rv = str_to_gensio(str, o, cli_event, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open client: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+    gensio_set_read_callback_enable(io, true);
+
+    start = msecs_now();
+    gensio_set_write_callback_enable(io, true);
+    for (i = 0; i < 60000 && bytes_rcvd < xfer_size; i++)
+	run_for(1);
+    end = msecs_now();
+
+    check(bytes_rcvd == xfer_size, "%u%% loss: got %llu of %llu bytes",
+	  loss, bytes_rcvd, xfer_size);
+    check(!bad_data, "%u%% loss: bad data", loss);
+    printf("v%u %u%% loss: %llu bytes in %lld ms, %u of %u packets dropped\n",
+	   protocol, loss, bytes_rcvd, (long long) (end - start), nr_dropped,
+	   nr_dropped + nr_passed);
+
+    gensio_close_s(io);
+    gensio_free(io);
+    for (i = 0; i < 100 && srv_io; i++)
+	run_for(10);
+    if (srv_side) {
+	gensio_close_s(srv_side);
+	gensio_free(srv_side);
+    }
+    if (cli_side) {
+	gensio_close(cli_side, proxy_close_done, NULL);
+	run_for(10);
+    }
+    gensio_acc_shutdown_s(proxy_acc);
+    gensio_acc_free(proxy_acc);
+    gensio_acc_shutdown_s(srv_acc);
+    gensio_acc_free(srv_acc);
+    run_for(10);
+
+    return end - start;
+}
+
+/*
+ * A selective ack whose length is not a multiple of 4 from a hand
+ * built version 2 remote end must just close the connection.
+ */
+static void
+test_bad_sack(void)
+{
+    static const unsigned char init[7] = {
+	0x10, 2, 128, PKTSIZE >> 8, PKTSIZE & 0xff, 0x04, 0x00
+    };
+    static const unsigned char ack[8] = { 0x22, 0, 0, 0, 0, 0, 1, 0 };
+    struct gensio_accepter *srv_acc;
+    struct gensio *io;
+    char str[200];
+    gensiods count;
+    unsigned int i;
+    int rv;
+
+    srv_io = NULL;
+    srv_err = 0;
+    snprintf(str, sizeof(str),
+	     "relpkt(max_pktsize=%d),udp,127.0.0.1,0", PKTSIZE);
+    srv_acc = start_acc(str, srv_acc_event, srv_port, sizeof(srv_port));
+
+    snprintf(str, sizeof(str), "udp,127.0.0.1,%s", srv_port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open raw client: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+
+    rv = gensio_write(io, &count, init, sizeof(init), NULL);
+    check(!rv, "init write: %s", gensio_err_to_str(rv));
+    for (i = 0; i < 100 && !srv_io; i++)
+	run_for(10);
+    check(srv_io, "No server connection");
+
+    rv = gensio_write(io, &count, ack, sizeof(ack), NULL);
+    check(!rv, "ack write: %s", gensio_err_to_str(rv));
+    for (i = 0; i < 100 && srv_io; i++)
+	run_for(10);
+    check(!srv_io && srv_err == GE_PROTOERR, "Bad sack gave %s",
+	  gensio_err_to_str(srv_err));
+
+    gensio_close_s(io);
+    gensio_free(io);
+    gensio_acc_shutdown_s(srv_acc);
+    gensio_acc_free(srv_acc);
+    run_for(10);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long long size = XFER_SIZE;
+    unsigned int protocol = 2;
+    int loss = -1;
+    int64_t msecs, limit;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:p:s:")) != -1) {
+	switch (c) {
+	case 'l':
+	    loss = strtoul(optarg, NULL, 0);
+	    break;
+	case 'p':
+	    protocol = strtoul(optarg, NULL, 0);
+	    break;
+	case 's':
+	    size = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    fprintf(stderr,
+		    "Usage: %s [-l <loss%%>] [-p <protocol>] [-s <size>]\n",
+		    argv[0]);
+	    return 1;
+	}
+    }
+
+    test_setup(0);
+
+    if (loss >= 0) {
+	run_test(loss, size, protocol);
+    } else {
+	/*
+	 * Waiting a second or so on a fixed timer for each lost packet
+	 * would make these take many seconds, recovering in a few round
+	 * trip times doesn't add much to the lossless time.  That is
+	 * the base so a busy machine doesn't cause a failure.
+	 */
+	limit = 2000 + 10 * run_test(0, size, 2);
+	msecs = run_test(5, size, 2);
+	check(msecs < limit, "5%% loss took %lld ms, limit %lld ms",
+	      (long long) msecs, (long long) limit);
+	msecs = run_test(10, size, 2);
+	check(msecs < limit, "10%% loss took %lld ms, limit %lld ms",
+	      (long long) msecs, (long long) limit);
+	/*
+	 * The client asks for an older protocol, the server must follow.
+	 * These recover with resend requests instead of selective acks.
+	 */
+	msecs = run_test(5, size, 1);
+	check(msecs < limit, "Version 1 5%% loss took %lld ms, limit %lld ms",
+	      (long long) msecs, (long long) limit);
+	msecs = run_test(5, size, 0);
+	check(msecs < limit, "Version 0 5%% loss took %lld ms, limit %lld ms",
+	      (long long) msecs, (long long) limit);
+	test_bad_sack();
+    }
+
+    return test_finish();
+}
@@ -0,0 +1,224 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test asynchronous name resolution for tcp client gensios.  A stub
+ * resolver that takes a while to answer is installed, then this
+ * makes sure that opening with asyncresolve does not block the
+ * event loop, that results are cached, that failures are reported
+ * through the open callback, and that closing/freeing a gensio with
+ * a lookup outstanding is safe.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gensio/gensio.h>
+#include <gensio/gensio_osops.h>
+#include "test_util.h"
+
+#define STUB_DELAY_US 300000
+
+static unsigned int resolver_calls;
+static unsigned int ticks;
+static struct gensio_timer *tick_timer;
+
+static int
+stub_resolver(struct gensio_os_funcs *f, const char *str, bool listen,
+	      int protocol, struct gensio_addr **raddr)
+{
+    const char *port;
+    char newstr[100];
+
+    __atomic_add_fetch(&resolver_calls, 1, __ATOMIC_SEQ_CST);
+    usleep(STUB_DELAY_US);
+
+    if (strncmp(str, "fail.invalid,", 13) == 0)
+	return GE_NOTFOUND;
+    if (strncmp(str, "stub.invalid,", 13) != 0)
+	return gensio_os_scan_netaddr(f, str, listen, protocol, raddr);
+    port = str + 13;
+    snprintf(newstr, sizeof(newstr), "ipv4,127.0.0.1,%s", port);
+    return gensio_os_scan_netaddr(f, newstr, listen, protocol, raddr);
+}
+
+static void
+tick(struct gensio_timer *t, void *cb_data)
+{
+    gensio_time timeout = { 0, 20000000 };
+
+    ticks++;
+    o->start_timer(tick_timer, &timeout);
+}
+
+static struct gensio *accepted[4];
+static unsigned int nr_accepted;
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_accepted < 4)
+	accepted[nr_accepted++] = data;
+    else
+	gensio_free(data);
+    return 0;
+}
+
+static int64_t
+now_us(void)
+{
+    gensio_time t;
+
+    o->get_monotonic_time(o, &t);
+    return t.secs * 1000000 + t.nsecs / 1000;
+}
+
+static void
+open_done(struct gensio *io, int err, void *open_data)
+{
+    *((int *) open_data) = err;
+}
+
+static void
+close_done(struct gensio *io, void *close_data)
+{
+    *((bool *) close_data) = true;
+    o->wake(w);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    gensio_time timeout;
+    char port[20], str[100];
+    gensiods len;
+    unsigned int i, start_ticks;
+    int64_t start;
+    int rv, open_err;
+    bool closed;
+
+#ifndef USE_PTHREADS
+    fprintf(stderr, "No threads, asynchronous resolution is not available\n");
+    exit(77);
+#endif
+
+    test_setup(0);
+    tick_timer = o->alloc_timer(o, tick, NULL);
+    if (!tick_timer) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    gensio_os_set_resolver(stub_resolver);
+
+    rv = str_to_gensio_accepter("tcp,127.0.0.1,0", o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+
+    timeout.secs = 0;
+    timeout.nsecs = 20000000;
+    o->start_timer(tick_timer, &timeout);
+
+    /* Allocation must not do the lookup. */
+    snprintf(str, sizeof(str), "tcp(asyncresolve),stub.invalid,%s", port);
+    start = now_us();
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc failed: %s", gensio_err_to_str(rv));
+    check(now_us() - start < STUB_DELAY_US / 2, "alloc blocked");
+    check(resolver_calls == 0, "resolver called on alloc");
+
+    /* The loop must keep running while the lookup is outstanding. */
+    start_ticks = ticks;
+    rv = gensio_open_s(io);
+    check(!rv, "open failed: %s", gensio_err_to_str(rv));
+    check(ticks - start_ticks >= 5, "event loop blocked, %u ticks",
+	  ticks - start_ticks);
+    check(resolver_calls == 1, "resolver called %u times", resolver_calls);
+    rv = gensio_close_s(io);
+    check(!rv, "close failed: %s", gensio_err_to_str(rv));
+
+    /* Reopening uses the already resolved address. */
+    rv = gensio_open_s(io);
+    check(!rv, "reopen failed: %s", gensio_err_to_str(rv));
+    check(resolver_calls == 1, "resolver called %u times", resolver_calls);
+    gensio_close_s(io);
+    gensio_free(io);
+
+    /* A new gensio with the same name hits the cache. */
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc failed: %s", gensio_err_to_str(rv));
+    start = now_us();
+    rv = gensio_open_s(io);
+    check(!rv, "cached open failed: %s", gensio_err_to_str(rv));
+    check(now_us() - start < STUB_DELAY_US / 2, "cached open was slow");
+    check(resolver_calls == 1, "resolver called %u times", resolver_calls);
+    gensio_close_s(io);
+    gensio_free(io);
+
+    /* Lookup failures come back through the open. */
+    snprintf(str, sizeof(str), "tcp(asyncresolve),fail.invalid,%s", port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc failed: %s", gensio_err_to_str(rv));
+    rv = gensio_open_s(io);
+    check(rv == GE_NOTFOUND, "bad lookup gave: %s", gensio_err_to_str(rv));
+    gensio_free(io);
+
+    /* Close and free with the lookup still outstanding. */
+    gensio_os_set_resolver(stub_resolver); /* Empty the cache. */
+    for (i = 0; i < 2; i++) {
+	snprintf(str, sizeof(str), "tcp(asyncresolve),stub.invalid,%s", port);
+	rv = str_to_gensio(str, o, NULL, NULL, &io);
+	check(!rv, "alloc failed: %s", gensio_err_to_str(rv));
+	open_err = -1;
+	rv = gensio_open(io, open_done, &open_err);
+	check(!rv, "open failed: %s", gensio_err_to_str(rv));
+	if (i == 0) {
+	    closed = false;
+	    rv = gensio_close(io, close_done, &closed);
+	    check(!rv, "close failed: %s", gensio_err_to_str(rv));
+	    timeout.secs = 2;
+	    timeout.nsecs = 0;
+	    o->wait(w, 1, &timeout);
+	    check(closed, "close did not finish");
+	}
+	gensio_free(io);
+	timeout.secs = 0;
+	timeout.nsecs = STUB_DELAY_US * 2000;
+	o->wait(w, 1, &timeout);
+	check(open_err != 0, "open reported success after close");
+    }
+
+    gensio_os_set_resolver(NULL);
+    o->stop_timer(tick_timer);
+    for (i = 0; i < nr_accepted; i++) {
+	gensio_close_s(accepted[i]);
+	gensio_free(accepted[i]);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    o->free_timer(tick_timer);
+    return test_finish();
+}
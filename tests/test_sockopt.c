@@ -0,0 +1,244 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the tcp socket tuning options.  Each option is set in the
+ * gensio string, read back from the socket with getsockopt(), then
+ * changed with GENSIO_CONTROL_SOCKOPT and read back again.  The
+ * socket is found by the local port of the gensio.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+struct sockopt_test {
+    const char *name;
+    int level;
+    int optname;
+    const char *strval; /* Set in the gensio string. */
+    const char *ctlval; /* Set with GENSIO_CONTROL_SOCKOPT. */
+    bool atleast; /* The kernel may give more than asked for. */
+    bool isstr;
+};
+
+static struct sockopt_test tests[] = {
+    { "sndbuf", SOL_SOCKET, SO_SNDBUF, "65536", "131072", true },
+    { "rcvbuf", SOL_SOCKET, SO_RCVBUF, "65536", "131072", true },
+#ifdef TCP_NOTSENT_LOWAT
+    { "notsent_lowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT, "16384", "32768" },
+#endif
+#ifdef TCP_QUICKACK
+    { "quickack", IPPROTO_TCP, TCP_QUICKACK, "1", "0" },
+#endif
+#ifdef TCP_USER_TIMEOUT
+    { "user_timeout", IPPROTO_TCP, TCP_USER_TIMEOUT, "5000", "7000" },
+#endif
+#ifdef TCP_KEEPIDLE
+    { "keepidle", IPPROTO_TCP, TCP_KEEPIDLE, "30", "40" },
+#endif
+#ifdef TCP_KEEPINTVL
+    { "keepintvl", IPPROTO_TCP, TCP_KEEPINTVL, "5", "6" },
+#endif
+#ifdef TCP_KEEPCNT
+    { "keepcnt", IPPROTO_TCP, TCP_KEEPCNT, "3", "4" },
+#endif
+#ifdef SO_BUSY_POLL
+    { "busy_poll", SOL_SOCKET, SO_BUSY_POLL, "50", "100" },
+#endif
+#ifdef TCP_CONGESTION
+    /* ctlval is filled in with the system default. */
+    { "congestion", IPPROTO_TCP, TCP_CONGESTION, "reno", NULL, false, true },
+#endif
+    { NULL }
+};
+
+static char default_congestion[32] = "reno";
+
+/*
+ * Held open until the client is done, a close from the remote end
+ * changes some options (like quickack) on the client socket.
+ */
+static struct gensio *srv_io;
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (srv_io)
+	gensio_free(srv_io);
+    srv_io = data;
+    return 0;
+}
+
+/* Find the socket with the same local port as io. */
+static int
+find_fd(struct gensio *io)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *s4 = (struct sockaddr_in *) &ss;
+    char port[20];
+    gensiods len = sizeof(port);
+    socklen_t slen;
+    int rv, fd;
+
+    strcpy(port, "0");
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_LPORT, port, &len);
+    check(!rv, "lport: %s", gensio_err_to_str(rv));
+    if (rv)
+	return -1;
+
+    for (fd = 3; fd < 1024; fd++) {
+	slen = sizeof(ss);
+	if (getsockname(fd, (struct sockaddr *) &ss, &slen) == -1)
+	    continue;
+	if (ss.ss_family == AF_INET &&
+		ntohs(s4->sin_port) == strtoul(port, NULL, 0))
+	    return fd;
+    }
+    check(0, "no socket with port %s", port);
+    return -1;
+}
+
+static void
+check_val(struct sockopt_test *t, int fd, const char *val, const char *how)
+{
+    char strval[32];
+    int ival;
+    socklen_t len;
+
+    if (t->isstr) {
+	len = sizeof(strval) - 1;
+	if (getsockopt(fd, t->level, t->optname, strval, &len) == -1) {
+	    check(0, "%s %s getsockopt: %s", how, t->name, strerror(errno));
+	    return;
+	}
+	strval[len] = '\0';
+	check(strcmp(strval, val) == 0, "%s %s is %s, expected %s", how,
+	      t->name, strval, val);
+	return;
+    }
+
+    len = sizeof(ival);
+    if (getsockopt(fd, t->level, t->optname, &ival, &len) == -1) {
+	check(0, "%s %s getsockopt: %s", how, t->name, strerror(errno));
+	return;
+    }
+    if (t->atleast)
+	check(ival >= atoi(val), "%s %s is %d, expected at least %s", how,
+	      t->name, ival, val);
+    else
+	check(ival == atoi(val), "%s %s is %d, expected %s", how,
+	      t->name, ival, val);
+}
+
+static void
+test_one(struct sockopt_test *t, const char *port)
+{
+    struct gensio *io;
+    char str[100], data[100];
+    gensiods len;
+    int rv, fd;
+
+    snprintf(str, sizeof(str), "tcp(%s=%s),127.0.0.1,%s", t->name, t->strval,
+	     port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    check(!rv, "alloc %s: %s", str, gensio_err_to_str(rv));
+    if (rv)
+	return;
+    rv = gensio_open_s(io);
+    if (rv == GE_PERM || rv == GE_NOTSUP) {
+	fprintf(stderr, "Can't set %s, skipping it: %s\n", t->name,
+		gensio_err_to_str(rv));
+	gensio_free(io);
+	return;
+    }
+    check(!rv, "open %s: %s", str, gensio_err_to_str(rv));
+    if (rv) {
+	gensio_free(io);
+	return;
+    }
+
+    fd = find_fd(io);
+    if (fd == -1)
+	goto out;
+    check_val(t, fd, t->strval, "string");
+
+    snprintf(data, sizeof(data), "%s=%s", t->name, t->ctlval);
+    len = strlen(data);
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, false,
+			GENSIO_CONTROL_SOCKOPT, data, &len);
+    check(!rv, "control set %s: %s", data, gensio_err_to_str(rv));
+    if (!rv)
+	check_val(t, fd, t->ctlval, "control");
+
+    /* A get returns what the socket has. */
+    strcpy(data, t->name);
+    len = sizeof(data);
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_SOCKOPT, data, &len);
+    check(!rv, "control get %s: %s", t->name, gensio_err_to_str(rv));
+    if (!rv)
+	check_val(t, fd, data, "control get");
+
+ out:
+    gensio_close_s(io);
+    gensio_free(io);
+    if (srv_io)
+	gensio_free(srv_io);
+    srv_io = NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct sockopt_test *t;
+    char port[20];
+
+    test_setup(0);
+
+#ifdef TCP_CONGESTION
+    {
+	/* Switch back to the default, it is always available. */
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	socklen_t len = sizeof(default_congestion) - 1;
+
+	if (fd != -1 &&
+		getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+			   default_congestion, &len) == 0)
+	    default_congestion[len] = '\0';
+	if (fd != -1)
+	    close(fd);
+    }
+#endif
+    for (t = tests; t->name; t++) {
+	if (!t->ctlval)
+	    t->ctlval = default_congestion;
+    }
+
+    acc = start_acc("tcp,127.0.0.1,0", acc_event, port, sizeof(port));
+
+    for (t = tests; t->name; t++)
+	test_one(t, port);
+
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+
+    return test_finish();
+}
@@ -0,0 +1,194 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the connected UDP client.  Packets are bounced off an echo
+ * accepter, some written from the read callback (so they go out in
+ * a batch) and some split with segsize.  The source address must
+ * still come up in the auxdata, and datagrams from some other
+ * address must not get to the client.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_PKTS 20
+
+static struct gensio *srv_io;
+static unsigned int nr_rcvd, nr_bad_addr, nr_foreign;
+static char expect_addr[100];
+
+static int
+srv_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (!err)
+	gensio_write(io, NULL, buf, *buflen, NULL);
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (srv_io) {
+	gensio_free(io);
+	return 0;
+    }
+    srv_io = io;
+    gensio_set_callback(io, srv_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static int
+cli_event(struct gensio *io, void *user_data, int event, int err,
+	  unsigned char *buf, gensiods *buflen,
+	  const char *const *auxdata)
+{
+    unsigned int i;
+    unsigned char c;
+    bool found = false;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    if (buf[0] == 0xff) {
+	nr_foreign++;
+	return 0;
+    }
+    for (i = 0; auxdata && auxdata[i]; i++) {
+	if (strcmp(auxdata[i], expect_addr) == 0)
+	    found = true;
+    }
+    if (!found)
+	nr_bad_addr++;
+    nr_rcvd++;
+    if (buf[0] < NR_PKTS / 2) {
+	/* Send the next one from the callback. */
+	c = buf[0] + 1;
+	gensio_write(io, NULL, &c, 1, NULL);
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    struct sockaddr_in dest;
+    const char *segaux[] = { "segsize:1", NULL };
+    unsigned char data[NR_PKTS];
+    char port[20], cport[20], str[100];
+    gensiods len;
+    unsigned int i;
+    int rv, fd;
+
+    test_setup(0);
+
+    rv = str_to_gensio_accepter("udp,127.0.0.1,0", o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+    snprintf(expect_addr, sizeof(expect_addr), "addr:ipv4,127.0.0.1,%s",
+	     port);
+
+    snprintf(str, sizeof(str), "udp(connected),127.0.0.1,%s", port);
+    rv = str_to_gensio(str, o, cli_event, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open client: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+    gensio_set_read_callback_enable(io, true);
+
+    /* Ping-pong half the packets, written from the read callback. */
+    data[0] = 0;
+    rv = gensio_write(io, NULL, data, 1, NULL);
+    check(!rv, "write: %s", gensio_err_to_str(rv));
+    run_for(200);
+    check(nr_rcvd == NR_PKTS / 2 + 1, "ping-pong got %u", nr_rcvd);
+
+    /* The rest as one segmented write. */
+    for (i = 0; i < NR_PKTS; i++)
+	data[i] = 100 + i;
+    len = 0;
+    rv = gensio_write(io, &len, data, NR_PKTS, segaux);
+    check(!rv && len == NR_PKTS, "segsize write: %s %lu",
+	  gensio_err_to_str(rv), (unsigned long) len);
+    run_for(200);
+    check(nr_rcvd == NR_PKTS / 2 + 1 + NR_PKTS, "after segsize got %u",
+	  nr_rcvd);
+    check(nr_bad_addr == 0, "%u packets had a bad address", nr_bad_addr);
+
+    /* Someone else sending to the client must not get through. */
+    len = sizeof(cport);
+    strcpy(cport, "0");
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_LPORT, cport, &len);
+    check(!rv, "client lport: %s", gensio_err_to_str(rv));
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+	perror("socket");
+	return 1;
+    }
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(strtoul(cport, NULL, 0));
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    data[0] = 0xff;
+    sendto(fd, data, 1, 0, (struct sockaddr *) &dest, sizeof(dest));
+    run_for(100);
+    check(nr_foreign == 0, "got %u foreign packets", nr_foreign);
+    close(fd);
+
+    gensio_close_s(io);
+    gensio_free(io);
+    if (srv_io) {
+	gensio_close_s(srv_io);
+	gensio_free(srv_io);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+
+    /* Connected can't take datagrams from anywhere. */
+    rv = str_to_gensio("udp(connected,nocon),127.0.0.1,1234", o,
+		       NULL, NULL, &io);
+    check(rv == GE_INVAL, "connected nocon gave %s", gensio_err_to_str(rv));
+
+    return test_finish();
+}
@@ -0,0 +1,155 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test sending multiple datagrams in one write with "segsize" and
+ * receiving them with gro on.  Whether or not the OS does GSO and
+ * GRO, the receiver must see the individual datagrams.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define SEGSIZE 100
+#define NR_SEGS 20
+#define LAST_SIZE 37
+#define TOTAL (SEGSIZE * (NR_SEGS - 1) + LAST_SIZE)
+
+static struct gensio *acc_io;
+
+static unsigned int nr_rcvd;
+static gensiods rcvd_len[NR_SEGS + 1];
+static unsigned char rcvd_data[TOTAL];
+static gensiods rcvd_pos;
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    if (nr_rcvd <= NR_SEGS)
+	rcvd_len[nr_rcvd] = *buflen;
+    nr_rcvd++;
+    if (rcvd_pos + *buflen <= TOTAL) {
+	memcpy(rcvd_data + rcvd_pos, buf, *buflen);
+	rcvd_pos += *buflen;
+    }
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (acc_io) {
+	gensio_free(io);
+	return 0;
+    }
+    acc_io = io;
+    gensio_set_callback(io, io_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static void
+run_test(const char *accopts)
+{
+    struct gensio_accepter *acc;
+    struct gensio *io;
+    unsigned char data[TOTAL];
+    char port[20], str[100], segstr[30];
+    const char *auxdata[] = { segstr, NULL };
+    gensiods len, count;
+    unsigned int i;
+    int rv;
+
+    acc_io = NULL;
+    nr_rcvd = 0;
+    rcvd_pos = 0;
+
+    snprintf(str, sizeof(str), "udp(%s),127.0.0.1,0", accopts);
+    rv = str_to_gensio_accepter(str, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+
+    snprintf(str, sizeof(str), "udp,127.0.0.1,%s", port);
+    rv = str_to_gensio(str, o, NULL, NULL, &io);
+    if (!rv)
+	rv = gensio_open_s(io);
+    if (rv) {
+	fprintf(stderr, "Could not open client: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+
+    for (i = 0; i < TOTAL; i++)
+	data[i] = i * 7;
+    snprintf(segstr, sizeof(segstr), "segsize:%d", SEGSIZE);
+    rv = gensio_write(io, &count, data, TOTAL, auxdata);
+    check(!rv, "%s: write: %s", accopts, gensio_err_to_str(rv));
+    check(count == TOTAL, "%s: wrote %lu", accopts, (unsigned long) count);
+    run_for(200);
+
+    check(nr_rcvd == NR_SEGS, "%s: received %u datagrams", accopts, nr_rcvd);
+    for (i = 0; i < nr_rcvd && i < NR_SEGS; i++)
+	check(rcvd_len[i] == (i == NR_SEGS - 1 ? LAST_SIZE : SEGSIZE),
+	      "%s: datagram %u was %lu bytes", accopts, i,
+	      (unsigned long) rcvd_len[i]);
+    check(rcvd_pos == TOTAL && memcmp(rcvd_data, data, TOTAL) == 0,
+	  "%s: data mismatch", accopts);
+
+    /* A bad segment size is rejected. */
+    strcpy(segstr, "segsize:x");
+    rv = gensio_write(io, &count, data, TOTAL, auxdata);
+    check(rv == GE_INVAL, "%s: bad segsize gave %s", accopts,
+	  gensio_err_to_str(rv));
+
+    gensio_close_s(io);
+    gensio_free(io);
+    if (acc_io) {
+	gensio_close_s(acc_io);
+	gensio_free(acc_io);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_setup(0);
+
+    run_test("gro=false");
+    run_test("gro=true");
+    run_test("gro=true,rxbatch=1");
+
+    return test_finish();
+}
@@ -0,0 +1,228 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test idle timeouts on the UDP accepter.  One peer keeps sending and
+ * must keep its connection, the other goes quiet and must get a
+ * GE_TIMEDOUT read error.  When the quiet peer sends again it gets a
+ * new connection.  A connection that isn't reading finds out from a
+ * write.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define IDLE_TIMEOUT 200
+#define MAX_CONNS 4
+
+struct conn {
+    struct gensio *io;
+    unsigned int nr_rcvd;
+    int last;
+    int timedout;
+    unsigned int nr_write_ready;
+    int write_err;
+};
+
+static struct conn conns[MAX_CONNS];
+static unsigned int nr_conns;
+static bool accept_write_only;
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    struct conn *c = user_data;
+    gensiods count;
+
+    if (event == GENSIO_EVENT_WRITE_READY) {
+	c->nr_write_ready++;
+	c->write_err = gensio_write(io, &count, "x", 1, NULL);
+	gensio_set_write_callback_enable(io, false);
+	return 0;
+    }
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err) {
+	check(err == GE_TIMEDOUT, "read error %s", gensio_err_to_str(err));
+	c->timedout++;
+	gensio_set_read_callback_enable(io, false);
+	return 0;
+    }
+    c->nr_rcvd++;
+    c->last = buf[0];
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+    struct conn *c;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_conns >= MAX_CONNS) {
+	gensio_free(io);
+	return 0;
+    }
+    c = &conns[nr_conns++];
+    c->io = io;
+    gensio_set_callback(io, io_event, c);
+    if (accept_write_only)
+	gensio_set_write_callback_enable(io, true);
+    else
+	gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static void
+send_pkt(int fd, int val)
+{
+    unsigned char c = val;
+
+    if (send(fd, &c, 1, 0) != 1) {
+	perror("send");
+	exit(1);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct sockaddr_in dest;
+    char port[20], str[100];
+    gensiods len;
+    unsigned int i;
+    int rv, fds[3];
+
+    test_setup(0);
+
+    snprintf(str, sizeof(str), "udp(idle_timeout=%d),127.0.0.1,0",
+	     IDLE_TIMEOUT);
+    rv = str_to_gensio_accepter(str, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(strtoul(port, NULL, 0));
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 3; i++) {
+	fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fds[i] == -1 ||
+		connect(fds[i], (struct sockaddr *) &dest,
+			sizeof(dest)) == -1) {
+	    perror("socket");
+	    return 1;
+	}
+    }
+
+    send_pkt(fds[0], 1);
+    send_pkt(fds[1], 1);
+    run_for(50);
+    check(nr_conns == 2, "accepted %u", nr_conns);
+    if (nr_conns != 2)
+	return 1;
+
+    /* Peer 0 keeps talking, peer 1 goes quiet. */
+    for (i = 0; i < 8; i++) {
+	send_pkt(fds[0], 2 + i);
+	run_for(IDLE_TIMEOUT / 4);
+    }
+    check(!conns[0].timedout, "busy peer timed out");
+    check(conns[0].nr_rcvd == 9, "busy peer got %u", conns[0].nr_rcvd);
+    check(conns[1].timedout == 1, "quiet peer timed out %d times",
+	  conns[1].timedout);
+    check(nr_conns == 2, "connections %u", nr_conns);
+
+    /* The quiet peer starts over with a new connection. */
+    send_pkt(fds[1], 50);
+    run_for(50);
+    check(nr_conns == 3, "after restart connections %u", nr_conns);
+    check(conns[1].nr_rcvd == 1, "old connection got %u", conns[1].nr_rcvd);
+    check(conns[2].nr_rcvd == 1 && conns[2].last == 50,
+	  "new connection got %u", conns[2].nr_rcvd);
+
+    /* Everything goes quiet, everything times out. */
+    run_for(IDLE_TIMEOUT * 2);
+    check(conns[0].timedout == 1, "busy peer timed out %d times",
+	  conns[0].timedout);
+    check(conns[2].timedout == 1, "new connection timed out %d times",
+	  conns[2].timedout);
+
+    /*
+     * A connection that isn't reading gets a write error and its
+     * write callback still works.  The read error still comes when
+     * it reads.
+     */
+    accept_write_only = true;
+    send_pkt(fds[2], 60);
+    run_for(50);
+    check(nr_conns == 4, "write only connections %u", nr_conns);
+    if (nr_conns != 4)
+	return 1;
+    check(conns[3].nr_write_ready == 1 && conns[3].write_err == 0,
+	  "write before timeout gave %s",
+	  gensio_err_to_str(conns[3].write_err));
+    run_for(IDLE_TIMEOUT * 2);
+    rv = gensio_write(conns[3].io, &len, "y", 1, NULL);
+    check(rv == GE_TIMEDOUT, "write after timeout gave %s",
+	  gensio_err_to_str(rv));
+    gensio_set_write_callback_enable(conns[3].io, true);
+    run_for(10);
+    check(conns[3].nr_write_ready == 2 && conns[3].write_err == GE_TIMEDOUT,
+	  "write callback after timeout gave %s",
+	  gensio_err_to_str(conns[3].write_err));
+    check(conns[3].timedout == 0, "write only got a read error");
+    gensio_set_read_callback_enable(conns[3].io, true);
+    run_for(10);
+    check(conns[3].timedout == 1, "write only timed out %d times",
+	  conns[3].timedout);
+    check(conns[3].nr_rcvd == 0, "write only got %u", conns[3].nr_rcvd);
+
+    for (i = 0; i < 3; i++)
+	close(fds[i]);
+    for (i = 0; i < nr_conns; i++) {
+	gensio_close_s(conns[i].io);
+	gensio_free(conns[i].io);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+
+    /* Idle timeouts are only for the accepter. */
+    rv = str_to_gensio("udp(idle_timeout=100),127.0.0.1,1234", o,
+		       NULL, NULL, &conns[0].io);
+    check(rv == GE_INVAL, "client idle_timeout gave %s",
+	  gensio_err_to_str(rv));
+
+    return test_finish();
+}
@@ -0,0 +1,205 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test multicast hub mode on the udp gensio.  Gensios with mhub and
+ * the same laddr and mcast share one socket, every datagram goes to
+ * each of them, and one that is not reading doesn't hold up the
+ * others.  Unicast datagrams to the hub's port are used so this
+ * doesn't depend on multicast routing, but the multicast group has
+ * to be joinable or the test is skipped.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_PKTS 10
+#define RXQUEUE 4
+
+#define HUB_STR(opts)							\
+    "udp(mhub,mcast='239.255.42.1',laddr='ipv4,0.0.0.0,0'" opts		\
+    "),239.255.42.1,1234"
+
+struct consumer {
+    struct gensio *io;
+    unsigned int nr_rcvd;
+    int rcvd[NR_PKTS + 1];
+    int stop_reading;
+};
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    struct consumer *c = user_data;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    if (c->nr_rcvd <= NR_PKTS)
+	c->rcvd[c->nr_rcvd++] = buf[0];
+    if (c->stop_reading)
+	gensio_set_read_callback_enable(io, false);
+    return 0;
+}
+
+static int
+open_consumer(struct consumer *c, const char *str)
+{
+    int rv;
+
+    memset(c, 0, sizeof(*c));
+    rv = str_to_gensio(str, o, io_event, c, &c->io);
+    if (rv)
+	return rv;
+    rv = gensio_open_s(c->io);
+    if (rv) {
+	gensio_free(c->io);
+	return rv;
+    }
+    gensio_set_read_callback_enable(c->io, true);
+    return 0;
+}
+
+static void
+close_consumer(struct consumer *c)
+{
+    gensio_close_s(c->io);
+    gensio_free(c->io);
+}
+
+static unsigned int
+get_port(struct consumer *c)
+{
+    char port[20];
+    gensiods len = sizeof(port);
+    int rv;
+
+    strcpy(port, "0");
+    rv = gensio_control(c->io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_LPORT, port, &len);
+    check(!rv, "get port: %s", gensio_err_to_str(rv));
+    return strtoul(port, NULL, 0);
+}
+
+static void
+send_pkt(int fd, unsigned int port, int val)
+{
+    struct sockaddr_in dest;
+    unsigned char c = val;
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sendto(fd, &c, 1, 0, (struct sockaddr *) &dest, sizeof(dest)) != 1) {
+	perror("sendto");
+	exit(1);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct consumer c[3];
+    unsigned int port, i;
+    int rv, fd;
+
+    test_setup(0);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+	perror("socket");
+	return 1;
+    }
+
+    rv = open_consumer(&c[0], HUB_STR(""));
+    if (rv) {
+	fprintf(stderr, "Can't set up multicast, skipping: %s\n",
+		gensio_err_to_str(rv));
+	return 77;
+    }
+    rv = open_consumer(&c[1], HUB_STR(",rxqueue=4"));
+    check(!rv, "second consumer: %s", gensio_err_to_str(rv));
+    if (rv)
+	return 1;
+
+    /* They share the socket, so they have the same port. */
+    port = get_port(&c[0]);
+    check(port != 0 && port == get_port(&c[1]), "ports differ");
+
+    /* A different group gets its own socket. */
+    rv = open_consumer(&c[2], "udp(mhub,mcast='239.255.42.2',"
+		       "laddr='ipv4,0.0.0.0,0'),239.255.42.2,1234");
+    check(!rv, "other hub: %s", gensio_err_to_str(rv));
+    if (!rv) {
+	check(get_port(&c[2]) != port, "other hub shares the port");
+	close_consumer(&c[2]);
+    }
+
+    /* Everyone gets everything. */
+    send_pkt(fd, port, 100);
+    run_for(100);
+    check(c[0].nr_rcvd == 1 && c[1].nr_rcvd == 1, "got %u and %u",
+	  c[0].nr_rcvd, c[1].nr_rcvd);
+
+    /* Consumer 1 stops reading, consumer 0 must not be held up. */
+    c[1].stop_reading = 1;
+    for (i = 0; i < NR_PKTS; i++)
+	send_pkt(fd, port, i);
+    run_for(200);
+    check(c[0].nr_rcvd == NR_PKTS + 1, "consumer 0 got %u", c[0].nr_rcvd);
+    check(c[1].nr_rcvd == 2, "consumer 1 got %u", c[1].nr_rcvd);
+
+    /*
+     * Consumer 1's own queue limit applied to what it missed.  Hub
+     * datagrams are always delivered from the queue, so the one it
+     * read when it stopped counted against the limit.
+     */
+    c[1].stop_reading = 0;
+    gensio_set_read_callback_enable(c[1].io, true);
+    run_for(200);
+    check(c[1].nr_rcvd == RXQUEUE + 1, "consumer 1 got %u", c[1].nr_rcvd);
+    for (i = 1; i < c[1].nr_rcvd; i++)
+	check(c[1].rcvd[i] == (int) i - 1, "consumer 1 packet %u was %d",
+	      i, c[1].rcvd[i]);
+
+    /* The hub lives on as long as someone is using it. */
+    close_consumer(&c[0]);
+    run_for(10);
+    send_pkt(fd, port, 55);
+    run_for(100);
+    check(c[1].nr_rcvd == RXQUEUE + 2, "after close consumer 1 got %u",
+	  c[1].nr_rcvd);
+    close_consumer(&c[1]);
+    run_for(10);
+
+    /* And a new one comes up after they are all gone. */
+    rv = open_consumer(&c[0], HUB_STR(""));
+    check(!rv, "reopen: %s", gensio_err_to_str(rv));
+    if (!rv)
+	close_consumer(&c[0]);
+
+    /* mhub needs mcast and laddr. */
+    rv = str_to_gensio("udp(mhub,laddr='ipv4,0.0.0.0,0'),239.255.42.1,1234",
+		       o, NULL, NULL, &c[0].io);
+    check(rv == GE_INVAL, "mhub without mcast gave %s",
+	  gensio_err_to_str(rv));
+
+    close(fd);
+    run_for(10);
+    return test_finish();
+}
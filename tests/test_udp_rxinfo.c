@@ -0,0 +1,247 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the kernel receive information on UDP reads.  With timestamp
+ * on every read must have a sane "timestamp:" auxdata.  Overflowing
+ * the socket must show up as "drops:" auxdata and in
+ * GENSIO_CONTROL_DROPS.  The socket receive buffer is set small with
+ * rcvbuf and must be reported by the sockopt controls.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+/* Enough to overflow the socket receive buffer. */
+#define NR_FLOOD 5000
+#define RCVBUF 8192
+
+static struct gensio *acc_io;
+
+static unsigned int nr_rcvd, nr_stamped, nr_bad_stamp;
+static unsigned long long max_drops;
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    struct timespec now;
+    double stamp;
+    unsigned long long drops;
+    unsigned int i;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    nr_rcvd++;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 0; auxdata && auxdata[i]; i++) {
+	if (strncmp(auxdata[i], "timestamp:", 10) == 0) {
+	    nr_stamped++;
+	    stamp = strtod(auxdata[i] + 10, NULL);
+	    /* Must be in the recent past. */
+	    if (stamp > now.tv_sec + now.tv_nsec / 1e9 + 0.001 ||
+		    stamp < now.tv_sec - 10)
+		nr_bad_stamp++;
+	} else if (strncmp(auxdata[i], "drops:", 6) == 0) {
+	    drops = strtoull(auxdata[i] + 6, NULL, 0);
+	    if (drops > max_drops)
+		max_drops = drops;
+	}
+    }
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (acc_io) {
+	gensio_free(io);
+	return 0;
+    }
+    acc_io = io;
+    gensio_set_callback(io, io_event, NULL);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static unsigned long long
+get_drops(const char *which)
+{
+    char buf[30];
+    gensiods len = sizeof(buf);
+    int rv;
+
+    strcpy(buf, which);
+    rv = gensio_control(acc_io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_DROPS, buf, &len);
+    check(!rv, "get %s drops: %s", which, gensio_err_to_str(rv));
+    if (rv)
+	return 0;
+    return strtoull(buf, NULL, 0);
+}
+
+static unsigned long
+get_acc_val(struct gensio_accepter *acc, unsigned int option,
+	    const char *name)
+{
+    char buf[30];
+    gensiods len = sizeof(buf);
+    int rv;
+
+    strcpy(buf, name);
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    option, buf, &len);
+    check(!rv, "get acc %s: %s", name, gensio_err_to_str(rv));
+    if (rv)
+	return 0;
+    return strtoul(buf, NULL, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct gensio_accepter *acc;
+    struct sockaddr_in dest;
+    char port[20], buf[50];
+    unsigned char c = 0;
+    gensiods len;
+    unsigned int i;
+    int rv, fd;
+
+    test_setup(0);
+
+    snprintf(buf, sizeof(buf), "udp(timestamp,rcvbuf=%d),127.0.0.1,0",
+	     RCVBUF);
+    rv = str_to_gensio_accepter(buf, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	return 1;
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	return 1;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(strtoul(port, NULL, 0));
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1 ||
+	    connect(fd, (struct sockaddr *) &dest, sizeof(dest)) == -1) {
+	perror("socket");
+	return 1;
+    }
+
+    if (send(fd, &c, 1, 0) != 1) {
+	perror("send");
+	return 1;
+    }
+    run_for(100);
+    check(acc_io != NULL, "no connection");
+    if (!acc_io)
+	return 1;
+    check(nr_rcvd == 1, "received %u", nr_rcvd);
+#ifdef __linux__
+    check(nr_stamped == 1, "%u timestamps", nr_stamped);
+#endif
+    check(get_drops("") == 0, "drops before flood");
+
+    /* The kernel may round this up (Linux doubles it), but not down. */
+    check(get_acc_val(acc, GENSIO_ACC_CONTROL_SOCKOPT, "rcvbuf") >= RCVBUF,
+	  "acc rcvbuf too small");
+    strcpy(buf, "rcvbuf");
+    len = sizeof(buf);
+    rv = gensio_control(acc_io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_SOCKOPT, buf, &len);
+    check(!rv && strtoul(buf, NULL, 0) >= RCVBUF, "gensio rcvbuf: %s %s",
+	  gensio_err_to_str(rv), buf);
+    strcpy(buf, "keepidle");
+    len = sizeof(buf);
+    rv = gensio_control(acc_io, 0, true,
+			GENSIO_CONTROL_SOCKOPT, buf, &len);
+    check(rv == GE_NOTSUP, "keepidle on udp gave %s", gensio_err_to_str(rv));
+
+    /* Nothing is read while this goes on, so the socket overflows. */
+    for (i = 0; i < NR_FLOOD; i++) {
+	if (send(fd, &c, 1, 0) != 1) {
+	    perror("send");
+	    return 1;
+	}
+    }
+    run_for(200);
+    /*
+     * The kernel gives the drop count with the datagrams queued after
+     * the drops, so send one more now that there is room.
+     */
+    if (send(fd, &c, 1, 0) != 1) {
+	perror("send");
+	return 1;
+    }
+    run_for(100);
+    check(nr_bad_stamp == 0, "%u bad timestamps", nr_bad_stamp);
+    check(nr_stamped == 0 || nr_stamped == nr_rcvd,
+	  "%u of %u reads stamped", nr_stamped, nr_rcvd);
+#ifdef __linux__
+    check(max_drops > 0, "no drops reported");
+    check(max_drops + nr_rcvd == NR_FLOOD + 2,
+	  "%llu dropped + %u received != %u sent", max_drops, nr_rcvd,
+	  NR_FLOOD + 2);
+#endif
+    check(get_drops("kernel") == max_drops, "kernel drops mismatch");
+    check(get_drops("queue") == 0, "queue drops");
+    check(get_drops("total") == max_drops, "total drops mismatch");
+    check(get_acc_val(acc, GENSIO_ACC_CONTROL_DROPS, "") == max_drops,
+	  "acc drops mismatch");
+
+    /* Make room for bigger bursts. */
+    snprintf(buf, sizeof(buf), "rcvbuf=%d", RCVBUF * 4);
+    len = sizeof(buf);
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, false,
+			    GENSIO_ACC_CONTROL_SOCKOPT, buf, &len);
+    check(!rv, "set acc rcvbuf: %s", gensio_err_to_str(rv));
+    check(get_acc_val(acc, GENSIO_ACC_CONTROL_SOCKOPT, "rcvbuf") >= RCVBUF * 4,
+	  "acc rcvbuf not raised");
+
+    strcpy(buf, "bogus");
+    len = sizeof(buf);
+    rv = gensio_control(acc_io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_DROPS, buf, &len);
+    check(rv == GE_INVAL, "bogus drops gave %s", gensio_err_to_str(rv));
+
+    close(fd);
+    gensio_close_s(acc_io);
+    gensio_free(acc_io);
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+
+    return test_finish();
+}
@@ -0,0 +1,205 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Test the per-connection receive queues on the UDP accepter.  One
+ * peer stops reading, the other peer must keep getting its data, and
+ * when the first peer starts reading again it gets what was queued
+ * with the drop policy applied.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+#define NR_PKTS 10
+#define RXQUEUE 4
+
+struct peer {
+    int fd;
+    struct gensio *io;
+    unsigned int nr_rcvd;
+    int rcvd[NR_PKTS + 1];
+    int stop_reading;
+};
+
+static struct peer peers[2];
+static unsigned int nr_accepted;
+
+static int
+io_event(struct gensio *io, void *user_data, int event, int err,
+	 unsigned char *buf, gensiods *buflen,
+	 const char *const *auxdata)
+{
+    struct peer *p = user_data;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+    if (err)
+	return 0;
+    if (p->nr_rcvd <= NR_PKTS)
+	p->rcvd[p->nr_rcvd++] = buf[0];
+    if (p->stop_reading)
+	gensio_set_read_callback_enable(io, false);
+    return 0;
+}
+
+static int
+acc_event(struct gensio_accepter *acc, void *user_data, int event, void *data)
+{
+    struct gensio *io = data;
+    struct peer *p;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (nr_accepted >= 2) {
+	gensio_free(io);
+	return 0;
+    }
+    p = &peers[nr_accepted++];
+    p->io = io;
+    gensio_set_callback(io, io_event, p);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+static unsigned long long
+get_queue_drops(struct gensio *io)
+{
+    char buf[30];
+    gensiods len = sizeof(buf);
+    int rv;
+
+    strcpy(buf, "queue");
+    rv = gensio_control(io, GENSIO_CONTROL_DEPTH_FIRST, true,
+			GENSIO_CONTROL_DROPS, buf, &len);
+    check(!rv, "get queue drops: %s", gensio_err_to_str(rv));
+    if (rv)
+	return 0;
+    return strtoull(buf, NULL, 0);
+}
+
+static void
+send_pkt(struct peer *p, int val)
+{
+    unsigned char c = val;
+
+    if (send(p->fd, &c, 1, 0) != 1) {
+	perror("send");
+	exit(1);
+    }
+}
+
+static void
+run_test(const char *drop, int first)
+{
+    struct gensio_accepter *acc;
+    struct sockaddr_in dest;
+    char port[20], str[100];
+    gensiods len;
+    unsigned int i;
+    int rv;
+
+    memset(peers, 0, sizeof(peers));
+    nr_accepted = 0;
+
+    snprintf(str, sizeof(str), "udp(rxqueue=%d,rxdrop=%s),127.0.0.1,0",
+	     RXQUEUE, drop);
+    rv = str_to_gensio_accepter(str, o, acc_event, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    len = sizeof(port);
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &len);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(strtoul(port, NULL, 0));
+    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 2; i++) {
+	peers[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (peers[i].fd == -1 ||
+		connect(peers[i].fd, (struct sockaddr *) &dest,
+			sizeof(dest)) == -1) {
+	    perror("socket");
+	    exit(1);
+	}
+    }
+
+    /* Get the connections up, peer 0 stops reading after this. */
+    peers[0].stop_reading = 1;
+    send_pkt(&peers[0], 100);
+    run_for(100);
+    send_pkt(&peers[1], 100);
+    run_for(100);
+    check(nr_accepted == 2, "%s: accepted %u", drop, nr_accepted);
+    if (nr_accepted != 2)
+	exit(1);
+    peers[0].stop_reading = 0;
+
+    for (i = 0; i < NR_PKTS; i++) {
+	send_pkt(&peers[0], i);
+	send_pkt(&peers[1], i);
+    }
+    run_for(200);
+
+    /* Peer 0 not reading must not hold up peer 1. */
+    check(peers[0].nr_rcvd == 1, "%s: peer 0 got %u", drop,
+	  peers[0].nr_rcvd);
+    check(peers[1].nr_rcvd == NR_PKTS + 1, "%s: peer 1 got %u", drop,
+	  peers[1].nr_rcvd);
+
+    /* Now peer 0 gets what was queued, in order. */
+    gensio_set_read_callback_enable(peers[0].io, true);
+    run_for(200);
+    check(peers[0].nr_rcvd == RXQUEUE + 1, "%s: peer 0 got %u", drop,
+	  peers[0].nr_rcvd);
+    for (i = 1; i < peers[0].nr_rcvd; i++)
+	check(peers[0].rcvd[i] == first + (int) i - 1,
+	      "%s: packet %u was %d", drop, i, peers[0].rcvd[i]);
+    check(get_queue_drops(peers[0].io) == NR_PKTS - RXQUEUE,
+	  "%s: peer 0 queue drops", drop);
+    check(get_queue_drops(peers[1].io) == 0, "%s: peer 1 queue drops", drop);
+
+    for (i = 0; i < 2; i++) {
+	close(peers[i].fd);
+	gensio_close_s(peers[i].io);
+	gensio_free(peers[i].io);
+    }
+    gensio_acc_shutdown_s(acc);
+    gensio_acc_free(acc);
+    run_for(10);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_setup(0);
+
+    /* Tail drop keeps the oldest, head drop keeps the newest. */
+    run_test("tail", 0);
+    run_test("head", NR_PKTS - RXQUEUE);
+
+    return test_finish();
+}
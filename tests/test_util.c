@@ -0,0 +1,289 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+#include "test_util.h"
+
+struct gensio_os_funcs *o;
+struct gensio_waiter *w;
+int errors;
+
+static void
+do_vlog(struct gensio_os_funcs *f, enum gensio_log_levels level,
+	const char *log, va_list args)
+{
+    fprintf(stderr, "gensio %s log: ", gensio_log_level_to_str(level));
+    vfprintf(stderr, log, args);
+    fprintf(stderr, "\n");
+}
+
+void
+test_setup(int wake_sig)
+{
+    int rv;
+
+    rv = gensio_default_os_hnd(wake_sig, &o);
+    if (rv) {
+	fprintf(stderr, "Could not allocate OS handler: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    o->vlog = do_vlog;
+    w = o->alloc_waiter(o);
+    if (!w) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+}
+
+int
+test_finish(void)
+{
+    o->free_waiter(w);
+    gensio_cleanup_mem(o);
+    o->free_funcs(o);
+
+    if (errors) {
+	fprintf(stderr, "%d errors\n", errors);
+	return 1;
+    }
+    return 0;
+}
+
+void
+run_for(unsigned int msecs)
+{
+    gensio_time timeout;
+
+    timeout.secs = msecs / 1000;
+    timeout.nsecs = (msecs % 1000) * 1000000;
+    o->wait(w, 1, &timeout);
+}
+
+static void
+get_acc_port(struct gensio_accepter *acc, char *port, gensiods portlen)
+{
+    int rv;
+
+    strcpy(port, "0");
+    rv = gensio_acc_control(acc, GENSIO_CONTROL_DEPTH_FIRST, true,
+			    GENSIO_ACC_CONTROL_LPORT, port, &portlen);
+    if (rv) {
+	fprintf(stderr, "Could not get port: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+}
+
+struct gensio_accepter *
+start_acc(const char *str, gensio_accepter_event cb, char *port,
+	  gensiods portlen)
+{
+    struct gensio_accepter *acc;
+    int rv;
+
+    rv = str_to_gensio_accepter(str, o, cb, NULL, &acc);
+    if (!rv)
+	rv = gensio_acc_startup(acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    get_acc_port(acc, port, portlen);
+    return acc;
+}
+
+void
+close_free_done(struct gensio *io, void *close_data)
+{
+    gensio_free(io);
+}
+
+static void
+pair_close_done(struct gensio *io, void *close_data)
+{
+    struct test_pair *p = close_data;
+
+    p->srv = NULL;
+    gensio_free(io);
+}
+
+static int
+pair_srv_event(struct gensio *io, void *user_data, int event, int err,
+	       unsigned char *buf, gensiods *buflen,
+	       const char *const *auxdata)
+{
+    struct test_pair *p = user_data;
+
+    if (event == GENSIO_EVENT_READ && err) {
+	/* The other end closed. */
+	gensio_close(io, pair_close_done, p);
+	return 0;
+    }
+    if (!p->srv_cb)
+	return GE_NOTSUP;
+    return p->srv_cb(io, p->srv_data, event, err, buf, buflen, auxdata);
+}
+
+static int
+pair_acc_event(struct gensio_accepter *acc, void *user_data, int event,
+	       void *data)
+{
+    struct test_pair *p = user_data;
+    struct gensio *io = data;
+
+    if (event != GENSIO_ACC_EVENT_NEW_CONNECTION)
+	return GE_NOTSUP;
+    if (p->srv) {
+	gensio_free(io);
+	return 0;
+    }
+    p->srv = io;
+    gensio_set_callback(io, pair_srv_event, p);
+    gensio_set_read_callback_enable(io, true);
+    return 0;
+}
+
+void
+start_pair(struct test_pair *p, const char *accstr,
+	   gensio_event srv_cb, void *srv_data,
+	   const char *clistr, gensio_event cli_cb, void *cli_data)
+{
+    char port[20], str[200];
+    int rv;
+
+    p->srv = NULL;
+    p->srv_cb = srv_cb;
+    p->srv_data = srv_data;
+    rv = str_to_gensio_accepter(accstr, o, pair_acc_event, p, &p->acc);
+    if (!rv)
+	rv = gensio_acc_startup(p->acc);
+    if (rv) {
+	fprintf(stderr, "Could not start accepter: %s\n",
+		gensio_err_to_str(rv));
+	exit(1);
+    }
+    get_acc_port(p->acc, port, sizeof(port));
+
+    snprintf(str, sizeof(str), "%s%s", clistr, port);
+    rv = str_to_gensio(str, o, cli_cb, cli_data, &p->cli);
+    if (!rv)
+	rv = gensio_open_s(p->cli);
+    if (rv) {
+	fprintf(stderr, "Could not open client: %s\n", gensio_err_to_str(rv));
+	exit(1);
+    }
+    while (!p->srv)
+	run_for(100);
+}
+
+void
+stop_pair(struct test_pair *p)
+{
+    gensio_close_s(p->cli);
+    gensio_free(p->cli);
+    run_for(100);
+    if (p->srv)
+	gensio_free(p->srv);
+    gensio_acc_shutdown_s(p->acc);
+    gensio_acc_free(p->acc);
+    run_for(10);
+}
+
+int
+test_msgs_srv_event(struct gensio *io, void *user_data, int event, int err,
+		    unsigned char *buf, gensiods *buflen,
+		    const char *const *auxdata)
+{
+    struct test_msgs *m = user_data;
+    gensiods i, len;
+
+    if (event != GENSIO_EVENT_READ)
+	return GE_NOTSUP;
+
+    len = *buflen;
+    if (m->take && len > m->take)
+	len = m->take;
+    if (m->rcv_pos + len > m->msg_len(m->rcvd)) {
+	check(0, "msg %u too long", m->rcvd);
+	exit(1);
+    }
+    for (i = 0; i < len; i++) {
+	if (buf[i] != (unsigned char) (m->rcvd + m->rcv_pos + i)) {
+	    check(0, "msg %u byte %lu bad", m->rcvd,
+		  (unsigned long) (m->rcv_pos + i));
+	    exit(1);
+	}
+    }
+    m->rcv_pos += len;
+    if (m->rcv_pos == m->msg_len(m->rcvd)) {
+	/* Only the last part can be the end of the message. */
+	check(gensio_str_in_auxdata(auxdata, "eom"), "msg %u no eom",
+	      m->rcvd);
+	m->rcvd++;
+	m->rcv_pos = 0;
+    }
+    *buflen = len;
+    if (m->pause_reads)
+	gensio_set_read_callback_enable(io, false);
+    return 0;
+}
+
+int
+test_msgs_cli_event(struct gensio *io, void *user_data, int event, int err,
+		    unsigned char *buf, gensiods *buflen,
+		    const char *const *auxdata)
+{
+    static const char *const eom[] = { "eom", NULL };
+    struct test_msgs *m = user_data;
+    unsigned char data[TEST_MSG_MAX];
+    gensiods i, len, count;
+    int rv;
+
+    if (event != GENSIO_EVENT_WRITE_READY)
+	return GE_NOTSUP;
+    while (m->sent < m->nr_msgs) {
+	/* The write may only take part of the message. */
+	len = m->msg_len(m->sent) - m->send_pos;
+	for (i = 0; i < len; i++)
+	    data[i] = m->sent + m->send_pos + i;
+	rv = gensio_write(io, &count, data, len, eom);
+	if (rv) {
+	    check(0, "write: %s", gensio_err_to_str(rv));
+	    exit(1);
+	}
+	m->send_pos += count;
+	if (m->send_pos < m->msg_len(m->sent))
+	    return 0;
+	m->sent++;
+	m->send_pos = 0;
+    }
+    gensio_set_write_callback_enable(io, false);
+    return 0;
+}
+
+void
+run_msgs(struct test_pair *p, struct test_msgs *m)
+{
+    unsigned int i;
+
+    m->sent = 0;
+    m->send_pos = 0;
+    m->rcvd = 0;
+    m->rcv_pos = 0;
+    gensio_set_write_callback_enable(p->cli, true);
+    for (i = 0; i < 10000 && m->rcvd < m->nr_msgs; i++) {
+	run_for(1);
+	if (m->pause_reads)
+	    gensio_set_read_callback_enable(p->srv, true);
+    }
+}
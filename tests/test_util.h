@@ -0,0 +1,130 @@
+/*
+ *  gensio - A library for abstracting stream I/O
+ *  Copyright (C) 2026  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ */
+
+/*
+ * Common code for the C test programs.  These set up an OS handler
+ * and a waiter, count failed checks, and report the result.
+ */
+
+#ifndef GENSIO_TEST_UTIL_H
+#define GENSIO_TEST_UTIL_H
+
+#include <stdio.h>
+#include <gensio/gensio.h>
+
+extern struct gensio_os_funcs *o;
+extern struct gensio_waiter *w;
+extern int errors;
+
+/*
+ * Report a failure if cond is false and keep going, the failure is
+ * counted and test_finish() will return an error.
+ */
+#define check(cond, ...)						\
+    do {								\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);		\
+	    fprintf(stderr, __VA_ARGS__);				\
+	    fprintf(stderr, "\n");					\
+	    errors++;							\
+	}								\
+    } while(0)
+
+/*
+ * Allocate the OS handler and the waiter and send gensio logs to
+ * stderr.  wake_sig is passed to gensio_default_os_hnd().  Exits the
+ * program on failure.
+ */
+void test_setup(int wake_sig);
+
+/*
+ * Free the waiter, the global gensio memory, and the OS handler and
+ * return the exit code for the program.
+ */
+int test_finish(void);
+
+/* Run the OS handler for the given number of milliseconds. */
+void run_for(unsigned int msecs);
+
+/*
+ * Allocate and start an accepter from str with the callback cb, and
+ * return the port it is listening on in port.  Exits the program on
+ * failure.
+ */
+struct gensio_accepter *start_acc(const char *str, gensio_accepter_event cb,
+				  char *port, gensiods portlen);
+
+/* A close done callback that frees the gensio. */
+void close_free_done(struct gensio *io, void *close_data);
+
+/*
+ * A client connected to an accepter, normally with a mux on top.  srv
+ * is the first connection the accepter gets, any after that are
+ * refused.  srv_cb is called with srv_data for events on srv, except
+ * for a read error, which closes and frees srv.
+ */
+struct test_pair {
+    struct gensio_accepter *acc;
+    struct gensio *cli;
+    struct gensio *srv;
+    gensio_event srv_cb;
+    void *srv_data;
+};
+
+/*
+ * Start an accepter from accstr and open a client from clistr with
+ * the accepter's port appended to it, and wait for the server end to
+ * show up.  Exits the program on failure.
+ */
+void start_pair(struct test_pair *p, const char *accstr,
+		gensio_event srv_cb, void *srv_data,
+		const char *clistr, gensio_event cli_cb, void *cli_data);
+
+/* Close and free the client, then the server end and the accepter. */
+void stop_pair(struct test_pair *p);
+
+/* The biggest message test_msgs can send. */
+#define TEST_MSG_MAX 4096
+
+/*
+ * Numbered messages written by the client of a test_pair and checked
+ * by its server end.  Byte i of message n is (unsigned char) (n + i)
+ * and every write carries "eom", so the reader can check the data and
+ * that eom comes with the last byte of each message.
+ */
+struct test_msgs {
+    unsigned int nr_msgs;
+    gensiods (*msg_len)(unsigned int msg);
+
+    /* The most the reader takes per callback, 0 means everything. */
+    gensiods take;
+
+    /* Stop reading after each callback, run_msgs() starts it again. */
+    bool pause_reads;
+
+    unsigned int sent, rcvd;
+    gensiods send_pos, rcv_pos;
+};
+
+/*
+ * Use these as the server and client callbacks of the pair with the
+ * test_msgs as the user data.  Bad data exits the program.
+ */
+int test_msgs_srv_event(struct gensio *io, void *user_data, int event,
+			int err, unsigned char *buf, gensiods *buflen,
+			const char *const *auxdata);
+int test_msgs_cli_event(struct gensio *io, void *user_data, int event,
+			int err, unsigned char *buf, gensiods *buflen,
+			const char *const *auxdata);
+
+/*
+ * Send all the messages in m from the client of p and run until they
+ * are received or ten seconds pass.  The caller checks m->rcvd.
+ */
+void run_msgs(struct test_pair *p, struct test_msgs *m);
+
+#endif /* GENSIO_TEST_UTIL_H */